@@ -25,6 +25,21 @@ typedef enum detail_state_t {
   STATE_REPLIED
 } detail_state_t;
 
+/*
+ *	A record which has been read from the detail file, when more
+ *	than one may be outstanding.  A free entry is STATE_UNOPENED.
+ */
+typedef struct detail_entry_t {
+	detail_state_t	state;
+	int		tries;
+	time_t		running;
+	time_t		timestamp;
+	off_t		timestamp_offset; /* of "\tTimestamp", or -1 */
+	fr_ipaddr_t	client_ip;
+	VALUE_PAIR	*vps;
+	RADIUS_PACKET	*packet;	/* the one we're waiting for */
+} detail_entry_t;
+
 typedef struct listen_detail_t {
 	fr_event_t	*ev;	/* has to be first entry (ugh) */
 	int		delay_time;
@@ -50,6 +65,19 @@ typedef struct listen_detail_t {
 	int		rttvar;
 	struct timeval  last_packet;
 	RADCLIENT	detail_client;
+
+	/*
+	 *	For the mmap'd reader.
+	 */
+	int		max_outstanding;
+	int		track;
+	int		outstanding;
+	detail_entry_t	*entries;
+	char		*map;
+	size_t		map_size;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
 } listen_detail_t;
 
 int detail_recv(rad_listen_t *listener,
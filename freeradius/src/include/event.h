@@ -40,6 +40,7 @@ typedef void (*fr_event_fd_handler_t)(fr_event_list_t *el, int sock, void *ctx);
 
 fr_event_list_t *fr_event_list_create(fr_event_status_t status);
 void fr_event_list_free(fr_event_list_t *el);
+const char *fr_event_list_poller(fr_event_list_t *el);
 
 int fr_event_list_num_elements(fr_event_list_t *el);
 
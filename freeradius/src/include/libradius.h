@@ -160,6 +160,7 @@ typedef struct value_pair {
 	int			attribute;
 	int			vendor;
 	int			type;
+	uint8_t			padded; /* has room for the name after it */
 	size_t			length; /* of data */
 #ifdef __cplusplus
 	/*
@@ -301,9 +302,13 @@ void fr_hmac_sha1(const uint8_t *text, int text_len,
 		    uint8_t *digest);
 
 /* radius.c */
+#define RAD_BATCH_MAX	(16)	/* for rad_recv_batch and rad_send_batch */
 int		rad_send(RADIUS_PACKET *, const RADIUS_PACKET *, const char *secret);
+int		rad_send_batch(RADIUS_PACKET **packets, int num);
 int		rad_packet_ok(RADIUS_PACKET *packet, int flags);
 RADIUS_PACKET	*rad_recv(int fd, int flags);
+int		rad_recv_batch(int fd, RADIUS_PACKET **packets, int num,
+			       int flags);
 ssize_t rad_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, int *src_port,
 			int *code);
 void		rad_recv_discard(int sockfd);
@@ -358,16 +363,29 @@ VALUE_PAIR	*pairread(const char **ptr, FR_TOKEN *eol);
 FR_TOKEN	userparse(const char *buffer, VALUE_PAIR **first_pair);
 VALUE_PAIR     *readvp2(FILE *fp, int *pfiledone, const char *errprefix);
 
+typedef struct value_pair_packed VALUE_PAIR_PACKED;
+VALUE_PAIR_PACKED *pairpack(const VALUE_PAIR *vps);
+VALUE_PAIR	*pairunpack(const VALUE_PAIR_PACKED *packed);
+size_t		pairpacked_size(const VALUE_PAIR_PACKED *packed);
+VALUE_PAIR_PACKED *pairpacked_copy(const void *data, size_t len);
+
+typedef struct fr_pair_index_t fr_pair_index_t;
+extern int	fr_pair_index_enabled;
+fr_pair_index_t	*pairindex_create(VALUE_PAIR *vps, int hint);
+void		pairindex_free(fr_pair_index_t *pi);
+VALUE_PAIR	*pairindex_find(fr_pair_index_t *pi, VALUE_PAIR *vps, int attr);
+int		pairindex_add(fr_pair_index_t *pi, VALUE_PAIR *vp);
+void		pairindex_delete(fr_pair_index_t *pi, int attr);
+int		pairindex_count(fr_pair_index_t *pi, int attr);
+
 /*
  *	Error functions.
  */
-#ifdef _LIBRADIUS
 void		fr_strerror_printf(const char *, ...)
 #ifdef __GNUC__
 		__attribute__ ((format (printf, 1, 2)))
 #endif
 ;
-#endif
 void		fr_perror(const char *, ...)
 #ifdef __GNUC__
 		__attribute__ ((format (printf, 1, 2)))
@@ -489,6 +507,72 @@ void *fr_fifo_pop(fr_fifo_t *fi);
 void *fr_fifo_peek(fr_fifo_t *fi);
 int fr_fifo_num_elements(fr_fifo_t *fi);
 
+/*
+ *	Thread-safe, lock-free, bounded FIFOs.
+ */
+typedef struct fr_atomic_queue_t fr_atomic_queue_t;
+fr_atomic_queue_t *fr_atomic_queue_create(int max_entries);
+void fr_atomic_queue_free(fr_atomic_queue_t *aq);
+int fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data);
+void *fr_atomic_queue_pop(fr_atomic_queue_t *aq);
+int fr_atomic_queue_num_elements(fr_atomic_queue_t *aq);
+
+/*
+ *	Per-thread caches of fixed-size objects.
+ */
+typedef struct fr_slab_t fr_slab_t;
+typedef struct fr_slab_stats_t {
+	const char	*name;
+	size_t		size;
+	uint64_t	allocs;		/* calls to fr_slab_alloc() */
+	uint64_t	frees;		/* calls to fr_slab_free() */
+	uint64_t	mallocs;	/* calls to malloc() */
+	uint64_t	releases;	/* calls to free() */
+	int		num_free;	/* objects waiting to be re-used */
+} fr_slab_stats_t;
+
+extern int fr_slab_enabled;
+fr_slab_t *fr_slab_create(const char *name, size_t size);
+fr_slab_t *fr_slab_get(fr_slab_t **pslab, const char *name, size_t size);
+void *fr_slab_alloc(fr_slab_t *slab);
+void fr_slab_free(fr_slab_t *slab, void *ptr);
+int fr_slab_stats(int index, fr_slab_stats_t *stats);
+
+#ifdef HAVE_REGEX_H
+#include <regex.h>
+
+/*
+ *	Cache of compiled regular expressions.
+ */
+typedef struct fr_regex_stats_t {
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	evictions;
+	uint64_t	errors;		/* patterns which didn't compile */
+	int		num_entries;
+	int		max_entries;
+} fr_regex_stats_t;
+
+extern int fr_regex_cache_size;
+regex_t *fr_regex_get(const char *pattern, int cflags);
+void fr_regex_release(regex_t *reg);
+void fr_regex_cache_stats(fr_regex_stats_t *stats);
+void fr_regex_cache_free(void);
+#endif
+
+/*
+ *	Match names against exact names and regexes in one pass.
+ */
+typedef struct fr_trie_t fr_trie_t;
+fr_trie_t *fr_trie_create(void);
+void fr_trie_free(fr_trie_t *ft);
+int fr_trie_add_name(fr_trie_t *ft, const char *name, void *data);
+#ifdef HAVE_REGEX_H
+int fr_trie_add_regex(fr_trie_t *ft, const char *pattern, int cflags,
+		      void *data);
+#endif
+void *fr_trie_match(const fr_trie_t *ft, const char *name);
+
 #ifdef __cplusplus
 }
 #endif
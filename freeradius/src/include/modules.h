@@ -68,6 +68,10 @@ enum {
 int setup_modules(int, CONF_SECTION *);
 int detach_modules(void);
 int module_hup(CONF_SECTION *modules);
+typedef size_t (*RAD_STATS_FUNC)(void *instance, char *out, size_t outlen);
+int module_stats_register(void *instance, RAD_STATS_FUNC func);
+void module_stats_unregister(void *instance);
+size_t module_stats(void *instance, char *out, size_t outlen);
 int module_authorize(int type, REQUEST *request);
 int module_authenticate(int type, REQUEST *request);
 int module_preacct(REQUEST *request);
@@ -213,6 +213,7 @@ struct auth_req {
 	RADCLIENT		*client;
 #ifdef HAVE_PTHREAD_H
 	pthread_t    		child_pid;
+	int			(*process)(struct auth_req *); /* while queued */
 #endif
 	time_t			timestamp;
 	unsigned int	       	number; /* internal server number */
@@ -551,6 +552,11 @@ int		log_debug(const char *, ...)
 #endif
 ;
 void 		vp_listdebug(VALUE_PAIR *vp);
+int		radlog_async_start(void);
+void		radlog_async_stop(void);
+void		radlog_set_fd(int fd);
+void		radlog_async_stats(uint64_t *written, uint64_t *dropped,
+				   int *queued);
 void radlog_request(int lvl, int priority, REQUEST *request, const char *msg, ...)
 #ifdef __GNUC__
 		__attribute__ ((format (printf, 4, 5)))
@@ -568,6 +574,19 @@ int		radius_exec_program(const char *,  REQUEST *, int,
 				    VALUE_PAIR *input_pairs,
 				    VALUE_PAIR **output_pairs,
 					int shell_escape);
+typedef struct exec_pool_t exec_pool_t;
+exec_pool_t	*exec_pool_create(const char *name, const char *cmd,
+				  int num_helpers, int timeout);
+void		exec_pool_check(exec_pool_t *pool, const char *msg,
+				int interval);
+void		exec_pool_free(exec_pool_t *pool);
+int		exec_pool_send(exec_pool_t *pool, const char *msg, size_t msglen,
+			       char *answer, size_t answerlen);
+int		radius_exec_pool(exec_pool_t *pool, REQUEST *request,
+				 char *user_msg, int msg_len,
+				 VALUE_PAIR *input_pairs,
+				 VALUE_PAIR **output_pairs);
+size_t		exec_pool_stats(exec_pool_t *pool, char *out, size_t outlen);
 
 /* timestr.c */
 int		timestr_match(char *, time_t);
@@ -596,6 +615,13 @@ typedef size_t (*RADIUS_ESCAPE_STRING)(char *out, size_t outlen, const char *in)
 
 int            radius_xlat(char * out, int outlen, const char *fmt,
 			   REQUEST * request, RADIUS_ESCAPE_STRING func);
+typedef struct xlat_template_t xlat_template_t;
+xlat_template_t *radius_compile_xlat(const char *fmt);
+int		radius_xlat_template(char *out, int outlen,
+				     const xlat_template_t *xt,
+				     REQUEST *request,
+				     RADIUS_ESCAPE_STRING func);
+void		radius_free_xlat(xlat_template_t **pxt);
 typedef size_t (*RAD_XLAT_FUNC)(void *instance, REQUEST *, char *, char *, size_t, RADIUS_ESCAPE_STRING func);
 int		xlat_register(const char *module, RAD_XLAT_FUNC func,
 			      void *instance);
@@ -604,14 +630,26 @@ void		xlat_unregister(const char *module, RAD_XLAT_FUNC func,
 void		xlat_free(void);
 
 /* threads.c */
+typedef struct fr_crypto_pool_stats_t {
+	int		threads;
+	int		active;
+	int		queued;
+	int		max_queued;
+	uint64_t	requests;
+	uint64_t	dropped;
+	uint64_t	wait_usec;	/* time spent in the queue */
+	uint64_t	max_wait_usec;
+	uint64_t	run_usec;	/* time spent processing */
+	uint64_t	max_run_usec;
+} fr_crypto_pool_stats_t;
+
 extern		int thread_pool_init(CONF_SECTION *cs, int *spawn_flag);
 extern		int thread_pool_addrequest(REQUEST *, RAD_REQUEST_FUNP);
 extern		pid_t rad_fork(void);
 extern		pid_t rad_waitpid(pid_t pid, int *status);
 extern          int total_active_threads(void);
-extern          void thread_pool_lock(void);
-extern          void thread_pool_unlock(void);
 extern		void thread_pool_queue_stats(int *array);
+extern		void thread_pool_crypto_stats(fr_crypto_pool_stats_t *stats);
 
 #ifndef HAVE_PTHREAD_H
 #define rad_fork(n) fork()
@@ -631,6 +669,7 @@ void fr_suid_down_permanent(void);
 
 /* listen.c */
 void listen_free(rad_listen_t **head);
+int listen_event_fd(rad_listen_t *this);
 int listen_init(CONF_SECTION *cs, rad_listen_t **head);
 rad_listen_t *proxy_new_listener(fr_ipaddr_t *ipaddr, int exists);
 RADCLIENT *client_listener_find(const rad_listen_t *listener,
@@ -645,6 +684,8 @@ rad_listen_t *listener_find_byipaddr(const fr_ipaddr_t *ipaddr, int port);
 int radius_event_init(CONF_SECTION *cs, int spawn_flag);
 void radius_event_free(void);
 int radius_event_process(void);
+int radius_event_defer(fr_event_callback_t callback, void *ctx);
+void radius_event_undefer(void *ctx);
 void radius_handle_request(REQUEST *request, RAD_REQUEST_FUNP fun);
 int received_request(rad_listen_t *listener,
 		     RADIUS_PACKET *packet, REQUEST **prequest,
@@ -653,6 +694,11 @@ REQUEST *received_proxy_response(RADIUS_PACKET *packet);
 void event_new_fd(rad_listen_t *listener);
 
 /* evaluate.c */
+typedef struct fr_cond_t fr_cond_t;
+fr_cond_t *radius_compile_condition(const char *condition);
+int radius_evaluate_compiled_condition(REQUEST *request, int modreturn,
+				       const fr_cond_t *cond, int *presult);
+void radius_free_condition(fr_cond_t **pcond);
 int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 			      const char **ptr, int evaluate_it, int *presult);
 int radius_update_attrlist(REQUEST *request, CONF_SECTION *cs,
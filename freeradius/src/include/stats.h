@@ -73,24 +73,28 @@ void request_stats_reply(REQUEST *request);
 void radius_stats_ema(fr_stats_ema_t *ema,
 		      struct timeval *start, struct timeval *end);
 
-#define RAD_STATS_INC(_x) _x++
+/*
+ *	The receive threads update the counters, too, so the
+ *	increments are atomic.
+ */
+#define RAD_STATS_INC(_x) __sync_fetch_and_add(&(_x), 1)
 #ifdef WITH_ACCOUNTING
 #define RAD_STATS_TYPE_INC(_listener, _x) if (_listener->type == RAD_LISTEN_AUTH) { \
-                                       radius_auth_stats._x++; \
+                                       RAD_STATS_INC(radius_auth_stats._x); \
 				     } else if (_listener->type == RAD_LISTEN_ACCT) { \
-                                       radius_acct_stats._x++; } \
-				       _listener->stats._x++
+                                       RAD_STATS_INC(radius_acct_stats._x); } \
+				       RAD_STATS_INC(_listener->stats._x)
 
 #define RAD_STATS_CLIENT_INC(_listener, _client, _x) if (_listener->type == RAD_LISTEN_AUTH) \
-                                       _client->auth->_x++; \
+                                       RAD_STATS_INC(_client->auth->_x); \
 				     else if (_listener->type == RAD_LISTEN_ACCT) \
-                                       _client->acct->_x++
+                                       RAD_STATS_INC(_client->acct->_x)
 
 #else  /* WITH_ACCOUNTING */
 
-#define RAD_STATS_TYPE_INC(_listener, _x) { radius_auth_stats._x++; _listener->stats._x++; }
+#define RAD_STATS_TYPE_INC(_listener, _x) { RAD_STATS_INC(radius_auth_stats._x); RAD_STATS_INC(_listener->stats._x); }
 
-#define RAD_STATS_CLIENT_INC(_listener, _client, _x) _client->auth->_x++
+#define RAD_STATS_CLIENT_INC(_listener, _client, _x) RAD_STATS_INC(_client->auth->_x)
 
 #endif /* WITH_ACCOUNTING */
 
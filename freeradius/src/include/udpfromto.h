@@ -16,6 +16,11 @@ extern "C" {
 #endif
 
 #ifdef WITH_UDPFROMTO
+/*
+ *	Big enough for the control messages we send and receive.
+ */
+#define UDPFROMTO_CMSG_SIZE (256)
+
 int udpfromto_init(int s);
 int recvfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t *fromlen,
@@ -23,6 +28,13 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 int sendfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t fromlen,
 	       struct sockaddr *to, socklen_t tolen);
+
+/*
+ *	For callers which use recvmmsg() / sendmmsg() directly.
+ */
+void udpfromto_get_dst(struct msghdr *msgh, struct sockaddr *to,
+		       socklen_t *tolen);
+int udpfromto_set_src(struct msghdr *msgh, void *cbuf, struct sockaddr *from);
 #endif
 
 #ifdef __cplusplus
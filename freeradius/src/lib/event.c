@@ -29,6 +29,18 @@ RCSID("$Id$")
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/event.h>
 
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#define FR_EV_POLL_EPOLL (1)
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#define FR_EV_POLL_KQUEUE (1)
+#endif
+
 typedef struct fr_event_fd_t {
 	int			fd;
 	fr_event_fd_handler_t	handler;
@@ -36,9 +48,26 @@ typedef struct fr_event_fd_t {
 } fr_event_fd_t;
 
 #define FR_EV_MAX_FDS (256)
+#define FR_EV_BATCH (64)
 #undef USEC
 #define USEC (1000000)
 
+/*
+ *	The mechanism used to wait for readable file descriptors.
+ *	"wait" blocks until something is ready, or the timeout
+ *	expires.  "dispatch" then calls the handlers for the
+ *	descriptors which "wait" found to be ready.
+ */
+typedef struct fr_event_poller_t {
+	const char	*name;
+	int		(*init)(fr_event_list_t *el);
+	void		(*free)(fr_event_list_t *el);
+	int		(*insert)(fr_event_list_t *el, int id);
+	void		(*delete)(fr_event_list_t *el, int id);
+	int		(*wait)(fr_event_list_t *el, struct timeval *wake);
+	void		(*dispatch)(fr_event_list_t *el, int rcode);
+} fr_event_poller_t;
+
 struct fr_event_list_t {
 	fr_heap_t	*times;
 
@@ -51,8 +80,28 @@ struct fr_event_list_t {
 	struct timeval  now;
 	int		dispatch;
 
+	const fr_event_poller_t *poller;
+
 	int		max_readers;
-	fr_event_fd_t	readers[FR_EV_MAX_FDS];
+	int		num_slots;
+	fr_event_fd_t	*readers;
+
+	/*
+	 *	select()
+	 */
+	int		maxfd;
+	fd_set		read_fds;
+	fd_set		master_fds;
+
+#if defined(FR_EV_POLL_EPOLL) || defined(FR_EV_POLL_KQUEUE)
+	int		poll_fd;
+#endif
+#ifdef FR_EV_POLL_EPOLL
+	struct epoll_event events[FR_EV_BATCH];
+#endif
+#ifdef FR_EV_POLL_KQUEUE
+	struct kevent	events[FR_EV_BATCH];
+#endif
 };
 
 /*
@@ -82,6 +131,286 @@ static int fr_event_list_time_cmp(const void *one, const void *two)
 }
 
 
+/*
+ *	Call the handler for one socket.  Returns 0 if the handler
+ *	changed the set of sockets, in which case the rest of the
+ *	ready list may be stale, and the caller should stop.
+ */
+static int fr_event_fd_call(fr_event_list_t *el, int id)
+{
+	fr_event_fd_t *ef;
+
+	if ((id < 0) || (id >= el->max_readers)) return 1;
+
+	ef = &el->readers[id];
+	if (ef->fd < 0) return 1;
+
+	ef->handler(el, ef->fd, ef->ctx);
+
+	return !el->changed;
+}
+
+
+/*
+ *	select() works everywhere, but it's O(N) in the number of
+ *	sockets, and it can't handle sockets >= FD_SETSIZE.
+ */
+static int fr_select_init(fr_event_list_t *el)
+{
+	FD_ZERO(&el->master_fds);
+	el->maxfd = -1;
+
+	return 1;
+}
+
+static void fr_select_free(UNUSED fr_event_list_t *el)
+{
+}
+
+static int fr_select_insert(fr_event_list_t *el, int id)
+{
+	if (el->readers[id].fd >= FD_SETSIZE) {
+		fr_strerror_printf("Socket %d is too large for select()",
+				   el->readers[id].fd);
+		return 0;
+	}
+
+	return 1;		/* master_fds is re-built in wait */
+}
+
+static void fr_select_delete(UNUSED fr_event_list_t *el, UNUSED int id)
+{
+}
+
+static int fr_select_wait(fr_event_list_t *el, struct timeval *wake)
+{
+	int i;
+
+	/*
+	 *	Cache the list of FD's to watch.
+	 */
+	if (el->changed) {
+		FD_ZERO(&el->master_fds);
+		el->maxfd = -1;
+
+		for (i = 0; i < el->max_readers; i++) {
+			if (el->readers[i].fd < 0) continue;
+
+			if (el->readers[i].fd > el->maxfd) {
+				el->maxfd = el->readers[i].fd;
+			}
+			FD_SET(el->readers[i].fd, &el->master_fds);
+		}
+	}
+
+	el->read_fds = el->master_fds;
+	return select(el->maxfd + 1, &el->read_fds, NULL, NULL, wake);
+}
+
+static void fr_select_dispatch(fr_event_list_t *el, UNUSED int rcode)
+{
+	int i;
+
+	for (i = 0; i < el->max_readers; i++) {
+		if (el->readers[i].fd < 0) continue;
+
+		if (!FD_ISSET(el->readers[i].fd, &el->read_fds)) continue;
+
+		if (!fr_event_fd_call(el, i)) break;
+	}
+}
+
+static const fr_event_poller_t fr_select_poller = {
+	"select",
+	fr_select_init,
+	fr_select_free,
+	fr_select_insert,
+	fr_select_delete,
+	fr_select_wait,
+	fr_select_dispatch
+};
+
+
+#ifdef FR_EV_POLL_EPOLL
+/*
+ *	epoll returns only the ready sockets, so the cost of a wakeup
+ *	doesn't depend on how many idle sockets we have.
+ */
+static int fr_epoll_init(fr_event_list_t *el)
+{
+	el->poll_fd = epoll_create(FR_EV_MAX_FDS);
+	if (el->poll_fd < 0) return 0;
+
+#ifdef FD_CLOEXEC
+	fcntl(el->poll_fd, F_SETFD, FD_CLOEXEC);
+#endif
+
+	return 1;
+}
+
+static void fr_epoll_free(fr_event_list_t *el)
+{
+	if (el->poll_fd >= 0) close(el->poll_fd);
+	el->poll_fd = -1;
+}
+
+static int fr_epoll_insert(fr_event_list_t *el, int id)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = id;
+
+	if (epoll_ctl(el->poll_fd, EPOLL_CTL_ADD, el->readers[id].fd,
+		      &ev) < 0) {
+		fr_strerror_printf("Failed adding socket to epoll: %s",
+				   strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+static void fr_epoll_delete(fr_event_list_t *el, int id)
+{
+	struct epoll_event ev;
+
+	/*
+	 *	Older kernels require a non-NULL event, even for DEL.
+	 */
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(el->poll_fd, EPOLL_CTL_DEL, el->readers[id].fd, &ev);
+}
+
+static int fr_epoll_wait(fr_event_list_t *el, struct timeval *wake)
+{
+	int timeout;
+
+	if (wake) {
+		/*
+		 *	Round up, so that we don't wake up just
+		 *	before the next timer is due, and spin.
+		 */
+		timeout = (wake->tv_sec * 1000) + ((wake->tv_usec + 999) / 1000);
+	} else {
+		timeout = -1;
+	}
+
+	return epoll_wait(el->poll_fd, el->events, FR_EV_BATCH, timeout);
+}
+
+static void fr_epoll_dispatch(fr_event_list_t *el, int rcode)
+{
+	int i;
+
+	for (i = 0; i < rcode; i++) {
+		if (!fr_event_fd_call(el, el->events[i].data.u32)) break;
+	}
+}
+
+static const fr_event_poller_t fr_epoll_poller = {
+	"epoll",
+	fr_epoll_init,
+	fr_epoll_free,
+	fr_epoll_insert,
+	fr_epoll_delete,
+	fr_epoll_wait,
+	fr_epoll_dispatch
+};
+#endif	/* FR_EV_POLL_EPOLL */
+
+
+#ifdef FR_EV_POLL_KQUEUE
+static int fr_kqueue_init(fr_event_list_t *el)
+{
+	el->poll_fd = kqueue();
+	if (el->poll_fd < 0) return 0;
+
+	return 1;
+}
+
+static void fr_kqueue_free(fr_event_list_t *el)
+{
+	if (el->poll_fd >= 0) close(el->poll_fd);
+	el->poll_fd = -1;
+}
+
+static int fr_kqueue_insert(fr_event_list_t *el, int id)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, el->readers[id].fd, EVFILT_READ, EV_ADD, 0, 0,
+	       (void *) (intptr_t) id);
+
+	if (kevent(el->poll_fd, &kev, 1, NULL, 0, NULL) < 0) {
+		fr_strerror_printf("Failed adding socket to kqueue: %s",
+				   strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+static void fr_kqueue_delete(fr_event_list_t *el, int id)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, el->readers[id].fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+	kevent(el->poll_fd, &kev, 1, NULL, 0, NULL);
+}
+
+static int fr_kqueue_wait(fr_event_list_t *el, struct timeval *wake)
+{
+	struct timespec ts;
+
+	if (wake) {
+		ts.tv_sec = wake->tv_sec;
+		ts.tv_nsec = wake->tv_usec * 1000;
+	}
+
+	return kevent(el->poll_fd, NULL, 0, el->events, FR_EV_BATCH,
+		      wake ? &ts : NULL);
+}
+
+static void fr_kqueue_dispatch(fr_event_list_t *el, int rcode)
+{
+	int i;
+
+	for (i = 0; i < rcode; i++) {
+		if (el->events[i].flags & EV_ERROR) continue;
+
+		if (!fr_event_fd_call(el, (intptr_t) el->events[i].udata)) break;
+	}
+}
+
+static const fr_event_poller_t fr_kqueue_poller = {
+	"kqueue",
+	fr_kqueue_init,
+	fr_kqueue_free,
+	fr_kqueue_insert,
+	fr_kqueue_delete,
+	fr_kqueue_wait,
+	fr_kqueue_dispatch
+};
+#endif	/* FR_EV_POLL_KQUEUE */
+
+
+/*
+ *	In order of preference.  select() always works.
+ */
+static const fr_event_poller_t *fr_event_pollers[] = {
+#ifdef FR_EV_POLL_EPOLL
+	&fr_epoll_poller,
+#endif
+#ifdef FR_EV_POLL_KQUEUE
+	&fr_kqueue_poller,
+#endif
+	&fr_select_poller,
+	NULL
+};
+
+
 void fr_event_list_free(fr_event_list_t *el)
 {
 	fr_event_t *ev;
@@ -93,11 +422,14 @@ void fr_event_list_free(fr_event_list_t *el)
 	}
 
 	fr_heap_delete(el->times);
+	if (el->poller) el->poller->free(el);
+	free(el->readers);
 	free(el);
 }
 
 
-fr_event_list_t *fr_event_list_create(fr_event_status_t status)
+static fr_event_list_t *fr_event_list_create_poller(fr_event_status_t status,
+							const fr_event_poller_t **pollers)
 {
 	int i;
 	fr_event_list_t *el;
@@ -113,16 +445,50 @@ fr_event_list_t *fr_event_list_create(fr_event_status_t status)
 		return NULL;
 	}
 
+	el->readers = malloc(FR_EV_MAX_FDS * sizeof(el->readers[0]));
+	if (!el->readers) {
+		fr_event_list_free(el);
+		return NULL;
+	}
+	el->num_slots = FR_EV_MAX_FDS;
+
 	for (i = 0; i < FR_EV_MAX_FDS; i++) {
 		el->readers[i].fd = -1;
 	}
 
+	/*
+	 *	Use the first one which works.
+	 */
+	for (i = 0; pollers[i] != NULL; i++) {
+		if (pollers[i]->init(el)) {
+			el->poller = pollers[i];
+			break;
+		}
+	}
+
+	if (!el->poller) {
+		fr_event_list_free(el);
+		return NULL;
+	}
+
 	el->status = status;
 	el->changed = 1;	/* force re-set of fds's */
 
 	return el;
 }
 
+fr_event_list_t *fr_event_list_create(fr_event_status_t status)
+{
+	return fr_event_list_create_poller(status, fr_event_pollers);
+}
+
+const char *fr_event_list_poller(fr_event_list_t *el)
+{
+	if (!el || !el->poller) return "none";
+
+	return el->poller->name;
+}
+
 int fr_event_list_num_elements(fr_event_list_t *el)
 {
 	if (!el) return 0;
@@ -239,17 +605,15 @@ int fr_event_now(fr_event_list_t *el, struct timeval *when)
 int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		       fr_event_fd_handler_t handler, void *ctx)
 {
-	int i;
+	int i, id;
 	fr_event_fd_t *ef;
 
 	if (!el || (fd < 0) || !handler || !ctx) return 0;
 
 	if (type != 0) return 0;
 
-	if (el->max_readers >= FR_EV_MAX_FDS) return 0;
-
-	ef = NULL;
-	for (i = 0; i <= el->max_readers; i++) {
+	id = -1;
+	for (i = 0; i < el->max_readers; i++) {
 		/*
 		 *	Be fail-safe on multiple inserts.
 		 */
@@ -265,20 +629,44 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 			return 1;
 		}
 
-		if (el->readers[i].fd < 0) {
-			ef = &el->readers[i];
+		if ((id < 0) && (el->readers[i].fd < 0)) id = i;
+	}
 
-			if (i == el->max_readers) el->max_readers = i + 1;
-			break;
+	/*
+	 *	No free slot: add one to the end, growing the array
+	 *	if necessary.  The pollers refer to sockets by index,
+	 *	so moving the array is OK.
+	 */
+	if (id < 0) {
+		if (el->max_readers == el->num_slots) {
+			fr_event_fd_t *readers;
+
+			readers = realloc(el->readers,
+					  2 * el->num_slots * sizeof(*readers));
+			if (!readers) return 0;
+
+			for (i = el->num_slots; i < 2 * el->num_slots; i++) {
+				readers[i].fd = -1;
+			}
+
+			el->readers = readers;
+			el->num_slots *= 2;
 		}
-	}
 
-	if (!ef) return 0;
+		id = el->max_readers;
+	}
 
+	ef = &el->readers[id];
 	ef->handler = handler;
 	ef->ctx = ctx;
 	ef->fd = fd;
 
+	if (!el->poller->insert(el, id)) {
+		ef->fd = -1;
+		return 0;
+	}
+
+	if (id == el->max_readers) el->max_readers = id + 1;
 	el->changed = 1;
 
 	return 1;
@@ -294,6 +682,7 @@ int fr_event_fd_delete(fr_event_list_t *el, int type, int fd)
 
 	for (i = 0; i < el->max_readers; i++) {
 		if (el->readers[i].fd == fd) {
+			el->poller->delete(el, i);
 			el->readers[i].fd = -1;
 			if ((i + 1) == el->max_readers) el->max_readers = i;
 			el->changed = 1;
@@ -315,33 +704,14 @@ void fr_event_loop_exit(fr_event_list_t *el, int code)
 
 int fr_event_loop(fr_event_list_t *el)
 {
-	int i, rcode, maxfd = 0;
+	int rcode;
 	struct timeval when, *wake;
-	fd_set read_fds, master_fds;
 
 	el->exit = 0;
 	el->dispatch = 1;
 	el->changed = 1;
 
 	while (!el->exit) {
-		/*
-		 *	Cache the list of FD's to watch.
-		 */
-		if (el->changed) {
-			FD_ZERO(&master_fds);
-			
-			for (i = 0; i < el->max_readers; i++) {
-				if (el->readers[i].fd < 0) continue;
-				
-				if (el->readers[i].fd > maxfd) {
-					maxfd = el->readers[i].fd;
-				}
-				FD_SET(el->readers[i].fd, &master_fds);
-			}
-			
-			el->changed = 0;
-		}
-
 		/*
 		 *	Find the first event.  If there's none, we wait
 		 *	on the socket forever.
@@ -387,11 +757,11 @@ int fr_event_loop(fr_event_list_t *el)
 		 */
 		if (el->status) el->status(wake);
 
-		read_fds = master_fds;
-		rcode = select(maxfd + 1, &read_fds, NULL, NULL, wake);
+		rcode = el->poller->wait(el, wake);
+		el->changed = 0;
 		if ((rcode < 0) && (errno != EINTR)) {
-			fr_strerror_printf("Failed in select: %s",
-					   strerror(errno));
+			fr_strerror_printf("Failed in %s: %s",
+					   el->poller->name, strerror(errno));
 			el->dispatch = 0;
 			return -1;
 		}
@@ -405,17 +775,7 @@ int fr_event_loop(fr_event_list_t *el)
 		
 		if (rcode <= 0) continue;
 
-		for (i = 0; i < el->max_readers; i++) {
-			fr_event_fd_t *ef = &el->readers[i];
-
-			if (ef->fd < 0) continue;
-
-			if (!FD_ISSET(ef->fd, &read_fds)) continue;
-			
-			ef->handler(el, ef->fd, ef->ctx);
-
-			if (el->changed) break;
-		}
+		el->poller->dispatch(el, rcode);
 	}
 
 	el->dispatch = 0;
@@ -426,7 +786,7 @@ int fr_event_loop(fr_event_list_t *el)
 #ifdef TESTING
 
 /*
- *  cc -g -I .. -c rbtree.c -o rbtree.o && cc -g -I .. -c isaac.c -o isaac.o && cc -DTESTING -I .. -c event.c  -o event_mine.o && cc event_mine.o rbtree.o isaac.o -o event
+ *  cc -g -I .. -c heap.c -o heap.o && cc -g -I .. -c isaac.c -o isaac.o && cc -g -I .. -c log.c -o log.o && cc -DTESTING -D_LIBRADIUS -I .. -c event.c  -o event_mine.o && cc event_mine.o heap.o isaac.o log.o -o event
  *
  *  ./event
  *
@@ -464,15 +824,139 @@ static uint32_t event_rand(void)
 }
 
 
+/*
+ *	./event -b
+ *
+ *	Measures the cost of one trip around the event loop, for
+ *	each poller, with 10/100/1000 idle sockets and one busy one.
+ */
+#define BENCH_LOOPS (100000)
+
+static int bench_pipe[2];
+static int bench_count;
+
+static void bench_idle(fr_event_list_t *el, UNUSED int sock,
+		       UNUSED void *ctx)
+{
+	fr_event_loop_exit(el, -1); /* idle sockets should never be ready */
+}
+
+static void bench_ready(fr_event_list_t *el, int sock, UNUSED void *ctx)
+{
+	char c;
+
+	if (read(sock, &c, 1) != 1) {
+		fr_event_loop_exit(el, -1);
+		return;
+	}
+
+	if (++bench_count >= BENCH_LOOPS) {
+		fr_event_loop_exit(el, 1);
+		return;
+	}
+
+	if (write(bench_pipe[1], &c, 1) != 1) fr_event_loop_exit(el, -1);
+}
+
+static void bench_poller(const fr_event_poller_t *poller, int num_idle)
+{
+	int i, num_fds, rcode;
+	int *fds;
+	const fr_event_poller_t *pollers[2];
+	fr_event_list_t *el;
+	struct timeval start, end;
+	double usec;
+	char c = 0;
+
+	pollers[0] = poller;
+	pollers[1] = NULL;
+
+	el = fr_event_list_create_poller(NULL, pollers);
+	if (!el) {
+		printf("%-8s %5d idle: failed creating event list\n",
+		       poller->name, num_idle);
+		return;
+	}
+
+	fds = malloc(num_idle * sizeof(*fds));
+	if (!fds) exit(1);
+
+	bench_pipe[0] = bench_pipe[1] = -1;
+	for (num_fds = 0; num_fds < num_idle; num_fds++) {
+		fds[num_fds] = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fds[num_fds] < 0) {
+			printf("%-8s %5d idle: skipped (%s)\n",
+			       poller->name, num_idle, strerror(errno));
+			goto done;
+		}
+
+		if (!fr_event_fd_insert(el, 0, fds[num_fds], bench_idle, el)) {
+			close(fds[num_fds]);
+			printf("%-8s %5d idle: skipped (%s)\n",
+			       poller->name, num_idle, fr_strerror());
+			goto done;
+		}
+	}
+
+	if ((pipe(bench_pipe) < 0) ||
+	    !fr_event_fd_insert(el, 0, bench_pipe[0], bench_ready, el)) {
+		printf("%-8s %5d idle: skipped (pipe)\n",
+		       poller->name, num_idle);
+		goto done;
+	}
+
+	bench_count = 0;
+	if (write(bench_pipe[1], &c, 1) != 1) goto done;
+
+	gettimeofday(&start, NULL);
+	rcode = fr_event_loop(el);
+	gettimeofday(&end, NULL);
+
+	if (rcode != 1) {
+		printf("%-8s %5d idle: loop failed\n", poller->name, num_idle);
+		goto done;
+	}
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000.0;
+	usec += end.tv_usec - start.tv_usec;
+
+	printf("%-8s %5d idle: %.3f usec/loop\n", poller->name, num_idle,
+	       usec / BENCH_LOOPS);
+
+done:
+	for (i = 0; i < num_fds; i++) close(fds[i]);
+	if (bench_pipe[0] >= 0) close(bench_pipe[0]);
+	if (bench_pipe[1] >= 0) close(bench_pipe[1]);
+	free(fds);
+	fr_event_list_free(el);
+}
+
+static int bench_main(void)
+{
+	int i, j;
+	static const int num_idle[] = { 10, 100, 1000, 0 };
+
+	for (i = 0; fr_event_pollers[i] != NULL; i++) {
+		for (j = 0; num_idle[j] != 0; j++) {
+			bench_poller(fr_event_pollers[i], num_idle[j]);
+		}
+	}
+
+	return 0;
+}
+
+
 #define MAX 100
 int main(int argc, char **argv)
 {
-	int i, rcode;
+	int i;
 	struct timeval array[MAX];
 	struct timeval now, when;
 	fr_event_list_t *el;
 
-	el = fr_event_list_create();
+	if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) return bench_main();
+
+	el = fr_event_list_create(NULL);
 	if (!el) exit(1);
 
 	memset(&rand_pool, 0, sizeof(rand_pool));
@@ -490,7 +974,7 @@ int main(int argc, char **argv)
 			array[i].tv_usec -= 1000000;
 			array[i].tv_sec++;
 		}
-		fr_event_insert(el, print_time, &array[i], &array[i]);
+		fr_event_insert(el, print_time, &array[i], &array[i], NULL);
 	}
 
 	while (fr_event_list_num_elements(el)) {
@@ -1530,6 +1530,105 @@ int rad_send(RADIUS_PACKET *packet, const RADIUS_PACKET *original,
 			  &packet->dst_ipaddr, packet->dst_port);
 }
 
+/*
+ *	Send packets which have already been encoded and signed.
+ *	All of the packets must use the same socket.  Returns the
+ *	number of packets which were sent, or -1 on error.
+ */
+int rad_send_batch(RADIUS_PACKET **packets, int num)
+{
+#ifdef HAVE_SENDMMSG
+	int			i, rcode, sent, sockfd;
+	struct mmsghdr		msgs[RAD_BATCH_MAX];
+	struct iovec		iov[RAD_BATCH_MAX];
+	struct sockaddr_storage	dst[RAD_BATCH_MAX];
+#ifdef WITH_UDPFROMTO
+	struct sockaddr_storage	src;
+	socklen_t		sizeof_src;
+	char			cbuf[RAD_BATCH_MAX][UDPFROMTO_CMSG_SIZE];
+#endif
+
+	if (num <= 0) return 0;
+	if (num > RAD_BATCH_MAX) num = RAD_BATCH_MAX;
+
+	sockfd = packets[0]->sockfd;
+
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+	for (i = 0; i < num; i++) {
+		RADIUS_PACKET *packet = packets[i];
+		socklen_t sizeof_dst;
+
+		if ((packet->sockfd != sockfd) || !packet->data) {
+			fr_strerror_printf("Invalid packet in batch");
+			return -1;
+		}
+
+		if (!fr_ipaddr2sockaddr(&packet->dst_ipaddr, packet->dst_port,
+					&dst[i], &sizeof_dst)) {
+			return -1;
+		}
+
+		iov[i].iov_base = packet->data;
+		iov[i].iov_len = packet->data_len;
+
+		msgs[i].msg_hdr.msg_name = &dst[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof_dst;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+
+#ifdef WITH_UDPFROMTO
+		/*
+		 *	Same rules as rad_sendto().
+		 */
+		if (((packet->dst_ipaddr.af == AF_INET) ||
+		     (packet->dst_ipaddr.af == AF_INET6)) &&
+		    (packet->src_ipaddr.af != AF_UNSPEC) &&
+		    !fr_inaddr_any(&packet->src_ipaddr) &&
+		    fr_ipaddr2sockaddr(&packet->src_ipaddr, packet->src_port,
+				       &src, &sizeof_src)) {
+			udpfromto_set_src(&msgs[i].msg_hdr, cbuf[i],
+					  (struct sockaddr *)&src);
+		}
+#endif
+	}
+
+	/*
+	 *	sendmmsg() stops at the first packet it can't send.
+	 *	Complain about that one, and carry on with the rest.
+	 */
+	i = sent = 0;
+	while (i < num) {
+		rcode = sendmmsg(sockfd, msgs + i, num - i, 0);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			DEBUG("rad_send() failed: %s\n", strerror(errno));
+			i++;
+			continue;
+		}
+
+		i += rcode;
+		sent += rcode;
+	}
+
+	return sent;
+#else
+	int i, sent = 0;
+
+	for (i = 0; i < num; i++) {
+		RADIUS_PACKET *packet = packets[i];
+
+		if (rad_sendto(packet->sockfd, packet->data, packet->data_len, 0,
+			       &packet->src_ipaddr, packet->src_port,
+			       &packet->dst_ipaddr, packet->dst_port) >= 0) {
+			sent++;
+		}
+	}
+
+	return sent;
+#endif
+}
+
 /*
  *	Do a comparison of two authentication digests by comparing
  *	the FULL digest.  Otehrwise, the server can be subject to
@@ -1938,6 +2037,25 @@ int rad_packet_ok(RADIUS_PACKET *packet, int flags)
 }
 
 
+static int rad_recv_check(RADIUS_PACKET *packet, int fd, int flags);
+
+/*
+ *	RADIUS_PACKETs come from a slab, as there are at least two
+ *	for every request.
+ */
+static fr_slab_t *packet_slab = NULL;
+
+static RADIUS_PACKET *packet_malloc(void)
+{
+	fr_slab_t *slab;
+
+	slab = fr_slab_get(&packet_slab, "RADIUS_PACKET",
+			   sizeof(RADIUS_PACKET));
+	if (!slab) return malloc(sizeof(RADIUS_PACKET));
+
+	return fr_slab_alloc(slab);
+}
+
 /*
  *	Receive UDP client requests, and fill in
  *	the basics of a RADIUS_PACKET structure.
@@ -1950,7 +2068,7 @@ RADIUS_PACKET *rad_recv(int fd, int flags)
 	/*
 	 *	Allocate the new request data structure
 	 */
-	if ((packet = malloc(sizeof(*packet))) == NULL) {
+	if ((packet = packet_malloc()) == NULL) {
 		fr_strerror_printf("out of memory");
 		return NULL;
 	}
@@ -1971,7 +2089,7 @@ RADIUS_PACKET *rad_recv(int fd, int flags)
 	if (packet->data_len < 0) {
 		fr_strerror_printf("Error receiving packet: %s", strerror(errno));
 		/* packet->data is NULL */
-		free(packet);
+		rad_free(&packet);
 		return NULL;
 	}
 
@@ -1983,7 +2101,7 @@ RADIUS_PACKET *rad_recv(int fd, int flags)
 	if (packet->data_len > MAX_PACKET_LEN) {
 		fr_strerror_printf("Discarding packet: Larger than RFC limitation of 4096 bytes.");
 		/* packet->data is NULL */
-		free(packet);
+		rad_free(&packet);
 		return NULL;
 	}
 
@@ -1995,16 +2113,29 @@ RADIUS_PACKET *rad_recv(int fd, int flags)
 	 */
 	if ((packet->data_len == 0) || !packet->data) {
 		fr_strerror_printf("Empty packet: Socket is not ready.");
-		free(packet);
+		rad_free(&packet);
+		return NULL;
+	}
+
+	if (!rad_recv_check(packet, fd, flags)) {
+		rad_free(&packet);
 		return NULL;
 	}
 
+	return packet;
+}
+
+
+/*
+ *	Checks which are common to rad_recv() and rad_recv_batch().
+ */
+static int rad_recv_check(RADIUS_PACKET *packet, int fd, int flags)
+{
 	/*
 	 *	See if it's a well-formed RADIUS packet.
 	 */
 	if (!rad_packet_ok(packet, flags)) {
-		rad_free(&packet);
-		return NULL;
+		return 0;
 	}
 
 	/*
@@ -2044,7 +2175,160 @@ RADIUS_PACKET *rad_recv(int fd, int flags)
 		DEBUG(", id=%d, length=%d\n", packet->id, packet->data_len);
 	}
 
-	return packet;
+	return 1;
+}
+
+
+/*
+ *	Receive up to "num" packets from a socket, with as few system
+ *	calls as possible.  Packets which fail the sanity checks are
+ *	discarded.  Returns the number of packets received, which may
+ *	be zero, or -1 on error.
+ *
+ *	The socket should be readable, otherwise the fallback code
+ *	may block.  MSG_PEEK is not supported here.
+ */
+int rad_recv_batch(int fd, RADIUS_PACKET **packets, int num, int flags)
+{
+#ifdef HAVE_RECVMMSG
+	int			i, rcode, received;
+	struct mmsghdr		msgs[RAD_BATCH_MAX];
+	struct iovec		iov[RAD_BATCH_MAX];
+	struct sockaddr_storage	src[RAD_BATCH_MAX];
+	uint8_t			buffer[RAD_BATCH_MAX][MAX_PACKET_LEN];
+#ifdef WITH_UDPFROMTO
+	char			cbuf[RAD_BATCH_MAX][UDPFROMTO_CMSG_SIZE];
+	int			udpfromto = FALSE;
+#endif
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_dst = sizeof(dst);
+
+	if (num <= 0) return 0;
+	if (num > RAD_BATCH_MAX) num = RAD_BATCH_MAX;
+
+	/*
+	 *	Get address family, etc. first, so we know if we
+	 *	need to do udpfromto.
+	 */
+	memset(&dst, 0, sizeof(dst));
+	if (getsockname(fd, (struct sockaddr *)&dst, &sizeof_dst) < 0) {
+		fr_strerror_printf("Error receiving packet: %s", strerror(errno));
+		return -1;
+	}
+
+#ifdef WITH_UDPFROMTO
+	if ((dst.ss_family == AF_INET) || (dst.ss_family == AF_INET6)) {
+		udpfromto = TRUE;
+	}
+#endif
+
+	memset(msgs, 0, sizeof(msgs[0]) * num);
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = buffer[i];
+		iov[i].iov_len = sizeof(buffer[i]);
+
+		msgs[i].msg_hdr.msg_name = &src[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(src[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+
+#ifdef WITH_UDPFROMTO
+		if (udpfromto) {
+			msgs[i].msg_hdr.msg_control = cbuf[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(cbuf[i]);
+		}
+#endif
+	}
+
+	rcode = recvmmsg(fd, msgs, num, MSG_DONTWAIT, NULL);
+	if (rcode < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("Error receiving packet: %s", strerror(errno));
+		return -1;
+	}
+
+	received = 0;
+	for (i = 0; i < rcode; i++) {
+		int			port;
+		RADIUS_PACKET		*packet;
+		struct sockaddr_storage	to;
+		socklen_t		sizeof_to = sizeof_dst;
+
+		/*
+		 *	Anything larger than 4k is discarded.
+		 */
+		if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+			DEBUG("Discarding packet: Larger than RFC limitation of 4096 bytes.\n");
+			continue;
+		}
+
+		if (msgs[i].msg_len == 0) continue;
+
+		if ((packet = packet_malloc()) == NULL) {
+			fr_strerror_printf("out of memory");
+			break;
+		}
+		memset(packet, 0, sizeof(*packet));
+
+		if (!fr_sockaddr2ipaddr(&src[i], msgs[i].msg_hdr.msg_namelen,
+					&packet->src_ipaddr, &port)) {
+			rad_free(&packet);
+			continue;
+		}
+		packet->src_port = port;
+
+		memcpy(&to, &dst, sizeof(to));
+#ifdef WITH_UDPFROMTO
+		if (udpfromto) {
+			udpfromto_get_dst(&msgs[i].msg_hdr,
+					  (struct sockaddr *)&to, &sizeof_to);
+		}
+#endif
+		fr_sockaddr2ipaddr(&to, sizeof_to, &packet->dst_ipaddr, &port);
+		packet->dst_port = port;
+
+		/*
+		 *	Different address families should never happen.
+		 */
+		if (src[i].ss_family != to.ss_family) {
+			rad_free(&packet);
+			continue;
+		}
+
+		packet->data_len = msgs[i].msg_len;
+		packet->data = malloc(packet->data_len);
+		if (!packet->data) {
+			rad_free(&packet);
+			fr_strerror_printf("out of memory");
+			break;
+		}
+		memcpy(packet->data, buffer[i], packet->data_len);
+
+		if (!rad_recv_check(packet, fd, flags)) {
+			DEBUG("%s\n", fr_strerror());
+			rad_free(&packet);
+			continue;
+		}
+
+		packets[received++] = packet;
+	}
+
+	return received;
+#else
+	/*
+	 *	One packet at a time.
+	 */
+	if (num <= 0) return 0;
+
+	packets[0] = rad_recv(fd, flags);
+	if (!packets[0]) {
+		DEBUG("%s\n", fr_strerror());
+		return 0;
+	}
+
+	return 1;
+#endif
 }
 
 
@@ -3577,7 +3861,7 @@ RADIUS_PACKET *rad_alloc(int newvector)
 {
 	RADIUS_PACKET	*rp;
 
-	if ((rp = malloc(sizeof(RADIUS_PACKET))) == NULL) {
+	if ((rp = packet_malloc()) == NULL) {
 		fr_strerror_printf("out of memory");
 		return NULL;
 	}
@@ -3647,7 +3931,7 @@ void rad_free(RADIUS_PACKET **radius_packet_ptr)
 
 	pairfree(&radius_packet->vps);
 
-	free(radius_packet);
+	fr_slab_free(packet_slab, radius_packet);
 
 	*radius_packet_ptr = NULL;
 }
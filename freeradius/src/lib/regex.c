@@ -0,0 +1,445 @@
+/*
+ * regex.c	Cache of compiled regular expressions.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2012  The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#ifdef HAVE_REGEX_H
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/*
+ *	Patterns which are known when the configuration is loaded
+ *	should be compiled then, and kept.  This cache is for patterns
+ *	which aren't known until a packet arrives: ones built by
+ *	xlat, or taken from attributes in the "users" file.
+ *
+ *	The cache holds at most fr_regex_cache_size entries, and
+ *	evicts the least recently used one when it's full.  Entries
+ *	are reference counted, so an entry which is evicted while a
+ *	caller is using it is freed when the caller releases it.
+ *	regexec() doesn't modify the regex_t, so many threads can use
+ *	one entry at the same time.
+ */
+typedef struct fr_regex_entry_t {
+	regex_t		reg;		/* MUST be first */
+	char		*pattern;
+	int		cflags;
+	int		refcount;	/* callers, plus one for the cache */
+
+	struct fr_regex_entry_t *prev;	/* more recently used */
+	struct fr_regex_entry_t *next;	/* less recently used */
+} fr_regex_entry_t;
+
+/*
+ *	Set this to zero to compile the pattern on every call.
+ */
+int fr_regex_cache_size = 256;
+
+static fr_hash_table_t *regex_cache = NULL;
+static fr_regex_entry_t *regex_lru_head = NULL;
+static fr_regex_entry_t *regex_lru_tail = NULL;
+static int regex_num_entries = 0;
+
+static uint64_t regex_hits = 0;
+static uint64_t regex_misses = 0;
+static uint64_t regex_evictions = 0;
+static uint64_t regex_errors = 0;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t regex_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define REGEX_LOCK	pthread_mutex_lock(&regex_mutex)
+#define REGEX_UNLOCK	pthread_mutex_unlock(&regex_mutex)
+#else
+#define REGEX_LOCK
+#define REGEX_UNLOCK
+#endif
+
+
+static uint32_t regex_entry_hash(const void *data)
+{
+	const fr_regex_entry_t *entry = data;
+	uint32_t hash;
+
+	hash = fr_hash_string(entry->pattern);
+	return fr_hash_update(&entry->cflags, sizeof(entry->cflags), hash);
+}
+
+static int regex_entry_cmp(const void *one, const void *two)
+{
+	const fr_regex_entry_t *a = one;
+	const fr_regex_entry_t *b = two;
+
+	if (a->cflags != b->cflags) return a->cflags - b->cflags;
+
+	return strcmp(a->pattern, b->pattern);
+}
+
+static void regex_entry_free(fr_regex_entry_t *entry)
+{
+	regfree(&entry->reg);
+	free(entry->pattern);
+	free(entry);
+}
+
+static void regex_lru_unlink(fr_regex_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		regex_lru_head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		regex_lru_tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void regex_lru_push(fr_regex_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = regex_lru_head;
+	if (regex_lru_head) regex_lru_head->prev = entry;
+	regex_lru_head = entry;
+	if (!regex_lru_tail) regex_lru_tail = entry;
+}
+
+/*
+ *	Remove an entry from the cache, and drop the cache's
+ *	reference.  Called with the lock held.
+ */
+static void regex_cache_remove(fr_regex_entry_t *entry)
+{
+	regex_lru_unlink(entry);
+	fr_hash_table_yank(regex_cache, entry);
+	regex_num_entries--;
+
+	if (--entry->refcount == 0) regex_entry_free(entry);
+}
+
+
+/*
+ *	Get a compiled regex for the pattern.  The caller MUST call
+ *	fr_regex_release() when it's done with the regex_t.
+ *
+ *	Returns NULL, with the error in fr_strerror(), if the pattern
+ *	doesn't compile.
+ */
+regex_t *fr_regex_get(const char *pattern, int cflags)
+{
+	int rcode;
+	fr_regex_entry_t *entry, *old, my_entry;
+
+	if (!pattern) {
+		fr_strerror_printf("No regular expression");
+		return NULL;
+	}
+
+	if (fr_regex_cache_size > 0) {
+		memcpy(&my_entry.pattern, &pattern, sizeof(my_entry.pattern));
+		my_entry.cflags = cflags;
+
+		REGEX_LOCK;
+		if (regex_cache &&
+		    ((entry = fr_hash_table_finddata(regex_cache,
+						     &my_entry)) != NULL)) {
+			regex_hits++;
+			entry->refcount++;
+			if (entry != regex_lru_head) {
+				regex_lru_unlink(entry);
+				regex_lru_push(entry);
+			}
+			REGEX_UNLOCK;
+			return &entry->reg;
+		}
+		regex_misses++;
+		REGEX_UNLOCK;
+	}
+
+	/*
+	 *	Compile it without holding the lock.  regcomp() can be
+	 *	slow.
+	 */
+	entry = malloc(sizeof(*entry));
+	if (!entry) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	memset(entry, 0, sizeof(*entry));
+
+	rcode = regcomp(&entry->reg, pattern, cflags);
+	if (rcode != 0) {
+		char buffer[256];
+
+		regerror(rcode, &entry->reg, buffer, sizeof(buffer));
+		fr_strerror_printf("Invalid regular expression %s: %s",
+				   pattern, buffer);
+		free(entry);
+
+		REGEX_LOCK;
+		regex_errors++;
+		REGEX_UNLOCK;
+		return NULL;
+	}
+
+	entry->pattern = strdup(pattern);
+	entry->cflags = cflags;
+	entry->refcount = 1;
+
+	if (!entry->pattern || (fr_regex_cache_size <= 0)) {
+		return &entry->reg;
+	}
+
+	REGEX_LOCK;
+	if (!regex_cache) {
+		regex_cache = fr_hash_table_create(regex_entry_hash,
+						   regex_entry_cmp, NULL);
+		if (!regex_cache) {
+			REGEX_UNLOCK;
+			return &entry->reg;
+		}
+	}
+
+	/*
+	 *	Another thread may have compiled the same pattern
+	 *	while we were compiling ours.
+	 */
+	old = fr_hash_table_finddata(regex_cache, entry);
+	if (old) {
+		old->refcount++;
+		REGEX_UNLOCK;
+
+		regex_entry_free(entry);
+		return &old->reg;
+	}
+
+	if (!fr_hash_table_insert(regex_cache, entry)) {
+		REGEX_UNLOCK;
+		return &entry->reg;
+	}
+
+	entry->refcount++;
+	regex_lru_push(entry);
+	regex_num_entries++;
+
+	while ((regex_num_entries > fr_regex_cache_size) && regex_lru_tail) {
+		regex_evictions++;
+		regex_cache_remove(regex_lru_tail);
+	}
+	REGEX_UNLOCK;
+
+	return &entry->reg;
+}
+
+/*
+ *	Release a regex_t returned by fr_regex_get().
+ */
+void fr_regex_release(regex_t *reg)
+{
+	int refcount;
+	fr_regex_entry_t *entry = (fr_regex_entry_t *) reg;
+
+	if (!entry) return;
+
+	REGEX_LOCK;
+	refcount = --entry->refcount;
+	REGEX_UNLOCK;
+
+	if (refcount == 0) regex_entry_free(entry);
+}
+
+void fr_regex_cache_stats(fr_regex_stats_t *stats)
+{
+	REGEX_LOCK;
+	stats->hits = regex_hits;
+	stats->misses = regex_misses;
+	stats->evictions = regex_evictions;
+	stats->errors = regex_errors;
+	stats->num_entries = regex_num_entries;
+	stats->max_entries = fr_regex_cache_size;
+	REGEX_UNLOCK;
+}
+
+/*
+ *	Empty the cache.  Entries which are still in use are freed
+ *	when they're released.
+ */
+void fr_regex_cache_free(void)
+{
+	REGEX_LOCK;
+	while (regex_lru_tail) {
+		regex_cache_remove(regex_lru_tail);
+	}
+
+	fr_hash_table_free(regex_cache);
+	regex_cache = NULL;
+	REGEX_UNLOCK;
+}
+
+#ifdef TESTING
+
+/*
+ *  cc -g -O2 -I .. -D_LIBRADIUS -DTESTING regex.c -o regex .libs/libfreeradius-radius.a -lpthread -lcrypto
+ *
+ *  ./regex
+ *
+ *  Matches user names against a set of realm-like patterns, first
+ *  calling regcomp() for every match, and then using the cache.  It
+ *  then runs the cached version from several threads at once, with
+ *  a cache smaller than the number of patterns, so that entries are
+ *  evicted while other threads are using them.
+ */
+#define NUM_PATTERNS	(32)
+#define NUM_MATCHES	(100000)
+#define NUM_THREADS	(8)
+
+static char patterns[NUM_PATTERNS][64];
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+static int match_regcomp(int i)
+{
+	int rcode;
+	regex_t reg;
+
+	if (regcomp(&reg, patterns[i % NUM_PATTERNS],
+		    REG_EXTENDED | REG_NOSUB | REG_ICASE) != 0) exit(1);
+
+	rcode = regexec(&reg, "bob@host7.example.com", 0, NULL, 0);
+	regfree(&reg);
+
+	return (rcode == 0);
+}
+
+static int match_cached(int i)
+{
+	int rcode;
+	regex_t *reg;
+
+	reg = fr_regex_get(patterns[i % NUM_PATTERNS],
+			   REG_EXTENDED | REG_NOSUB | REG_ICASE);
+	if (!reg) exit(1);
+
+	rcode = regexec(reg, "bob@host7.example.com", 0, NULL, 0);
+	fr_regex_release(reg);
+
+	return (rcode == 0);
+}
+
+static void *match_thread(void *arg)
+{
+	int i, matched = 0;
+	int offset = *(int *) arg;
+
+	for (i = 0; i < NUM_MATCHES; i++) {
+		matched += match_cached(i + offset);
+	}
+
+	/*
+	 *	Pattern 7 matches, and we see it once every
+	 *	NUM_PATTERNS loops.
+	 */
+	if (matched != (NUM_MATCHES / NUM_PATTERNS)) {
+		fprintf(stderr, "Got %d matches, expected %d\n",
+			matched, NUM_MATCHES / NUM_PATTERNS);
+		exit(1);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int i, matched;
+	double start, end;
+	fr_regex_stats_t stats;
+	pthread_t threads[NUM_THREADS];
+	int offsets[NUM_THREADS];
+
+	for (i = 0; i < NUM_PATTERNS; i++) {
+		snprintf(patterns[i], sizeof(patterns[i]),
+			 "^.*@(host%d\\.)?example\\.(com|net)$", i);
+	}
+
+	start = now();
+	for (i = 0, matched = 0; i < NUM_MATCHES; i++) {
+		matched += match_regcomp(i);
+	}
+	end = now();
+	printf("regcomp + regexec:  %8.3f usec per match\n",
+	       ((end - start) * 1000000.0) / NUM_MATCHES);
+
+	start = now();
+	for (i = 0, matched = 0; i < NUM_MATCHES; i++) {
+		matched += match_cached(i);
+	}
+	end = now();
+	printf("cached regexec:     %8.3f usec per match\n",
+	       ((end - start) * 1000000.0) / NUM_MATCHES);
+
+	fr_regex_cache_stats(&stats);
+	printf("hits %llu misses %llu evictions %llu entries %d\n",
+	       (unsigned long long) stats.hits,
+	       (unsigned long long) stats.misses,
+	       (unsigned long long) stats.evictions, stats.num_entries);
+
+	/*
+	 *	Now with evictions, from many threads.
+	 */
+	fr_regex_cache_free();
+	fr_regex_cache_size = NUM_PATTERNS / 2;
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		offsets[i] = i;
+		pthread_create(&threads[i], NULL, match_thread, &offsets[i]);
+	}
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	fr_regex_cache_stats(&stats);
+	printf("threads: hits %llu misses %llu evictions %llu entries %d\n",
+	       (unsigned long long) stats.hits,
+	       (unsigned long long) stats.misses,
+	       (unsigned long long) stats.evictions, stats.num_entries);
+
+	fr_regex_cache_free();
+
+	return 0;
+}
+#endif
+#endif	/* HAVE_REGEX_H */
@@ -0,0 +1,557 @@
+/*
+ * slab.c	Per-thread caches of fixed-size objects.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2012  The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/*
+ *	Each slab hands out objects of one size.  Freed objects are
+ *	kept on a list in the thread which freed them, and are
+ *	re-used by the next allocation in that thread.  When a
+ *	thread has too many free objects, it moves a batch of them
+ *	to the "depot", where other threads can pick them up.  This
+ *	matters because requests are often allocated in one thread
+ *	and freed in another.
+ *
+ *	The objects are ordinary malloc()'d blocks, with no header.
+ *	An object from a slab can be passed to free(), and a
+ *	malloc()'d block of the right size can be passed to
+ *	fr_slab_free().
+ */
+#define FR_SLAB_MAX		(16)
+#define FR_SLAB_BATCH		(64)
+#define FR_SLAB_DEPOT_MAX	(256)
+
+/*
+ *	Overlaid on top of free objects.
+ */
+typedef struct fr_slab_free_t {
+	struct fr_slab_free_t	*next;	/* next free object */
+	struct fr_slab_free_t	*chain;	/* next batch, in the depot */
+} fr_slab_free_t;
+
+typedef struct fr_slab_cache_t {
+	fr_slab_free_t	*head;
+	int		num_free;
+
+	uint64_t	allocs;
+	uint64_t	frees;
+	uint64_t	mallocs;
+	uint64_t	releases;
+} fr_slab_cache_t;
+
+typedef struct fr_slab_thread_t {
+	struct fr_slab_thread_t	*next;
+	fr_slab_cache_t		cache[FR_SLAB_MAX];
+} fr_slab_thread_t;
+
+struct fr_slab_t {
+	int		id;
+	const char	*name;
+	size_t		size;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+	fr_slab_free_t	*depot;
+	int		num_batches;
+
+	/*
+	 *	Counters from threads which have exited.
+	 */
+	uint64_t	allocs;
+	uint64_t	frees;
+	uint64_t	mallocs;
+	uint64_t	releases;
+};
+
+/*
+ *	Set this to zero to make the slabs call malloc() and free()
+ *	for every object.  Useful with valgrind.
+ */
+int fr_slab_enabled = 1;
+
+static fr_slab_t *fr_slabs[FR_SLAB_MAX];
+static int fr_slab_num = 0;
+static fr_slab_thread_t *fr_slab_threads = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t fr_slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t  fr_slab_key;
+static pthread_once_t fr_slab_once = PTHREAD_ONCE_INIT;
+
+#define SLAB_LOCK(_x)	pthread_mutex_lock(_x)
+#define SLAB_UNLOCK(_x)	pthread_mutex_unlock(_x)
+#else
+static fr_slab_thread_t fr_slab_main;
+
+#define SLAB_LOCK(_x)
+#define SLAB_UNLOCK(_x)
+#endif
+
+
+/*
+ *	Called with fr_slab_mutex held.
+ */
+static fr_slab_t *slab_find_or_create(const char *name, size_t size)
+{
+	int i;
+	fr_slab_t *slab;
+
+	/*
+	 *	Free objects have to hold the list pointers.
+	 */
+	if (size < sizeof(fr_slab_free_t)) size = sizeof(fr_slab_free_t);
+
+	/*
+	 *	Creating the same slab twice returns the same one.
+	 */
+	for (i = 0; i < fr_slab_num; i++) {
+		if (strcmp(fr_slabs[i]->name, name) != 0) continue;
+
+		if (fr_slabs[i]->size == size) return fr_slabs[i];
+		return NULL;
+	}
+
+	if (fr_slab_num >= FR_SLAB_MAX) return NULL;
+
+	slab = malloc(sizeof(*slab));
+	if (!slab) return NULL;
+	memset(slab, 0, sizeof(*slab));
+
+	slab->id = fr_slab_num;
+	slab->name = name;
+	slab->size = size;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&slab->mutex, NULL);
+#endif
+
+	fr_slabs[fr_slab_num++] = slab;
+
+	return slab;
+}
+
+fr_slab_t *fr_slab_create(const char *name, size_t size)
+{
+	fr_slab_t *slab;
+
+	if (!name || (size == 0)) return NULL;
+
+	SLAB_LOCK(&fr_slab_mutex);
+	slab = slab_find_or_create(name, size);
+	SLAB_UNLOCK(&fr_slab_mutex);
+
+	return slab;
+}
+
+/*
+ *	Return the slab in *pslab, creating it the first time it's
+ *	needed.  *pslab is only set with the lock held, so several
+ *	threads can call this at once for the same slab.
+ */
+fr_slab_t *fr_slab_get(fr_slab_t **pslab, const char *name, size_t size)
+{
+	fr_slab_t *slab;
+
+	if (!pslab || !name || (size == 0)) return NULL;
+
+	slab = *pslab;
+	if (slab) return slab;	/* unlocked check is OK */
+
+	SLAB_LOCK(&fr_slab_mutex);
+	slab = *pslab;
+	if (!slab) {
+		slab = slab_find_or_create(name, size);
+
+		/*
+		 *	Other threads check *pslab without the
+		 *	lock, so the slab has to be set up before
+		 *	they can see it.
+		 */
+		__sync_synchronize();
+		*pslab = slab;
+	}
+	SLAB_UNLOCK(&fr_slab_mutex);
+
+	return slab;
+}
+
+
+/*
+ *	Move a batch of free objects from a thread to the depot.
+ *	If the depot is full, give them back to the system.
+ */
+static void slab_drain(fr_slab_t *slab, fr_slab_cache_t *cache)
+{
+	int i;
+	fr_slab_free_t *batch, *last;
+
+	batch = last = cache->head;
+	for (i = 1; i < FR_SLAB_BATCH; i++) {
+		last = last->next;
+	}
+	cache->head = last->next;
+	cache->num_free -= FR_SLAB_BATCH;
+	last->next = NULL;
+
+	SLAB_LOCK(&slab->mutex);
+	if (slab->num_batches < FR_SLAB_DEPOT_MAX) {
+		batch->chain = slab->depot;
+		slab->depot = batch;
+		slab->num_batches++;
+		batch = NULL;
+	}
+	SLAB_UNLOCK(&slab->mutex);
+
+	while (batch) {
+		last = batch->next;
+		free(batch);
+		cache->releases++;
+		batch = last;
+	}
+}
+
+/*
+ *	Take a batch of free objects from the depot.
+ */
+static void slab_refill(fr_slab_t *slab, fr_slab_cache_t *cache)
+{
+	fr_slab_free_t *batch;
+
+	if (!slab->depot) return; /* unlocked check is OK */
+
+	SLAB_LOCK(&slab->mutex);
+	batch = slab->depot;
+	if (batch) {
+		slab->depot = batch->chain;
+		slab->num_batches--;
+	}
+	SLAB_UNLOCK(&slab->mutex);
+
+	if (!batch) return;
+
+	cache->head = batch;
+	cache->num_free = FR_SLAB_BATCH;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Called when a thread exits.  Its free objects go to the depot,
+ *	and its counters are added to the totals.
+ */
+static void slab_thread_free(void *arg)
+{
+	int i;
+	fr_slab_thread_t *thread = arg;
+	fr_slab_thread_t **last;
+
+	SLAB_LOCK(&fr_slab_mutex);
+	for (last = &fr_slab_threads; *last != NULL; last = &((*last)->next)) {
+		if (*last == thread) {
+			*last = thread->next;
+			break;
+		}
+	}
+
+	for (i = 0; i < fr_slab_num; i++) {
+		fr_slab_t *slab = fr_slabs[i];
+		fr_slab_cache_t *cache = &thread->cache[i];
+
+		while (cache->num_free >= FR_SLAB_BATCH) {
+			slab_drain(slab, cache);
+		}
+
+		while (cache->head) {
+			fr_slab_free_t *next = cache->head->next;
+
+			free(cache->head);
+			cache->releases++;
+			cache->head = next;
+		}
+
+		SLAB_LOCK(&slab->mutex);
+		slab->allocs += cache->allocs;
+		slab->frees += cache->frees;
+		slab->mallocs += cache->mallocs;
+		slab->releases += cache->releases;
+		SLAB_UNLOCK(&slab->mutex);
+	}
+	SLAB_UNLOCK(&fr_slab_mutex);
+
+	free(thread);
+}
+
+static void slab_make_key(void)
+{
+	pthread_key_create(&fr_slab_key, slab_thread_free);
+}
+#endif
+
+static fr_slab_thread_t *slab_thread(void)
+{
+#ifdef HAVE_PTHREAD_H
+	fr_slab_thread_t *thread;
+
+	pthread_once(&fr_slab_once, slab_make_key);
+
+	thread = pthread_getspecific(fr_slab_key);
+	if (thread) return thread;
+
+	thread = malloc(sizeof(*thread));
+	if (!thread) return NULL;
+	memset(thread, 0, sizeof(*thread));
+
+	if (pthread_setspecific(fr_slab_key, thread) != 0) {
+		free(thread);
+		return NULL;
+	}
+
+	SLAB_LOCK(&fr_slab_mutex);
+	thread->next = fr_slab_threads;
+	fr_slab_threads = thread;
+	SLAB_UNLOCK(&fr_slab_mutex);
+
+	return thread;
+#else
+	if (!fr_slab_threads) fr_slab_threads = &fr_slab_main;
+
+	return &fr_slab_main;
+#endif
+}
+
+
+void *fr_slab_alloc(fr_slab_t *slab)
+{
+	fr_slab_thread_t *thread;
+	fr_slab_cache_t *cache;
+	fr_slab_free_t *obj;
+
+	if (!slab) return NULL;
+
+	thread = slab_thread();
+	if (!thread) return malloc(slab->size);
+
+	cache = &thread->cache[slab->id];
+	cache->allocs++;
+
+	if (fr_slab_enabled) {
+		if (!cache->head) slab_refill(slab, cache);
+
+		obj = cache->head;
+		if (obj) {
+			cache->head = obj->next;
+			cache->num_free--;
+			return obj;
+		}
+	}
+
+	cache->mallocs++;
+	return malloc(slab->size);
+}
+
+
+void fr_slab_free(fr_slab_t *slab, void *ptr)
+{
+	fr_slab_thread_t *thread;
+	fr_slab_cache_t *cache;
+	fr_slab_free_t *obj = ptr;
+
+	if (!ptr) return;
+
+	if (!slab || ((thread = slab_thread()) == NULL)) {
+		free(ptr);
+		return;
+	}
+
+	cache = &thread->cache[slab->id];
+	cache->frees++;
+
+	if (!fr_slab_enabled) {
+		free(ptr);
+		cache->releases++;
+		return;
+	}
+
+	obj->next = cache->head;
+	cache->head = obj;
+	cache->num_free++;
+
+	if (cache->num_free >= (2 * FR_SLAB_BATCH)) slab_drain(slab, cache);
+}
+
+
+/*
+ *	The counters are updated without locks by each thread, so
+ *	these numbers are approximate while the server is busy.
+ */
+int fr_slab_stats(int index, fr_slab_stats_t *stats)
+{
+	fr_slab_t *slab;
+	fr_slab_thread_t *thread;
+
+	if (!stats) return 0;
+
+	SLAB_LOCK(&fr_slab_mutex);
+	if ((index < 0) || (index >= fr_slab_num)) {
+		SLAB_UNLOCK(&fr_slab_mutex);
+		return 0;
+	}
+
+	slab = fr_slabs[index];
+
+	memset(stats, 0, sizeof(*stats));
+	stats->name = slab->name;
+	stats->size = slab->size;
+
+	SLAB_LOCK(&slab->mutex);
+	stats->allocs = slab->allocs;
+	stats->frees = slab->frees;
+	stats->mallocs = slab->mallocs;
+	stats->releases = slab->releases;
+	stats->num_free = slab->num_batches * FR_SLAB_BATCH;
+	SLAB_UNLOCK(&slab->mutex);
+
+	for (thread = fr_slab_threads; thread != NULL; thread = thread->next) {
+		fr_slab_cache_t *cache = &thread->cache[index];
+
+		stats->allocs += cache->allocs;
+		stats->frees += cache->frees;
+		stats->mallocs += cache->mallocs;
+		stats->releases += cache->releases;
+		stats->num_free += cache->num_free;
+	}
+	SLAB_UNLOCK(&fr_slab_mutex);
+
+	return 1;
+}
+
+#ifdef TESTING
+
+/*
+ *  cc -g -I .. -D_LIBRADIUS -DTESTING slab.c -o slab .libs/libfreeradius-radius.a -lpthread -lcrypto
+ *
+ *  ./slab
+ *
+ *  Simulates the allocations done for an Access-Request and its
+ *  reply: two RADIUS_PACKETs, and a list of VALUE_PAIRs for each,
+ *  allocated and freed in a loop.  It prints the number of calls to
+ *  malloc() per request for those objects, with the slabs disabled
+ *  and enabled.
+ */
+#define NUM_REQUESTS	(200000)
+#define REQUEST_VPS	(12)
+#define REPLY_VPS	(4)
+
+static void one_request(void)
+{
+	int i;
+	RADIUS_PACKET *packet, *reply;
+
+	packet = rad_alloc(1);
+	reply = rad_alloc(0);
+	if (!packet || !reply) exit(1);
+
+	for (i = 0; i < REQUEST_VPS; i++) {
+		VALUE_PAIR *vp = paircreate(1 + i, PW_TYPE_STRING);
+		if (!vp) exit(1);
+		pairadd(&packet->vps, vp);
+	}
+
+	for (i = 0; i < REPLY_VPS; i++) {
+		VALUE_PAIR *vp = paircreate(18 + i, PW_TYPE_STRING);
+		if (!vp) exit(1);
+		pairadd(&reply->vps, vp);
+	}
+
+	rad_free(&reply);
+	rad_free(&packet);
+}
+
+static void run(int enabled)
+{
+	int i;
+	uint64_t allocs = 0, mallocs = 0;
+	fr_slab_stats_t stats;
+	struct timeval start, end;
+	double usec;
+
+	fr_slab_enabled = enabled;
+
+	/*
+	 *	Warm up, and create the slabs.
+	 */
+	one_request();
+
+	for (i = 0; fr_slab_stats(i, &stats); i++) {
+		allocs -= stats.allocs;
+		mallocs -= stats.mallocs;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < NUM_REQUESTS; i++) {
+		one_request();
+	}
+	gettimeofday(&end, NULL);
+
+	for (i = 0; fr_slab_stats(i, &stats); i++) {
+		allocs += stats.allocs;
+		mallocs += stats.mallocs;
+	}
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000.0;
+	usec += end.tv_usec - start.tv_usec;
+
+	printf("slabs %-8s  %6.2f allocs/request  %6.2f mallocs/request  %6.3f usec/request\n",
+	       enabled ? "enabled" : "disabled",
+	       (double) allocs / NUM_REQUESTS,
+	       (double) mallocs / NUM_REQUESTS,
+	       usec / NUM_REQUESTS);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	fr_slab_stats_t stats;
+
+	run(0);
+	run(1);
+
+	printf("\n%-24s %6s %10s %10s %10s %8s\n",
+	       "slab", "size", "allocs", "mallocs", "releases", "free");
+	for (i = 0; fr_slab_stats(i, &stats); i++) {
+		printf("%-24s %6u %10llu %10llu %10llu %8d\n",
+		       stats.name, (unsigned int) stats.size,
+		       (unsigned long long) stats.allocs,
+		       (unsigned long long) stats.mallocs,
+		       (unsigned long long) stats.releases,
+		       stats.num_free);
+	}
+
+	return 0;
+}
+#endif
@@ -0,0 +1,679 @@
+/*
+ * trie.c	Match names against a set of exact names and regular
+ *		expressions, in one pass.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2012  The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#include <ctype.h>
+
+/*
+ *	The names are stored backwards, one character per level, so
+ *	that names sharing a suffix ("example.com", "host.example.com")
+ *	share nodes.  Comparisons are case-insensitive.
+ *
+ *	Most regular expressions used for realms end in a fixed
+ *	string, e.g. "(.*\.)?example\.com$".  Any name which matches
+ *	one of those must end in that string, so the regex is stored
+ *	at the node for its fixed suffix.  A lookup walks the name
+ *	once, from the end, and only has to try the regexes found on
+ *	the way.  Regexes with no fixed suffix are stored at the root,
+ *	and are tried for every name.
+ *
+ *	An exact name always wins.  Otherwise, the regexes which
+ *	are tried are run in the order in which they were added, and
+ *	the first one which matches wins, just as if every one of
+ *	them had been tried in turn.
+ */
+#define FR_TRIE_MAX_SUFFIX (63)
+
+typedef struct fr_trie_entry_t {
+	int		order;
+	void		*data;
+#ifdef HAVE_REGEX_H
+	regex_t		reg;
+#endif
+	struct fr_trie_entry_t *next;	/* in the same node, by order */
+	struct fr_trie_entry_t *all;	/* every entry, for freeing */
+} fr_trie_entry_t;
+
+typedef struct fr_trie_node_t {
+	struct fr_trie_node_t **child;	/* sorted by "c" */
+	int		num_children;
+	unsigned char	c;
+	void		*exact;
+	fr_trie_entry_t	*head;
+	fr_trie_entry_t	*tail;
+} fr_trie_node_t;
+
+struct fr_trie_t {
+	fr_trie_node_t	root;
+	int		num_entries;
+	fr_trie_entry_t	*all;
+};
+
+
+fr_trie_t *fr_trie_create(void)
+{
+	fr_trie_t *ft;
+
+	ft = malloc(sizeof(*ft));
+	if (!ft) return NULL;
+
+	memset(ft, 0, sizeof(*ft));
+	return ft;
+}
+
+static void trie_node_free(fr_trie_node_t *node)
+{
+	int i;
+
+	for (i = 0; i < node->num_children; i++) {
+		trie_node_free(node->child[i]);
+		free(node->child[i]);
+	}
+	free(node->child);
+}
+
+void fr_trie_free(fr_trie_t *ft)
+{
+	fr_trie_entry_t *entry, *next;
+
+	if (!ft) return;
+
+	for (entry = ft->all; entry != NULL; entry = next) {
+		next = entry->all;
+#ifdef HAVE_REGEX_H
+		regfree(&entry->reg);
+#endif
+		free(entry);
+	}
+
+	trie_node_free(&ft->root);
+	free(ft);
+}
+
+static fr_trie_node_t *trie_child(const fr_trie_node_t *node, unsigned char c)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = node->num_children - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (node->child[mid]->c == c) return node->child[mid];
+
+		if (node->child[mid]->c < c) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *	Find the node for a suffix, creating it if necessary.
+ */
+static fr_trie_node_t *trie_insert(fr_trie_t *ft, const char *name, size_t len)
+{
+	int i;
+	unsigned char c;
+	fr_trie_node_t *node, *child, **array;
+
+	node = &ft->root;
+	while (len > 0) {
+		c = tolower((int) (uint8_t) name[--len]);
+
+		child = trie_child(node, c);
+		if (child) {
+			node = child;
+			continue;
+		}
+
+		child = malloc(sizeof(*child));
+		if (!child) return NULL;
+		memset(child, 0, sizeof(*child));
+		child->c = c;
+
+		array = realloc(node->child,
+				(node->num_children + 1) * sizeof(*array));
+		if (!array) {
+			free(child);
+			return NULL;
+		}
+		node->child = array;
+
+		for (i = node->num_children; i > 0; i--) {
+			if (array[i - 1]->c < c) break;
+			array[i] = array[i - 1];
+		}
+		array[i] = child;
+		node->num_children++;
+
+		node = child;
+	}
+
+	return node;
+}
+
+/*
+ *	Returns 1 if the name was added, 0 if it was already there.
+ */
+int fr_trie_add_name(fr_trie_t *ft, const char *name, void *data)
+{
+	fr_trie_node_t *node;
+
+	if (!ft || !name || !data) return -1;
+
+	node = trie_insert(ft, name, strlen(name));
+	if (!node) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	if (node->exact) return 0;
+
+	node->exact = data;
+	ft->num_entries++;
+	return 1;
+}
+
+#ifdef HAVE_REGEX_H
+/*
+ *	Skip a bracket expression, returning a pointer to the
+ *	character after the closing ']'.
+ */
+static const char *skip_bracket(const char *p)
+{
+	p++;
+	if (*p == '^') p++;
+	if (*p == ']') p++;
+
+	while (*p && (*p != ']')) {
+		if ((*p == '[') &&
+		    ((p[1] == ':') || (p[1] == '.') || (p[1] == '='))) {
+			char end = p[1];
+
+			p += 2;
+			while (*p && !((p[0] == end) && (p[1] == ']'))) p++;
+			if (!*p) return NULL;
+			p++;
+		}
+		p++;
+	}
+
+	if (!*p) return NULL;
+	return p + 1;
+}
+
+/*
+ *	Skip a group, returning a pointer to the character after
+ *	the matching ')'.
+ */
+static const char *skip_group(const char *p)
+{
+	int depth = 0;
+
+	while (*p) {
+		switch (*p) {
+		case '\\':
+			if (!p[1]) return NULL;
+			p += 2;
+			continue;
+
+		case '[':
+			p = skip_bracket(p);
+			if (!p) return NULL;
+			continue;
+
+		case '(':
+			depth++;
+			break;
+
+		case ')':
+			if (--depth == 0) return p + 1;
+			break;
+
+		default:
+			break;
+		}
+		p++;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Find the fixed string which every name matching the regex
+ *	must end with.  We don't have to be clever, only safe: when
+ *	in doubt, say there's no suffix, and the regex is tried for
+ *	every name.
+ *
+ *	The pattern is split into atoms, and each atom is either a
+ *	single literal character, or something else.  The suffix is
+ *	the run of literal atoms before a final '$'.
+ */
+static size_t regex_suffix(const char *pattern, int cflags,
+			   char *out, size_t outlen)
+{
+	int *atoms;
+	size_t i, num_atoms, len;
+	const char *p;
+
+	if ((cflags & REG_EXTENDED) == 0) return 0;
+	if ((cflags & REG_NEWLINE) != 0) return 0;
+
+	atoms = malloc((strlen(pattern) + 1) * sizeof(*atoms));
+	if (!atoms) return 0;
+
+#define NOT_LITERAL (-1)
+	num_atoms = 0;
+	p = pattern;
+	if (*p == '^') p++;
+
+	while (*p) {
+		switch (*p) {
+		case '\\':
+			if (!p[1]) goto none;
+
+			/*
+			 *	GNU regex gives special meanings to
+			 *	\w, \b, \1, etc.
+			 */
+			if (isalnum((int) (uint8_t) p[1])) {
+				atoms[num_atoms++] = NOT_LITERAL;
+			} else {
+				atoms[num_atoms++] = (uint8_t) p[1];
+			}
+			p += 2;
+			break;
+
+		case '[':
+			p = skip_bracket(p);
+			if (!p) goto none;
+			atoms[num_atoms++] = NOT_LITERAL;
+			break;
+
+		case '(':
+			p = skip_group(p);
+			if (!p) goto none;
+			atoms[num_atoms++] = NOT_LITERAL;
+			break;
+
+		case '.':
+			atoms[num_atoms++] = NOT_LITERAL;
+			p++;
+			break;
+
+		case '{':
+			while (*p && (*p != '}')) p++;
+			if (!*p) goto none;
+			/* FALL-THROUGH */
+
+		case '*':
+		case '+':
+		case '?':
+			if (num_atoms > 0) atoms[num_atoms - 1] = NOT_LITERAL;
+			atoms[num_atoms++] = NOT_LITERAL;
+			p++;
+			break;
+
+		case '$':
+			if (p[1] != '\0') goto none;
+			p++;
+			goto done;
+
+		case ')':
+		case '|':
+		case '^':
+			goto none;
+
+		default:
+			atoms[num_atoms++] = (uint8_t) *p;
+			p++;
+			break;
+		}
+	}
+
+	/*
+	 *	Not anchored at the end, so it can match anywhere.
+	 */
+none:
+	free(atoms);
+	return 0;
+
+done:
+	i = num_atoms;
+	while ((i > 0) && (atoms[i - 1] != NOT_LITERAL)) i--;
+
+	len = num_atoms - i;
+	if (len >= outlen) {
+		i += len - (outlen - 1);
+		len = outlen - 1;
+	}
+
+	for (num_atoms = 0; num_atoms < len; num_atoms++) {
+		out[num_atoms] = atoms[i + num_atoms];
+	}
+	out[len] = '\0';
+#undef NOT_LITERAL
+
+	free(atoms);
+	return len;
+}
+
+/*
+ *	Returns 1 if the regex was added, or -1 on error.
+ */
+int fr_trie_add_regex(fr_trie_t *ft, const char *pattern, int cflags,
+		      void *data)
+{
+	int rcode;
+	size_t len;
+	fr_trie_node_t *node;
+	fr_trie_entry_t *entry;
+	char suffix[FR_TRIE_MAX_SUFFIX + 1];
+
+	if (!ft || !pattern || !data) return -1;
+
+	entry = malloc(sizeof(*entry));
+	if (!entry) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	memset(entry, 0, sizeof(*entry));
+
+	rcode = regcomp(&entry->reg, pattern, cflags);
+	if (rcode != 0) {
+		char buffer[256];
+
+		regerror(rcode, &entry->reg, buffer, sizeof(buffer));
+		fr_strerror_printf("Invalid regular expression \"%s\": %s",
+				   pattern, buffer);
+		free(entry);
+		return -1;
+	}
+
+	len = regex_suffix(pattern, cflags, suffix, sizeof(suffix));
+	node = trie_insert(ft, suffix, len);
+	if (!node) {
+		regfree(&entry->reg);
+		free(entry);
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	entry->order = ft->num_entries++;
+	entry->data = data;
+
+	if (!node->head) {
+		node->head = entry;
+	} else {
+		node->tail->next = entry;
+	}
+	node->tail = entry;
+
+	entry->all = ft->all;
+	ft->all = entry;
+
+	return 1;
+}
+#endif
+
+void *fr_trie_match(const fr_trie_t *ft, const char *name)
+{
+	size_t len;
+	const fr_trie_node_t *node;
+#ifdef HAVE_REGEX_H
+	int i, best, num_lists;
+	const fr_trie_entry_t *entry;
+	const fr_trie_entry_t *lists[FR_TRIE_MAX_SUFFIX + 1];
+#endif
+
+	if (!ft || !name) return NULL;
+
+	len = strlen(name);
+	node = &ft->root;
+#ifdef HAVE_REGEX_H
+	num_lists = 0;
+	if (node->head) lists[num_lists++] = node->head;
+#endif
+
+	while (len > 0) {
+		node = trie_child(node, tolower((int) (uint8_t) name[--len]));
+		if (!node) break;
+
+#ifdef HAVE_REGEX_H
+		if (node->head) lists[num_lists++] = node->head;
+#endif
+	}
+
+	if (node && node->exact) return node->exact;
+
+#ifdef HAVE_REGEX_H
+	/*
+	 *	Try the regexes in the order they were added, by
+	 *	merging the lists we found on the way down.
+	 */
+	while (num_lists > 0) {
+		best = 0;
+		for (i = 1; i < num_lists; i++) {
+			if (lists[i]->order < lists[best]->order) best = i;
+		}
+
+		entry = lists[best];
+		if (regexec(&entry->reg, name, 0, NULL, 0) == 0) {
+			return entry->data;
+		}
+
+		if (entry->next) {
+			lists[best] = entry->next;
+		} else {
+			lists[best] = lists[--num_lists];
+		}
+	}
+#endif
+
+	return NULL;
+}
+
+#ifdef TESTING
+
+/*
+ *  cc -g -O2 -I .. -D_LIBRADIUS -DTESTING trie.c -o trie .libs/libfreeradius-radius.a -lcrypto
+ *
+ *  ./trie
+ *
+ *  Builds 10000 realms, most of them exact names, some regexes
+ *  ending in a domain name, and a few regexes with no fixed suffix.
+ *  It then looks up names, first by trying the exact names and then
+ *  every regex in turn, and then with the trie, and checks that
+ *  both give the same answer.
+ */
+#define NUM_REALMS	(10000)
+#define NUM_GENERIC	(20)
+#define NUM_LOOKUPS	(20000)
+
+typedef struct test_realm_t {
+	char		name[64];
+	int		is_regex;
+	regex_t		reg;
+} test_realm_t;
+
+static test_realm_t realms[NUM_REALMS];
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+static void *match_linear(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_REALMS; i++) {
+		if (realms[i].is_regex) continue;
+
+		if (strcasecmp(realms[i].name, name) == 0) return &realms[i];
+	}
+
+	for (i = 0; i < NUM_REALMS; i++) {
+		if (!realms[i].is_regex) continue;
+
+		if (regexec(&realms[i].reg, name, 0, NULL, 0) == 0) {
+			return &realms[i];
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int i, matched;
+	double start, end;
+	fr_trie_t *ft;
+	void *a, *b;
+	char names[64][64];
+	int cflags = REG_EXTENDED | REG_NOSUB | REG_ICASE;
+
+	ft = fr_trie_create();
+	if (!ft) exit(1);
+
+	for (i = 0; i < NUM_REALMS; i++) {
+		if (i < NUM_GENERIC) {
+			/*
+			 *	Matches "user6.roam", or "guest7.anything".
+			 */
+			if ((i & 1) == 0) {
+				snprintf(realms[i].name, sizeof(realms[i].name),
+					 "^[a-z]+%d\\.roam$", i);
+			} else {
+				snprintf(realms[i].name, sizeof(realms[i].name),
+					 "^guest%d\\.", i);
+			}
+			realms[i].is_regex = 1;
+
+		} else if ((i % 4) == 0) {
+			snprintf(realms[i].name, sizeof(realms[i].name),
+				 "(.*\\.)?site%d\\.example\\.net$", i);
+			realms[i].is_regex = 1;
+
+		} else {
+			snprintf(realms[i].name, sizeof(realms[i].name),
+				 "site%d.example.com", i);
+		}
+
+		if (!realms[i].is_regex) {
+			if (fr_trie_add_name(ft, realms[i].name,
+					     &realms[i]) != 1) exit(1);
+			continue;
+		}
+
+		if (regcomp(&realms[i].reg, realms[i].name, cflags) != 0) {
+			exit(1);
+		}
+
+		if (fr_trie_add_regex(ft, realms[i].name, cflags,
+				      &realms[i]) != 1) {
+			fprintf(stderr, "%s\n", fr_strerror());
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < 64; i++) {
+		switch (i % 8) {
+		case 0:
+			snprintf(names[i], sizeof(names[i]),
+				 "SITE%d.example.com", 21 + (i * 151));
+			break;
+
+		case 1:
+			snprintf(names[i], sizeof(names[i]),
+				 "host.site%d.example.net", i * 152);
+			break;
+
+		case 2:
+			snprintf(names[i], sizeof(names[i]),
+				 "site%d.example.net", i * 152);
+			break;
+
+		case 3:
+			snprintf(names[i], sizeof(names[i]),
+				 "user%d.roam", i % NUM_GENERIC);
+			break;
+
+		case 4:
+			snprintf(names[i], sizeof(names[i]),
+				 "guest%d.example.com", i % NUM_GENERIC);
+			break;
+
+		default:
+			snprintf(names[i], sizeof(names[i]),
+				 "nowhere%d.example.org", i);
+			break;
+		}
+	}
+
+	for (i = 0; i < 64; i++) {
+		a = match_linear(names[i]);
+		b = fr_trie_match(ft, names[i]);
+		if (a != b) {
+			fprintf(stderr, "Mismatch for %s: %s != %s\n",
+				names[i],
+				a ? ((test_realm_t *) a)->name : "none",
+				b ? ((test_realm_t *) b)->name : "none");
+			exit(1);
+		}
+	}
+
+	start = now();
+	for (i = 0, matched = 0; i < NUM_LOOKUPS / 100; i++) {
+		if (match_linear(names[i % 64])) matched++;
+	}
+	end = now();
+	printf("linear:  %10.3f usec per lookup (%d matched)\n",
+	       ((end - start) * 1000000.0) / (NUM_LOOKUPS / 100), matched);
+
+	start = now();
+	for (i = 0, matched = 0; i < NUM_LOOKUPS; i++) {
+		if (fr_trie_match(ft, names[i % 64])) matched++;
+	}
+	end = now();
+	printf("trie:    %10.3f usec per lookup (%d matched)\n",
+	       ((end - start) * 1000000.0) / NUM_LOOKUPS, matched);
+
+	fr_trie_free(ft);
+	for (i = 0; i < NUM_REALMS; i++) {
+		if (realms[i].is_regex) regfree(&realms[i].reg);
+	}
+
+	return 0;
+}
+#endif
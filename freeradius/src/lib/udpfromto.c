@@ -156,14 +156,60 @@ int udpfromto_init(int s)
 	return setsockopt(s, proto, flag, &opt, sizeof(opt));
 }
 
+/*
+ *	Look through the control messages returned by recvmsg() for
+ *	the destination address of the packet.  "to" should already
+ *	be set to the address of the socket, from getsockname().
+ */
+void udpfromto_get_dst(struct msghdr *msgh, struct sockaddr *to,
+		       socklen_t *tolen)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh,cmsg)) {
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i =
+				(struct in_pktinfo *) CMSG_DATA(cmsg);
+			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
+			*tolen = sizeof(struct sockaddr_in);
+			break;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+			((struct sockaddr_in *)to)->sin_addr = *i;
+			*tolen = sizeof(struct sockaddr_in);
+			break;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i =
+				(struct in6_pktinfo *) CMSG_DATA(cmsg);
+			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
+			*tolen = sizeof(struct sockaddr_in6);
+			break;
+		}
+#endif
+	}
+}
+
 int recvfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t *fromlen,
 	       struct sockaddr *to, socklen_t *tolen)
 {
 	struct msghdr msgh;
-	struct cmsghdr *cmsg;
 	struct iovec iov;
-	char cbuf[256];
+	char cbuf[UDPFROMTO_CMSG_SIZE];
 	int err;
 	struct sockaddr_storage si;
 	socklen_t si_len = sizeof(si);
@@ -253,93 +299,36 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 
 	if (fromlen) *fromlen = msgh.msg_namelen;
 
-	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh,cmsg)) {
-
-#ifdef IP_PKTINFO
-		if ((cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == IP_PKTINFO)) {
-			struct in_pktinfo *i =
-				(struct in_pktinfo *) CMSG_DATA(cmsg);
-			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
-			*tolen = sizeof(struct sockaddr_in);
-			break;
-		}
-#endif
-
-#ifdef IP_RECVDSTADDR
-		if ((cmsg->cmsg_level == IPPROTO_IP) &&
-		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
-			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
-			((struct sockaddr_in *)to)->sin_addr = *i;
-			*tolen = sizeof(struct sockaddr_in);
-			break;
-		}
-#endif
-
-#ifdef IPV6_PKTINFO
-		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
-		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
-			struct in6_pktinfo *i =
-				(struct in6_pktinfo *) CMSG_DATA(cmsg);
-			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
-			*tolen = sizeof(struct sockaddr_in6);
-			break;
-		}
-#endif
-	}
+	udpfromto_get_dst(&msgh, to, tolen);
 
 	return err;
 }
 
-int sendfromto(int s, void *buf, size_t len, int flags,
-	       struct sockaddr *from, socklen_t fromlen,
-	       struct sockaddr *to, socklen_t tolen)
+/*
+ *	Add a control message to "msgh" which sets the source address
+ *	of the packet to "from".  "cbuf" must be at least
+ *	UDPFROMTO_CMSG_SIZE bytes, and must live until sendmsg() is
+ *	called.  If the OS can't set the source address for this
+ *	address family, no control message is added.
+ */
+int udpfromto_set_src(struct msghdr *msgh, void *cbuf, struct sockaddr *from)
 {
-	struct msghdr msgh;
 	struct cmsghdr *cmsg;
-	struct iovec iov;
-	char cbuf[256];
-
-#if !defined(IP_PKTINFO) && !defined(IP_SENDSRCADDR) && !defined(IPV6_PKTINFO)
-	/*
-	 *	If the sendmsg() flags aren't defined, fall back to
-	 *	using sendto().
-	 */
-	from = NULL;
-#endif
-
-	/*
-	 *	Catch the case where the caller passes invalid arguments.
-	 */
-	if (!from || (fromlen == 0) || (from->sa_family == AF_UNSPEC)) {
-		return sendto(s, buf, len, flags, to, tolen);
-	}
 
-	/* Set up iov and msgh structures. */
-	memset(&msgh, 0, sizeof(struct msghdr));
-	iov.iov_base = buf;
-	iov.iov_len = len;
-	msgh.msg_iov = &iov;
-	msgh.msg_iovlen = 1;
-	msgh.msg_name = to;
-	msgh.msg_namelen = tolen;
+	msgh->msg_control = NULL;
+	msgh->msg_controllen = 0;
 
 	if (from->sa_family == AF_INET) {
-#if !defined(IP_PKTINFO) && !defined(IP_SENDSRCADDR)
-		return sendto(s, buf, len, flags, to, tolen);
-#else
+#if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
 		struct sockaddr_in *s4 = (struct sockaddr_in *) from;
 
 #ifdef IP_PKTINFO
 		struct in_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = SOL_IP;
 		cmsg->cmsg_type = IP_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -352,10 +341,10 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 #ifdef IP_SENDSRCADDR
 		struct in_addr *in;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IP;
 		cmsg->cmsg_type = IP_SENDSRCADDR;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
@@ -368,17 +357,15 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 
 #ifdef AF_INET6
 	else if (from->sa_family == AF_INET6) {
-#if !defined(IPV6_PKTINFO)
-		return sendto(s, buf, len, flags, to, tolen);
-#else		
+#ifdef IPV6_PKTINFO
 		struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) from;
 
 		struct in6_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IPV6;
 		cmsg->cmsg_type = IPV6_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -398,6 +385,43 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 		return -1;
 	}
 
+	return 0;
+}
+
+int sendfromto(int s, void *buf, size_t len, int flags,
+	       struct sockaddr *from, socklen_t fromlen,
+	       struct sockaddr *to, socklen_t tolen)
+{
+	struct msghdr msgh;
+	struct iovec iov;
+	char cbuf[UDPFROMTO_CMSG_SIZE];
+
+#if !defined(IP_PKTINFO) && !defined(IP_SENDSRCADDR) && !defined(IPV6_PKTINFO)
+	/*
+	 *	If the sendmsg() flags aren't defined, fall back to
+	 *	using sendto().
+	 */
+	from = NULL;
+#endif
+
+	/*
+	 *	Catch the case where the caller passes invalid arguments.
+	 */
+	if (!from || (fromlen == 0) || (from->sa_family == AF_UNSPEC)) {
+		return sendto(s, buf, len, flags, to, tolen);
+	}
+
+	/* Set up iov and msgh structures. */
+	memset(&msgh, 0, sizeof(struct msghdr));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_name = to;
+	msgh.msg_namelen = tolen;
+
+	if (udpfromto_set_src(&msgh, cbuf, from) < 0) return -1;
+
 	return sendmsg(s, &msgh, flags);
 }
 
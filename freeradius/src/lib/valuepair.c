@@ -58,6 +58,31 @@ static const char *months[] = {
 #define FR_VP_NAME_PAD (32)
 #define FR_VP_NAME_LEN (24)
 
+/*
+ *	VALUE_PAIRs are allocated from slabs, so that most requests
+ *	don't call malloc() or free() for them.  Pairs which have
+ *	the name padding use a different slab.  vp->padded records
+ *	which one, as callers can change vp->flags.unknown_attr.
+ */
+static fr_slab_t *vp_slab[2] = { NULL, NULL };
+
+static VALUE_PAIR *vp_malloc(int padded)
+{
+	fr_slab_t *slab;
+	VALUE_PAIR *vp;
+
+	slab = fr_slab_get(&vp_slab[padded],
+			   padded ? "VALUE_PAIR (unknown)" : "VALUE_PAIR",
+			   sizeof(VALUE_PAIR) + (padded ? FR_VP_NAME_PAD : 0));
+	if (slab) {
+		vp = fr_slab_alloc(slab);
+	} else {
+		vp = malloc(sizeof(VALUE_PAIR) + (padded ? FR_VP_NAME_PAD : 0));
+	}
+
+	return vp;
+}
+
 VALUE_PAIR *pairalloc(DICT_ATTR *da)
 {
 	size_t name_len = 0;
@@ -69,9 +94,10 @@ VALUE_PAIR *pairalloc(DICT_ATTR *da)
 	 */
 	if (!da) name_len = FR_VP_NAME_PAD;
 
-	vp = malloc(sizeof(*vp) + name_len);
+	vp = vp_malloc(name_len != 0);
 	if (!vp) return NULL;
 	memset(vp, 0, sizeof(*vp));
+	vp->padded = (name_len != 0);
 
 	if (da) {
 		vp->attribute = da->attr;
@@ -139,7 +165,7 @@ VALUE_PAIR *paircreate_raw(int attr, int type, VALUE_PAIR *vp)
 {
 	char *p = (char *) (vp + 1);
 
-	if (!vp->flags.unknown_attr) {
+	if (!vp->padded) {
 		pairfree(&vp);
 		return NULL;
 	}
@@ -154,7 +180,7 @@ VALUE_PAIR *paircreate_raw(int attr, int type, VALUE_PAIR *vp)
 	vp->flags.unknown_attr = 1;
 	
 	if (!vp_print_name(p, FR_VP_NAME_LEN, vp->attribute)) {
-		free(vp);
+		pairbasicfree(vp);
 		return NULL;
 	}
 
@@ -191,10 +217,12 @@ VALUE_PAIR *paircreate(int attr, int type)
  */
 void pairbasicfree(VALUE_PAIR *pair)
 {
+	int padded = (pair->padded != 0);
+
 	if (pair->type == PW_TYPE_TLV) free(pair->vp_tlv);
 	/* clear the memory here */
 	memset(pair, 0, sizeof(*pair));
-	free(pair);
+	fr_slab_free(vp_slab[padded], pair);
 }
 
 /*
@@ -220,6 +248,10 @@ void pairfree(VALUE_PAIR **pair_ptr)
 
 /*
  *	Find the pair with the matching attribute
+ *
+ *	This, and pairdelete(), walk the list.  They can't use a
+ *	pairindex_*() index, because nothing tells an index when
+ *	someone splices the list by hand.  See pairindex_create().
  */
 VALUE_PAIR * pairfind(VALUE_PAIR *first, int attr)
 {
@@ -326,13 +358,13 @@ VALUE_PAIR *paircopyvp(const VALUE_PAIR *vp)
 
 	if (!vp) return NULL;
 	
-	if (!vp->flags.unknown_attr) {
+	if (!vp->padded) {
 		name_len = 0;
 	} else {
 		name_len = FR_VP_NAME_PAD;
 	}
 	
-	if ((n = malloc(sizeof(*n) + name_len)) == NULL) {
+	if ((n = vp_malloc(name_len != 0)) == NULL) {
 		fr_strerror_printf("out of memory");
 		return NULL;
 	}
@@ -342,7 +374,7 @@ VALUE_PAIR *paircopyvp(const VALUE_PAIR *vp)
 	 *	Reset the name field to point to the NEW attribute,
 	 *	rather than to the OLD one.
 	 */
-	if (vp->flags.unknown_attr) n->name = (char *) (n + 1);
+	if (vp->name == (const char *) (vp + 1)) n->name = (char *) (n + 1);
 	n->next = NULL;
 
 	if ((n->type == PW_TYPE_TLV) &&
@@ -390,6 +422,482 @@ VALUE_PAIR *paircopy(VALUE_PAIR *vp)
 }
 
 
+/*
+ *	A VALUE_PAIR is big, because VALUE_PAIR_DATA has room for
+ *	the longest string.  Lists which are kept for a long time
+ *	(e.g. in a cache) can instead be packed into one block of
+ *	memory, where each value takes only as much room as it needs.
+ *
+ *	Packed lists can't be modified.  They are turned back into
+ *	normal VALUE_PAIRs with pairunpack().
+ */
+typedef struct vp_packed_t {
+	int		attribute;
+	int		vendor;
+	int		type;
+	FR_TOKEN	operator;
+	ATTR_FLAGS	flags;
+	uint32_t	lvalue;
+	uint32_t	length;		/* vp->length */
+	uint16_t	data_len;	/* bytes of data which follow */
+	uint16_t	name_len;	/* unknown attributes only */
+} vp_packed_t;
+
+struct value_pair_packed {
+	size_t		size;		/* including this header */
+	int		num_pairs;
+};
+
+#define VP_PACKED_ALIGN(_x) (((_x) + 7) & ~((size_t) 7))
+
+/*
+ *	How much of the data union has to be saved.  Even for
+ *	integers, dates, and IP addresses, we keep the original
+ *	string in vp_strvalue.  See pairparsevalue().
+ */
+static size_t vp_packed_data_len(const VALUE_PAIR *vp)
+{
+	size_t len;
+	const char *end;
+
+	if (vp->type == PW_TYPE_TLV) {
+		return vp->vp_tlv ? vp->length : 0;
+	}
+
+	end = memchr(vp->vp_strvalue, 0, sizeof(vp->vp_strvalue));
+	if (end) {
+		len = (end - vp->vp_strvalue) + 1; /* and the zero */
+	} else {
+		len = sizeof(vp->vp_strvalue);
+	}
+	if (len < vp->length) len = vp->length;
+	if (len > sizeof(vp->data)) len = sizeof(vp->data);
+
+	return len;
+}
+
+static size_t vp_packed_len(const VALUE_PAIR *vp)
+{
+	size_t len;
+
+	len = sizeof(vp_packed_t) + vp_packed_data_len(vp);
+	if (vp->flags.unknown_attr && vp->name) len += strlen(vp->name) + 1;
+
+	return VP_PACKED_ALIGN(len);
+}
+
+/*
+ *	Pack a list of VALUE_PAIRs.  The result should be free'd
+ *	with free().
+ */
+VALUE_PAIR_PACKED *pairpack(const VALUE_PAIR *vps)
+{
+	size_t size;
+	uint8_t *p;
+	const VALUE_PAIR *vp;
+	VALUE_PAIR_PACKED *packed;
+
+	size = VP_PACKED_ALIGN(sizeof(*packed));
+	for (vp = vps; vp != NULL; vp = vp->next) {
+		size += vp_packed_len(vp);
+	}
+
+	packed = malloc(size);
+	if (!packed) {
+		fr_strerror_printf("out of memory");
+		return NULL;
+	}
+
+	packed->size = size;
+	packed->num_pairs = 0;
+
+	p = ((uint8_t *) packed) + VP_PACKED_ALIGN(sizeof(*packed));
+	for (vp = vps; vp != NULL; vp = vp->next) {
+		vp_packed_t *pp = (vp_packed_t *) p;
+		uint8_t *data = p + sizeof(*pp);
+
+		memset(pp, 0, sizeof(*pp));
+		pp->attribute = vp->attribute;
+		pp->vendor = vp->vendor;
+		pp->type = vp->type;
+		pp->operator = vp->operator;
+		pp->flags = vp->flags;
+		pp->lvalue = vp->lvalue;
+		pp->length = vp->length;
+		pp->data_len = vp_packed_data_len(vp);
+
+		if (vp->type == PW_TYPE_TLV) {
+			if (pp->data_len) memcpy(data, vp->vp_tlv, pp->data_len);
+		} else {
+			memcpy(data, &vp->data, pp->data_len);
+		}
+
+		if (vp->flags.unknown_attr && vp->name) {
+			pp->name_len = strlen(vp->name) + 1;
+			memcpy(data + pp->data_len, vp->name, pp->name_len);
+		}
+
+		p += vp_packed_len(vp);
+		packed->num_pairs++;
+	}
+
+	return packed;
+}
+
+/*
+ *	Unpack a list.  The packed list is left alone.
+ */
+VALUE_PAIR *pairunpack(const VALUE_PAIR_PACKED *packed)
+{
+	int i;
+	const uint8_t *p;
+	VALUE_PAIR *first = NULL, **last = &first;
+
+	if (!packed) return NULL;
+
+	p = ((const uint8_t *) packed) + VP_PACKED_ALIGN(sizeof(*packed));
+	for (i = 0; i < packed->num_pairs; i++) {
+		const vp_packed_t *pp = (const vp_packed_t *) p;
+		const uint8_t *data = p + sizeof(*pp);
+		DICT_ATTR *da = NULL;
+		VALUE_PAIR *vp;
+
+		if (!pp->flags.unknown_attr) da = dict_attrbyvalue(pp->attribute);
+
+		if (da) {
+			vp = pairalloc(da);
+			if (vp) {
+				vp->type = pp->type;
+				vp->flags = pp->flags;
+			}
+		} else {
+			vp = paircreate(pp->attribute, pp->type);
+			if (vp) {
+				vp->flags.tag = pp->flags.tag;
+				vp->flags.encoded = pp->flags.encoded;
+			}
+		}
+
+		if (!vp) {
+			pairfree(&first);
+			fr_strerror_printf("out of memory");
+			return NULL;
+		}
+
+		vp->vendor = pp->vendor;
+		vp->operator = pp->operator;
+		vp->lvalue = pp->lvalue;
+		vp->length = pp->length;
+
+		if (pp->type == PW_TYPE_TLV) {
+			vp->vp_tlv = NULL;
+			if (pp->data_len) {
+				vp->vp_tlv = malloc(pp->data_len);
+				if (!vp->vp_tlv) {
+					pairbasicfree(vp);
+					pairfree(&first);
+					fr_strerror_printf("out of memory");
+					return NULL;
+				}
+				memcpy(vp->vp_tlv, data, pp->data_len);
+			}
+		} else {
+			memcpy(&vp->data, data, pp->data_len);
+		}
+
+		/*
+		 *	Unknown attributes have room for the name
+		 *	after the VALUE_PAIR.
+		 */
+		if (vp->padded && pp->name_len &&
+		    (pp->name_len <= FR_VP_NAME_PAD)) {
+			memcpy((char *) (vp + 1), data + pp->data_len,
+			       pp->name_len);
+		}
+
+		*last = vp;
+		last = &(vp->next);
+
+		p += VP_PACKED_ALIGN(sizeof(*pp) + pp->data_len + pp->name_len);
+	}
+
+	return first;
+}
+
+/*
+ *	How much memory the packed list uses.
+ */
+size_t pairpacked_size(const VALUE_PAIR_PACKED *packed)
+{
+	if (!packed) return 0;
+
+	return packed->size;
+}
+
+/*
+ *	Copy a packed list which came from outside of the server,
+ *	e.g. from a file written by an earlier run.  We check that
+ *	it's well formed, so that pairunpack() won't run off of the
+ *	end of it.
+ */
+VALUE_PAIR_PACKED *pairpacked_copy(const void *data, size_t len)
+{
+	int i;
+	size_t offset, rec_len;
+	VALUE_PAIR_PACKED *packed;
+
+	if (len < VP_PACKED_ALIGN(sizeof(*packed))) {
+		fr_strerror_printf("packed list is too short");
+		return NULL;
+	}
+
+	/*
+	 *	Copy it first, so that we're looking at aligned
+	 *	memory.
+	 */
+	packed = malloc(len);
+	if (!packed) {
+		fr_strerror_printf("out of memory");
+		return NULL;
+	}
+	memcpy(packed, data, len);
+
+	if ((packed->size != len) || (packed->num_pairs < 0)) {
+		fr_strerror_printf("packed list has invalid header");
+		goto error;
+	}
+
+	offset = VP_PACKED_ALIGN(sizeof(*packed));
+	for (i = 0; i < packed->num_pairs; i++) {
+		const vp_packed_t *pp;
+		const uint8_t *name;
+
+		if ((offset + sizeof(*pp)) > len) goto truncated;
+
+		pp = (const vp_packed_t *) (((const uint8_t *) packed) + offset);
+		rec_len = VP_PACKED_ALIGN(sizeof(*pp) + pp->data_len + pp->name_len);
+		if ((offset + rec_len) > len) goto truncated;
+
+		if ((pp->type != PW_TYPE_TLV) &&
+		    (pp->data_len > sizeof(VALUE_PAIR_DATA))) {
+			fr_strerror_printf("packed attribute has too much data");
+			goto error;
+		}
+
+		if (pp->name_len) {
+			name = ((const uint8_t *) (pp + 1)) + pp->data_len;
+			if (name[pp->name_len - 1] != '\0') {
+				fr_strerror_printf("packed attribute has invalid name");
+				goto error;
+			}
+		}
+
+		offset += rec_len;
+	}
+
+	if (offset != len) {
+	truncated:
+		fr_strerror_printf("packed list has invalid length");
+		goto error;
+	}
+
+	return packed;
+
+error:
+	free(packed);
+	return NULL;
+}
+
+
+/*
+ *	An index of the attributes in a list, so that moving one
+ *	large list into another doesn't turn into a quadratic
+ *	number of calls to pairfind().
+ *
+ *	Lists are bare pointers which the server splices by hand
+ *	all over the place, so an index cannot safely live with the
+ *	list.  Instead, the caller creates one for the duration of
+ *	an operation, and tells it about any changes it makes.
+ */
+#define FR_PAIR_INDEX_MIN (16)
+
+int fr_pair_index_enabled = 1;
+
+typedef struct pair_index_slot_t {
+	int		in_use;
+	int		attr;
+	int		count;		/* of this attribute in the list */
+	VALUE_PAIR	*vp;		/* the first one in the list */
+} pair_index_slot_t;
+
+struct fr_pair_index_t {
+	int		size;		/* always a power of two */
+	int		used;
+	pair_index_slot_t *slot;
+};
+
+
+/*
+ *	Open addressing with linear probing.  Slots are never
+ *	removed, only emptied, so there are no tombstones to
+ *	deal with.
+ */
+static pair_index_slot_t *pairindex_slot(fr_pair_index_t *pi, int attr)
+{
+	uint32_t hash;
+	pair_index_slot_t *slot;
+
+	hash = ((uint32_t) attr) * 2654435761U;
+	hash ^= hash >> 16;
+
+	for (;;) {
+		slot = &pi->slot[hash & (pi->size - 1)];
+		if (!slot->in_use || (slot->attr == attr)) return slot;
+		hash++;
+	}
+}
+
+static int pairindex_grow(fr_pair_index_t *pi, int size)
+{
+	int i;
+	pair_index_slot_t *old = pi->slot;
+	int old_size = pi->size;
+
+	pi->slot = calloc(size, sizeof(pi->slot[0]));
+	if (!pi->slot) {
+		pi->slot = old;
+		return 0;
+	}
+	pi->size = size;
+
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].in_use) continue;
+
+		*pairindex_slot(pi, old[i].attr) = old[i];
+	}
+	free(old);
+
+	return 1;
+}
+
+/*
+ *	Returns NULL if the list (plus the "hint" of how many pairs
+ *	the caller expects to add) is too small to be worth indexing.
+ *	The pairindex_*() functions then fall back to walking the
+ *	list.
+ */
+fr_pair_index_t *pairindex_create(VALUE_PAIR *vps, int hint)
+{
+	int size, num = 0;
+	VALUE_PAIR *vp;
+	fr_pair_index_t *pi;
+
+	if (!fr_pair_index_enabled) return NULL;
+
+	for (vp = vps; vp != NULL; vp = vp->next) num++;
+
+	if ((num + hint) < FR_PAIR_INDEX_MIN) return NULL;
+
+	for (size = 32; size < 2 * (num + hint); size <<= 1) {
+		/* nothing */
+	}
+
+	pi = malloc(sizeof(*pi));
+	if (!pi) return NULL;
+
+	pi->size = 0;
+	pi->used = 0;
+	pi->slot = NULL;
+	if (!pairindex_grow(pi, size)) {
+		free(pi);
+		return NULL;
+	}
+
+	for (vp = vps; vp != NULL; vp = vp->next) {
+		if (!pairindex_add(pi, vp)) {
+			pairindex_free(pi);
+			return NULL;
+		}
+	}
+
+	return pi;
+}
+
+void pairindex_free(fr_pair_index_t *pi)
+{
+	if (!pi) return;
+
+	free(pi->slot);
+	free(pi);
+}
+
+/*
+ *	Same as pairfind(vps, attr)
+ */
+VALUE_PAIR *pairindex_find(fr_pair_index_t *pi, VALUE_PAIR *vps, int attr)
+{
+	if (!pi) return pairfind(vps, attr);
+
+	return pairindex_slot(pi, attr)->vp;
+}
+
+/*
+ *	Call this after adding "vp" to the END of the list.  This
+ *	can only fail (out of memory) for attributes which are not
+ *	already in the index.
+ */
+int pairindex_add(fr_pair_index_t *pi, VALUE_PAIR *vp)
+{
+	pair_index_slot_t *slot;
+
+	if (!pi) return 1;
+
+	slot = pairindex_slot(pi, vp->attribute);
+	if (!slot->in_use) {
+		/*
+		 *	Keep the table at most half full.
+		 */
+		if ((2 * (pi->used + 1)) > pi->size) {
+			if (!pairindex_grow(pi, pi->size * 2)) return 0;
+			slot = pairindex_slot(pi, vp->attribute);
+		}
+
+		slot->in_use = 1;
+		slot->attr = vp->attribute;
+		pi->used++;
+	}
+
+	if (!slot->vp) slot->vp = vp;
+	slot->count++;
+
+	return 1;
+}
+
+/*
+ *	Call this after pairdelete() of the same attribute.
+ */
+void pairindex_delete(fr_pair_index_t *pi, int attr)
+{
+	pair_index_slot_t *slot;
+
+	if (!pi) return;
+
+	slot = pairindex_slot(pi, attr);
+	slot->vp = NULL;
+	slot->count = 0;
+}
+
+/*
+ *	Returns -1 if we don't know.
+ */
+int pairindex_count(fr_pair_index_t *pi, int attr)
+{
+	if (!pi) return -1;
+
+	return pairindex_slot(pi, attr)->count;
+}
+
+
 /*
  *	Move attributes from one list to the other
  *	if not already present.
@@ -400,6 +908,8 @@ void pairmove(VALUE_PAIR **to, VALUE_PAIR **from)
 	VALUE_PAIR *tailfrom = NULL;
 	VALUE_PAIR *found;
 	int has_password = 0;
+	int num_from = 0;
+	fr_pair_index_t *pi;
 
 	/*
 	 *	First, see if there are any passwords here, and
@@ -413,6 +923,9 @@ void pairmove(VALUE_PAIR **to, VALUE_PAIR **from)
 		tailto = &i->next;
 	}
 
+	for(i = *from; i; i = i->next) num_from++;
+	pi = pairindex_create(*to, num_from);
+
 	/*
 	 *	Loop over the "from" list.
 	 */
@@ -463,7 +976,7 @@ void pairmove(VALUE_PAIR **to, VALUE_PAIR **from)
 		if (i->attribute == PW_FALL_THROUGH ||
 		    (i->attribute != PW_HINT && i->attribute != PW_FRAMED_ROUTE)) {
 
-			found = pairfind(*to, i->attribute);
+			found = pairindex_find(pi, *to, i->attribute);
 			switch (i->operator) {
 
 			  /*
@@ -475,6 +988,7 @@ void pairmove(VALUE_PAIR **to, VALUE_PAIR **from)
 					if (!i->vp_strvalue[0] ||
 					    (strcmp((char *)found->vp_strvalue,
 						    (char *)i->vp_strvalue) == 0)){
+						pairindex_delete(pi, found->attribute);
 						pairdelete(to, found->attribute);
 
 						/*
@@ -570,7 +1084,17 @@ void pairmove(VALUE_PAIR **to, VALUE_PAIR **from)
 					memcpy(found, i, sizeof(*found));
 					found->next = mynext;
 
+					/*
+					 *	Nothing to delete, so
+					 *	'tailto' is still good.
+					 */
+					if (pairindex_count(pi, found->attribute) == 1) {
+						continue;
+					}
+
 					pairdelete(&found->next, found->attribute);
+					pairindex_delete(pi, found->attribute);
+					pairindex_add(pi, found);
 
 					/*
 					 *	'tailto' may have been
@@ -609,8 +1133,15 @@ void pairmove(VALUE_PAIR **to, VALUE_PAIR **from)
 		if (i) {
 			i->next = NULL;
 			tailto = &i->next;
+
+			if (!pairindex_add(pi, i)) {
+				pairindex_free(pi);
+				pi = NULL;
+			}
 		}
 	}
+
+	pairindex_free(pi);
 }
 
 /*
@@ -1443,7 +1974,7 @@ static VALUE_PAIR *pairmake_any(const char *attribute, const char *value,
 
 	if (fr_hex2bin(value + 2, vp->vp_octets, size) != vp->length) {
 		fr_strerror_printf("Invalid hex string");
-		free(vp);
+		pairbasicfree(vp);
 		return NULL;
 	}
 
@@ -1959,13 +2490,12 @@ int paircmp(VALUE_PAIR *one, VALUE_PAIR *two)
 		return -1;
 #else
 		{
-			regex_t reg;
+			regex_t *preg;
 			char buffer[MAX_STRING_LEN * 4 + 1];
 
-			compare = regcomp(&reg, one->vp_strvalue,
-					  REG_EXTENDED);
-			if (compare != 0) {
-				regerror(compare, &reg, buffer, sizeof(buffer));
+			preg = fr_regex_get(one->vp_strvalue, REG_EXTENDED);
+			if (!preg) {
+				strlcpy(buffer, fr_strerror(), sizeof(buffer));
 				fr_strerror_printf("Illegal regular expression in attribute: %s: %s",
 					   one->name, buffer);
 				return -1;
@@ -1977,9 +2507,9 @@ int paircmp(VALUE_PAIR *one, VALUE_PAIR *two)
 			 *	Don't care about substring matches,
 			 *	oh well...
 			 */
-			compare = regexec(&reg, buffer, 0, NULL, 0);
+			compare = regexec(preg, buffer, 0, NULL, 0);
 
-			regfree(&reg);
+			fr_regex_release(preg);
 			if (one->operator == T_OP_REG_EQ) return (compare == 0);
 			return (compare != 0);
 		}
@@ -2083,3 +2613,225 @@ int paircmp(VALUE_PAIR *one, VALUE_PAIR *two)
 
 	return 0;
 }
+
+#ifdef TESTING
+/*
+ *  cc -g -O2 -I .. -D_LIBRADIUS -DTESTING valuepair.c -o valuepair .libs/libfreeradius-radius.a -lpthread -lcrypto
+ *
+ *  ./valuepair [<dictionary directory>]
+ *
+ *  Times pairmove() of lists of 4 to 256 attributes, with and
+ *  without the attribute index.
+ *
+ *  Then builds a cache of 1M entries, each with four attributes,
+ *  first as packed lists and then as lists of VALUE_PAIRs, and
+ *  prints the memory used by each.
+ */
+#include <sys/resource.h>
+
+#define NUM_ENTRIES (1000000)
+
+static VALUE_PAIR *make_vp(int attr, int type)
+{
+	VALUE_PAIR *vp = paircreate(attr, type);
+
+	if (!vp) {
+		fr_perror("valuepair");
+		exit(1);
+	}
+
+	return vp;
+}
+
+static VALUE_PAIR *make_entry(int i)
+{
+	char buffer[64];
+	VALUE_PAIR *vps = NULL, *vp;
+
+	snprintf(buffer, sizeof(buffer), "user%d@example.com", i);
+	vp = make_vp(PW_USER_NAME, PW_TYPE_STRING);
+	pairparsevalue(vp, buffer);
+	pairadd(&vps, vp);
+
+	vp = make_vp(27, PW_TYPE_INTEGER); /* Session-Timeout */
+	vp->vp_integer = 3600;
+	vp->length = 4;
+	pairadd(&vps, vp);
+
+	vp = make_vp(8, PW_TYPE_IPADDR); /* Framed-IP-Address */
+	vp->vp_ipaddr = htonl(0x0a000000 + i);
+	vp->length = 4;
+	pairadd(&vps, vp);
+
+	vp = make_vp(25, PW_TYPE_OCTETS); /* Class */
+	memcpy(vp->vp_octets, "0123456789abcdef", 16);
+	vp->length = 16;
+	pairadd(&vps, vp);
+
+	return vps;
+}
+
+/*
+ *	"num" vendor attributes, starting at "first".
+ */
+static VALUE_PAIR *make_vsas(int first, int num, int operator)
+{
+	int i;
+	VALUE_PAIR *vps = NULL, **last = &vps, *vp;
+
+	for (i = first; i < first + num; i++) {
+		vp = make_vp((9 << 16) | i, PW_TYPE_INTEGER);
+		vp->vp_integer = i;
+		vp->length = 4;
+		vp->operator = operator;
+		*last = vp;
+		last = &vp->next;
+	}
+
+	return vps;
+}
+
+/*
+ *	Move "num" attributes into a list of "num" attributes, where
+ *	half of them over-write existing ones.  Returns the average
+ *	time in usec, and the length of the result.
+ */
+static double time_pairmove(int num, int *result)
+{
+	int i;
+	double usec;
+	struct timeval start, end;
+	VALUE_PAIR *to[1000], *from[1000], *vp;
+
+	for (i = 0; i < 1000; i++) {
+		to[i] = make_vsas(1, num, T_OP_EQ);
+		from[i] = make_vsas(1 + num / 2, num, T_OP_SET);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 1000; i++) {
+		pairmove(&to[i], &from[i]);
+	}
+	gettimeofday(&end, NULL);
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000.0;
+	usec += end.tv_usec - start.tv_usec;
+
+	for (i = 0; i < 1000; i++) {
+		*result = 0;
+		for (vp = to[i]; vp != NULL; vp = vp->next) {
+			if (vp->vp_integer != (vp->attribute & 0xffff)) {
+				fprintf(stderr, "pairmove broke %s\n", vp->name);
+				exit(1);
+			}
+			(*result)++;
+		}
+		pairfree(&to[i]);
+		pairfree(&from[i]);
+	}
+
+	return usec / 1000;
+}
+
+static long max_rss(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;	/* KB on Linux */
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	long rss_start, rss_packed, rss_vps;
+	size_t packed_bytes = 0, vp_bytes = 0;
+	VALUE_PAIR **lists, *vp, *copy, *orig, *next;
+	VALUE_PAIR_PACKED **packed;
+
+	if ((argc > 1) && (dict_init(argv[1], "dictionary") < 0)) {
+		fr_perror("valuepair");
+		exit(1);
+	}
+
+	/*
+	 *	Check that pack / unpack round-trips.
+	 */
+	vp = make_entry(42);
+	packed = malloc(sizeof(*packed));
+	packed[0] = pairpack(vp);
+	copy = pairunpack(packed[0]);
+	for (orig = vp, next = copy;
+	     orig && next;
+	     orig = orig->next, next = next->next) {
+		if ((next->attribute != orig->attribute) ||
+		    (next->length != orig->length) ||
+		    (next->lvalue != orig->lvalue) ||
+		    (memcmp(&next->data, &orig->data,
+			    sizeof(next->data)) != 0)) {
+			fprintf(stderr, "Round trip failed for %s\n",
+				orig->name);
+			exit(1);
+		}
+	}
+	if (orig || next) {
+		fprintf(stderr, "Round trip lost attributes\n");
+		exit(1);
+	}
+	pairfree(&vp);
+	pairfree(&copy);
+	free(packed[0]);
+	free(packed);
+
+	/*
+	 *	pairmove() with and without the attribute index.
+	 */
+	printf("attributes  indexed (usec)  linear (usec)\n");
+	for (i = 4; i <= 256; i <<= 1) {
+		int indexed, linear;
+		double t_indexed, t_linear;
+
+		fr_pair_index_enabled = 1;
+		t_indexed = time_pairmove(i, &indexed);
+		fr_pair_index_enabled = 0;
+		t_linear = time_pairmove(i, &linear);
+
+		if ((indexed != linear) || (indexed != (i + i / 2))) {
+			fprintf(stderr, "pairmove results differ\n");
+			exit(1);
+		}
+
+		printf("%10d  %14.2f  %13.2f\n", i, t_indexed, t_linear);
+	}
+	fr_pair_index_enabled = 1;
+
+	rss_start = max_rss();
+
+	packed = malloc(NUM_ENTRIES * sizeof(*packed));
+	for (i = 0; i < NUM_ENTRIES; i++) {
+		vp = make_entry(i);
+		packed[i] = pairpack(vp);
+		packed_bytes += pairpacked_size(packed[i]);
+		pairfree(&vp);
+	}
+	rss_packed = max_rss();
+
+	lists = malloc(NUM_ENTRIES * sizeof(*lists));
+	for (i = 0; i < NUM_ENTRIES; i++) {
+		lists[i] = make_entry(i);
+		for (vp = lists[i]; vp != NULL; vp = vp->next) {
+			vp_bytes += sizeof(*vp);
+			if (vp->padded) vp_bytes += FR_VP_NAME_PAD;
+		}
+	}
+	rss_vps = max_rss();
+
+	printf("%d entries of 4 attributes\n", NUM_ENTRIES);
+	printf("VALUE_PAIR lists: %8lu KB allocated, max RSS grew %8ld KB\n",
+	       (unsigned long) (vp_bytes / 1024), rss_vps - rss_packed);
+	printf("packed lists:     %8lu KB allocated, max RSS grew %8ld KB\n",
+	       (unsigned long) (packed_bytes / 1024), rss_packed - rss_start);
+
+	return 0;
+}
+#endif
@@ -1516,6 +1516,136 @@ static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
 	return 1;
 }
 
+static int command_stats_memory(rad_listen_t *listener,
+				UNUSED int argc, UNUSED char *argv[])
+{
+	int i;
+	fr_slab_stats_t stats;
+
+	for (i = 0; fr_slab_stats(i, &stats); i++) {
+		cprintf(listener, "%s\n", stats.name);
+		cprintf(listener, "\tsize\t\t%u\n", (unsigned int) stats.size);
+		cprintf(listener, "\tallocs\t\t%llu\n",
+			(unsigned long long) stats.allocs);
+		cprintf(listener, "\tfrees\t\t%llu\n",
+			(unsigned long long) stats.frees);
+		cprintf(listener, "\tmallocs\t\t%llu\n",
+			(unsigned long long) stats.mallocs);
+		cprintf(listener, "\treleases\t%llu\n",
+			(unsigned long long) stats.releases);
+		cprintf(listener, "\tcached\t\t%d\n", stats.num_free);
+	}
+
+	return 1;
+}
+
+#ifdef HAVE_REGEX_H
+static int command_stats_regex(rad_listen_t *listener,
+			       UNUSED int argc, UNUSED char *argv[])
+{
+	fr_regex_stats_t stats;
+
+	fr_regex_cache_stats(&stats);
+
+	cprintf(listener, "\thits\t\t%llu\n",
+		(unsigned long long) stats.hits);
+	cprintf(listener, "\tmisses\t\t%llu\n",
+		(unsigned long long) stats.misses);
+	cprintf(listener, "\tevictions\t%llu\n",
+		(unsigned long long) stats.evictions);
+	cprintf(listener, "\terrors\t\t%llu\n",
+		(unsigned long long) stats.errors);
+	cprintf(listener, "\tentries\t\t%d\n", stats.num_entries);
+	cprintf(listener, "\tmax_entries\t%d\n", stats.max_entries);
+
+	return 1;
+}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+static int command_stats_crypto(rad_listen_t *listener,
+				UNUSED int argc, UNUSED char *argv[])
+{
+	fr_crypto_pool_stats_t stats;
+
+	thread_pool_crypto_stats(&stats);
+
+	cprintf(listener, "\tthreads\t\t%d\n", stats.threads);
+	cprintf(listener, "\tactive\t\t%d\n", stats.active);
+	cprintf(listener, "\tqueued\t\t%d\n", stats.queued);
+	cprintf(listener, "\tmax_queued\t%d\n", stats.max_queued);
+	cprintf(listener, "\trequests\t%llu\n",
+		(unsigned long long) stats.requests);
+	cprintf(listener, "\tdropped\t\t%llu\n",
+		(unsigned long long) stats.dropped);
+
+	/*
+	 *	Latencies are in microseconds.
+	 */
+	cprintf(listener, "\tavg_wait\t%llu\n",
+		(unsigned long long) (stats.requests ?
+				      (stats.wait_usec / stats.requests) : 0));
+	cprintf(listener, "\tmax_wait\t%llu\n",
+		(unsigned long long) stats.max_wait_usec);
+	cprintf(listener, "\tavg_run\t\t%llu\n",
+		(unsigned long long) (stats.requests ?
+				      (stats.run_usec / stats.requests) : 0));
+	cprintf(listener, "\tmax_run\t\t%llu\n",
+		(unsigned long long) stats.max_run_usec);
+
+	return 1;
+}
+#endif
+
+static int command_stats_log(rad_listen_t *listener,
+			     UNUSED int argc, UNUSED char *argv[])
+{
+	int queued;
+	uint64_t written, dropped;
+
+	radlog_async_stats(&written, &dropped, &queued);
+
+	cprintf(listener, "\twritten\t\t%llu\n",
+		(unsigned long long) written);
+	cprintf(listener, "\tdropped\t\t%llu\n",
+		(unsigned long long) dropped);
+	cprintf(listener, "\tqueued\t\t%d\n", queued);
+
+	return 1;
+}
+
+static int command_stats_module(rad_listen_t *listener, int argc, char *argv[])
+{
+	CONF_SECTION *cs;
+	module_instance_t *mi;
+	char buffer[4096];
+
+	if (argc != 1) {
+		cprintf(listener, "ERROR: No module name was given\n");
+		return 0;
+	}
+
+	cs = cf_section_find("modules");
+	if (!cs) return 0;
+
+	mi = find_module_instance(cs, argv[0], 0);
+	if (!mi) {
+		cprintf(listener, "ERROR: No such module \"%s\"\n", argv[0]);
+		return 0;
+	}
+
+	if (module_stats(mi->insthandle, buffer, sizeof(buffer)) == 0) {
+		cprintf(listener, "ERROR: Module \"%s\" has no statistics\n",
+			argv[0]);
+		return 0;
+	}
+
+	cprintf(listener, "%s", buffer);
+
+	return 1;
+}
+
+
 
 #ifdef WITH_DETAIL
 static FR_NAME_NUMBER state_names[] = {
@@ -1580,6 +1710,9 @@ static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
 	cprintf(listener, "tries\t%d\n", data->tries);
 	cprintf(listener, "offset\t%u\n", (unsigned int) data->offset);
 	cprintf(listener, "size\t%u\n", (unsigned int) buf.st_size);
+	if (data->entries) {
+		cprintf(listener, "outstanding\t%d\n", data->outstanding);
+	}
 
 	return 1;
 }
@@ -1818,12 +1951,36 @@ static fr_command_table_t command_table_stats[] = {
 	  command_stats_home_server, NULL },
 #endif
 
+#ifdef HAVE_PTHREAD_H
+	{ "crypto", FR_READ,
+	  "stats crypto - show statistics for the crypto threads",
+	  command_stats_crypto, NULL },
+#endif
+
 #ifdef WITH_DETAIL
 	{ "detail", FR_READ,
 	  "stats detail <filename> - show statistics for the given detail file",
 	  command_stats_detail, NULL },
 #endif
 
+	{ "log", FR_READ,
+	  "stats log - show statistics for the asynchronous log writer",
+	  command_stats_log, NULL },
+
+	{ "memory", FR_READ,
+	  "stats memory - show statistics for the memory caches",
+	  command_stats_memory, NULL },
+
+	{ "module", FR_READ,
+	  "stats module <module> - show statistics for the given module",
+	  command_stats_module, NULL },
+
+#ifdef HAVE_REGEX_H
+	{ "regex", FR_READ,
+	  "stats regex - show statistics for the cache of regular expressions",
+	  command_stats_regex, NULL },
+#endif
+
 	{ NULL, 0, NULL, NULL, NULL }
 };
 
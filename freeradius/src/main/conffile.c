@@ -1964,11 +1964,6 @@ FR_TOKEN cf_pair_operator(CONF_PAIR *pair)
 	return (pair ? pair->operator : T_OP_INVALID);
 }
 
-/*
- *	Copied here for error reporting.
- */
-extern void fr_strerror_printf(const char *, ...);
-
 /*
  * Turn a CONF_PAIR into a VALUE_PAIR
  * For now, ignore the "value_type" field...
@@ -37,12 +37,24 @@ RCSID("$Id$")
 #include <glob.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #include <fcntl.h>
+#include <ctype.h>
 
 #ifdef WITH_DETAIL
 
 #define USEC (1000000)
 
+#ifndef HAVE_PTHREAD_H
+#define pthread_mutex_init(_x, _y)
+#define pthread_mutex_destroy(_x)
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_unlock(_x)
+#endif
+
 static FR_NAME_NUMBER state_names[] = {
 	{ "unopened", STATE_UNOPENED },
 	{ "unlocked", STATE_UNLOCKED },
@@ -57,33 +69,13 @@ static FR_NAME_NUMBER state_names[] = {
 };
 
 /*
- *	If we're limiting outstanding packets, then mark the response
- *	as being sent.
+ *	Update the RTT from a reply, and calculate how long we wait
+ *	before reading the next packet.
  */
-int detail_send(rad_listen_t *listener, REQUEST *request)
+static void detail_update_delay(listen_detail_t *data, REQUEST *request)
 {
 	int rtt;
 	struct timeval now;
-	listen_detail_t *data = listener->data;
-
-	rad_assert(request->listener == listener);
-	rad_assert(listener->send == detail_send);
-
-	/*
-	 *	This request timed out.  Remember that, and tell the
-	 *	caller it's OK to read more "detail" file stuff.
-	 */
-	if (request->reply->code == 0) {
-		data->delay_time = data->retry_interval * USEC;
-		data->signal = 1;
-		data->state = STATE_NO_REPLY;
-
-		RDEBUG("Detail - No response configured for request %d.  Will retry in %d seconds",
-		       request->number, data->retry_interval);
-
-		radius_signal_self(RADIUS_SIGNAL_SELF_DETAIL);
-		return 0;
-	}
 
 	/*
 	 *	We call gettimeofday a lot.  But it should be OK,
@@ -155,130 +147,743 @@ int detail_send(rad_listen_t *listener, REQUEST *request)
 		request->number, data->delay_time / USEC);
 	
 	data->last_packet = now;
+}
+
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ *	When many packets are outstanding, each one has its own
+ *	entry.  Find it, and mark it as done.
+ */
+static int detail_send_window(rad_listen_t *listener, REQUEST *request)
+{
+	int i;
+	detail_entry_t *entry = NULL;
+	listen_detail_t *data = listener->data;
+
+	pthread_mutex_lock(&data->mutex);
+
+	for (i = 0; i < data->max_outstanding; i++) {
+		if ((data->entries[i].state == STATE_RUNNING) &&
+		    (data->entries[i].packet == request->packet)) {
+			entry = &data->entries[i];
+			break;
+		}
+	}
+
+	/*
+	 *	We gave up on this request, and sent the entry again.
+	 *	Ignore the old one.
+	 */
+	if (!entry) {
+		pthread_mutex_unlock(&data->mutex);
+		return 0;
+	}
+
+	entry->packet = NULL;
+
+	if (request->reply->code == 0) {
+		entry->state = STATE_NO_REPLY;
+		entry->running = time(NULL);
+
+		RDEBUG("Detail - No response configured for request %d.  Will retry in %d seconds",
+		       request->number, data->retry_interval);
+
+	} else {
+		/*
+		 *	The delay is shared among all of the
+		 *	outstanding packets.
+		 */
+		detail_update_delay(data, request);
+		data->delay_time /= data->max_outstanding;
+
+		/*
+		 *	Overwrite "\tTimestamp" with "\tDone", so
+		 *	that the record is skipped if we have to read
+		 *	the file again.  The lengths are different,
+		 *	but "Donestamp" is still a valid line.
+		 */
+		if (data->track && (entry->timestamp_offset >= 0) &&
+		    (pwrite(listener->fd, "\tDone", 5,
+			    entry->timestamp_offset) != 5)) {
+			radlog(L_ERR, "Detail - Failed marking record as done in %s: %s",
+			       data->filename_work, strerror(errno));
+		}
+
+		entry->state = STATE_REPLIED;
+	}
+
+	data->signal = 1;
+	pthread_mutex_unlock(&data->mutex);
+
+	radius_signal_self(RADIUS_SIGNAL_SELF_DETAIL);
+	return 0;
+}
+#endif
+
+
+/*
+ *	If we're limiting outstanding packets, then mark the response
+ *	as being sent.
+ */
+int detail_send(rad_listen_t *listener, REQUEST *request)
+{
+	listen_detail_t *data = listener->data;
+
+	rad_assert(request->listener == listener);
+	rad_assert(listener->send == detail_send);
+
+#ifdef HAVE_SYS_MMAN_H
+	if (data->entries) return detail_send_window(listener, request);
+#endif
+
+	/*
+	 *	This request timed out.  Remember that, and tell the
+	 *	caller it's OK to read more "detail" file stuff.
+	 */
+	if (request->reply->code == 0) {
+		data->delay_time = data->retry_interval * USEC;
+		data->signal = 1;
+		data->state = STATE_NO_REPLY;
+
+		RDEBUG("Detail - No response configured for request %d.  Will retry in %d seconds",
+		       request->number, data->retry_interval);
+
+		radius_signal_self(RADIUS_SIGNAL_SELF_DETAIL);
+		return 0;
+	}
+
+	detail_update_delay(data, request);
+
 	data->signal = 1;
 	data->state = STATE_REPLIED;
 	radius_signal_self(RADIUS_SIGNAL_SELF_DETAIL);
 
-	return 0;
-}
+	return 0;
+}
+
+
+/*
+ *	Create a packet from the attributes read from the detail file.
+ */
+static RADIUS_PACKET *detail_packet(VALUE_PAIR *vps, fr_ipaddr_t *client_ip,
+				    time_t timestamp, int tries)
+{
+	VALUE_PAIR	*vp;
+	RADIUS_PACKET	*packet;
+
+	/*
+	 *	Allocate the packet.  If we fail, it's a serious
+	 *	problem.
+	 */
+	packet = rad_alloc(1);
+	if (!packet) {
+		radlog(L_ERR, "FATAL: Failed allocating memory for detail");
+		exit(1);
+	}
+
+	memset(packet, 0, sizeof(*packet));
+	packet->sockfd = -1;
+	packet->src_ipaddr.af = AF_INET;
+	packet->src_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_NONE);
+	packet->code = PW_ACCOUNTING_REQUEST;
+	packet->timestamp = time(NULL);
+
+	/*
+	 *	Remember where it came from, so that we don't
+	 *	proxy it to the place it came from...
+	 */
+	if (client_ip->af != AF_UNSPEC) {
+		packet->src_ipaddr = *client_ip;
+	}
+
+	vp = pairfind(packet->vps, PW_PACKET_SRC_IP_ADDRESS);
+	if (vp) {
+		packet->src_ipaddr.af = AF_INET;
+		packet->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+	} else {
+		vp = pairfind(packet->vps, PW_PACKET_SRC_IPV6_ADDRESS);
+		if (vp) {
+			packet->src_ipaddr.af = AF_INET6;
+			memcpy(&packet->src_ipaddr.ipaddr.ip6addr,
+			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
+		}
+	}
+
+	vp = pairfind(packet->vps, PW_PACKET_DST_IP_ADDRESS);
+	if (vp) {
+		packet->dst_ipaddr.af = AF_INET;
+		packet->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+	} else {
+		vp = pairfind(packet->vps, PW_PACKET_DST_IPV6_ADDRESS);
+		if (vp) {
+			packet->dst_ipaddr.af = AF_INET6;
+			memcpy(&packet->dst_ipaddr.ipaddr.ip6addr,
+			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
+		}
+	}
+
+	/*
+	 *	We've got to give SOME value for Id & ports, so that
+	 *	the packets can be added to the request queue.
+	 *	However, we don't want to keep track of used/unused
+	 *	id's and ports, as that's a lot of work.  This hack
+	 *	ensures that (if we have real random numbers), that
+	 *	there will be a collision on every 2^(16+15+15+24 - 1)
+	 *	packets, on average.  That means we can read 2^37
+	 *	packets before having a collision, which means it's
+	 *	effectively impossible.
+	 */
+	packet->id = fr_rand() & 0xffff;
+	packet->src_port = 1024 + (fr_rand() & 0x7fff);
+	packet->dst_port = 1024 + (fr_rand() & 0x7fff);
+
+	packet->dst_ipaddr.af = AF_INET;
+	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | (fr_rand() & 0xffffff));
+
+	/*
+	 *	If everything's OK, this is a waste of memory.
+	 *	Otherwise, it lets us re-send the original packet
+	 *	contents, unmolested.
+	 */
+	packet->vps = paircopy(vps);
+
+	/*
+	 *	Prefer the Event-Timestamp in the packet, if it
+	 *	exists.  That is when the event occurred, whereas the
+	 *	"Timestamp" field is when we wrote the packet to the
+	 *	detail file, which could have been much later.
+	 */
+	vp = pairfind(packet->vps, PW_EVENT_TIMESTAMP);
+	if (vp) {
+		timestamp = vp->vp_integer;
+	}
+
+	/*
+	 *	Look for Acct-Delay-Time, and update
+	 *	based on Acct-Delay-Time += (time(NULL) - timestamp)
+	 */
+	vp = pairfind(packet->vps, PW_ACCT_DELAY_TIME);
+	if (!vp) {
+		vp = paircreate(PW_ACCT_DELAY_TIME, PW_TYPE_INTEGER);
+		rad_assert(vp != NULL);
+		pairadd(&packet->vps, vp);
+	}
+	if (timestamp != 0) {
+		vp->vp_integer += time(NULL) - timestamp;
+	}
+
+	/*
+	 *	Set the transmission count.
+	 */
+	vp = pairfind(packet->vps, PW_PACKET_TRANSMIT_COUNTER);
+	if (!vp) {
+		vp = paircreate(PW_PACKET_TRANSMIT_COUNTER, PW_TYPE_INTEGER);
+		rad_assert(vp != NULL);
+		pairadd(&packet->vps, vp);
+	}
+	vp->vp_integer = tries;
+
+	return packet;
+}
+
+
+/*
+ *	Open the detail file, if we can.
+ *
+ *	FIXME: create it, if it's not already there, so that the main
+ *	server select() will wake us up if there's anything to read.
+ */
+static int detail_open(rad_listen_t *this)
+{
+	struct stat st;
+	listen_detail_t *data = this->data;
+	char *filename = data->filename;
+
+	rad_assert(data->state == STATE_UNOPENED);
+	data->delay_time = USEC;
+
+	/*
+	 *	Open detail.work first, so we don't lose
+	 *	accounting packets.  It's probably better to
+	 *	duplicate them than to lose them.
+	 *
+	 *	Note that we're not writing to the file, but
+	 *	we've got to open it for writing in order to
+	 *	establish the lock, to prevent rlm_detail from
+	 *	writing to it.
+	 *
+	 *	This also means that if we're doing globbing,
+	 *	this file will be read && processed before the
+	 *	file globbing is done.
+	 */
+	this->fd = open(data->filename_work, O_RDWR);
+	if (this->fd < 0) {
+		DEBUG2("Polling for detail file %s", filename);
+
+		/*
+		 *	Try reading the detail file.  If it
+		 *	doesn't exist, we can't do anything.
+		 *
+		 *	Doing the stat will tell us if the file
+		 *	exists, even if we don't have permissions
+		 *	to read it.
+		 */
+		if (stat(filename, &st) < 0) {
+#ifdef HAVE_GLOB_H
+			unsigned int i;
+			int found;
+			time_t chtime;
+			glob_t files;
+
+			memset(&files, 0, sizeof(files));
+			if (glob(filename, 0, NULL, &files) != 0) {
+				globfree(&files);
+				return 0;
+			}
+
+			chtime = 0;
+			found = -1;
+			for (i = 0; i < files.gl_pathc; i++) {
+				if (stat(files.gl_pathv[i], &st) < 0) continue;
+
+				if ((i == 0) ||
+				    (st.st_ctime < chtime)) {
+					chtime = st.st_ctime;
+					found = i;
+				}
+			}
+
+			if (found < 0) {
+				globfree(&files);
+				return 0;
+			}
+
+			filename = strdup(files.gl_pathv[found]);
+			globfree(&files);
+#else
+			return 0;
+#endif
+		}
+
+		/*
+		 *	Open it BEFORE we rename it, just to
+		 *	be safe...
+		 */
+		this->fd = open(filename, O_RDWR);
+		if (this->fd < 0) {
+			radlog(L_ERR, "Detail - Failed to open %s: %s",
+			       filename, strerror(errno));
+			if (filename != data->filename) free(filename);
+			return 0;
+		}
+
+		/*
+		 *	Rename detail to detail.work
+		 */
+		DEBUG("Detail - Renaming %s -> %s", filename, data->filename_work);
+		if (rename(filename, data->filename_work) < 0) {
+			if (filename != data->filename) free(filename);
+			close(this->fd);
+			this->fd = -1;
+			return 0;
+		}
+		if (filename != data->filename) free(filename);
+	} /* else detail.work existed, and we opened it */
+
+	rad_assert(data->vps == NULL);
+	rad_assert(data->fp == NULL);
+
+	data->state = STATE_UNLOCKED;
+
+	data->client_ip.af = AF_UNSPEC;
+	data->timestamp = 0;
+	data->offset = 0;
+	data->packets = 0;
+	data->tries = 0;
+
+	return 1;
+}
+
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ *	Map the whole file.  If it's already mapped, map it again,
+ *	as rlm_detail may have appended to it.
+ */
+static int detail_map(rad_listen_t *this)
+{
+	struct stat st;
+	listen_detail_t *data = this->data;
+
+	if (fstat(this->fd, &st) < 0) return 0;
+
+	if (data->map) munmap(data->map, data->map_size);
+	data->map = NULL;
+	data->map_size = 0;
+
+	if (st.st_size == 0) return 1;
+
+	data->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, this->fd, 0);
+	if (data->map == MAP_FAILED) {
+		radlog(L_ERR, "Detail - Failed to map %s: %s",
+		       data->filename_work, strerror(errno));
+		data->map = NULL;
+		return 0;
+	}
+	data->map_size = st.st_size;
+
+#ifdef MADV_SEQUENTIAL
+	madvise(data->map, data->map_size, MADV_SEQUENTIAL);
+#endif
+
+	return 1;
+}
+
+static void detail_unmap(rad_listen_t *this)
+{
+	listen_detail_t *data = this->data;
+
+	if (data->map) munmap(data->map, data->map_size);
+	data->map = NULL;
+	data->map_size = 0;
+
+	if (this->fd >= 0) close(this->fd);
+	this->fd = -1;
+	data->state = STATE_UNOPENED;
+}
+
+/*
+ *	Read the next record from the mapped file.  Returns 1 if we
+ *	read one, or 0 if there are no more complete records.
+ *
+ *	This is the same parser as detail_recv(), but it works on
+ *	memory instead of stdio, and it skips records which have been
+ *	marked as done.
+ */
+static int detail_read_entry(rad_listen_t *listener, detail_entry_t *entry)
+{
+	int		in_header, done;
+	size_t		len;
+	off_t		line_offset;
+	const char	*p, *line, *eol, *end;
+	char		*q, *key, *op, *value;
+	VALUE_PAIR	*vp, **tail;
+	char		buffer[2048];
+	listen_detail_t *data = listener->data;
+
+ next_record:
+	entry->vps = NULL;
+	entry->client_ip.af = AF_UNSPEC;
+	entry->timestamp = 0;
+	entry->timestamp_offset = -1;
+	tail = &entry->vps;
+	in_header = TRUE;
+	done = FALSE;
+
+	p = data->map + data->offset;
+	end = data->map + data->map_size;
+
+	while (p < end) {
+		line = p;
+		eol = memchr(line, '\n', end - line);
+		if (!eol) break;	/* partial line */
+
+		len = eol - line;
+		line_offset = line - data->map;
+		p = eol + 1;
+
+		/*
+		 *	Look for the date/time header.  Anything else
+		 *	is left over from a partially read record.
+		 */
+		if (in_header) {
+			if ((len > 0) && isalpha((int) line[0])) {
+				in_header = FALSE;
+			}
+			continue;
+		}
+
+		/*
+		 *	End of the record.
+		 */
+		if (len == 0) {
+			data->offset = p - data->map;
+
+			if (done || !entry->vps) {
+				pairfree(&entry->vps);
+				goto next_record;
+			}
+
+			data->packets++;
+			return 1;
+		}
+
+		if (len >= sizeof(buffer)) {
+			DEBUG2("WARNING: Skipping long line in %s",
+			       data->filename_work);
+			continue;
+		}
+
+		memcpy(buffer, line, len);
+		buffer[len] = '\0';
+
+		/*
+		 *	Split "key op value", like sscanf("%s %s %s").
+		 */
+		q = buffer;
+		while ((*q == ' ') || (*q == '\t')) q++;
+		key = q;
+		while (*q && (*q != ' ') && (*q != '\t')) q++;
+		if (*q) *(q++) = '\0';
+		while ((*q == ' ') || (*q == '\t')) q++;
+		op = q;
+		while (*q && (*q != ' ') && (*q != '\t')) q++;
+		if (*q) *(q++) = '\0';
+		while ((*q == ' ') || (*q == '\t')) q++;
+		value = q;
+
+		if (!*key || !*value) {
+			DEBUG2("WARNING: Skipping badly formatted line in %s",
+			       data->filename_work);
+			continue;
+		}
+
+		if (!strchr(op, '=')) continue;
+
+		if (!strcasecmp(key, "Donestamp")) {
+			done = TRUE;
+			continue;
+		}
+
+		if (!strcasecmp(key, "Request-Authenticator")) continue;
+
+		if (!strcasecmp(key, "Client-IP-Address")) {
+			entry->client_ip.af = AF_INET;
+			ip_hton(value, AF_INET, &entry->client_ip);
+			continue;
+		}
+
+		if (!strcasecmp(key, "Timestamp")) {
+			entry->timestamp = atoi(value);
+			entry->timestamp_offset = line_offset;
+
+			vp = paircreate(PW_PACKET_ORIGINAL_TIMESTAMP,
+					PW_TYPE_DATE);
+			if (vp) {
+				vp->vp_date = (uint32_t) entry->timestamp;
+				*tail = vp;
+				tail = &(vp->next);
+			}
+			continue;
+		}
+
+		/*
+		 *	userparse() needs the original line.
+		 */
+		memcpy(buffer, line, len);
+		buffer[len] = '\0';
+
+		vp = NULL;
+		if ((userparse(buffer, &vp) > 0) &&
+		    (vp != NULL)) {
+			*tail = vp;
+			tail = &(vp->next);
+		}
+	}
+
+	pairfree(&entry->vps);
+
+	/*
+	 *	The writer may have added more to the file since we
+	 *	mapped it.
+	 */
+	if (p >= end) {
+		struct stat st;
+
+		if ((fstat(listener->fd, &st) == 0) &&
+		    ((size_t) st.st_size > data->map_size) &&
+		    detail_map(listener)) {
+			goto next_record;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ *	Read from the detail file, with up to "max_outstanding"
+ *	packets being processed at the same time.
+ *
+ *	data->state is:
+ *
+ *		STATE_READING	we're reading records from the file
+ *		STATE_RUNNING	we've read everything, and are
+ *				waiting for the replies.
+ *
+ *	and each entry has its own state.
+ */
+static int detail_recv_window(rad_listen_t *listener,
+			      RAD_REQUEST_FUNP *pfun, REQUEST **prequest)
+{
+	int		i, rcode = 0;
+	time_t		now;
+	RADIUS_PACKET	*packet;
+	VALUE_PAIR	*vp;
+	detail_entry_t	*entry, *this;
+	listen_detail_t *data = listener->data;
+
+	pthread_mutex_lock(&data->mutex);
+
+	switch (data->state) {
+	case STATE_UNOPENED:
+		if (!detail_open(listener)) goto done;
+
+		/* FALL-THROUGH */
 
+	case STATE_UNLOCKED:
+		/*
+		 *	See detail_recv() for why we don't block.
+		 */
+		if (rad_lockfd_nonblock(listener->fd, 0) < 0) {
+			detail_unmap(listener);
+			goto done;
+		}
 
-/*
- *	Open the detail file, if we can.
- *
- *	FIXME: create it, if it's not already there, so that the main
- *	server select() will wake us up if there's anything to read.
- */
-static int detail_open(rad_listen_t *this)
-{
-	struct stat st;
-	listen_detail_t *data = this->data;
-	char *filename = data->filename;
+		if (!detail_map(listener)) {
+			detail_unmap(listener);
+			goto done;
+		}
 
-	rad_assert(data->state == STATE_UNOPENED);
-	data->delay_time = USEC;
+		data->state = STATE_READING;
+		data->delay_time = 0;
+		break;
+
+	default:
+		break;
+	}
+
+	now = time(NULL);
 
 	/*
-	 *	Open detail.work first, so we don't lose
-	 *	accounting packets.  It's probably better to
-	 *	duplicate them than to lose them.
-	 *
-	 *	Note that we're not writing to the file, but
-	 *	we've got to open it for writing in order to
-	 *	establish the lock, to prevent rlm_detail from
-	 *	writing to it.
-	 *
-	 *	This also means that if we're doing globbing,
-	 *	this file will be read && processed before the
-	 *	file globbing is done.
+	 *	Clean up the entries which got a reply, and find one
+	 *	which needs to be sent again.
 	 */
-	this->fd = open(data->filename_work, O_RDWR);
-	if (this->fd < 0) {
-		DEBUG2("Polling for detail file %s", filename);
+	entry = NULL;
+	for (i = 0; i < data->max_outstanding; i++) {
+		this = &data->entries[i];
 
-		/*
-		 *	Try reading the detail file.  If it
-		 *	doesn't exist, we can't do anything.
-		 *
-		 *	Doing the stat will tell us if the file
-		 *	exists, even if we don't have permissions
-		 *	to read it.
-		 */
-		if (stat(filename, &st) < 0) {
-#ifdef HAVE_GLOB_H
-			unsigned int i;
-			int found;
-			time_t chtime;
-			glob_t files;
+		switch (this->state) {
+		case STATE_REPLIED:
+			pairfree(&this->vps);
+			this->state = STATE_UNOPENED;
+			data->outstanding--;
+			break;
 
-			memset(&files, 0, sizeof(files));
-			if (glob(filename, 0, NULL, &files) != 0) {
-				globfree(&files);
-				return 0;
+		case STATE_RUNNING:
+			if (now < (this->running + data->retry_interval)) {
+				break;
 			}
 
-			chtime = 0;
-			found = -1;
-			for (i = 0; i < files.gl_pathc; i++) {
-				if (stat(files.gl_pathv[i], &st) < 0) continue;
+			DEBUG("No response to detail request.  Retrying");
+			this->packet = NULL;
+			this->state = STATE_NO_REPLY;
+			if (!entry) entry = this;
+			break;
 
-				if ((i == 0) ||
-				    (st.st_ctime < chtime)) {
-					chtime = st.st_ctime;
-					found = i;
-				}
+		case STATE_NO_REPLY:
+			if (now < (this->running + data->retry_interval)) {
+				break;
 			}
+			if (!entry) entry = this;
+			break;
 
-			if (found < 0) {
-				globfree(&files);
-				return 0;
+		default:
+			break;
+		}
+	}
+
+	/*
+	 *	Nothing to retry.  Read a new record, if there's room.
+	 */
+	if (!entry && (data->state == STATE_READING) &&
+	    (data->outstanding < data->max_outstanding)) {
+		for (i = 0; i < data->max_outstanding; i++) {
+			if (data->entries[i].state == STATE_UNOPENED) {
+				entry = &data->entries[i];
+				break;
 			}
+		}
+		rad_assert(entry != NULL);
 
-			filename = strdup(files.gl_pathv[found]);
-			globfree(&files);
-#else
-			return 0;
-#endif
+		if (detail_read_entry(listener, entry)) {
+			entry->tries = 0;
+			entry->state = STATE_QUEUED;
+			data->outstanding++;
+		} else {
+			entry = NULL;
+			data->state = STATE_RUNNING;
 		}
+	}
 
+	if (!entry) {
 		/*
-		 *	Open it BEFORE we rename it, just to
-		 *	be safe...
+		 *	Everything has been read, and replied to.
+		 *
+		 *	A truncated record at the end of the file is
+		 *	treated as EOF, the same as detail_recv().
 		 */
-		this->fd = open(filename, O_RDWR);
-		if (this->fd < 0) {
-			radlog(L_ERR, "Detail - Failed to open %s: %s",
-			       filename, strerror(errno));
-			if (filename != data->filename) free(filename);
-			return 0;
+		if ((data->state == STATE_RUNNING) &&
+		    (data->outstanding == 0)) {
+			DEBUG("Detail - unlinking %s",
+			      data->filename_work);
+			unlink(data->filename_work);
+			detail_unmap(listener);
+
+			if (data->one_shot) {
+				radlog(L_INFO, "Finished reading \"one shot\" detail file - Exiting");
+				radius_signal_self(RADIUS_SIGNAL_SELF_EXIT);
+			}
 		}
+		goto done;
+	}
 
-		/*
-		 *	Rename detail to detail.work
-		 */
-		DEBUG("Detail - Renaming %s -> %s", filename, data->filename_work);
-		if (rename(filename, data->filename_work) < 0) {
-			if (filename != data->filename) free(filename);
-			close(this->fd);
-			this->fd = -1;
-			return 0;
+	entry->tries++;
+	packet = detail_packet(entry->vps, &entry->client_ip,
+			       entry->timestamp, entry->tries);
+
+	if (debug_flag) {
+		fr_printf_log("detail_recv: Read packet from %s\n", data->filename_work);
+		for (vp = packet->vps; vp; vp = vp->next) {
+			debug_pair(vp);
 		}
-		if (filename != data->filename) free(filename);
-	} /* else detail.work existed, and we opened it */
+	}
 
-	rad_assert(data->vps == NULL);
-	rad_assert(data->fp == NULL);
+	if (!received_request(listener, packet, prequest,
+			      &data->detail_client)) {
+		rad_free(&packet);
+		entry->state = STATE_NO_REPLY;	/* try again later */
+		entry->running = now;
+		goto done;
+	}
 
-	data->state = STATE_UNLOCKED;
+	entry->packet = packet;
+	entry->state = STATE_RUNNING;
+	entry->running = packet->timestamp;
 
-	data->client_ip.af = AF_UNSPEC;
-	data->timestamp = 0;
-	data->offset = 0;
-	data->packets = 0;
-	data->tries = 0;
+	/*
+	 *	Come back after "delay_time" to read the next one.
+	 */
+	data->signal = 1;
+	*pfun = rad_accounting;
+	rcode = 1;
 
-	return 1;
+ done:
+	pthread_mutex_unlock(&data->mutex);
+	return rcode;
 }
+#endif
 
 
 /*
@@ -311,6 +916,10 @@ int detail_recv(rad_listen_t *listener,
 	 */
 	if (data->signal) return 0;
 
+#ifdef HAVE_SYS_MMAN_H
+	if (data->entries) return detail_recv_window(listener, pfun, prequest);
+#endif
+
 	switch (data->state) {
 		case STATE_UNOPENED:
 	open_file:
@@ -609,117 +1218,8 @@ int detail_recv(rad_listen_t *listener,
 		return 0;
 	}
 
-	/*
-	 *	Allocate the packet.  If we fail, it's a serious
-	 *	problem.
-	 */
-	packet = rad_alloc(1);
-	if (!packet) {
-		radlog(L_ERR, "FATAL: Failed allocating memory for detail");
-		exit(1);
-	}
-
-	memset(packet, 0, sizeof(*packet));
-	packet->sockfd = -1;
-	packet->src_ipaddr.af = AF_INET;
-	packet->src_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_NONE);
-	packet->code = PW_ACCOUNTING_REQUEST;
-	packet->timestamp = time(NULL);
-
-	/*
-	 *	Remember where it came from, so that we don't
-	 *	proxy it to the place it came from...
-	 */
-	if (data->client_ip.af != AF_UNSPEC) {
-		packet->src_ipaddr = data->client_ip;
-	}
-
-	vp = pairfind(packet->vps, PW_PACKET_SRC_IP_ADDRESS);
-	if (vp) {
-		packet->src_ipaddr.af = AF_INET;
-		packet->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
-	} else {
-		vp = pairfind(packet->vps, PW_PACKET_SRC_IPV6_ADDRESS);
-		if (vp) {
-			packet->src_ipaddr.af = AF_INET6;
-			memcpy(&packet->src_ipaddr.ipaddr.ip6addr,
-			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
-		}
-	}
-
-	vp = pairfind(packet->vps, PW_PACKET_DST_IP_ADDRESS);
-	if (vp) {
-		packet->dst_ipaddr.af = AF_INET;
-		packet->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
-	} else {
-		vp = pairfind(packet->vps, PW_PACKET_DST_IPV6_ADDRESS);
-		if (vp) {
-			packet->dst_ipaddr.af = AF_INET6;
-			memcpy(&packet->dst_ipaddr.ipaddr.ip6addr,
-			       &vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
-		}
-	}
-
-	/*
-	 *	We've got to give SOME value for Id & ports, so that
-	 *	the packets can be added to the request queue.
-	 *	However, we don't want to keep track of used/unused
-	 *	id's and ports, as that's a lot of work.  This hack
-	 *	ensures that (if we have real random numbers), that
-	 *	there will be a collision on every 2^(16+15+15+24 - 1)
-	 *	packets, on average.  That means we can read 2^37
-	 *	packets before having a collision, which means it's
-	 *	effectively impossible.
-	 */
-	packet->id = fr_rand() & 0xffff;
-	packet->src_port = 1024 + (fr_rand() & 0x7fff);
-	packet->dst_port = 1024 + (fr_rand() & 0x7fff);
-
-	packet->dst_ipaddr.af = AF_INET;
-	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | (fr_rand() & 0xffffff));
-
-	/*
-	 *	If everything's OK, this is a waste of memory.
-	 *	Otherwise, it lets us re-send the original packet
-	 *	contents, unmolested.
-	 */
-	packet->vps = paircopy(data->vps);
-
-	/*
-	 *	Prefer the Event-Timestamp in the packet, if it
-	 *	exists.  That is when the event occurred, whereas the
-	 *	"Timestamp" field is when we wrote the packet to the
-	 *	detail file, which could have been much later.
-	 */
-	vp = pairfind(packet->vps, PW_EVENT_TIMESTAMP);
-	if (vp) {
-		data->timestamp = vp->vp_integer;
-	}
-
-	/*
-	 *	Look for Acct-Delay-Time, and update
-	 *	based on Acct-Delay-Time += (time(NULL) - timestamp)
-	 */
-	vp = pairfind(packet->vps, PW_ACCT_DELAY_TIME);
-	if (!vp) {
-		vp = paircreate(PW_ACCT_DELAY_TIME, PW_TYPE_INTEGER);
-		rad_assert(vp != NULL);
-		pairadd(&packet->vps, vp);
-	}
-	if (data->timestamp != 0) {
-		vp->vp_integer += time(NULL) - data->timestamp;
-	}
-
-	/*
-	 *	Set the transmission count.
-	 */
-	vp = pairfind(packet->vps, PW_PACKET_TRANSMIT_COUNTER);
-	if (!vp) {
-		vp = paircreate(PW_PACKET_TRANSMIT_COUNTER, PW_TYPE_INTEGER);
-		rad_assert(vp != NULL);
-		pairadd(&packet->vps, vp);
-	}
-	vp->vp_integer = data->tries;
+	packet = detail_packet(data->vps, &data->client_ip,
+			       data->timestamp, data->tries);
 
 	*pfun = rad_accounting;
 
@@ -765,6 +1265,21 @@ void detail_free(rad_listen_t *this)
 		fclose(data->fp);
 		data->fp = NULL;
 	}
+
+#ifdef HAVE_SYS_MMAN_H
+	if (data->entries) {
+		int i;
+
+		for (i = 0; i < data->max_outstanding; i++) {
+			pairfree(&data->entries[i].vps);
+		}
+		free(data->entries);
+		data->entries = NULL;
+
+		detail_unmap(this);
+		pthread_mutex_destroy(&data->mutex);
+	}
+#endif
 }
 
 
@@ -841,6 +1356,10 @@ static const CONF_PARSER detail_config[] = {
 	  offsetof(listen_detail_t, retry_interval), NULL, Stringify(30)},
 	{ "one_shot",   PW_TYPE_BOOLEAN,
 	  offsetof(listen_detail_t, one_shot), NULL, NULL},
+	{ "max_outstanding",   PW_TYPE_INTEGER,
+	  offsetof(listen_detail_t, max_outstanding), NULL, Stringify(1)},
+	{ "track",   PW_TYPE_BOOLEAN,
+	  offsetof(listen_detail_t, track), NULL, "no"},
 
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
@@ -887,6 +1406,33 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+	if ((data->max_outstanding < 1) || (data->max_outstanding > 65536)) {
+		cf_log_err(cf_sectiontoitem(cs), "max_outstanding must be between 1 and 65536");
+		return -1;
+	}
+
+	/*
+	 *	Use the mmap'd reader if we're allowed to have more
+	 *	than one packet outstanding, or we're tracking which
+	 *	records are done.
+	 */
+	if (!data->entries &&
+	    ((data->max_outstanding > 1) || data->track)) {
+#ifdef HAVE_SYS_MMAN_H
+		data->entries = rad_malloc(data->max_outstanding *
+					   sizeof(data->entries[0]));
+		memset(data->entries, 0,
+		       data->max_outstanding * sizeof(data->entries[0]));
+		data->outstanding = 0;
+		data->map = NULL;
+		data->map_size = 0;
+		pthread_mutex_init(&data->mutex, NULL);
+#else
+		cf_log_err(cf_sectiontoitem(cs), "max_outstanding and track are not supported on this system");
+		return -1;
+#endif
+	}
+
 	/*
 	 *	If the filename is a glob, use "detail.work" as the
 	 *	work file name.
@@ -201,143 +201,294 @@ static const FR_NAME_NUMBER modreturn_table[] = {
 };
 
 
-int radius_get_vp(REQUEST *request, const char *name, VALUE_PAIR **vp_p)
-{
-	const char *vp_name = name;
-	REQUEST *myrequest = request;
-	DICT_ATTR *da;
-	VALUE_PAIR *vps = NULL;
+/*
+ *	Which list a "list:Attribute-Name" reference points to.
+ */
+typedef enum vp_list_t {
+	VP_LIST_REQUEST = 0,
+	VP_LIST_REPLY,
+	VP_LIST_PROXY_REQUEST,
+	VP_LIST_PROXY_REPLY,
+	VP_LIST_CONTROL,
+	VP_LIST_COA,
+	VP_LIST_COA_REPLY,
+	VP_LIST_DISCONNECT,
+	VP_LIST_DISCONNECT_REPLY
+} vp_list_t;
 
-	*vp_p = NULL;
+/*
+ *	Parse the "outer." and "list:" prefixes off of an attribute
+ *	name, and return a pointer to the attribute name itself.
+ */
+static const char *radius_list_name(const char *name, int *pouter,
+				    vp_list_t *plist)
+{
+	*pouter = FALSE;
+	*plist = VP_LIST_REQUEST;
 
 	/*
 	 *	Allow for tunneled sessions.
 	 */
-	if (strncmp(vp_name, "outer.", 6) == 0) {
-		if (!myrequest->parent) return TRUE;
-		vp_name += 6;
-		myrequest = myrequest->parent;
+	if (strncmp(name, "outer.", 6) == 0) {
+		*pouter = TRUE;
+		name += 6;
 	}
 
-	if (strncmp(vp_name, "request:", 8) == 0) {
-		vp_name += 8;
-		vps = myrequest->packet->vps;
+	if (strncmp(name, "request:", 8) == 0) {
+		name += 8;
 
-	} else if (strncmp(vp_name, "reply:", 6) == 0) {
-		vp_name += 6;
-		vps = myrequest->reply->vps;
+	} else if (strncmp(name, "reply:", 6) == 0) {
+		name += 6;
+		*plist = VP_LIST_REPLY;
 
 #ifdef WITH_PROXY
-	} else if (strncmp(vp_name, "proxy-request:", 14) == 0) {
-		vp_name += 14;
-		if (request->proxy) vps = myrequest->proxy->vps;
+	} else if (strncmp(name, "proxy-request:", 14) == 0) {
+		name += 14;
+		*plist = VP_LIST_PROXY_REQUEST;
 
-	} else if (strncmp(vp_name, "proxy-reply:", 12) == 0) {
-		vp_name += 12;
-		if (request->proxy_reply) vps = myrequest->proxy_reply->vps;
+	} else if (strncmp(name, "proxy-reply:", 12) == 0) {
+		name += 12;
+		*plist = VP_LIST_PROXY_REPLY;
 #endif
 
-	} else if (strncmp(vp_name, "config:", 7) == 0) {
-		vp_name += 7;
-		vps = myrequest->config_items;
+	} else if (strncmp(name, "config:", 7) == 0) {
+		name += 7;
+		*plist = VP_LIST_CONTROL;
 
-	} else if (strncmp(vp_name, "control:", 8) == 0) {
-		vp_name += 8;
-		vps = myrequest->config_items;
+	} else if (strncmp(name, "control:", 8) == 0) {
+		name += 8;
+		*plist = VP_LIST_CONTROL;
 
 #ifdef WITH_COA
-	} else if (strncmp(vp_name, "coa:", 4) == 0) {
-		vp_name += 4;
+	} else if (strncmp(name, "coa:", 4) == 0) {
+		name += 4;
+		*plist = VP_LIST_COA;
 
-		if (myrequest->coa &&
-		    (myrequest->coa->proxy->code == PW_COA_REQUEST)) {
-			vps = myrequest->coa->proxy->vps;
-		}
+	} else if (strncmp(name, "coa-reply:", 10) == 0) {
+		name += 10;
+		*plist = VP_LIST_COA_REPLY;
 
-	} else if (strncmp(vp_name, "coa-reply:", 10) == 0) {
-		vp_name += 10;
+	} else if (strncmp(name, "disconnect:", 11) == 0) {
+		name += 11;
+		*plist = VP_LIST_DISCONNECT;
 
-		if (myrequest->coa && /* match reply with request */
-		    (myrequest->coa->proxy->code == PW_COA_REQUEST) &&
-		    (myrequest->coa->proxy_reply)) {
-			vps = myrequest->coa->proxy_reply->vps;
-		}
+	} else if (strncmp(name, "disconnect-reply:", 17) == 0) {
+		name += 17;
+		*plist = VP_LIST_DISCONNECT_REPLY;
+#endif
+	}
 
-	} else if (strncmp(vp_name, "disconnect:", 11) == 0) {
-		vp_name += 11;
+	return name;
+}
 
-		if (myrequest->coa &&
-		    (myrequest->coa->proxy->code == PW_DISCONNECT_REQUEST)) {
-			vps = myrequest->coa->proxy->vps;
+/*
+ *	Find the list in the request.  It may not exist.
+ */
+static VALUE_PAIR *radius_list_vps(REQUEST *request, int outer,
+				   vp_list_t list)
+{
+	if (outer) {
+		if (!request->parent) return NULL;
+		request = request->parent;
+	}
+
+	switch (list) {
+	default:
+	case VP_LIST_REQUEST:
+		return request->packet->vps;
+
+	case VP_LIST_REPLY:
+		return request->reply->vps;
+
+#ifdef WITH_PROXY
+	case VP_LIST_PROXY_REQUEST:
+		if (request->proxy) return request->proxy->vps;
+		break;
+
+	case VP_LIST_PROXY_REPLY:
+		if (request->proxy_reply) return request->proxy_reply->vps;
+		break;
+#endif
+
+	case VP_LIST_CONTROL:
+		return request->config_items;
+
+#ifdef WITH_COA
+	case VP_LIST_COA:
+		if (request->coa &&
+		    (request->coa->proxy->code == PW_COA_REQUEST)) {
+			return request->coa->proxy->vps;
+		}
+		break;
+
+	case VP_LIST_COA_REPLY:
+		if (request->coa && /* match reply with request */
+		    (request->coa->proxy->code == PW_COA_REQUEST) &&
+		    (request->coa->proxy_reply)) {
+			return request->coa->proxy_reply->vps;
 		}
+		break;
 
-	} else if (strncmp(vp_name, "disconnect-reply:", 17) == 0) {
-		vp_name += 17;
+	case VP_LIST_DISCONNECT:
+		if (request->coa &&
+		    (request->coa->proxy->code == PW_DISCONNECT_REQUEST)) {
+			return request->coa->proxy->vps;
+		}
+		break;
 
-		if (myrequest->coa && /* match reply with request */
-		    (myrequest->coa->proxy->code == PW_DISCONNECT_REQUEST) &&
-		    (myrequest->coa->proxy_reply)) {
-			vps = myrequest->coa->proxy_reply->vps;
+	case VP_LIST_DISCONNECT_REPLY:
+		if (request->coa && /* match reply with request */
+		    (request->coa->proxy->code == PW_DISCONNECT_REQUEST) &&
+		    (request->coa->proxy_reply)) {
+			return request->coa->proxy_reply->vps;
 		}
+		break;
 #endif
-
-	} else {
-		vps = myrequest->packet->vps;
 	}
 
+	return NULL;
+}
+
+
+int radius_get_vp(REQUEST *request, const char *name, VALUE_PAIR **vp_p)
+{
+	int outer;
+	vp_list_t list;
+	const char *vp_name;
+	DICT_ATTR *da;
+
+	*vp_p = NULL;
+
+	vp_name = radius_list_name(name, &outer, &list);
+	if (outer && !request->parent) return TRUE;
+
 	da = dict_attrbyname(vp_name);
 	if (!da) return FALSE;	/* not a dictionary name */
 
 	/*
 	 *	May not may not be found, but it *is* a known name.
 	 */
-	*vp_p = pairfind(vps, da->attr);
+	*vp_p = pairfind(radius_list_vps(request, outer, list), da->attr);
 	return TRUE;
 }
 
 
+/*
+ *	A condition, compiled when the configuration is loaded.
+ *
+ *	Each node is either one comparison, or a parenthesised group
+ *	of nodes.  Nodes at the same level are chained via "next", and
+ *	joined by "&&" or "||".  Everything which can be decided
+ *	without a request is decided here, so that evaluating the
+ *	condition at run time doesn't need to parse anything.
+ */
+struct fr_cond_t {
+	fr_cond_t	*next;
+	int		next_op;	/* '&' or '|' */
+	int		negate;
+	fr_cond_t	*child;		/* ( ... ) */
+
+	char		*text;		/* for debugging */
+	FR_TOKEN	lt, token, rt;
+	char		*left, *right;
+	int		cflags;
+
+	int		rcode;		/* left is a module return code */
+	int		outer;
+	vp_list_t	list;
+	DICT_ATTR	*da;		/* left is an attribute name */
+	DICT_ATTR	*cmp_da;	/* ... maybe with a callback */
+	VALUE_PAIR	*rvp;		/* pre-parsed right side */
+#ifdef HAVE_REGEX_H
+	regex_t		*preg;		/* pre-compiled right side */
+#endif
+};
+
+
+static void cond_free(fr_cond_t *c)
+{
+	fr_cond_t *next;
+
+	for (; c != NULL; c = next) {
+		next = c->next;
+
+		cond_free(c->child);
+		free(c->text);
+		free(c->left);
+		free(c->right);
+		pairfree(&c->rvp);
+#ifdef HAVE_REGEX_H
+		if (c->preg) {
+			regfree(c->preg);
+			free(c->preg);
+		}
+#endif
+		free(c);
+	}
+}
+
+
+#ifdef HAVE_REGEX_H
+/*
+ *	Static patterns are compiled when the condition is compiled.
+ *	Expanded ones come from the cache.
+ */
+static regex_t *cond_regex_get(const fr_cond_t *c, const char *pattern)
+{
+	regex_t *preg;
+
+	if (c->preg) return c->preg;
+
+	preg = fr_regex_get(pattern, c->cflags);
+	if (!preg) {
+		DEBUG("ERROR: Failed compiling regular expression: %s",
+		      fr_strerror());
+	}
+
+	return preg;
+}
+
+static void cond_regex_release(const fr_cond_t *c, regex_t *preg)
+{
+	if (preg != c->preg) fr_regex_release(preg);
+}
+#endif
+
+
 /*
  *	*presult is "did comparison match or not"
  */
 static int radius_do_cmp(REQUEST *request, int *presult,
-			 FR_TOKEN lt, const char *pleft, FR_TOKEN token,
-			 FR_TOKEN rt, const char *pright,
-			 int cflags, int modreturn)
+			 const fr_cond_t *c, const char *pleft,
+			 const char *pright, int modreturn)
 {
 	int result;
 	uint32_t lint, rint;
 	VALUE_PAIR *vp = NULL;
+	FR_TOKEN token = c->token;
 #ifdef HAVE_REGEX_H
 	char buffer[8192];
-#else
-	cflags = cflags;	/* -Wunused */
 #endif
 
-	rt = rt;		/* -Wunused */
-
-	if (lt == T_BARE_WORD) {
+	if (c->lt == T_BARE_WORD) {
 		/*
-		 *	Maybe check the last return code.
+		 *	Check the last return code.
 		 */
-		if (token == T_OP_CMP_TRUE) {
-			int isreturn;
-
-			/*
-			 *	Looks like a return code, treat is as such.
-			 */
-			isreturn = fr_str2int(modreturn_table, pleft, -1);
-			if (isreturn != -1) {
-				*presult = (modreturn == isreturn);
-				return TRUE;
-			}
+		if (c->rcode != -1) {
+			*presult = (modreturn == c->rcode);
+			return TRUE;
 		}
 
 		/*
 		 *	Bare words on the left can be attribute names.
 		 */
-		if (radius_get_vp(request, pleft, &vp)) {
+		if (c->da) {
 			VALUE_PAIR myvp;
 
+			vp = pairfind(radius_list_vps(request, c->outer,
+						      c->list),
+				      c->da->attr);
+
 			/*
 			 *	VP exists, and that's all we're looking for.
 			 */
@@ -347,8 +498,6 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 			}
 
 			if (!vp) {
-				DICT_ATTR *da;
-				
 				/*
 				 *	The attribute on the LHS may
 				 *	have been a dynamically
@@ -356,8 +505,8 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 				 *	doesn't exist as a VALUE_PAIR.
 				 *	If so, try looking for it.
 				 */
-				da = dict_attrbyname(pleft);
-				if (da && radius_find_compare(da->attr)) {
+				if (c->cmp_da &&
+				    radius_find_compare(c->cmp_da->attr)) {
 					VALUE_PAIR *check = pairmake(pleft, pright, token);
 					*presult = (radius_callback_compare(request, NULL, check, NULL, NULL) == 0);
 					RDEBUG3("  Callback returns %d",
@@ -386,7 +535,18 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 #endif
 
 			memcpy(&myvp, vp, sizeof(myvp));
-			if (!pairparsevalue(&myvp, pright)) {
+
+			/*
+			 *	Use the value parsed when the
+			 *	condition was compiled, if we can.
+			 */
+			if (c->rvp && (c->rvp->type == vp->type)) {
+				myvp.length = c->rvp->length;
+				myvp.lvalue = c->rvp->lvalue;
+				memcpy(&myvp.data, &c->rvp->data,
+				       sizeof(myvp.data));
+
+			} else if (!pairparsevalue(&myvp, pright)) {
 				RDEBUG2("Failed parsing \"%s\": %s",
 				       pright, fr_strerror());
 				return FALSE;
@@ -466,27 +626,19 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 #ifdef HAVE_REGEX_H
 	case T_OP_REG_EQ: {
 		int i, compare;
-		regex_t reg;
+		regex_t *preg;
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
 		
+		preg = cond_regex_get(c, pright);
+		if (!preg) return FALSE;
+
 		/*
 		 *	Include substring matches.
 		 */
-		compare = regcomp(&reg, pright, cflags);
-		if (compare != 0) {
-			if (debug_flag) {
-				char errbuf[128];
-
-				regerror(compare, &reg, errbuf, sizeof(errbuf));
-				DEBUG("ERROR: Failed compiling regular expression: %s", errbuf);
-			}
-			return FALSE;
-		}
-
-		compare = regexec(&reg, pleft,
+		compare = regexec(preg, pleft,
 				  REQUEST_MAX_REGEX + 1,
 				  rxmatch, 0);
-		regfree(&reg);
+		cond_regex_release(c, preg);
 		
 		/*
 		 *	Add new %{0}, %{1}, etc.
@@ -521,27 +673,16 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 		
 	case T_OP_REG_NE: {
 		int compare;
-		regex_t reg;
+		regex_t *preg;
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
 		
-		/*
-		 *	Include substring matches.
-		 */
-		compare = regcomp(&reg, pright, cflags);
-		if (compare != 0) {
-			if (debug_flag) {
-				char errbuf[128];
-
-				regerror(compare, &reg, errbuf, sizeof(errbuf));
-				DEBUG("ERROR: Failed compiling regular expression: %s", errbuf);
-			}
-			return FALSE;
-		}
+		preg = cond_regex_get(c, pright);
+		if (!preg) return FALSE;
 
-		compare = regexec(&reg, pleft,
+		compare = regexec(preg, pleft,
 				  REQUEST_MAX_REGEX + 1,
 				  rxmatch, 0);
-		regfree(&reg);
+		cond_regex_release(c, preg);
 		
 		result = (compare != 0);
 	}
@@ -560,24 +701,85 @@ static int radius_do_cmp(REQUEST *request, int *presult,
 }
 
 
-int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
-			      const char **ptr, int evaluate_it, int *presult)
+/*
+ *	Decide as much as we can about a comparison, before we have a
+ *	request to compare against.
+ */
+static void cond_resolve(fr_cond_t *c)
+{
+	const char *name;
+	DICT_ATTR *da;
+
+	c->rcode = -1;
+	if (c->lt != T_BARE_WORD) return;
+
+	/*
+	 *	Looks like a return code, treat is as such.
+	 */
+	if (c->token == T_OP_CMP_TRUE) {
+		c->rcode = fr_str2int(modreturn_table, c->left, -1);
+		if (c->rcode != -1) return;
+	}
+
+	name = radius_list_name(c->left, &c->outer, &c->list);
+	da = dict_attrbyname(name);
+	if (!da) return;
+
+	c->da = da;
+
+	/*
+	 *	Callbacks are only looked up by the plain name.
+	 */
+	if (name == c->left) c->cmp_da = da;
+
+	if ((c->token == T_OP_CMP_TRUE) ||
+	    (c->token == T_OP_REG_EQ) || (c->token == T_OP_REG_NE)) return;
+
+	/*
+	 *	Only static strings can be parsed now.
+	 */
+	if ((c->rt == T_BACK_QUOTED_STRING) ||
+	    ((c->rt == T_DOUBLE_QUOTED_STRING) && strchr(c->right, '%'))) {
+		return;
+	}
+
+	/*
+	 *	Don't resolve host names once, and use the answer
+	 *	forever.
+	 */
+	if (((da->type == PW_TYPE_IPADDR) ||
+	     (da->type == PW_TYPE_IPV6ADDR)) &&
+	    (c->right[strspn(c->right, "0123456789abcdefABCDEF.:")] != '\0')) {
+		return;
+	}
+
+	c->rvp = pairalloc(da);
+	if (!c->rvp) return;
+
+	/*
+	 *	If it fails, we try again at run time, which prints
+	 *	the error where someone can see it.
+	 */
+	if (!pairparsevalue(c->rvp, c->right)) {
+		pairfree(&c->rvp);
+	}
+}
+
+
+static fr_cond_t *cond_compile(const char **ptr, int depth)
 {
 	int found_condition = FALSE;
-	int result = TRUE;
 	int invert = FALSE;
-	int evaluate_next_condition = evaluate_it;
+	int cflags = 0;
 	const char *p;
 	const char *q, *start;
 	FR_TOKEN token, lt, rt;
 	char left[1024], right[1024], comp[4];
-	const char *pleft, *pright;
-	char  xleft[1024], xright[1024];
-	int cflags = 0;
+	fr_cond_t *first = NULL, *c = NULL, **last = &first;
 	
 	if (!ptr || !*ptr || (depth >= 64)) {
 		radlog(L_ERR, "Internal sanity check failed in evaluate condition");
-		return FALSE;
+		return NULL;
 	}
 
 	/*
@@ -591,14 +793,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		 *	! EXPR
 		 */
 		if (!found_condition && (*p == '!')) {
-			/*
-			 *	Don't change the results if we're not
-			 *	evaluating the condition.
-			 */
-			if (evaluate_next_condition) {
-				RDEBUG4(">>> INVERT");
-				invert = TRUE;
-			}
+			invert = TRUE;
 			p++;
 
 			while ((*p == ' ') || (*p == '\t')) p++;
@@ -610,41 +805,28 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		if (!found_condition && (*p == '(')) {
 			const char *end = p + 1;
 
-			/*
-			 *	Evaluate the condition, bailing out on
-			 *	parse error.
-			 */
-			RDEBUG4(">>> RECURSING WITH ... %s", end);
-			if (!radius_evaluate_condition(request, modreturn,
-						       depth + 1, &end,
-						       evaluate_next_condition,
-						       &result)) {
-				return FALSE;
-			}
+			c = rad_malloc(sizeof(*c));
+			memset(c, 0, sizeof(*c));
+			c->rcode = -1;
+			c->negate = invert;
+			invert = FALSE;
+			*last = c;
+			last = &c->next;
 
-			if (invert) {
-				if (evaluate_next_condition) {
-					RDEBUG2("%.*s Converting !%s -> %s",
-						depth, filler,
-						(result != FALSE) ? "TRUE" : "FALSE",
-						(result == FALSE) ? "TRUE" : "FALSE");
-					result = (result == FALSE);
-				}
-				invert = FALSE;
-			}
+			c->child = cond_compile(&end, depth + 1);
+			if (!c->child) goto error;
 
 			/*
 			 *	Start from the end of the previous
 			 *	condition
 			 */
 			p = end;
-			RDEBUG4(">>> AFTER RECURSION ... %s", end);
 
 			while ((*p == ' ') || (*p == '\t')) p++;
 
 			if (!*p) {
 				radlog(L_ERR, "No closing brace");
-				return FALSE;
+				goto error;
 			}
 
 			if (*p == ')') p++; /* eat closing brace */
@@ -654,7 +836,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		}
 
 		/*
-		 *	At EOL or closing brace, update && return.
+		 *	At EOL or closing brace, return.
 		 */
 		if (found_condition && (!*p || (*p == ')'))) break;
 
@@ -667,42 +849,18 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		 *	|| EXPR
 		 */
 		if (found_condition) {
-			/*
-			 *	(A && B) means "evaluate B
-			 *	only if A was true"
-			 */
-			if ((p[0] == '&') && (p[1] == '&')) {
-				if (!result) evaluate_next_condition = FALSE;
+			if (((p[0] == '&') && (p[1] == '&')) ||
+			    ((p[0] == '|') && (p[1] == '|'))) {
+				c->next_op = p[0];
 				p += 2;
 				found_condition = FALSE;
 				continue; /* go back to the start */
 			}
 
-			/*
-			 *	(A || B) means "evaluate B
-			 *	only if A was false"
-			 */
-			if ((p[0] == '|') && (p[1] == '|')) {
-				if (result) evaluate_next_condition = FALSE;
-				p += 2;
-				found_condition = FALSE;
-				continue;
-			}
-
-			/*
-			 *	It must be:
-			 *
-			 *	WORD
-			 *	WORD1 op WORD2
-			 */
-		}
-
-		if (found_condition) {
 			radlog(L_ERR, "Consecutive conditions at %s", p);
-			return FALSE;
+			goto error;
 		}
 
-		RDEBUG4(">>> LOOKING AT %s", p);
 		start = p;
 
 		/*
@@ -710,7 +868,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		 */
 		if ((p[0] == '%') && (p[1] == '{')) {
 			radlog(L_ERR, "Bare %%{...} is invalid in condition at: %s", p);
-			return FALSE;
+			goto error;
 		}
 
 		/*
@@ -722,16 +880,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		    (lt != T_SINGLE_QUOTED_STRING) &&
 		    (lt != T_BACK_QUOTED_STRING)) {
 			radlog(L_ERR, "Expected string or numbers at: %s", p);
-			return FALSE;
-		}
-
-		pleft = left;
-		if (evaluate_next_condition) {
-			pleft = expand_string(xleft, sizeof(xleft), request,
-					      lt, left);
-			if (!pleft) {
-				return FALSE;
-			}
+			goto error;
 		}
 
 		/*
@@ -758,14 +907,13 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		 *	||
 		 *
 		 *	Then WORD is just a test for existence.
-		 *	Remember that and skip ahead.
 		 */
 		if (!*q || (*q == ')') ||
 		    ((q[0] == '&') && (q[1] == '&')) ||
 		    ((q[0] == '|') && (q[1] == '|'))) {
 			token = T_OP_CMP_TRUE;
 			rt = T_OP_INVALID;
-			pright = NULL;
+			right[0] = '\0';
 			goto do_cmp;
 		}
 
@@ -778,7 +926,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		if ((token < T_OP_NE) || (token > T_OP_CMP_EQ) ||
 		    (token == T_OP_CMP_TRUE)) {
 			radlog(L_ERR, "Expected comparison at: %s", comp);
-			return FALSE;
+			goto error;
 		}
 		
 		/*
@@ -786,7 +934,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		 */
 		if ((p[0] == '%') && (p[1] == '{')) {
 			radlog(L_ERR, "Bare %%{...} is invalid in condition at: %s", p);
-			return FALSE;
+			goto error;
 		}
 		
 		/*
@@ -798,7 +946,7 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 			rt = getregex(&p, right, sizeof(right), &cflags);
 			if (rt != T_DOUBLE_QUOTED_STRING) {
 				radlog(L_ERR, "Expected regular expression at: %s", p);
-				return FALSE;
+				goto error;
 			}
 		} else
 #endif
@@ -809,68 +957,201 @@ int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
 		    (rt != T_SINGLE_QUOTED_STRING) &&
 		    (rt != T_BACK_QUOTED_STRING)) {
 			radlog(L_ERR, "Expected string or numbers at: %s", p);
-			return FALSE;
+			goto error;
 		}
 		
-		pright = right;
-		if (evaluate_next_condition) {
-			pright = expand_string(xright, sizeof(xright), request,
-					       rt, right);
-			if (!pright) {
-				return FALSE;
+	do_cmp:
+		c = rad_malloc(sizeof(*c));
+		memset(c, 0, sizeof(*c));
+		c->negate = invert;
+		invert = FALSE;
+		*last = c;
+		last = &c->next;
+
+		c->text = rad_malloc((p - start) + 1);
+		memcpy(c->text, start, p - start);
+		c->text[p - start] = '\0';
+
+		c->lt = lt;
+		c->token = token;
+		c->rt = rt;
+		c->left = strdup(left);
+		c->right = strdup(right);
+		c->cflags = cflags;
+		cond_resolve(c);
+
+#ifdef HAVE_REGEX_H
+		if (((token == T_OP_REG_EQ) || (token == T_OP_REG_NE)) &&
+		    !strchr(right, '%')) {
+			int rcode;
+
+			c->preg = rad_malloc(sizeof(*c->preg));
+			rcode = regcomp(c->preg, right, cflags);
+			if (rcode != 0) {
+				char buffer[256];
+
+				regerror(rcode, c->preg, buffer, sizeof(buffer));
+				free(c->preg);
+				c->preg = NULL;
+
+				radlog(L_ERR, "Invalid regular expression %s: %s",
+				       right, buffer);
+				goto error;
 			}
 		}
-		
-		RDEBUG4(">>> %d:%s %d %d:%s",
-		       lt, pleft, token, rt, pright);
-		
-	do_cmp:
-		if (evaluate_next_condition) {
-			/*
-			 *	More parse errors.
-			 */
-			if (!radius_do_cmp(request, &result, lt, pleft, token,
-					   rt, pright, cflags, modreturn)) {
+#endif
+
+		found_condition = TRUE;
+	} /* loop over the input condition */
+
+	if (!found_condition) {
+		radlog(L_ERR, "Syntax error.  Expected condition at %s", p);
+		goto error;
+	}
+
+	*ptr = p;
+	return first;
+
+ error:
+	cond_free(first);
+	return NULL;
+}
+
+
+static void cond_skip(REQUEST *request, int depth, const fr_cond_t *c)
+{
+	for (; c != NULL; c = c->next) {
+		if (c->child) {
+			cond_skip(request, depth + 1, c->child);
+			continue;
+		}
+
+		RDEBUG2("%.*s Skipping %s(%s)",
+		       depth, filler, c->negate ? "!" : "", c->text);
+	}
+}
+
+
+static int cond_eval(REQUEST *request, int modreturn, int depth,
+		     const fr_cond_t *c, int *presult)
+{
+	int result = TRUE;
+	const char *pleft, *pright;
+	char  xleft[1024], xright[1024];
+
+	while (c) {
+		if (c->child) {
+			if (!cond_eval(request, modreturn, depth + 1,
+				       c->child, &result)) {
 				return FALSE;
 			}
-			RDEBUG4(">>> Comparison returned %d", result);
 
-			if (invert) {
-				RDEBUG4(">>> INVERTING result");
+			if (c->negate) {
+				RDEBUG2("%.*s Converting !%s -> %s",
+					depth, filler,
+					(result != FALSE) ? "TRUE" : "FALSE",
+					(result == FALSE) ? "TRUE" : "FALSE");
 				result = (result == FALSE);
 			}
 
-			RDEBUG2("%.*s Evaluating %s(%.*s) -> %s",
-			       depth, filler,
-			       invert ? "!" : "", p - start, start,
-			       (result != FALSE) ? "TRUE" : "FALSE");
+		} else {
+			pleft = expand_string(xleft, sizeof(xleft), request,
+					      c->lt, c->left);
+			if (!pleft) return FALSE;
 
-			invert = FALSE;
-			RDEBUG4(">>> GOT result %d", result);
+			pright = NULL;
+			if (c->token != T_OP_CMP_TRUE) {
+				pright = expand_string(xright, sizeof(xright),
+						       request, c->rt,
+						       c->right);
+				if (!pright) return FALSE;
+			}
 
-			/*
-			 *	Not evaluating it.  We may be just
-			 *	parsing it.
-			 */
-		} else if (request) {
-			RDEBUG2("%.*s Skipping %s(%.*s)",
-			       depth, filler,
-			       invert ? "!" : "", p - start, start);
+			if (!radius_do_cmp(request, &result, c, pleft, pright,
+					   modreturn)) {
+				return FALSE;
+			}
+
+			if (c->negate) result = (result == FALSE);
+
+			RDEBUG2("%.*s Evaluating %s(%s) -> %s",
+			       depth, filler, c->negate ? "!" : "", c->text,
+			       (result != FALSE) ? "TRUE" : "FALSE");
 		}
 
-		found_condition = TRUE;
-	} /* loop over the input condition */
+		if (!c->next) break;
 
-	if (!found_condition) {
-		radlog(L_ERR, "Syntax error.  Expected condition at %s", p);
-		return FALSE;
+		/*
+		 *	(A && B) means "evaluate B only if A was true".
+		 *	(A || B) means "evaluate B only if A was false".
+		 *
+		 *	There's no precedence, so once we stop, we
+		 *	skip everything else at this level.
+		 */
+		if (((c->next_op == '&') && !result) ||
+		    ((c->next_op == '|') && result)) {
+			cond_skip(request, depth, c->next);
+			break;
+		}
+
+		c = c->next;
 	}
 
-	RDEBUG4(">>> AT EOL -> %d", result);
-	*ptr = p;
-	if (evaluate_it) *presult = result;
+	*presult = result;
 	return TRUE;
 }
+
+
+/*
+ *	Compile a condition, for evaluation later.  Returns NULL, and
+ *	logs an error, if the condition is invalid.
+ */
+fr_cond_t *radius_compile_condition(const char *condition)
+{
+	const char *p = condition;
+
+	return cond_compile(&p, 0);
+}
+
+/*
+ *	Returns FALSE on run-time error.  Otherwise, *presult is the
+ *	result of the condition.
+ */
+int radius_evaluate_compiled_condition(REQUEST *request, int modreturn,
+				       const fr_cond_t *cond, int *presult)
+{
+	if (!request || !cond) return FALSE;
+
+	return cond_eval(request, modreturn, 0, cond, presult);
+}
+
+void radius_free_condition(fr_cond_t **pcond)
+{
+	if (!pcond) return;
+
+	cond_free(*pcond);
+	*pcond = NULL;
+}
+
+/*
+ *	Parse, and maybe evaluate, a condition in one go.
+ */
+int radius_evaluate_condition(REQUEST *request, int modreturn, int depth,
+			      const char **ptr, int evaluate_it, int *presult)
+{
+	int rcode = TRUE;
+	fr_cond_t *cond;
+
+	cond = cond_compile(ptr, depth);
+	if (!cond) return FALSE;
+
+	if (evaluate_it) {
+		rcode = cond_eval(request, modreturn, depth, cond, presult);
+	}
+
+	cond_free(cond);
+	return rcode;
+}
 #endif
 
 static void fix_up(REQUEST *request)
@@ -1353,3 +1634,211 @@ int radius_update_attrlist(REQUEST *request, CONF_SECTION *cs,
 	return RLM_MODULE_UPDATED;
 }
 #endif
+
+#if defined(TESTING) && defined(WITH_UNLANG)
+/*
+ *  After building the server, in src/main:
+ *
+ *  cc -g -O2 -D_REENTRANT -DNDEBUG -DTESTING -I.. -I../.. -c evaluate.c -o evaluate_test.o && cc evaluate_test.o xlat.o util.o valuepair.o log.o exec.o conffile.o ../lib/.libs/libfreeradius-radius.a -lcrypto -lpthread -o evaluate
+ *
+ *  Leave out -DNDEBUG if the server was configured with
+ *  --enable-developer, as REQUEST is a different size.
+ *
+ *  ./evaluate [-d dictionary_dir] [-n count]
+ *
+ *  Times a 20-condition "if" / "elsif" policy against one fixed
+ *  request.  The first nineteen conditions are false, so every
+ *  condition is evaluated, as for a request which falls through
+ *  to the end of a long policy.  It prints the cost per request
+ *  of parsing each condition from the text (as was done before
+ *  conditions were compiled), and of evaluating the compiled
+ *  conditions.
+ */
+int		debug_flag = 0;
+const char	*radacct_dir = NULL;
+const char	*radius_dir = RADDBDIR;
+const char	*radlog_dir = NULL;
+struct main_config_t mainconfig;
+char		*request_log_file = NULL;
+char		*debug_log_file = NULL;
+
+#ifdef HAVE_PTHREAD_H
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+/*
+ *	exec.c wants these from threads.c.  Nothing here runs a
+ *	program, so do what a non-threaded server does.
+ */
+pid_t rad_fork(void)
+{
+	return fork();
+}
+
+pid_t rad_waitpid(pid_t pid, int *status)
+{
+	return waitpid(pid, status, 0);
+}
+#endif
+
+static const char *bench_policy[] = {
+	"User-Name == \"alice\"",
+	"User-Name == \"bob\" && NAS-Port == 1",
+	"NAS-IP-Address == 10.0.0.1",
+	"NAS-Port > 1000",
+	"Service-Type == Login-User",
+	"Calling-Station-Id == \"00-11-22-33-44-55\"",
+	"!User-Name",
+	"Called-Station-Id",
+	"User-Name =~ /^admin/",
+	"User-Name !~ /@/",
+	"NAS-Identifier == \"core-switch\" || NAS-Port-Type == Virtual",
+	"(NAS-Port < 10) && (Service-Type == Framed-User)",
+	"control:Auth-Type == Reject",
+	"reply:Reply-Message",
+	"Framed-IP-Address == 192.0.2.1",
+	"User-Name == \"%{Calling-Station-Id}\"",
+	"NAS-Port-Type == Wireless-802.11 && !Framed-Protocol",
+	"noop",
+	"\"%{bench:}\" == \"yes\"",
+	"User-Name == \"bob@example.com\" && NAS-Port == 42",
+	NULL
+};
+
+#define BENCH_CONDITIONS (sizeof(bench_policy) / sizeof(bench_policy[0]) - 1)
+
+static size_t bench_xlat(UNUSED void *instance, UNUSED REQUEST *request,
+			 UNUSED char *fmt, char *out, size_t outlen,
+			 UNUSED RADIUS_ESCAPE_STRING func)
+{
+	strlcpy(out, "no", outlen);
+	return strlen(out);
+}
+
+static REQUEST *bench_request(void)
+{
+	REQUEST *request;
+	VALUE_PAIR *vps = NULL;
+
+	request = request_alloc();
+	request->packet = rad_alloc(0);
+	request->reply = rad_alloc(0);
+	if (!request->packet || !request->reply) return NULL;
+
+	if ((userparse("User-Name = \"bob@example.com\", "
+		       "NAS-IP-Address = 192.0.2.10, "
+		       "NAS-Port = 42, "
+		       "NAS-Port-Type = Ethernet, "
+		       "Service-Type = Framed-User, "
+		       "Calling-Station-Id = \"00-aa-bb-cc-dd-ee\"",
+		       &vps) == T_OP_INVALID) || !vps) {
+		return NULL;
+	}
+	request->packet->vps = vps;
+	request->username = pairfind(vps, PW_USER_NAME);
+
+	return request;
+}
+
+static double bench_now(void)
+{
+	struct timeval when;
+
+	gettimeofday(&when, NULL);
+	return (when.tv_sec * 1000000.0) + when.tv_usec;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, n, count = 100000, result;
+	double start, parsed, compiled;
+	const char *p;
+	REQUEST *request;
+	fr_cond_t *conds[BENCH_CONDITIONS];
+
+	while ((c = getopt(argc, argv, "d:n:")) != EOF) switch(c) {
+		case 'd':
+			radius_dir = optarg;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			if (count <= 0) count = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: evaluate [-d dictionary_dir] [-n count]\n");
+			exit(1);
+	}
+
+	if (dict_init(radius_dir, RADIUS_DICTIONARY) < 0) {
+		fprintf(stderr, "evaluate: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	/*
+	 *	Also registers the built-in expansions.
+	 */
+	xlat_register("bench", bench_xlat, NULL);
+
+	request = bench_request();
+	if (!request) {
+		fprintf(stderr, "evaluate: Failed creating request: %s\n",
+			fr_strerror());
+		exit(1);
+	}
+
+	for (i = 0; i < (int) BENCH_CONDITIONS; i++) {
+		conds[i] = radius_compile_condition(bench_policy[i]);
+		if (!conds[i]) {
+			fprintf(stderr, "evaluate: Failed compiling \"%s\"\n",
+				bench_policy[i]);
+			exit(1);
+		}
+
+		/*
+		 *	Check the policy does what it says: every
+		 *	condition but the last is false.
+		 */
+		result = FALSE;
+		if (!radius_evaluate_compiled_condition(request, RLM_MODULE_OK,
+							conds[i], &result) ||
+		    (result != (i == (int) BENCH_CONDITIONS - 1))) {
+			fprintf(stderr, "evaluate: Unexpected result %d for \"%s\"\n",
+				result, bench_policy[i]);
+			exit(1);
+		}
+	}
+
+	start = bench_now();
+	for (n = 0; n < count; n++) {
+		for (i = 0; i < (int) BENCH_CONDITIONS; i++) {
+			p = bench_policy[i];
+			radius_evaluate_condition(request, RLM_MODULE_OK, 0,
+						  &p, TRUE, &result);
+			if (result) break;
+		}
+	}
+	parsed = (bench_now() - start) / count;
+
+	start = bench_now();
+	for (n = 0; n < count; n++) {
+		for (i = 0; i < (int) BENCH_CONDITIONS; i++) {
+			radius_evaluate_compiled_condition(request, RLM_MODULE_OK,
+							   conds[i], &result);
+			if (result) break;
+		}
+	}
+	compiled = (bench_now() - start) / count;
+
+	printf("%d conditions, %d requests\n", (int) BENCH_CONDITIONS, count);
+	printf("parsed:   %.3f usec/request\n", parsed);
+	printf("compiled: %.3f usec/request\n", compiled);
+
+	for (i = 0; i < (int) BENCH_CONDITIONS; i++) {
+		radius_free_condition(&conds[i]);
+	}
+	request_free(&request);
+
+	return 0;
+}
+#endif
@@ -3258,9 +3258,10 @@ void event_new_fd(rad_listen_t *this)
 		} else {
 			radlog(L_INFO, " ... adding new socket %s", buffer);
 		}
-		if (!fr_event_fd_insert(el, 0, this->fd,
+		if (!fr_event_fd_insert(el, 0, listen_event_fd(this),
 					event_socket_handler, this)) {
-			radlog(L_ERR, "Failed remembering handle for proxy socket!");
+			radlog(L_ERR, "Failed adding event handler for socket %s",
+			       buffer);
 			exit(1);
 		}
 		
@@ -3271,7 +3272,7 @@ void event_new_fd(rad_listen_t *this)
 	if (this->status == RAD_LISTEN_STATUS_CLOSED) {
 		DEBUG(" ... closing socket %s", buffer);
 		
-		fr_event_fd_delete(el, 0, this->fd);
+		fr_event_fd_delete(el, 0, listen_event_fd(this));
 		this->status = RAD_LISTEN_STATUS_FINISH;
 		
 		/*
@@ -3537,6 +3538,8 @@ int radius_event_init(CONF_SECTION *cs, int spawn_flag)
 	el = fr_event_list_create(event_status);
 	if (!el) return 0;
 
+	DEBUG2(" Using %s for the event loop", fr_event_list_poller(el));
+
 	pl = fr_packet_list_create(0);
 	if (!pl) return 0;	/* leak el */
 
@@ -3744,6 +3747,59 @@ static int proxy_hash_cb(UNUSED void *ctx, void *data)
 }
 #endif
 
+/*
+ *	Functions to call once the server has forked and started its
+ *	threads.  Modules are instantiated before that, so they can't
+ *	start their own threads in instantiate().  This is only used
+ *	from the main thread.
+ */
+typedef struct event_deferred_t {
+	fr_event_callback_t	callback;
+	void			*ctx;
+	struct event_deferred_t	*next;
+} event_deferred_t;
+
+static event_deferred_t *deferred = NULL;
+
+int radius_event_defer(fr_event_callback_t callback, void *ctx)
+{
+	event_deferred_t *this, **last;
+
+	if (!callback) return 0;
+
+	this = rad_malloc(sizeof(*this));
+	this->callback = callback;
+	this->ctx = ctx;
+	this->next = NULL;
+
+	for (last = &deferred; *last != NULL; last = &(*last)->next) {
+		/* nothing */
+	}
+	*last = this;
+
+	return 1;
+}
+
+/*
+ *	For modules which are detached before the event loop runs.
+ */
+void radius_event_undefer(void *ctx)
+{
+	event_deferred_t *this, **last;
+
+	last = &deferred;
+	while (*last != NULL) {
+		this = *last;
+		if (this->ctx != ctx) {
+			last = &this->next;
+			continue;
+		}
+
+		*last = this->next;
+		free(this);
+	}
+}
+
 void radius_event_free(void)
 {
 	/*
@@ -3770,12 +3826,32 @@ void radius_event_free(void)
 	pl = NULL;
 
 	fr_event_list_free(el);
+
+	while (deferred) {
+		event_deferred_t *next = deferred->next;
+
+		free(deferred);
+		deferred = next;
+	}
 }
 
 int radius_event_process(void)
 {
+	event_deferred_t *this;
+
 	if (!el) return 0;
 
+	/*
+	 *	Called after the fork, and again after each HUP.
+	 */
+	while (deferred) {
+		this = deferred;
+		deferred = this->next;
+
+		this->callback(this->ctx);
+		free(this);
+	}
+
 	return fr_event_loop(el);
 }
 
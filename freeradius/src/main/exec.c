@@ -66,43 +66,21 @@ static void tv_sub(struct timeval *end, struct timeval *start,
 
 
 /*
- *	Execute a program on successful authentication.
- *	Return 0 if exec_wait == 0.
- *	Return the exit code of the called program if exec_wait != 0.
- *	Return -1 on fork/other errors in the parent process.
+ *	Split a command line into argv's, and then expand each one
+ *	as appropriate.  The argv's point into mycmd and argv_buf.
+ *
+ *	Returns the number of argv's, or -1 on error.
  */
-int radius_exec_program(const char *cmd, REQUEST *request,
-			int exec_wait,
-			char *user_msg, int msg_len,
-			VALUE_PAIR *input_pairs,
-			VALUE_PAIR **output_pairs,
-			int shell_escape)
+static int exec_argv(const char *cmd, REQUEST *request, char **argv,
+		     char *mycmd, size_t mycmd_len,
+		     char *argv_buf, size_t argv_len)
 {
-	VALUE_PAIR *vp;
-	char mycmd[1024];
 	const char *from;
-	char *p, *to;
-	int pd[2];
-	pid_t pid, child_pid;
+	char *to;
 	int argc = -1;
-	int comma = 0;
-	int status;
-	int i;
-	int n, left, done;
-	char *argv[MAX_ARGV];
-	char answer[4096];
-	char argv_buf[4096];
-#define MAX_ENVP 1024
-	char *envp[MAX_ENVP];
-	struct timeval start;
-#ifdef O_NONBLOCK
-	int nonblock = TRUE;
-#endif
-
-	if (user_msg) *user_msg = '\0';
-	if (output_pairs) *output_pairs = NULL;
+	int i, left;
 
-	if (strlen(cmd) > (sizeof(mycmd) - 1)) {
+	if (strlen(cmd) > (mycmd_len - 1)) {
 		radlog(L_ERR|L_CONS, "Command line is too long");
 		return -1;
 	}
@@ -115,7 +93,7 @@ int radius_exec_program(const char *cmd, REQUEST *request,
 		return -1;
 	}
 
-	strlcpy(mycmd, cmd, sizeof(mycmd));
+	strlcpy(mycmd, cmd, mycmd_len);
 
 	/*
 	 *	Split the string into argv's BEFORE doing radius_xlat...
@@ -143,7 +121,7 @@ int radius_exec_program(const char *cmd, REQUEST *request,
 		 *	Copy the argv over to our buffer.
 		 */
 		while (*from && (*from != ' ') && (*from != '\t')) {
-			if (to >= mycmd + sizeof(mycmd) - 1) {
+			if (to >= mycmd + mycmd_len - 1) {
 				return -1; /* ran out of space */
 			}
 
@@ -199,7 +177,7 @@ int radius_exec_program(const char *cmd, REQUEST *request,
 	 *	Expand each string, as appropriate.
 	 */
 	to = argv_buf;
-	left = sizeof(argv_buf);
+	left = argv_len;
 	for (i = 0; i < argc; i++) {
 		int sublen;
 
@@ -234,6 +212,117 @@ int radius_exec_program(const char *cmd, REQUEST *request,
 	}
 	argv[argc] = NULL;
 
+	return argc;
+}
+
+/*
+ *	Parse the output of a program: either a plain-text message,
+ *	or a list of VALUE_PAIRs.
+ */
+static void exec_parse_answer(const char *cmd, char *answer,
+			      char *user_msg, int msg_len,
+			      VALUE_PAIR **output_pairs)
+{
+	int n;
+	int comma = 0;
+	char *p;
+	VALUE_PAIR *vp;
+
+	n = T_OP_INVALID;
+	if (output_pairs) {
+		/*
+		 *	For backwards compatibility, first check
+		 *	for plain text (user_msg).
+		 */
+		vp = NULL;
+		n = userparse(answer, &vp);
+		if (vp) {
+			pairfree(&vp);
+		}
+	}
+
+	if (n == T_OP_INVALID) {
+		DEBUG("Exec-Program-Wait: plaintext: %s", answer);
+		if (user_msg) {
+			strlcpy(user_msg, answer, msg_len);
+		}
+	} else {
+		/*
+		 *	HACK: Replace '\n' with ',' so that
+		 *	userparse() can parse the buffer in
+		 *	one go (the proper way would be to
+		 *	fix userparse(), but oh well).
+		 */
+		for (p = answer; *p; p++) {
+			if (*p == '\n') {
+				*p = comma ? ' ' : ',';
+				p++;
+				comma = 0;
+			}
+			if (*p == ',') comma++;
+		}
+
+		/*
+		 *	Replace any trailing comma by a NUL.
+		 */
+		if (answer[strlen(answer) - 1] == ',') {
+			answer[strlen(answer) - 1] = '\0';
+		}
+
+		radlog(L_DBG,"Exec-Program-Wait: value-pairs: %s", answer);
+		if (userparse(answer, &vp) == T_OP_INVALID) {
+			radlog(L_ERR, "Exec-Program-Wait: %s: unparsable reply", cmd);
+
+		} else {
+			/*
+			 *	Tell the caller about the value
+			 *	pairs.
+			 */
+			*output_pairs = vp;
+		}
+	} /* else the answer was a set of VP's, not a text message */
+}
+
+
+/*
+ *	Execute a program on successful authentication.
+ *	Return 0 if exec_wait == 0.
+ *	Return the exit code of the called program if exec_wait != 0.
+ *	Return -1 on fork/other errors in the parent process.
+ */
+int radius_exec_program(const char *cmd, REQUEST *request,
+			int exec_wait,
+			char *user_msg, int msg_len,
+			VALUE_PAIR *input_pairs,
+			VALUE_PAIR **output_pairs,
+			int shell_escape)
+{
+	VALUE_PAIR *vp;
+	char mycmd[1024];
+	char *p;
+	int pd[2];
+	pid_t pid, child_pid;
+	int argc = -1;
+	int status;
+	int i;
+	int n, left, done;
+	char *argv[MAX_ARGV];
+	char answer[4096];
+	char argv_buf[4096];
+#define MAX_ENVP 1024
+	char *envp[MAX_ENVP];
+	struct timeval start;
+#ifdef O_NONBLOCK
+	int nonblock = TRUE;
+#endif
+
+	if (user_msg) *user_msg = '\0';
+	if (output_pairs) *output_pairs = NULL;
+
+	argc = exec_argv(cmd, request, argv, mycmd, sizeof(mycmd),
+			 argv_buf, sizeof(argv_buf));
+	if (argc < 0) return -1;
+
 #ifndef __MINGW32__
 	/*
 	 *	Open a pipe for child/parent communication, if necessary.
@@ -537,61 +626,7 @@ int radius_exec_program(const char *cmd, REQUEST *request,
 	/*
 	 *	Parse the output, if any.
 	 */
-	if (done) {
-		n = T_OP_INVALID;
-		if (output_pairs) {
-			/*
-			 *	For backwards compatibility, first check
-			 *	for plain text (user_msg).
-			 */
-			vp = NULL;
-			n = userparse(answer, &vp);
-			if (vp) {
-				pairfree(&vp);
-			}
-		}
-
-		if (n == T_OP_INVALID) {
-			DEBUG("Exec-Program-Wait: plaintext: %s", answer);
-			if (user_msg) {
-				strlcpy(user_msg, answer, msg_len);
-			}
-		} else {
-			/*
-			 *	HACK: Replace '\n' with ',' so that
-			 *	userparse() can parse the buffer in
-			 *	one go (the proper way would be to
-			 *	fix userparse(), but oh well).
-			 */
-			for (p = answer; *p; p++) {
-				if (*p == '\n') {
-					*p = comma ? ' ' : ',';
-					p++;
-					comma = 0;
-				}
-				if (*p == ',') comma++;
-			}
-
-			/*
-			 *	Replace any trailing comma by a NUL.
-			 */
-			if (answer[strlen(answer) - 1] == ',') {
-				answer[strlen(answer) - 1] = '\0';
-			}
-
-			radlog(L_DBG,"Exec-Program-Wait: value-pairs: %s", answer);
-			if (userparse(answer, &vp) == T_OP_INVALID) {
-				radlog(L_ERR, "Exec-Program-Wait: %s: unparsable reply", cmd);
-
-			} else {
-				/*
-				 *	Tell the caller about the value
-				 *	pairs.
-				 */
-				*output_pairs = vp;
-			}
-		} /* else the answer was a set of VP's, not a text message */
-	} /* else we didn't read anything from the child */
+	if (done) exec_parse_answer(cmd, answer, user_msg, msg_len, output_pairs);
 
 	/*
 	 *	Call rad_waitpid (should map to waitpid on non-threaded
@@ -660,3 +695,645 @@ int radius_exec_program(const char *cmd, REQUEST *request,
 	return 0;
 #endif
 }
+
+
+#ifndef __MINGW32__
+#ifndef HAVE_PTHREAD_H
+/*
+ *	This is easier than ifdef's throughout the code.  Without
+ *	threads, there is only ever one caller, so a helper is
+ *	always free.
+ */
+#define pthread_mutex_init(_x, _y)
+#define pthread_mutex_destroy(_x)
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_unlock(_x)
+#define pthread_cond_init(_x, _y)
+#define pthread_cond_destroy(_x)
+#define pthread_cond_signal(_x)
+#define pthread_cond_timedwait(_x, _y, _z) (ETIMEDOUT)
+#endif
+
+/*
+ *	A pool of helpers.  A helper is a program which is started
+ *	once, and then answers requests for as long as it runs.
+ *
+ *	Each request is written to the helper's stdin as a set of
+ *	lines, followed by a line containing only ".".  The helper
+ *	writes its answer to stdout, as a set of lines, followed by
+ *	a line containing only ".".  The final line may instead
+ *	contain ". <n>", in which case <n> is used as the exit code.
+ *	Lines of the answer MUST NOT start with ".".
+ *
+ *	For radius_exec_pool(), each line of the request is one
+ *	attribute, "Name = value", and the answer is the same as the
+ *	output of a program run via radius_exec_program().
+ *
+ *	Helpers are started when they are first needed, and are
+ *	re-started if they exit, or if they take too long to answer.
+ *	If a health check is set, a helper which has been idle for a
+ *	while is sent the check request before it is used, and is
+ *	re-started if it doesn't answer.
+ */
+typedef struct exec_helper_t {
+	pid_t		pid;
+	int		to_child;
+	int		from_child;
+	int		busy;
+	time_t		last_used;
+} exec_helper_t;
+
+struct exec_pool_t {
+	char		*name;
+	char		*argv[MAX_ARGV];
+	int		timeout;
+	int		num_helpers;
+	exec_helper_t	*helpers;
+
+	char		*check;
+	size_t		check_len;
+	int		check_interval;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;		/* a helper is free */
+#endif
+
+	uint64_t	requests;
+	uint64_t	waits;
+	uint64_t	failed;
+	uint64_t	started;
+	uint64_t	check_failed;
+};
+
+
+static void helper_stop(exec_pool_t *pool, exec_helper_t *h)
+{
+	int status;
+
+	if (h->pid <= 0) return;
+
+	/*
+	 *	Closing stdin is enough for most helpers, but
+	 *	we may also be stopping one which is stuck.
+	 */
+	close(h->to_child);
+	close(h->from_child);
+	kill(h->pid, SIGTERM);
+
+	if (rad_waitpid(h->pid, &status) != h->pid) {
+		radlog(L_ERR, "Exec-Pool %s: Helper PID %u did not exit",
+		       pool->name, (unsigned int) h->pid);
+	}
+
+	h->pid = 0;
+	h->to_child = h->from_child = -1;
+}
+
+
+static int helper_start(exec_pool_t *pool, exec_helper_t *h)
+{
+	int to[2], from[2];
+	int flags;
+	pid_t pid;
+	char *envp[1];
+
+	if (pipe(to) != 0) {
+		radlog(L_ERR, "Exec-Pool %s: Couldn't open pipe: %s",
+		       pool->name, strerror(errno));
+		return -1;
+	}
+
+	if (pipe(from) != 0) {
+		radlog(L_ERR, "Exec-Pool %s: Couldn't open pipe: %s",
+		       pool->name, strerror(errno));
+		close(to[0]);
+		close(to[1]);
+		return -1;
+	}
+
+	envp[0] = NULL;
+
+	pid = rad_fork();
+	if (pid == 0) {
+		int devnull;
+
+		/*
+		 *	Child process.  As with radius_exec_program(),
+		 *	anything going wrong means we exit with status 1.
+		 */
+		if ((dup2(to[0], STDIN_FILENO) != STDIN_FILENO) ||
+		    (dup2(from[1], STDOUT_FILENO) != STDOUT_FILENO)) {
+			exit(1);
+		}
+
+		if (debug_flag == 0) {
+			devnull = open("/dev/null", O_RDWR);
+			if (devnull < 0) exit(1);
+			dup2(devnull, STDERR_FILENO);
+			close(devnull);
+		}
+
+		closefrom(3);
+
+		execve(pool->argv[0], pool->argv, envp);
+		radlog(L_ERR, "Exec-Pool %s: FAILED to execute %s: %s",
+		       pool->name, pool->argv[0], strerror(errno));
+		exit(1);
+	}
+
+	close(to[0]);
+	close(from[1]);
+
+	if (pid < 0) {
+		radlog(L_ERR, "Exec-Pool %s: Couldn't fork %s: %s",
+		       pool->name, pool->argv[0], strerror(errno));
+		close(to[1]);
+		close(from[0]);
+		return -1;
+	}
+
+	/*
+	 *	Other programs we run shouldn't get these, and we
+	 *	read the answers via select().
+	 */
+	fcntl(to[1], F_SETFD, FD_CLOEXEC);
+	fcntl(from[0], F_SETFD, FD_CLOEXEC);
+	flags = fcntl(from[0], F_GETFL, NULL);
+	if (flags >= 0) fcntl(from[0], F_SETFL, flags | O_NONBLOCK);
+
+	h->pid = pid;
+	h->to_child = to[1];
+	h->from_child = from[0];
+	h->last_used = time(NULL);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->started++;
+	pthread_mutex_unlock(&pool->mutex);
+
+	DEBUG2("Exec-Pool %s: Started helper PID %u",
+	       pool->name, (unsigned int) pid);
+
+	return 0;
+}
+
+
+/*
+ *	Send one request to a helper, and read the answer.
+ *
+ *	Returns 1 on success, 0 if the helper had exited before it
+ *	read the request, and -1 on all other errors.
+ */
+static int helper_io(exec_pool_t *pool, exec_helper_t *h,
+		     const char *msg, size_t msglen,
+		     char *answer, size_t answerlen, int *code)
+{
+	size_t done, line;
+	ssize_t rcode;
+	struct timeval start;
+
+	done = 0;
+	while (done < msglen) {
+		rcode = write(h->to_child, msg + done, msglen - done);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EPIPE) && (done == 0)) return 0;
+
+			radlog(L_ERR, "Exec-Pool %s: Failed writing to helper PID %u: %s",
+			       pool->name, (unsigned int) h->pid,
+			       strerror(errno));
+			return -1;
+		}
+		done += rcode;
+	}
+
+	done = line = 0;
+	gettimeofday(&start, NULL);
+	while (1) {
+		fd_set fds;
+		struct timeval when, elapsed, wake;
+
+		FD_ZERO(&fds);
+		FD_SET(h->from_child, &fds);
+
+		gettimeofday(&when, NULL);
+		tv_sub(&when, &start, &elapsed);
+		if (elapsed.tv_sec >= pool->timeout) goto too_long;
+
+		when.tv_sec = pool->timeout;
+		when.tv_usec = 0;
+		tv_sub(&when, &elapsed, &wake);
+
+		rcode = select(h->from_child + 1, &fds, NULL, NULL, &wake);
+		if (rcode == 0) {
+		too_long:
+			radlog(L_ERR, "Exec-Pool %s: Helper PID %u is taking too much time: forcing failure and restarting it.",
+			       pool->name, (unsigned int) h->pid);
+			return -1;
+		}
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		rcode = read(h->from_child, answer + done,
+			     answerlen - 1 - done);
+		if (rcode == 0) {
+			/*
+			 *	It exited after reading the request.
+			 *	Don't give the request to another
+			 *	helper, as it may be what caused the
+			 *	exit.
+			 */
+			radlog(L_ERR, "Exec-Pool %s: Helper PID %u exited without answering",
+			       pool->name, (unsigned int) h->pid);
+			return -1;
+		}
+		if (rcode < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN)) continue;
+			return -1;
+		}
+		done += rcode;
+
+		/*
+		 *	Look for the final "." line.
+		 */
+		while (line < done) {
+			char *eol;
+
+			eol = memchr(answer + line, '\n', done - line);
+			if (!eol) break;
+
+			if (answer[line] != '.') {
+				line = (eol - answer) + 1;
+				continue;
+			}
+
+			if ((size_t) (eol - answer) + 1 != done) {
+				radlog(L_ERR, "Exec-Pool %s: Helper PID %u sent data after the end of its answer",
+				       pool->name, (unsigned int) h->pid);
+				return -1;
+			}
+
+			*eol = '\0';
+			*code = atoi(answer + line + 1);
+			answer[line] = '\0';
+			return 1;
+		}
+
+		if (done >= answerlen - 1) {
+			radlog(L_ERR, "Exec-Pool %s: Answer from helper PID %u is too long",
+			       pool->name, (unsigned int) h->pid);
+			return -1;
+		}
+	}
+}
+
+
+/*
+ *	Returns 1 if the helper is OK to use, and 0 if it should be
+ *	re-started.
+ */
+static int helper_check(exec_pool_t *pool, exec_helper_t *h)
+{
+	int code;
+	char answer[1024];
+
+	if (!pool->check ||
+	    (time(NULL) < (h->last_used + pool->check_interval))) {
+		return 1;
+	}
+
+	if (helper_io(pool, h, pool->check, pool->check_len,
+		      answer, sizeof(answer), &code) > 0) {
+		return 1;
+	}
+
+	radlog(L_ERR, "Exec-Pool %s: Helper PID %u failed its health check: restarting it",
+	       pool->name, (unsigned int) h->pid);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->check_failed++;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 0;
+}
+
+
+static exec_helper_t *helper_get(exec_pool_t *pool)
+{
+	int i;
+	exec_helper_t *h;
+	struct timeval now;
+	struct timespec when;
+
+	gettimeofday(&now, NULL);
+	when.tv_sec = now.tv_sec + pool->timeout;
+	when.tv_nsec = now.tv_usec * 1000;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->requests++;
+
+	while (1) {
+		h = NULL;
+
+		/*
+		 *	Prefer helpers which are already running.
+		 */
+		for (i = 0; i < pool->num_helpers; i++) {
+			if (pool->helpers[i].busy) continue;
+
+			if (!h) h = &pool->helpers[i];
+			if (pool->helpers[i].pid > 0) {
+				h = &pool->helpers[i];
+				break;
+			}
+		}
+		if (h) break;
+
+		pool->waits++;
+		if (pthread_cond_timedwait(&pool->cond, &pool->mutex,
+					   &when) == ETIMEDOUT) {
+			pool->failed++;
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+	}
+
+	h->busy = 1;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return h;
+}
+
+
+static void helper_put(exec_pool_t *pool, exec_helper_t *h, int failed)
+{
+	pthread_mutex_lock(&pool->mutex);
+	h->busy = 0;
+	if (failed) pool->failed++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/*
+ *	Send a request to a helper, and wait for the answer.  The
+ *	request should end with ".\n".  The final "." line is removed
+ *	from the answer.
+ *
+ *	Returns the exit code given by the helper, or -1 on error.
+ */
+int exec_pool_send(exec_pool_t *pool, const char *msg, size_t msglen,
+		   char *answer, size_t answerlen)
+{
+	int tries, rcode, code;
+	exec_helper_t *h;
+
+	h = helper_get(pool);
+	if (!h) {
+		radlog(L_ERR, "Exec-Pool %s: No helper was free after %d seconds",
+		       pool->name, pool->timeout);
+		return -1;
+	}
+
+	code = 0;
+	rcode = -1;
+	for (tries = 0; tries < 2; tries++) {
+		if ((h->pid > 0) && !helper_check(pool, h)) {
+			helper_stop(pool, h);
+		}
+
+		if ((h->pid <= 0) && (helper_start(pool, h) < 0)) break;
+
+		rcode = helper_io(pool, h, msg, msglen,
+				  answer, answerlen, &code);
+		if (rcode > 0) {
+			h->last_used = time(NULL);
+			break;
+		}
+
+		helper_stop(pool, h);
+
+		/*
+		 *	If the helper had exited while it was idle,
+		 *	start a new one, and try again.
+		 */
+		if (rcode < 0) break;
+		rcode = -1;
+	}
+
+	helper_put(pool, h, (rcode < 0));
+	if (rcode < 0) return -1;
+
+	return code;
+}
+
+
+/*
+ *	Like radius_exec_program(), with exec_wait set, but using a
+ *	helper from the pool instead of running a new program.
+ */
+int radius_exec_pool(exec_pool_t *pool, REQUEST *request,
+		     char *user_msg, int msg_len,
+		     VALUE_PAIR *input_pairs,
+		     VALUE_PAIR **output_pairs)
+{
+	int code;
+	size_t len;
+	VALUE_PAIR *vp;
+	char msg[8192];
+	char answer[4096];
+
+	if (user_msg) *user_msg = '\0';
+	if (output_pairs) *output_pairs = NULL;
+
+	len = 0;
+	for (vp = input_pairs; vp != NULL; vp = vp->next) {
+		size_t vplen;
+
+		vplen = vp_prints(msg + len, sizeof(msg) - len - 2, vp);
+		if ((len + vplen) >= (sizeof(msg) - 3)) break;
+
+		len += vplen;
+		msg[len++] = '\n';
+	}
+	msg[len++] = '.';
+	msg[len++] = '\n';
+
+	code = exec_pool_send(pool, msg, len, answer, sizeof(answer));
+	if (code < 0) return -1;
+
+	if (request) RDEBUG2("Exec-Pool %s output: %s", pool->name, answer);
+
+	if (answer[0]) exec_parse_answer(pool->argv[0], answer,
+					 user_msg, msg_len, output_pairs);
+
+	return code;
+}
+
+
+/*
+ *	Create a pool of helpers which run "cmd".  The command line
+ *	cannot contain run-time expansions, as it is run before there
+ *	is a request.
+ */
+exec_pool_t *exec_pool_create(const char *name, const char *cmd,
+			      int num_helpers, int timeout)
+{
+	int i, argc;
+	exec_pool_t *pool;
+	char *argv[MAX_ARGV];
+	char mycmd[1024];
+	char argv_buf[4096];
+
+	argc = exec_argv(cmd, NULL, argv, mycmd, sizeof(mycmd),
+			 argv_buf, sizeof(argv_buf));
+	if (argc <= 0) return NULL;
+
+	if (access(argv[0], X_OK) < 0) {
+		radlog(L_ERR, "Exec-Pool %s: Cannot execute %s: %s",
+		       name, argv[0], strerror(errno));
+		return NULL;
+	}
+
+	if (num_helpers < 1) num_helpers = 1;
+	if (num_helpers > 256) num_helpers = 256;
+	if (timeout < 1) timeout = 1;
+
+	pool = rad_malloc(sizeof(*pool));
+	memset(pool, 0, sizeof(*pool));
+
+	pool->name = strdup(name);
+	for (i = 0; i < argc; i++) {
+		pool->argv[i] = strdup(argv[i]);
+	}
+	pool->argv[argc] = NULL;
+	pool->timeout = timeout;
+	pool->num_helpers = num_helpers;
+
+	pool->helpers = rad_malloc(num_helpers * sizeof(pool->helpers[0]));
+	memset(pool->helpers, 0, num_helpers * sizeof(pool->helpers[0]));
+	for (i = 0; i < num_helpers; i++) {
+		pool->helpers[i].to_child = -1;
+		pool->helpers[i].from_child = -1;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	return pool;
+}
+
+
+/*
+ *	Set the request used to check that idle helpers are still
+ *	working.  It should end with ".\n", and the answer is ignored.
+ */
+void exec_pool_check(exec_pool_t *pool, const char *msg, int interval)
+{
+	free(pool->check);
+	pool->check = strdup(msg);
+	pool->check_len = strlen(msg);
+	pool->check_interval = interval;
+}
+
+
+void exec_pool_free(exec_pool_t *pool)
+{
+	int i;
+
+	if (!pool) return;
+
+	for (i = 0; i < pool->num_helpers; i++) {
+		helper_stop(pool, &pool->helpers[i]);
+	}
+
+	for (i = 0; pool->argv[i] != NULL; i++) {
+		free(pool->argv[i]);
+	}
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->cond);
+
+	free(pool->check);
+	free(pool->helpers);
+	free(pool->name);
+	free(pool);
+}
+
+
+size_t exec_pool_stats(exec_pool_t *pool, char *out, size_t outlen)
+{
+	int i, running, busy;
+	uint64_t requests, waits, failed, started, check_failed;
+
+	running = busy = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (i = 0; i < pool->num_helpers; i++) {
+		if (pool->helpers[i].pid > 0) running++;
+		if (pool->helpers[i].busy) busy++;
+	}
+	requests = pool->requests;
+	waits = pool->waits;
+	failed = pool->failed;
+	started = pool->started;
+	check_failed = pool->check_failed;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return snprintf(out, outlen,
+			"requests\t%llu\n"
+			"waits\t\t%llu\n"
+			"failed\t\t%llu\n"
+			"started\t\t%llu\n"
+			"check_failed\t%llu\n"
+			"running\t\t%d\n"
+			"busy\t\t%d\n",
+			(unsigned long long) requests,
+			(unsigned long long) waits,
+			(unsigned long long) failed,
+			(unsigned long long) started,
+			(unsigned long long) check_failed,
+			running, busy);
+}
+
+#else  /* __MINGW32__ */
+
+exec_pool_t *exec_pool_create(const char *name, UNUSED const char *cmd,
+			      UNUSED int num_helpers, UNUSED int timeout)
+{
+	radlog(L_ERR, "Exec-Pool %s: Helper pools are not supported",
+	       name);
+	return NULL;
+}
+
+void exec_pool_check(UNUSED exec_pool_t *pool, UNUSED const char *msg,
+		     UNUSED int interval)
+{
+}
+
+void exec_pool_free(UNUSED exec_pool_t *pool)
+{
+}
+
+int exec_pool_send(UNUSED exec_pool_t *pool, UNUSED const char *msg,
+		   UNUSED size_t msglen,
+		   UNUSED char *answer, UNUSED size_t answerlen)
+{
+	return -1;
+}
+
+int radius_exec_pool(UNUSED exec_pool_t *pool, UNUSED REQUEST *request,
+		     UNUSED char *user_msg, UNUSED int msg_len,
+		     UNUSED VALUE_PAIR *input_pairs,
+		     UNUSED VALUE_PAIR **output_pairs)
+{
+	return -1;
+}
+
+size_t exec_pool_stats(UNUSED exec_pool_t *pool, char *out, size_t outlen)
+{
+	return snprintf(out, outlen, "unsupported\n");
+}
+#endif
@@ -49,6 +49,10 @@ RCSID("$Id$")
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+#define WITH_RECEIVE_THREADS (1)
+#endif
+
 
 /*
  *	We'll use this below.
@@ -66,6 +70,37 @@ typedef struct rad_listen_master_t {
 	rad_listen_decode_t	decode;
 } rad_listen_master_t;
 
+#ifdef WITH_RECEIVE_THREADS
+/*
+ *	A queue of packets between two threads.  The reader is woken
+ *	up through a pipe, which is written to only when the reader
+ *	isn't already awake.
+ */
+typedef struct listen_mailbox_t {
+	int			notify[2];
+	int			notified; /* updated atomically */
+	fr_atomic_queue_t	*queue;
+} listen_mailbox_t;
+
+/*
+ *	A receive thread reads packets from one socket, and does the
+ *	basic sanity checks on them.  The packets are then handed to
+ *	the main thread through the "in" mailbox.  Only the main
+ *	thread looks up clients, or touches the request hash.
+ *
+ *	Replies go the other way, through the "out" mailbox, so that
+ *	the receive thread can send many of them at once.
+ */
+typedef struct listen_rx_t {
+	pthread_t		pthread_id;
+	listen_mailbox_t	in;
+	listen_mailbox_t	out;
+	fr_event_list_t		*el;
+} listen_rx_t;
+
+#define RX_QUEUE_SIZE (4096)
+#endif
+
 typedef struct listen_socket_t {
 	/*
 	 *	For normal sockets.
@@ -74,6 +109,11 @@ typedef struct listen_socket_t {
 	int		port;
 	const char		*interface;
 	RADCLIENT_LIST	*clients;
+
+#ifdef WITH_RECEIVE_THREADS
+	int		receive_threads;
+	listen_rx_t	*rx;
+#endif
 } listen_socket_t;
 
 static rad_listen_t *listen_alloc(RAD_LISTEN_TYPE type);
@@ -577,6 +617,39 @@ static int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		sock->interface = value;
 	}
 
+#ifdef WITH_RECEIVE_THREADS
+	rcode = cf_item_parse(cs, "receive_threads", PW_TYPE_INTEGER,
+			      &sock->receive_threads, "0");
+	if (rcode < 0) return -1;
+
+	if (sock->receive_threads != 0) {
+		if ((this->type != RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+		    && (this->type != RAD_LISTEN_ACCT)
+#endif
+			) {
+			cf_log_err(cf_sectiontoitem(cs),
+				   "\"receive_threads\" can only be used with \"auth\" and \"acct\" sockets");
+			return -1;
+		}
+
+		if ((sock->receive_threads < 0) ||
+		    (sock->receive_threads > 64)) {
+			cf_log_err(cf_sectiontoitem(cs),
+				   "Invalid value for \"receive_threads\"");
+			return -1;
+		}
+
+#ifndef SO_REUSEPORT
+		if (sock->receive_threads > 1) {
+			cf_log_err(cf_sectiontoitem(cs),
+				   "\"receive_threads\" greater than 1 needs SO_REUSEPORT, which this system does not support");
+			return -1;
+		}
+#endif
+	}
+#endif
+
 	/*
 	 *	And bind it to the port.
 	 */
@@ -787,6 +860,41 @@ static int stats_socket_recv(rad_listen_t *listener,
  *	It takes packets, not requests.  It sees if the packet looks
  *	OK.  If so, it does a number of sanity checks on it.
   */
+/*
+ *	Some sanity checks, based on the packet code.  Returns the
+ *	function which handles the packet, or NULL if it should be
+ *	discarded.
+ */
+static RAD_REQUEST_FUNP auth_socket_fun(rad_listen_t *listener,
+					RADCLIENT *client,
+					int code, int src_port)
+{
+	switch(code) {
+	case PW_AUTHENTICATION_REQUEST:
+		RAD_STATS_CLIENT_INC(listener, client, total_requests);
+		return rad_authenticate;
+
+	case PW_STATUS_SERVER:
+		if (!mainconfig.status_server) {
+			RAD_STATS_TYPE_INC(listener, total_packets_dropped);
+			RAD_STATS_CLIENT_INC(listener, client, total_packets_dropped);
+			DEBUG("WARNING: Ignoring Status-Server request due to security configuration");
+			return NULL;
+		}
+		return rad_status_server;
+
+	default:
+		RAD_STATS_INC(radius_auth_stats.total_unknown_types);
+		RAD_STATS_CLIENT_INC(listener, client, total_unknown_types);
+
+		DEBUG("Invalid packet code %d sent to authentication port from client %s port %d : IGNORED",
+		      code, client->shortname, src_port);
+		break;
+	} /* switch over packet types */
+
+	return NULL;
+}
+
 static int auth_socket_recv(rad_listen_t *listener,
 			    RAD_REQUEST_FUNP *pfun, REQUEST **prequest)
 {
@@ -814,36 +922,11 @@ static int auth_socket_recv(rad_listen_t *listener,
 		return 0;
 	}
 
-	/*
-	 *	Some sanity checks, based on the packet code.
-	 */
-	switch(code) {
-	case PW_AUTHENTICATION_REQUEST:
-		RAD_STATS_CLIENT_INC(listener, client, total_requests);
-		fun = rad_authenticate;
-		break;
-
-	case PW_STATUS_SERVER:
-		if (!mainconfig.status_server) {
-			rad_recv_discard(listener->fd);
-			RAD_STATS_TYPE_INC(listener, total_packets_dropped);
-			RAD_STATS_CLIENT_INC(listener, client, total_packets_dropped);
-			DEBUG("WARNING: Ignoring Status-Server request due to security configuration");
-			return 0;
-		}
-		fun = rad_status_server;
-		break;
-
-	default:
+	fun = auth_socket_fun(listener, client, code, src_port);
+	if (!fun) {
 		rad_recv_discard(listener->fd);
-		RAD_STATS_INC(radius_auth_stats.total_unknown_types);
-		RAD_STATS_CLIENT_INC(listener, client, total_unknown_types);
-
-		DEBUG("Invalid packet code %d sent to authentication port from client %s port %d : IGNORED",
-		      code, client->shortname, src_port);
 		return 0;
-		break;
-	} /* switch over packet types */
+	}
 
 	/*
 	 *	Now that we've sanity checked everything, receive the
@@ -872,6 +955,40 @@ static int auth_socket_recv(rad_listen_t *listener,
 /*
  *	Receive packets from an accounting socket
  */
+/*
+ *	Some sanity checks, based on the packet code.
+ */
+static RAD_REQUEST_FUNP acct_socket_fun(rad_listen_t *listener,
+					RADCLIENT *client,
+					int code, int src_port)
+{
+	switch(code) {
+	case PW_ACCOUNTING_REQUEST:
+		RAD_STATS_CLIENT_INC(listener, client, total_requests);
+		return rad_accounting;
+
+	case PW_STATUS_SERVER:
+		if (!mainconfig.status_server) {
+			RAD_STATS_TYPE_INC(listener, total_packets_dropped);
+			RAD_STATS_CLIENT_INC(listener, client, total_unknown_types);
+
+			DEBUG("WARNING: Ignoring Status-Server request due to security configuration");
+			return NULL;
+		}
+		return rad_status_server;
+
+	default:
+		RAD_STATS_TYPE_INC(listener, total_unknown_types);
+		RAD_STATS_CLIENT_INC(listener, client, total_unknown_types);
+
+		DEBUG("Invalid packet code %d sent to a accounting port from client %s port %d : IGNORED",
+		      code, client->shortname, src_port);
+		break;
+	} /* switch over packet types */
+
+	return NULL;
+}
+
 static int acct_socket_recv(rad_listen_t *listener,
 			    RAD_REQUEST_FUNP *pfun, REQUEST **prequest)
 {
@@ -899,36 +1016,11 @@ static int acct_socket_recv(rad_listen_t *listener,
 		return 0;
 	}
 
-	/*
-	 *	Some sanity checks, based on the packet code.
-	 */
-	switch(code) {
-	case PW_ACCOUNTING_REQUEST:
-		RAD_STATS_CLIENT_INC(listener, client, total_requests);
-		fun = rad_accounting;
-		break;
-
-	case PW_STATUS_SERVER:
-		if (!mainconfig.status_server) {
-			rad_recv_discard(listener->fd);
-			RAD_STATS_TYPE_INC(listener, total_packets_dropped);
-			RAD_STATS_CLIENT_INC(listener, client, total_unknown_types);
-
-			DEBUG("WARNING: Ignoring Status-Server request due to security configuration");
-			return 0;
-		}
-		fun = rad_status_server;
-		break;
-
-	default:
+	fun = acct_socket_fun(listener, client, code, src_port);
+	if (!fun) {
 		rad_recv_discard(listener->fd);
-		RAD_STATS_TYPE_INC(listener, total_unknown_types);
-		RAD_STATS_CLIENT_INC(listener, client, total_unknown_types);
-
-		DEBUG("Invalid packet code %d sent to a accounting port from client %s port %d : IGNORED",
-		      code, client->shortname, src_port);
 		return 0;
-	} /* switch over packet types */
+	}
 
 	/*
 	 *	Now that we've sanity checked everything, receive the
@@ -957,6 +1049,455 @@ static int acct_socket_recv(rad_listen_t *listener,
 #endif
 
 
+#ifdef WITH_RECEIVE_THREADS
+static int mailbox_init(listen_mailbox_t *mb)
+{
+	int i;
+
+	mb->notified = 0;
+	mb->queue = NULL;
+
+	if (pipe(mb->notify) < 0) {
+		mb->notify[0] = mb->notify[1] = -1;
+		radlog(L_ERR, "Failed creating pipe for receive thread: %s",
+		       strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if ((fcntl(mb->notify[i], F_SETFL, O_NONBLOCK) < 0) ||
+		    (fcntl(mb->notify[i], F_SETFD, FD_CLOEXEC) < 0)) {
+			radlog(L_ERR, "Failed setting pipe flags for receive thread: %s",
+			       strerror(errno));
+			return -1;
+		}
+	}
+
+	mb->queue = fr_atomic_queue_create(RX_QUEUE_SIZE);
+	if (!mb->queue) {
+		radlog(L_ERR, "Failed creating queue for receive thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void mailbox_free(listen_mailbox_t *mb)
+{
+	RADIUS_PACKET *packet;
+
+	while ((packet = fr_atomic_queue_pop(mb->queue)) != NULL) {
+		rad_free(&packet);
+	}
+
+	if (mb->notify[0] >= 0) close(mb->notify[0]);
+	if (mb->notify[1] >= 0) close(mb->notify[1]);
+	fr_atomic_queue_free(mb->queue);
+}
+
+static int mailbox_push(listen_mailbox_t *mb, RADIUS_PACKET *packet)
+{
+	if (!fr_atomic_queue_push(mb->queue, packet)) return 0;
+
+	/*
+	 *	Only wake up the reader if it isn't already awake.
+	 *	It clears "notified" when the queue is empty.
+	 */
+	if (!mb->notified &&
+	    __sync_bool_compare_and_swap(&mb->notified, 0, 1)) {
+		if (write(mb->notify[1], "", 1) < 0) {
+			/* the reader will get to it eventually */
+		}
+	}
+
+	return 1;
+}
+
+static RADIUS_PACKET *mailbox_pop(listen_mailbox_t *mb)
+{
+	char buffer[64];
+	RADIUS_PACKET *packet;
+
+	packet = fr_atomic_queue_pop(mb->queue);
+	if (packet) return packet;
+
+	/*
+	 *	The queue is empty.  Re-arm the notification, and
+	 *	check again, in case the writer added a packet after
+	 *	we looked, but before it was re-armed.
+	 */
+	while (read(mb->notify[0], buffer, sizeof(buffer)) > 0) {
+		/* nothing */
+	}
+	mb->notified = 0;
+	__sync_synchronize();
+
+	packet = fr_atomic_queue_pop(mb->queue);
+
+	/*
+	 *	Writers which pushed before "notified" was cleared
+	 *	didn't write to the pipe.  If they left more packets
+	 *	behind, wake ourselves up again, or they will sit in
+	 *	the queue until the next unrelated push.
+	 */
+	if (packet && (fr_atomic_queue_num_elements(mb->queue) > 0) &&
+	    __sync_bool_compare_and_swap(&mb->notified, 0, 1)) {
+		if (write(mb->notify[1], "", 1) < 0) {
+			/* the reader will get to it eventually */
+		}
+	}
+
+	return packet;
+}
+
+/*
+ *	Called in the receive thread, when the socket is readable.
+ *	Reads as many packets as are available, in one system call.
+ */
+static void rx_socket_handler(UNUSED fr_event_list_t *el, int fd, void *ctx)
+{
+	int i, num;
+	rad_listen_t *listener = ctx;
+	listen_socket_t *sock = listener->data;
+	RADIUS_PACKET *packets[RAD_BATCH_MAX];
+
+	/*
+	 *	The client isn't known yet, so we can't check for
+	 *	Message-Authenticator here.  That's done in
+	 *	rx_socket_recv().
+	 */
+	num = rad_recv_batch(fd, packets, RAD_BATCH_MAX, 0);
+	if (num < 0) {
+		RAD_STATS_TYPE_INC(listener, total_malformed_requests);
+		DEBUG("%s", fr_strerror());
+		return;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (!mailbox_push(&sock->rx->in, packets[i])) {
+			RAD_STATS_TYPE_INC(listener, total_packets_dropped);
+			rad_free(&packets[i]);
+		}
+	}
+}
+
+/*
+ *	Called in the receive thread, when there are replies to send.
+ */
+static void rx_reply_handler(UNUSED fr_event_list_t *el, UNUSED int fd,
+			     void *ctx)
+{
+	int i, num;
+	rad_listen_t *listener = ctx;
+	listen_socket_t *sock = listener->data;
+	RADIUS_PACKET *packets[RAD_BATCH_MAX];
+
+	do {
+		for (num = 0; num < RAD_BATCH_MAX; num++) {
+			packets[num] = mailbox_pop(&sock->rx->out);
+			if (!packets[num]) break;
+		}
+
+		if (num > 0) rad_send_batch(packets, num);
+
+		for (i = 0; i < num; i++) {
+			rad_free(&packets[i]);
+		}
+	} while (num == RAD_BATCH_MAX);
+}
+
+static void *rx_thread(void *arg)
+{
+	listen_rx_t *rx = arg;
+
+	fr_event_loop(rx->el);
+
+	return NULL;
+}
+
+/*
+ *	Called in the main thread, for packets which have already
+ *	been read by a receive thread.
+ */
+static int rx_socket_recv(rad_listen_t *listener,
+			  RAD_REQUEST_FUNP *pfun, REQUEST **prequest)
+{
+	listen_socket_t *sock = listener->data;
+	RADIUS_PACKET	*packet;
+	RAD_REQUEST_FUNP fun = NULL;
+	RADCLIENT	*client;
+
+	packet = mailbox_pop(&sock->rx->in);
+	if (!packet) return 0;
+
+	RAD_STATS_TYPE_INC(listener, total_requests);
+
+	if ((client = client_listener_find(listener,
+					   &packet->src_ipaddr,
+					   packet->src_port)) == NULL) {
+		RAD_STATS_TYPE_INC(listener, total_invalid_requests);
+		rad_free(&packet);
+		return 0;
+	}
+
+	if (listener->type == RAD_LISTEN_AUTH) {
+		fun = auth_socket_fun(listener, client, packet->code,
+				      packet->src_port);
+	}
+#ifdef WITH_ACCOUNTING
+	else {
+		fun = acct_socket_fun(listener, client, packet->code,
+				      packet->src_port);
+	}
+#endif
+
+	if (!fun) {
+		rad_free(&packet);
+		return 0;
+	}
+
+	if (client->message_authenticator && !rad_packet_ok(packet, 1)) {
+		RAD_STATS_TYPE_INC(listener, total_malformed_requests);
+		DEBUG("%s", fr_strerror());
+		rad_free(&packet);
+		return 0;
+	}
+
+	if (!received_request(listener, packet, prequest, client)) {
+		RAD_STATS_TYPE_INC(listener, total_packets_dropped);
+		RAD_STATS_CLIENT_INC(listener, client, total_packets_dropped);
+		rad_free(&packet);
+		return 0;
+	}
+
+	*pfun = fun;
+	return 1;
+}
+
+/*
+ *	Encode and sign the reply in this thread, and hand a copy
+ *	of it to the receive thread to send.  The copy is needed
+ *	because the request may be cleaned up before the reply is
+ *	sent.
+ */
+static int rx_socket_send(rad_listen_t *listener, REQUEST *request)
+{
+	listen_socket_t *sock = listener->data;
+	RADIUS_PACKET *reply = request->reply;
+	RADIUS_PACKET *copy;
+
+	rad_assert(request->listener == listener);
+	rad_assert(listener->send == rx_socket_send);
+
+	/*
+	 *	Accounting reject's are silently dropped.
+	 */
+	if ((listener->type != RAD_LISTEN_AUTH) && (reply->code == 0)) {
+		return 0;
+	}
+
+	/*
+	 *	rad_send() prints the reply when debugging.
+	 */
+	if (debug_flag || !sock->rx || (reply->sockfd < 0)) goto send;
+
+	if (!reply->data &&
+	    ((rad_encode(reply, request->packet,
+			 request->client->secret) < 0) ||
+	     (rad_sign(reply, request->packet,
+		       request->client->secret) < 0))) {
+		return -1;
+	}
+
+	copy = rad_alloc(0);
+	if (!copy) goto send;
+
+	copy->sockfd = reply->sockfd;
+	copy->src_ipaddr = reply->src_ipaddr;
+	copy->src_port = reply->src_port;
+	copy->dst_ipaddr = reply->dst_ipaddr;
+	copy->dst_port = reply->dst_port;
+	copy->code = reply->code;
+	copy->id = reply->id;
+
+	copy->data = malloc(reply->data_len);
+	if (!copy->data) {
+		rad_free(&copy);
+		goto send;
+	}
+	memcpy(copy->data, reply->data, reply->data_len);
+	copy->data_len = reply->data_len;
+
+	if (mailbox_push(&sock->rx->out, copy)) return 0;
+
+	rad_free(&copy);
+
+ send:
+	return rad_send(reply, request->packet, request->client->secret);
+}
+
+static int rx_start(rad_listen_t *this)
+{
+	int rcode;
+	listen_socket_t *sock = this->data;
+	listen_rx_t *rx;
+
+	rx = rad_malloc(sizeof(*rx));
+	memset(rx, 0, sizeof(*rx));
+	rx->in.notify[0] = rx->in.notify[1] = -1;
+	rx->out.notify[0] = rx->out.notify[1] = -1;
+
+	if ((mailbox_init(&rx->in) < 0) ||
+	    (mailbox_init(&rx->out) < 0)) {
+		goto error;
+	}
+
+	rx->el = fr_event_list_create(NULL);
+	if (!rx->el ||
+	    !fr_event_fd_insert(rx->el, 0, this->fd, rx_socket_handler, this) ||
+	    !fr_event_fd_insert(rx->el, 0, rx->out.notify[0],
+				rx_reply_handler, this)) {
+		radlog(L_ERR, "Failed initializing receive thread");
+		goto error;
+	}
+
+	sock->rx = rx;
+
+	rcode = pthread_create(&rx->pthread_id, NULL, rx_thread, rx);
+	if (rcode != 0) {
+		radlog(L_ERR, "Failed creating receive thread: %s",
+		       strerror(rcode));
+		sock->rx = NULL;
+		goto error;
+	}
+
+	return 0;
+
+ error:
+	mailbox_free(&rx->in);
+	mailbox_free(&rx->out);
+	fr_event_list_free(rx->el);
+	free(rx);
+	return -1;
+}
+
+static void rx_free(rad_listen_t *this)
+{
+	listen_socket_t *sock = this->data;
+	listen_rx_t *rx = sock->rx;
+
+	if (!rx) return;
+
+	pthread_cancel(rx->pthread_id);
+	pthread_join(rx->pthread_id, NULL);
+
+	mailbox_free(&rx->in);
+	mailbox_free(&rx->out);
+	fr_event_list_free(rx->el);
+	free(rx);
+	sock->rx = NULL;
+}
+
+/*
+ *	"receive_threads = N" means "open N sockets with SO_REUSEPORT,
+ *	and read each one in its own thread".  The first listener has
+ *	already been bound.  Add N - 1 copies after it.
+ */
+static int rx_clone(CONF_SECTION *cs, rad_listen_t *this)
+{
+	int i;
+	listen_socket_t *sock = this->data;
+	rad_listen_t **last;
+
+	if (sock->receive_threads == 0) return 0;
+
+	this->recv = rx_socket_recv;
+	this->send = rx_socket_send;
+	last = &(this->next);
+
+	for (i = 1; i < sock->receive_threads; i++) {
+		rad_listen_t *clone;
+		listen_socket_t *clone_sock;
+
+		clone = listen_alloc(this->type);
+		clone->server = this->server;
+		clone->cs = this->cs;
+		clone->recv = rx_socket_recv;
+		clone->send = rx_socket_send;
+
+		clone_sock = clone->data;
+		*clone_sock = *sock;
+		clone_sock->rx = NULL;
+
+		if (listen_bind(clone) < 0) {
+			char buffer[128];
+
+			listen_free(&clone);
+			cf_log_err(cf_sectiontoitem(cs),
+				   "Error binding receive thread %d to port for %s port %d",
+				   i, ip_ntoh(&sock->ipaddr, buffer, sizeof(buffer)),
+				   sock->port);
+			return -1;
+		}
+
+		*last = clone;
+		last = &(clone->next);
+	}
+
+	return 0;
+}
+#endif	/* WITH_RECEIVE_THREADS */
+
+/*
+ *	The file descriptor which the main event loop should watch
+ *	for this listener.  For sockets which are read by receive
+ *	threads, the threads are started here, and the main loop
+ *	watches the pipe which the threads use to wake it up.  If
+ *	the threads can't be started, the socket is read directly.
+ */
+int listen_event_fd(rad_listen_t *this)
+{
+#ifdef WITH_RECEIVE_THREADS
+	if ((this->type == RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+	    || (this->type == RAD_LISTEN_ACCT)
+#endif
+		) {
+		listen_socket_t *sock = this->data;
+
+		if (sock->receive_threads > 0) {
+			if (sock->rx) return sock->rx->in.notify[0];
+
+			if (rx_start(this) == 0) {
+				return sock->rx->in.notify[0];
+			}
+
+			/*
+			 *	Read the socket from the main thread
+			 *	instead, as if there were no receive
+			 *	threads.
+			 */
+			radlog(L_ERR, "WARNING: Reading socket %d in the main thread",
+			       this->fd);
+			sock->receive_threads = 0;
+			if (this->type == RAD_LISTEN_AUTH) {
+				this->recv = auth_socket_recv;
+				this->send = auth_socket_send;
+			}
+#ifdef WITH_ACCOUNTING
+			else {
+				this->recv = acct_socket_recv;
+				this->send = acct_socket_send;
+			}
+#endif
+		}
+	}
+#endif
+
+	return this->fd;
+}
+
+
 #ifdef WITH_COA
 /*
  *	For now, all CoA requests are *only* originated, and not
@@ -1662,6 +2203,29 @@ static int listen_bind(rad_listen_t *this)
 #endif
 	}
 
+#if defined(WITH_RECEIVE_THREADS) && defined(SO_REUSEPORT)
+	/*
+	 *	Multiple sockets on the same IP / port, each with its
+	 *	own receive thread.  The kernel spreads packets across
+	 *	them by source IP / port.
+	 */
+	if (((this->type == RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+	     || (this->type == RAD_LISTEN_ACCT)
+#endif
+		    ) && (sock->receive_threads > 1)) {
+		int on = 1;
+
+		if (setsockopt(this->fd, SOL_SOCKET, SO_REUSEPORT,
+			       (char *)&on, sizeof(on)) < 0) {
+			close(this->fd);
+			radlog(L_ERR, "Failed setting SO_REUSEPORT: %s",
+			       strerror(errno));
+			return -1;
+		}
+	}
+#endif
+
 	/*
 	 *	May be binding to priviledged ports.
 	 */
@@ -1971,6 +2535,17 @@ static rad_listen_t *listen_parse(CONF_SECTION *cs, const char *server)
 		return NULL;
 	}
 
+#ifdef WITH_RECEIVE_THREADS
+	if (((type == RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+	     || (type == RAD_LISTEN_ACCT)
+#endif
+		    ) && !check_config && (rx_clone(cs, this) < 0)) {
+		listen_free(&this);
+		return NULL;
+	}
+#endif
+
 	cf_log_info(cs, "}");
 
 	return this;
@@ -2159,7 +2734,7 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head)
 #endif
 			
 			*last = this;
-			last = &(this->next);
+			while (*last) last = &((*last)->next);
 		} /* loop over "listen" directives in server <foo> */
 
 		goto do_proxy;
@@ -2182,7 +2757,7 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head)
 #endif
 
 		*last = this;
-		last = &(this->next);
+		while (*last) last = &((*last)->next);
 	}
 
 	/*
@@ -2214,7 +2789,7 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head)
 #endif
 
 			*last = this;
-			last = &(this->next);
+			while (*last) last = &((*last)->next);
 		} /* loop over "listen" directives in virtual servers */
 	} /* loop over virtual servers */
 
@@ -2342,6 +2917,20 @@ void listen_free(rad_listen_t **head)
 	while (this) {
 		rad_listen_t *next = this->next;
 
+#ifdef WITH_RECEIVE_THREADS
+		/*
+		 *	Stop the receive thread before closing the
+		 *	socket it's reading.
+		 */
+		if ((this->type == RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+		    || (this->type == RAD_LISTEN_ACCT)
+#endif
+			) {
+			rx_free(this);
+		}
+#endif
+
 		/*
 		 *	Other code may have eaten the FD.
 		 */
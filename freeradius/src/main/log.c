@@ -36,6 +36,11 @@ RCSID("$Id$")
 #	include <syslog.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+#include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
 /*
  * Logging facility names
  */
@@ -50,6 +55,419 @@ static const FR_NAME_NUMBER levels[] = {
 };
 
 int log_dates_utc = 0;
+int log_async = 0;
+
+#ifdef HAVE_SYSLOG_H
+static void log_syslog(int lvl, const char *buffer)
+{
+	switch(lvl & ~L_CONS) {
+		case L_DBG:
+			lvl = LOG_DEBUG;
+			break;
+		case L_AUTH:
+			lvl = LOG_NOTICE;
+			break;
+		case L_PROXY:
+			lvl = LOG_NOTICE;
+			break;
+		case L_ACCT:
+			lvl = LOG_NOTICE;
+			break;
+		case L_INFO:
+			lvl = LOG_INFO;
+			break;
+		case L_ERR:
+			lvl = LOG_ERR;
+			break;
+	}
+	syslog(lvl, "%s", buffer);
+}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	With "async = yes" in the "log" section, the worker threads
+ *	don't write to the log.  They format the message, and push it
+ *	onto a lock-free queue.  A separate thread writes the messages,
+ *	many at a time, with one writev().  If the queue is full, the
+ *	message is thrown away and counted, instead of making the
+ *	worker wait.
+ *
+ *	The writer thread adds the timestamps, so it only has to
+ *	call CTIME_R once a second.
+ *
+ *	The records are allocated when the writer is started, and
+ *	go back and forth between a queue of free records and the
+ *	queue of messages.  Most messages fit in a record.  Longer
+ *	ones are copied to memory from the heap.
+ */
+#define LOG_QUEUE_SIZE	(8192)
+#define LOG_BATCH_SIZE	(64)
+#define LOG_SLOT_TEXT	(256)
+
+typedef struct log_record_t {
+	time_t		when;
+	int		lvl;
+	size_t		len;
+	char		*text;		/* "buffer", or from the heap */
+	char		buffer[LOG_SLOT_TEXT];
+} log_record_t;
+
+static log_record_t	*log_slots = NULL;
+static fr_atomic_queue_t *log_free = NULL;
+static fr_atomic_queue_t *log_queue = NULL;
+static pthread_t	log_pthread_id;
+static pthread_mutex_t	log_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int		log_notify[2] = { -1, -1 };
+static volatile int	log_notified = 0;
+static volatile int	log_running = 0;
+static volatile int	log_stop = 0;
+static volatile uint64_t log_written = 0;
+static volatile uint64_t log_dropped = 0;
+
+/*
+ *	There's a slot for every record, so this can't fail.
+ */
+static void log_release(log_record_t *rec)
+{
+	if (rec->text != rec->buffer) free(rec->text);
+	fr_atomic_queue_push(log_free, rec);
+}
+
+static void log_push(int lvl, const char *buffer, size_t len)
+{
+	log_record_t *rec;
+
+	rec = fr_atomic_queue_pop(log_free);
+	if (!rec) {
+		__sync_fetch_and_add(&log_dropped, 1);
+		return;
+	}
+
+	rec->text = rec->buffer;
+	if ((len >= sizeof(rec->buffer)) &&
+	    ((rec->text = malloc(len + 1)) == NULL)) {
+		rec->text = rec->buffer;
+		log_release(rec);
+		__sync_fetch_and_add(&log_dropped, 1);
+		return;
+	}
+
+	rec->when = time(NULL);
+	rec->lvl = lvl;
+	rec->len = len;
+	memcpy(rec->text, buffer, len + 1);
+
+	if (!fr_atomic_queue_push(log_queue, rec)) {
+		log_release(rec);
+		__sync_fetch_and_add(&log_dropped, 1);
+		return;
+	}
+
+	/*
+	 *	Only wake up the writer if it isn't already awake.
+	 */
+	if (!log_notified &&
+	    __sync_bool_compare_and_swap(&log_notified, 0, 1)) {
+		if (write(log_notify[1], "", 1) < 0) {
+			/* the writer will get to it eventually */
+		}
+	}
+}
+
+static log_record_t *log_pop(void)
+{
+	char buffer[64];
+	log_record_t *rec;
+
+	rec = fr_atomic_queue_pop(log_queue);
+	if (rec) return rec;
+
+	/*
+	 *	The queue is empty.  Re-arm the notification, and
+	 *	check again, in case a message was added after we
+	 *	looked, but before it was re-armed.
+	 */
+	while (read(log_notify[0], buffer, sizeof(buffer)) > 0) {
+		/* nothing */
+	}
+	log_notified = 0;
+	__sync_synchronize();
+
+	return fr_atomic_queue_pop(log_queue);
+}
+
+static void log_write_batch(log_record_t **rec, int num)
+{
+	int i, n;
+	static time_t last = 0;
+	static char stamp[64];
+	struct iovec iov[LOG_BATCH_SIZE * 3];
+	const char *s;
+
+	/*
+	 *	So that a HUP can't close the log file under us.
+	 */
+	pthread_mutex_lock(&log_fd_mutex);
+
+	switch (mainconfig.radlog_dest) {
+#ifdef HAVE_SYSLOG_H
+	case RADLOG_SYSLOG:
+		for (i = 0; i < num; i++) {
+			log_syslog(rec[i]->lvl, rec[i]->text);
+		}
+		break;
+#endif
+
+	case RADLOG_FILES:
+	case RADLOG_STDOUT:
+	case RADLOG_STDERR:
+		for (i = 0, n = 0; i < num; i++) {
+			/*
+			 *	Same format as vradlog().  The newline
+			 *	from CTIME_R becomes a space.
+			 */
+			if (rec[i]->when != last) {
+				char *p;
+
+				last = rec[i]->when;
+				CTIME_R(&last, stamp, sizeof(stamp) - 1);
+				p = strchr(stamp, '\n');
+				if (p) *p = ' ';
+			}
+
+			s = fr_int2str(levels, (rec[i]->lvl & ~L_CONS), ": ");
+
+			iov[n].iov_base = stamp;
+			iov[n++].iov_len = strlen(stamp);
+			iov[n].iov_base = (char *) s;
+			iov[n++].iov_len = strlen(s);
+			iov[n].iov_base = rec[i]->text;
+			iov[n++].iov_len = rec[i]->len;
+		}
+
+		if (writev(mainconfig.radlog_fd, iov, n) < 0) {
+			/* nowhere to complain to */
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	pthread_mutex_unlock(&log_fd_mutex);
+
+	__sync_fetch_and_add(&log_written, num);
+}
+
+static void *log_thread(UNUSED void *arg)
+{
+	int num;
+	uint64_t dropped, reported = 0;
+	fd_set fds;
+	struct timeval tv;
+	log_record_t *rec[LOG_BATCH_SIZE];
+	log_record_t lost;
+
+	while (1) {
+		num = 0;
+		while ((num < LOG_BATCH_SIZE) &&
+		       ((rec[num] = log_pop()) != NULL)) {
+			num++;
+		}
+
+		if (num > 0) {
+			log_write_batch(rec, num);
+			while (num > 0) log_release(rec[--num]);
+		}
+
+		/*
+		 *	Say how many messages were lost, once we
+		 *	have room to say it.
+		 */
+		dropped = log_dropped;
+		if (dropped != reported) {
+			lost.when = time(NULL);
+			lost.lvl = L_ERR;
+			lost.text = lost.buffer;
+			lost.len = snprintf(lost.buffer, sizeof(lost.buffer),
+					    "Dropped %llu log messages, as the queue was full\n",
+					    (unsigned long long) (dropped - reported));
+			rec[0] = &lost;
+			log_write_batch(rec, 1);
+			reported = dropped;
+		}
+
+		if (log_notified) continue;
+		if (log_stop && (fr_atomic_queue_num_elements(log_queue) == 0)) break;
+
+		FD_ZERO(&fds);
+		FD_SET(log_notify[0], &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		select(log_notify[0] + 1, &fds, NULL, NULL, &tv);
+	}
+
+	return NULL;
+}
+
+/*
+ *	In a child process, there's no writer thread.
+ */
+static void log_atfork_child(void)
+{
+	log_running = 0;
+}
+
+/*
+ *	Called after we've forked into the background, and before
+ *	any worker threads are started.
+ */
+int radlog_async_start(void)
+{
+	int i, rcode;
+
+	if (!log_async || debug_flag || log_running) return 0;
+
+	if (mainconfig.radlog_dest == RADLOG_NULL) return 0;
+
+	if (pipe(log_notify) < 0) {
+		radlog(L_ERR, "Failed creating pipe for the log writer: %s",
+		       strerror(errno));
+		log_notify[0] = log_notify[1] = -1;
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if ((fcntl(log_notify[i], F_SETFL, O_NONBLOCK) < 0) ||
+		    (fcntl(log_notify[i], F_SETFD, FD_CLOEXEC) < 0)) {
+			radlog(L_ERR, "Failed setting pipe flags for the log writer: %s",
+			       strerror(errno));
+			goto error;
+		}
+	}
+
+	log_queue = fr_atomic_queue_create(LOG_QUEUE_SIZE);
+	log_free = fr_atomic_queue_create(LOG_QUEUE_SIZE);
+	log_slots = malloc(LOG_QUEUE_SIZE * sizeof(log_slots[0]));
+	if (!log_queue || !log_free || !log_slots) {
+		radlog(L_ERR, "Failed creating queue for the log writer");
+		goto error;
+	}
+
+	for (i = 0; i < LOG_QUEUE_SIZE; i++) {
+		fr_atomic_queue_push(log_free, &log_slots[i]);
+	}
+
+	rcode = pthread_create(&log_pthread_id, NULL, log_thread, NULL);
+	if (rcode != 0) {
+		radlog(L_ERR, "Failed creating the log writer thread: %s",
+		       strerror(rcode));
+		goto error;
+	}
+
+	pthread_atfork(NULL, NULL, log_atfork_child);
+	log_running = 1;
+	return 0;
+
+ error:
+	fr_atomic_queue_free(log_queue);
+	fr_atomic_queue_free(log_free);
+	free(log_slots);
+	log_queue = log_free = NULL;
+	log_slots = NULL;
+	close(log_notify[0]);
+	close(log_notify[1]);
+	log_notify[0] = log_notify[1] = -1;
+	return -1;
+}
+
+/*
+ *	Write everything which is queued, and stop the writer.
+ */
+void radlog_async_stop(void)
+{
+	log_record_t *rec;
+
+	if (!log_running) return;
+
+	log_running = 0;
+	__sync_synchronize();
+
+	log_stop = 1;
+	if (write(log_notify[1], "", 1) < 0) {
+		/* it wakes up once a second anyway */
+	}
+	pthread_join(log_pthread_id, NULL);
+
+	/*
+	 *	Anything which was pushed after the thread exited.
+	 */
+	while ((rec = fr_atomic_queue_pop(log_queue)) != NULL) {
+		log_write_batch(&rec, 1);
+		log_release(rec);
+	}
+
+	fr_atomic_queue_free(log_queue);
+	fr_atomic_queue_free(log_free);
+	free(log_slots);
+	log_queue = log_free = NULL;
+	log_slots = NULL;
+	close(log_notify[0]);
+	close(log_notify[1]);
+	log_notify[0] = log_notify[1] = -1;
+}
+
+/*
+ *	Replace the log file on HUP.  The writer thread holds the lock
+ *	while it writes, so it never writes to a closed file.
+ */
+void radlog_set_fd(int fd)
+{
+	int old_fd;
+
+	pthread_mutex_lock(&log_fd_mutex);
+	old_fd = mainconfig.radlog_fd;
+	mainconfig.radlog_fd = fd;
+	pthread_mutex_unlock(&log_fd_mutex);
+
+	if (old_fd >= 0) close(old_fd);
+}
+
+void radlog_async_stats(uint64_t *written, uint64_t *dropped, int *queued)
+{
+	*written = log_written;
+	*dropped = log_dropped;
+	*queued = log_queue ? fr_atomic_queue_num_elements(log_queue) : 0;
+}
+#else
+int radlog_async_start(void)
+{
+	if (log_async) {
+		radlog(L_ERR, "Asynchronous logging needs threads");
+	}
+	return 0;
+}
+
+void radlog_async_stop(void)
+{
+}
+
+void radlog_set_fd(int fd)
+{
+	int old_fd;
+
+	old_fd = mainconfig.radlog_fd;
+	mainconfig.radlog_fd = fd;
+	if (old_fd >= 0) close(old_fd);
+}
+
+void radlog_async_stats(uint64_t *written, uint64_t *dropped, int *queued)
+{
+	*written = *dropped = 0;
+	*queued = 0;
+}
+#endif
 
 
 /*
@@ -90,6 +508,11 @@ int vradlog(int lvl, const char *fmt, va_list ap)
 	 *	Print timestamps for non-debugging, and for high levels
 	 *	of debugging.
 	 */
+#ifdef HAVE_PTHREAD_H
+	if (log_running) {
+		/* the writer thread adds the timestamp */
+	} else
+#endif
 	if ((myconfig->radlog_dest != RADLOG_SYSLOG) &&
 	    (debug_flag != 1) && (debug_flag != 2)) {
 		const char *s;
@@ -116,40 +539,29 @@ int vradlog(int lvl, const char *fmt, va_list ap)
 		else if (*p < 32 || (*p >= 128 && *p <= 160))
 			*p = '?';
 	}
-	strcat(buffer, "\n");
+	len = (char *) p - buffer;
+	buffer[len++] = '\n';
+	buffer[len] = '\0';
+
+#ifdef HAVE_PTHREAD_H
+	if (log_running) {
+		log_push(lvl, buffer, len);
+		return 0;
+	}
+#endif
 
 	switch (myconfig->radlog_dest) {
 
 #ifdef HAVE_SYSLOG_H
 	case RADLOG_SYSLOG:
-		switch(lvl & ~L_CONS) {
-			case L_DBG:
-				lvl = LOG_DEBUG;
-				break;
-			case L_AUTH:
-				lvl = LOG_NOTICE;
-				break;
-			case L_PROXY:
-				lvl = LOG_NOTICE;
-				break;
-			case L_ACCT:
-				lvl = LOG_NOTICE;
-				break;
-			case L_INFO:
-				lvl = LOG_INFO;
-				break;
-			case L_ERR:
-				lvl = LOG_ERR;
-				break;
-		}
-		syslog(lvl, "%s", buffer);
+		log_syslog(lvl, buffer);
 		break;
 #endif
 
 	case RADLOG_FILES:
 	case RADLOG_STDOUT:
 	case RADLOG_STDERR:
-		write(myconfig->radlog_fd, buffer, strlen(buffer));
+		write(myconfig->radlog_fd, buffer, len);
 		break;
 
 	default:
@@ -62,6 +62,7 @@ struct main_config_t mainconfig;
 char *request_log_file = NULL;
 char *debug_condition = NULL;
 extern int log_dates_utc;
+extern int log_async;
 
 typedef struct cached_config_t {
 	struct cached_config_t *next;
@@ -206,6 +207,8 @@ static const CONF_PARSER log_config_nodest[] = {
 
 	{ "use_utc", PW_TYPE_BOOLEAN, 0, &log_dates_utc, NULL },
 
+	{ "async", PW_TYPE_BOOLEAN, 0, &log_async, "no" },
+
 	{ NULL, -1, 0, NULL, NULL }
 };
 
@@ -1050,7 +1053,7 @@ void hup_mainconfig(void)
 	 *	because it makes that function MUCH simpler.
 	 */
 	if (mainconfig.radlog_dest == RADLOG_FILES) {
-		int fd, old_fd;
+		int fd;
 		
 		fd = open(mainconfig.log_file,
 			  O_WRONLY | O_APPEND | O_CREAT, 0640);
@@ -1062,10 +1065,11 @@ void hup_mainconfig(void)
 			 *	writes go nowhere.  But that's hard to
 			 *	do.  So... we have the case where a
 			 *	log message *might* be lost on HUP.
+			 *
+			 *	The async log writer is safe, as the
+			 *	swap is done under its lock.
 			 */
-			old_fd = mainconfig.radlog_fd;
-			mainconfig.radlog_fd = fd;
-			close(old_fd);
+			radlog_set_fd(fd);
 		}
 	}
 
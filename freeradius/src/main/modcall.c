@@ -68,6 +68,7 @@ typedef struct {
 	modcallable *children;
 	CONF_SECTION *cs;
 	VALUE_PAIR *vps;
+	fr_cond_t *cond;	/* for "if" and "elsif" */
 } modgroup;
 
 typedef struct {
@@ -444,15 +445,16 @@ int modcall(int component, modcallable *c, REQUEST *request)
 		 */
 		if ((child->type == MOD_IF) || (child->type == MOD_ELSIF)) {
 			int condition = TRUE;
-			const char *p = child->name;
+			modgroup *g = mod_callabletogroup(child);
 
 			RDEBUG2("%.*s? %s %s",
 			       stack.pointer + 1, modcall_spaces,
 			       (child->type == MOD_IF) ? "if" : "elsif",
 			       child->name);
 
-			if (radius_evaluate_condition(request, myresult,
-						      0, &p, TRUE, &condition)) {
+			if (radius_evaluate_compiled_condition(request, myresult,
+							       g->cond,
+							       &condition)) {
 				RDEBUG2("%.*s? %s %s -> %s",
 				       stack.pointer + 1, modcall_spaces,
 				       (child->type == MOD_IF) ? "if" : "elsif",
@@ -1622,7 +1624,7 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 					 const char **modname)
 {
 #ifdef WITH_UNLANG
-	int result;
+	modgroup *g;
 #endif
 	const char *modrefname;
 	modsingle *single;
@@ -1709,12 +1711,16 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 			if (!csingle) return NULL;
 			csingle->type = MOD_IF;
 
-			if (!radius_evaluate_condition(NULL, 0, 0, modname,
-						       FALSE, &result)) {
+			/*
+			 *	Compile the condition now, so that we
+			 *	don't parse it again for every request.
+			 */
+			g = mod_callabletogroup(csingle);
+			g->cond = radius_compile_condition(name2);
+			if (!g->cond) {
 				modcallable_free(&csingle);
 				return NULL;
 			}
-			*modname = name2;
 
 			return csingle;
 
@@ -1738,12 +1744,16 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 			if (!csingle) return NULL;
 			csingle->type = MOD_ELSIF;
 
-			if (!radius_evaluate_condition(NULL, 0, 0, modname,
-						       FALSE, &result)) {
+			/*
+			 *	Compile the condition now, so that we
+			 *	don't parse it again for every request.
+			 */
+			g = mod_callabletogroup(csingle);
+			g->cond = radius_compile_condition(name2);
+			if (!g->cond) {
 				modcallable_free(&csingle);
 				return NULL;
 			}
-			*modname = name2;
 
 			return csingle;
 
@@ -2238,6 +2248,9 @@ void modcallable_free(modcallable **pc)
 			modcallable_free(&loop);
 		}
 		pairfree(&g->vps);
+#ifdef WITH_UNLANG
+		radius_free_condition(&g->cond);
+#endif
 	}
 	free(c);
 	*pc = NULL;
@@ -1363,6 +1363,65 @@ int module_hup(CONF_SECTION *modules)
 }
 
 
+
+/*
+ *	Modules which keep statistics register a function to print
+ *	them, for "radmin -e 'stats module <name>'".  This is only
+ *	used from the main thread.
+ */
+typedef struct module_stats_t {
+	void			*instance;
+	RAD_STATS_FUNC		func;
+	struct module_stats_t	*next;
+} module_stats_t;
+
+static module_stats_t *module_stats_list = NULL;
+
+int module_stats_register(void *instance, RAD_STATS_FUNC func)
+{
+	module_stats_t *ms;
+
+	if (!instance || !func) return 0;
+
+	ms = rad_malloc(sizeof(*ms));
+	ms->instance = instance;
+	ms->func = func;
+	ms->next = module_stats_list;
+	module_stats_list = ms;
+
+	return 1;
+}
+
+void module_stats_unregister(void *instance)
+{
+	module_stats_t *ms, **last;
+
+	for (last = &module_stats_list; *last != NULL; last = &(*last)->next) {
+		ms = *last;
+		if (ms->instance != instance) continue;
+
+		*last = ms->next;
+		free(ms);
+		return;
+	}
+}
+
+/*
+ *	Returns 0 if the module doesn't keep statistics.
+ */
+size_t module_stats(void *instance, char *out, size_t outlen)
+{
+	module_stats_t *ms;
+
+	for (ms = module_stats_list; ms != NULL; ms = ms->next) {
+		if (ms->instance == instance) {
+			return ms->func(instance, out, outlen);
+		}
+	}
+
+	return 0;
+}
+
 /*
  *	Parse the module config sections, and load
  *	and call each module's init() function.
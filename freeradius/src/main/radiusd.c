@@ -326,6 +326,12 @@ int main(int argc, char *argv[])
 		setlinebuf(stdout); /* unbuffered output */
 	}
 
+	/*
+	 *	Start the log writer, if there is one, before any
+	 *	other threads.
+	 */
+	radlog_async_start();
+
 	/*
 	 *	Initialize the event pool, including threads.
 	 */
@@ -418,6 +424,8 @@ int main(int argc, char *argv[])
 		radlog(L_INFO, "Exiting normally.");
 	}
 
+	radlog_async_stop();
+
 	/*
 	 *	Ignore the TERM signal: we're
 	 *	about to die.
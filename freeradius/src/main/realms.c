@@ -56,15 +56,17 @@ RCSID("$Id$")
 static rbtree_t *realms_byname = NULL;
 
 #ifdef HAVE_REGEX_H
-typedef struct realm_regex_t {
-	REALM	*realm;
-	struct realm_regex_t *next;
-} realm_regex_t;
-
-static realm_regex_t *realms_regex = NULL;
-
+/*
+ *	Regex realms, by the text of the regex, for realm_find2().
+ */
+static rbtree_t *realms_regex = NULL;
 #endif /* HAVE_REGEX_H */
 
+/*
+ *	All realms, exact names and regexes, for realm_find().
+ */
+static fr_trie_t *realms_trie = NULL;
+
 typedef struct realm_config_t {
 	CONF_SECTION	*cs;
 	int		dead_time;
@@ -127,6 +129,16 @@ static int realm_name_cmp(const void *one, const void *two)
 	return strcasecmp(a->name, b->name);
 }
 
+#ifdef HAVE_REGEX_H
+static int realm_regex_cmp(const void *one, const void *two)
+{
+	const REALM *a = one;
+	const REALM *b = two;
+
+	return strcmp(a->name, b->name);
+}
+#endif
+
 
 #ifdef WITH_PROXY
 static int home_server_name_cmp(const void *one, const void *two)
@@ -261,18 +273,13 @@ void realms_free(void)
 	realms_byname = NULL;
 
 #ifdef HAVE_REGEX_H
-	if (realms_regex) {
-		realm_regex_t *this, *next;
-
-		for (this = realms_regex; this != NULL; this = next) {
-			next = this->next;
-			free(this->realm);
-			free(this);
-		}
-		realms_regex = NULL;
-	}
+	rbtree_free(realms_regex);
+	realms_regex = NULL;
 #endif
 
+	fr_trie_free(realms_trie);
+	realms_trie = NULL;
+
 	free(realm_config);
 	realm_config = NULL;
 }
@@ -1584,24 +1591,42 @@ static int realm_add(realm_config_t *rc, CONF_SECTION *cs)
 	 *	It's a regex.  Add it to a separate list.
 	 */
 	if (name2[0] == '~') {
-		realm_regex_t *rr, **last;
+		r->name = name2;
 
-		rr = rad_malloc(sizeof(*rr));
-		
-		last = &realms_regex;
-		while (*last) last = &((*last)->next);  /* O(N^2)... sue me. */
+		if (rbtree_finddata(realms_regex, r)) {
+			cf_log_err(cf_sectiontoitem(cs), "Duplicate realm \"%s\"",
+				   name2);
+			goto error;
+		}
 
-		r->name = name2;
-		rr->realm = r;
-		rr->next = NULL;
+		/*
+		 *	Compile it once, here, instead of for every
+		 *	packet.  The trie keeps the regexes in the
+		 *	order they were defined.
+		 */
+		if (fr_trie_add_regex(realms_trie, name2 + 1,
+				      REG_EXTENDED | REG_NOSUB | REG_ICASE,
+				      r) < 0) {
+			cf_log_err(cf_sectiontoitem(cs), "%s", fr_strerror());
+			goto error;
+		}
 
-		*last = rr;
+		rbtree_insert(realms_regex, r);
 
 		cf_log_info(cs, " }");
 		return 1;
 	}
 #endif
 
+	/*
+	 *	The trie doesn't take duplicate names, so the
+	 *	rbtree_insert() below catches them.
+	 */
+	if (fr_trie_add_name(realms_trie, r->name, r) < 0) {
+		cf_log_err(cf_sectiontoitem(cs), "%s", fr_strerror());
+		goto error;
+	}
+
 	if (!rbtree_insert(realms_byname, r)) {
 		rad_assert("Internal sanity check failed");
 		goto error;
@@ -1686,6 +1711,20 @@ int realms_init(CONF_SECTION *config)
 		return 0;
 	}
 
+#ifdef HAVE_REGEX_H
+	realms_regex = rbtree_create(realm_regex_cmp, free, 0);
+	if (!realms_regex) {
+		realms_free();
+		return 0;
+	}
+#endif
+
+	realms_trie = fr_trie_create();
+	if (!realms_trie) {
+		realms_free();
+		return 0;
+	}
+
 #ifdef WITH_PROXY
 	home_servers_byaddr = rbtree_create(home_server_addr_cmp, free, 0);
 	if (!home_servers_byaddr) {
@@ -1811,15 +1850,8 @@ REALM *realm_find2(const char *name)
 	if (realm) return realm;
 
 #ifdef HAVE_REGEX_H
-	if (realms_regex) {
-		realm_regex_t *this;
-
-		for (this = realms_regex; this != NULL; this = this->next) {
-			if (strcmp(this->realm->name, name) == 0) {
-				return this->realm;
-			}
-		}
-	}
+	realm = rbtree_finddata(realms_regex, &myrealm);
+	if (realm) return realm;
 #endif
 
 	/*
@@ -1840,34 +1872,13 @@ REALM *realm_find(const char *name)
 	
 	if (!name) name = "NULL";
 
-	myrealm.name = name;
-	realm = rbtree_finddata(realms_byname, &myrealm);
+	/*
+	 *	Exact names first, and then the regexes in the order
+	 *	they were defined, all in one pass over the name.
+	 */
+	realm = fr_trie_match(realms_trie, name);
 	if (realm) return realm;
 
-#ifdef HAVE_REGEX_H
-	if (realms_regex) {
-		realm_regex_t *this;
-
-		for (this = realms_regex; this != NULL; this = this->next) {
-			int compare;
-			regex_t reg;
-
-			/*
-			 *	Include substring matches.
-			 */
-			if (regcomp(&reg, this->realm->name + 1,
-				    REG_EXTENDED | REG_NOSUB | REG_ICASE) != 0) {
-				continue;
-			}
-
-			compare = regexec(&reg, name, 0, NULL, 0);
-			regfree(&reg);
-
-			if (compare == 0) return this->realm;
-		}
-	}
-#endif
-
 	/*
 	 *	Couldn't find a realm.  Look for DEFAULT.
 	 */
@@ -59,11 +59,11 @@ void request_stats_final(REQUEST *request)
 	    (request->listener->type != RAD_LISTEN_ACCT)) return;
 
 #undef INC_AUTH
-#define INC_AUTH(_x) radius_auth_stats._x++;request->listener->stats._x++;if (request->client && request->client->auth) request->client->auth->_x++;
+#define INC_AUTH(_x) RAD_STATS_INC(radius_auth_stats._x);RAD_STATS_INC(request->listener->stats._x);if (request->client && request->client->auth) RAD_STATS_INC(request->client->auth->_x);
 
 
 #undef INC_ACCT
-#define INC_ACCT(_x) radius_acct_stats._x++;request->listener->stats._x++;if (request->client && request->client->acct) request->client->acct->_x++
+#define INC_ACCT(_x) RAD_STATS_INC(radius_acct_stats._x);RAD_STATS_INC(request->listener->stats._x);if (request->client && request->client->acct) RAD_STATS_INC(request->client->acct->_x)
 
 	/*
 	 *	Update the statistics.
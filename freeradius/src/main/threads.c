@@ -73,6 +73,18 @@ RCSID("$Id$")
 
 #define NUM_FIFOS               RAD_LISTEN_MAX
 
+#define USEC (1000000)
+
+/*
+ *	EAP-TLS, EAP-TTLS, PEAP and EAP-FAST.  See
+ *	src/modules/rlm_eap/eap_types.h
+ */
+#define EAP_TYPE_TLS		(13)
+#define EAP_TYPE_TTLS		(21)
+#define EAP_TYPE_PEAP		(25)
+#define EAP_TYPE_FAST		(43)
+#define EAP_CODE_RESPONSE	(2)
+
 
 /*
  *  A data structure which contains the information about
@@ -96,14 +108,6 @@ typedef struct THREAD_HANDLE {
 	REQUEST		     *request;
 } THREAD_HANDLE;
 
-/*
- *	For the request queue.
- */
-typedef struct request_queue_t {
-	REQUEST	    	  *request;
-	RAD_REQUEST_FUNP  fun;
-} request_queue_t;
-
 typedef struct thread_fork_t {
 	pid_t		pid;
 	int		status;
@@ -121,14 +125,14 @@ typedef struct THREAD_POOL {
 	THREAD_HANDLE *tail;
 
 	int total_threads;
-	int active_threads;	/* protected by queue_mutex */
+	int active_threads;	/* updated atomically */
 	int max_thread_num;
 	int start_threads;
 	int max_threads;
 	int min_spare_threads;
 	int max_spare_threads;
 	unsigned int max_requests_per_thread;
-	unsigned long request_count;
+	unsigned long request_count;	/* updated atomically */
 	time_t time_last_spawned;
 	int cleanup_delay;
 	int spawn_flag;
@@ -140,18 +144,24 @@ typedef struct THREAD_POOL {
 
 	/*
 	 *	All threads wait on this semaphore, for requests
-	 *	to enter the queue.
+	 *	to enter the queue.  It's only used to sleep and
+	 *	wake up; the queues themselves are lock-free.
 	 */
 	sem_t		semaphore;
 
+	int		max_queue_size;
+	int		num_queued;	/* updated atomically */
+	fr_atomic_queue_t *queue[NUM_FIFOS];
+
 	/*
-	 *	To ensure only one thread at a time touches the queue.
+	 *	A separate, fixed-size, pool of threads for requests
+	 *	which do TLS handshakes.  They're expensive, and a
+	 *	burst of them shouldn't block other requests.
 	 */
-	pthread_mutex_t	queue_mutex;
-
-	int		max_queue_size;
-	int		num_queued;
-	fr_fifo_t	*fifo[NUM_FIFOS];
+	int		crypto_threads;
+	sem_t		crypto_semaphore;
+	fr_atomic_queue_t *crypto_queue;
+	fr_crypto_pool_stats_t crypto;	/* updated atomically */
 } THREAD_POOL;
 
 static THREAD_POOL thread_pool;
@@ -172,6 +182,7 @@ static const CONF_PARSER thread_config[] = {
 	{ "max_requests_per_server", PW_TYPE_INTEGER, 0, &thread_pool.max_requests_per_thread, "0" },
 	{ "cleanup_delay",           PW_TYPE_INTEGER, 0, &thread_pool.cleanup_delay,           "5" },
 	{ "max_queue_size",          PW_TYPE_INTEGER, 0, &thread_pool.max_queue_size,           "65536" },
+	{ "crypto_servers",          PW_TYPE_INTEGER, 0, &thread_pool.crypto_threads,          "0" },
 	{ NULL, -1, 0, NULL, NULL }
 };
 
@@ -282,6 +293,19 @@ static void reap_children(void)
 #define reap_children()
 #endif /* WNOHANG */
 
+/*
+ *	Complain at most once a second.  Several threads can get here
+ *	at once, so only the one which updates the time complains.
+ */
+static int complain_now(time_t *last_complained, time_t now)
+{
+	time_t last = *last_complained;
+
+	if (last == now) return FALSE;
+
+	return __sync_bool_compare_and_swap(last_complained, last, now);
+}
+
 /*
  *	Add a request to the list of waiting requests.
  *	This function gets called ONLY from the main handler thread...
@@ -290,29 +314,22 @@ static void reap_children(void)
  */
 static int request_enqueue(REQUEST *request, RAD_REQUEST_FUNP fun)
 {
-	request_queue_t *entry;
-
-	pthread_mutex_lock(&thread_pool.queue_mutex);
-
-	thread_pool.request_count++;
+	__sync_fetch_and_add(&thread_pool.request_count, 1);
 
-	if (thread_pool.num_queued >= thread_pool.max_queue_size) {
-		int complain = FALSE;
-		time_t now;
+	/*
+	 *	Reserve our place in the queue first, so that
+	 *	num_queued never goes negative when a thread pops
+	 *	the request before we've counted it.
+	 */
+	if (__sync_fetch_and_add(&thread_pool.num_queued, 1) >= thread_pool.max_queue_size) {
 		static time_t last_complained = 0;
 
-		now = time(NULL);
-		if (last_complained != now) {
-			last_complained = now;
-			complain = TRUE;
-		}
-		    
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
+		__sync_fetch_and_sub(&thread_pool.num_queued, 1);
 
 		/*
 		 *	Mark the request as done.
 		 */
-		if (complain) {
+		if (complain_now(&last_complained, time(NULL))) {
 			radlog(L_ERR, "Something is blocking the server.  There are %d packets in the queue, waiting to be processed.  Ignoring the new request.", thread_pool.max_queue_size);
 		}
 		request->child_state = REQUEST_DONE;
@@ -321,34 +338,22 @@ static int request_enqueue(REQUEST *request, RAD_REQUEST_FUNP fun)
 	request->child_state = REQUEST_QUEUED;
 	request->component = "<core>";
 	request->module = "<queue>";
-
-	entry = rad_malloc(sizeof(*entry));
-	entry->request = request;
-	entry->fun = fun;
+	request->process = fun;
 
 	/*
-	 *	Push the request onto the appropriate fifo for that
+	 *	Push the request onto the appropriate queue for that
+	 *	priority.
 	 */
-	if (!fr_fifo_push(thread_pool.fifo[request->priority],
-			    entry)) {
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
+	if (!fr_atomic_queue_push(thread_pool.queue[request->priority],
+				  request)) {
+		__sync_fetch_and_sub(&thread_pool.num_queued, 1);
 		radlog(L_ERR, "!!! ERROR !!! Failed inserting request %d into the queue", request->number);
 		request->child_state = REQUEST_DONE;
 		return 0;
 	}
 
-	thread_pool.num_queued++;
-
-	pthread_mutex_unlock(&thread_pool.queue_mutex);
-
 	/*
 	 *	There's one more request in the queue.
-	 *
-	 *	Note that we're not touching the queue any more, so
-	 *	the semaphore post is outside of the mutex.  This also
-	 *	means that when the thread wakes up and tries to lock
-	 *	the mutex, it will be unlocked, and there won't be
-	 *	contention.
 	 */
 	sem_post(&thread_pool.semaphore);
 
@@ -362,63 +367,32 @@ static int request_dequeue(REQUEST **request, RAD_REQUEST_FUNP *fun)
 {
 	int blocked;
 	RAD_LISTEN_TYPE i, start;
-	request_queue_t *entry;
 
 	reap_children();
 
-	pthread_mutex_lock(&thread_pool.queue_mutex);
-
-	/*
-	 *	Clear old requests from all queues.
-	 *
-	 *	We only do one pass over the queue, in order to
-	 *	amortize the work across the child threads.  Since we
-	 *	do N checks for one request de-queued, the old
-	 *	requests will be quickly cleared.
-	 */
-	for (i = 0; i < RAD_LISTEN_MAX; i++) {
-		entry = fr_fifo_peek(thread_pool.fifo[i]);
-		if (!entry ||
-		    (entry->request->master_state != REQUEST_STOP_PROCESSING)) {
-			continue;
-}
-		/*
-		 *	This entry was marked to be stopped.  Acknowledge it.
-		 */
-		entry = fr_fifo_pop(thread_pool.fifo[i]);
-		rad_assert(entry != NULL);
-		entry->request->child_state = REQUEST_DONE;
-		thread_pool.num_queued--;
-		free(entry);
-		entry = NULL;
-	}
-
 	start = 0;
  retry:
 	/*
 	 *	Pop results from the top of the queue
 	 */
+	*request = NULL;
 	for (i = start; i < RAD_LISTEN_MAX; i++) {
-		entry = fr_fifo_pop(thread_pool.fifo[i]);
-		if (entry) {
+		*request = fr_atomic_queue_pop(thread_pool.queue[i]);
+		if (*request) {
 			start = i;
 			break;
 		}
 	}
 
-	if (!entry) {
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
-		*request = NULL;
+	if (!*request) {
 		*fun = NULL;
 		return 0;
 	}
 
 	rad_assert(thread_pool.num_queued > 0);
-	thread_pool.num_queued--;
-	*request = entry->request;
-	*fun = entry->fun;
-	free(entry);
-	entry = NULL;
+	__sync_fetch_and_sub(&thread_pool.num_queued, 1);
+	*fun = (*request)->process;
+	(*request)->process = NULL;
 
 	rad_assert(*request != NULL);
 	rad_assert((*request)->magic == REQUEST_MAGIC);
@@ -433,7 +407,9 @@ static int request_dequeue(REQUEST **request, RAD_REQUEST_FUNP *fun)
 	 *
 	 *	The main clean-up code can't delete the request from
 	 *	the queue, and therefore won't clean it up until we
-	 *	have acknowledged it as "done".
+	 *	have acknowledged it as "done".  We can't peek at the
+	 *	lock-free queues, so stale requests are acknowledged
+	 *	here, as they're popped.
 	 */
 	if ((*request)->master_state == REQUEST_STOP_PROCESSING) {
 		(*request)->module = "<done>";
@@ -451,10 +427,8 @@ static int request_dequeue(REQUEST **request, RAD_REQUEST_FUNP *fun)
 		blocked = 0;
 	} else {
 		static time_t last_complained = 0;
-		
-		if (last_complained != almost_now) {
-			last_complained = almost_now;
-		} else {
+
+		if (!complain_now(&last_complained, almost_now)) {
 			blocked = 0;
 		}
 	}
@@ -462,9 +436,7 @@ static int request_dequeue(REQUEST **request, RAD_REQUEST_FUNP *fun)
 	/*
 	 *	The thread is currently processing a request.
 	 */
-	thread_pool.active_threads++;
-
-	pthread_mutex_unlock(&thread_pool.queue_mutex);
+	__sync_fetch_and_add(&thread_pool.active_threads, 1);
 
 	if (blocked) {
 		radlog(L_ERR, "Request %u has been waiting in the processing queue for %d seconds.  Check that all databases are running properly!",
@@ -475,6 +447,247 @@ static int request_dequeue(REQUEST **request, RAD_REQUEST_FUNP *fun)
 }
 
 
+/*
+ *	Check if the request is an EAP-Response which continues a
+ *	TLS handshake.  The packet hasn't been decoded yet, so we
+ *	look at the first TLS record in the first EAP-Message of the
+ *	raw data.
+ *
+ *	Once the handshake is done, PEAP and TTLS send the tunnelled
+ *	authentication as application data.  That's cheap, and it
+ *	often waits on a database, so it stays in the main pool, as
+ *	do alerts, and ACKs of our own fragments.
+ */
+static int request_wants_crypto(REQUEST *request)
+{
+	int len;
+	const uint8_t *attr, *end, *eap, *tls;
+
+	if (!thread_pool.crypto_threads) return 0;
+
+	if ((request->priority != RAD_LISTEN_AUTH) ||
+	    (request->packet->code != PW_AUTHENTICATION_REQUEST) ||
+	    request->proxy_reply ||
+	    !request->packet->data ||
+	    (request->packet->data_len < 20)) {	/* AUTH_HDR_LEN */
+		return 0;
+	}
+
+	attr = request->packet->data + 20;	/* AUTH_HDR_LEN */
+	end = request->packet->data + request->packet->data_len;
+
+	while ((attr + 2) <= end) {
+		if ((attr[1] < 2) || ((attr + attr[1]) > end)) return 0;
+
+		if (attr[0] != PW_EAP_MESSAGE) {
+			attr += attr[1];
+			continue;
+		}
+
+		/*
+		 *	code, id, length, type, flags
+		 */
+		if (attr[1] < (2 + 6)) return 0;
+		eap = attr + 2;
+
+		if (eap[0] != EAP_CODE_RESPONSE) return 0;
+
+		if ((eap[4] != EAP_TYPE_TLS) && (eap[4] != EAP_TYPE_TTLS) &&
+		    (eap[4] != EAP_TYPE_PEAP) && (eap[4] != EAP_TYPE_FAST)) {
+			return 0;
+		}
+
+		/*
+		 *	An ACK has no data, and no L or M flags.
+		 */
+		len = (eap[2] << 8) | eap[3];
+		if ((len == 6) && ((eap[5] & 0xc0) == 0)) return 0;
+
+		/*
+		 *	Skip the TLS Message Length, if there is one.
+		 */
+		tls = eap + 6;
+		if ((eap[5] & 0x80) != 0) tls += 4;
+
+		/*
+		 *	type, version (major, minor)
+		 */
+		if ((tls + 3) > (attr + attr[1])) return 0;
+
+		/*
+		 *	Not a record header, so it's the next fragment
+		 *	of a message we're putting back together.  The
+		 *	only messages big enough to be fragmented are
+		 *	certificates, so it's a handshake.
+		 */
+		if ((tls[1] != 3) || (tls[0] < 20) || (tls[0] > 23)) return 1;
+
+		/*
+		 *	Handshake (22), or ChangeCipherSpec (20), which
+		 *	arrives with the client's Finished message.
+		 */
+		return ((tls[0] == 22) || (tls[0] == 20));
+	}
+
+	return 0;
+}
+
+/*
+ *	Add a request to the crypto queue.
+ */
+static int crypto_enqueue(REQUEST *request, RAD_REQUEST_FUNP fun)
+{
+	int queued;
+
+	__sync_fetch_and_add(&thread_pool.request_count, 1);
+
+	queued = __sync_add_and_fetch(&thread_pool.crypto.queued, 1);
+	if (queued > thread_pool.max_queue_size) {
+		static time_t last_complained = 0;
+
+		__sync_fetch_and_sub(&thread_pool.crypto.queued, 1);
+		__sync_fetch_and_add(&thread_pool.crypto.dropped, 1);
+
+		if (complain_now(&last_complained, time(NULL))) {
+			radlog(L_ERR, "The crypto threads are too busy.  There are %d packets in the queue, waiting to be processed.  Ignoring the new request.", thread_pool.max_queue_size);
+		}
+		request->child_state = REQUEST_DONE;
+		return 0;
+	}
+
+	/*
+	 *	High-water mark.  It's only a statistic, so losing a
+	 *	race here doesn't matter much.
+	 */
+	if (queued > thread_pool.crypto.max_queued) {
+		thread_pool.crypto.max_queued = queued;
+	}
+
+	request->child_state = REQUEST_QUEUED;
+	request->component = "<core>";
+	request->module = "<crypto queue>";
+	request->process = fun;
+
+	if (!fr_atomic_queue_push(thread_pool.crypto_queue, request)) {
+		__sync_fetch_and_sub(&thread_pool.crypto.queued, 1);
+		radlog(L_ERR, "!!! ERROR !!! Failed inserting request %d into the crypto queue", request->number);
+		request->child_state = REQUEST_DONE;
+		return 0;
+	}
+
+	sem_post(&thread_pool.crypto_semaphore);
+
+	return 1;
+}
+
+/*
+ *	Remove a request from the crypto queue.
+ */
+static int crypto_dequeue(REQUEST **request, RAD_REQUEST_FUNP *fun)
+{
+	uint64_t usec;
+	struct timeval now;
+
+ retry:
+	*request = fr_atomic_queue_pop(thread_pool.crypto_queue);
+	if (!*request) {
+		*fun = NULL;
+		return 0;
+	}
+
+	rad_assert(thread_pool.crypto.queued > 0);
+	__sync_fetch_and_sub(&thread_pool.crypto.queued, 1);
+	*fun = (*request)->process;
+	(*request)->process = NULL;
+
+	rad_assert((*request)->magic == REQUEST_MAGIC);
+	rad_assert(*fun != NULL);
+
+	(*request)->component = "<core>";
+	(*request)->module = "<crypto thread>";
+
+	/*
+	 *	See request_dequeue().
+	 */
+	if ((*request)->master_state == REQUEST_STOP_PROCESSING) {
+		(*request)->module = "<done>";
+		(*request)->child_state = REQUEST_DONE;
+		goto retry;
+	}
+
+	/*
+	 *	How long the request waited for a crypto thread.
+	 */
+	gettimeofday(&now, NULL);
+	usec = ((now.tv_sec - (*request)->received.tv_sec) * USEC) +
+		(now.tv_usec - (*request)->received.tv_usec);
+	if ((int64_t) usec < 0) usec = 0;
+
+	__sync_fetch_and_add(&thread_pool.crypto.wait_usec, usec);
+	if (usec > thread_pool.crypto.max_wait_usec) {
+		thread_pool.crypto.max_wait_usec = usec;
+	}
+
+	__sync_fetch_and_add(&thread_pool.crypto.active, 1);
+
+	return 1;
+}
+
+/*
+ *	The thread handler for the crypto threads.  They only ever
+ *	take requests from the crypto queue.
+ */
+static void *crypto_handler_thread(void *arg)
+{
+	RAD_REQUEST_FUNP  fun;
+	REQUEST		  *request;
+	uint64_t	  usec;
+	struct timeval	  start, end;
+
+	arg = arg;		/* -Wunused */
+
+	while (1) {
+		if (sem_wait(&thread_pool.crypto_semaphore) != 0) {
+			if (errno == EINTR) continue;
+
+			radlog(L_ERR, "Crypto thread failed waiting for semaphore: %s: Exiting\n",
+			       strerror(errno));
+			break;
+		}
+
+#ifdef HAVE_OPENSSL_ERR_H
+		ERR_clear_error ();
+#endif
+
+		if (!crypto_dequeue(&request, &fun)) continue;
+
+		request->child_pid = pthread_self();
+
+		gettimeofday(&start, NULL);
+		radius_handle_request(request, fun);
+		gettimeofday(&end, NULL);
+
+		usec = ((end.tv_sec - start.tv_sec) * USEC) +
+			(end.tv_usec - start.tv_usec);
+		if ((int64_t) usec < 0) usec = 0;
+
+		__sync_fetch_and_add(&thread_pool.crypto.requests, 1);
+		__sync_fetch_and_add(&thread_pool.crypto.run_usec, usec);
+		if (usec > thread_pool.crypto.max_run_usec) {
+			thread_pool.crypto.max_run_usec = usec;
+		}
+
+		rad_assert(thread_pool.crypto.active > 0);
+		__sync_fetch_and_sub(&thread_pool.crypto.active, 1);
+	}
+
+#ifdef HAVE_OPENSSL_ERR_H
+	ERR_remove_state(0);
+#endif
+
+	return NULL;
+}
+
 /*
  *	The main thread handler for requests.
  *
@@ -540,10 +753,8 @@ static void *request_handler_thread(void *arg)
 		/*
 		 *	Update the active threads.
 		 */
-		pthread_mutex_lock(&thread_pool.queue_mutex);
 		rad_assert(thread_pool.active_threads > 0);
-		thread_pool.active_threads--;
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
+		__sync_fetch_and_sub(&thread_pool.active_threads, 1);
 	} while (self->status != THREAD_CANCELLED);
 
 	DEBUG2("Thread %d exiting...", self->thread_num);
@@ -712,7 +923,7 @@ int total_active_threads(void)
 	 *	in getting the guaranteed correct value; by the time
 	 *	the caller sees it, it can be wrong again.
 	 */
-	return thread_pool.active_threads;
+	return thread_pool.active_threads + thread_pool.crypto.active;
 }
 
 
@@ -803,6 +1014,8 @@ int thread_pool_init(CONF_SECTION *cs, int *spawn_flag)
 		thread_pool.max_spare_threads = 1;
 	if (thread_pool.max_spare_threads < thread_pool.min_spare_threads)
 		thread_pool.max_spare_threads = thread_pool.min_spare_threads;
+	if (thread_pool.crypto_threads < 0)
+		thread_pool.crypto_threads = 0;
 
 	/*
 	 *	The pool has already been initialized.  Don't spawn
@@ -823,20 +1036,15 @@ int thread_pool_init(CONF_SECTION *cs, int *spawn_flag)
 		return -1;
 	}
 
-	rcode = pthread_mutex_init(&thread_pool.queue_mutex,NULL);
-	if (rcode != 0) {
-		radlog(L_ERR, "FATAL: Failed to initialize queue mutex: %s",
-		       strerror(errno));
-		return -1;
-	}
-
 	/*
-	 *	Allocate multiple fifos.
+	 *	Allocate one queue per priority.  Each is big enough
+	 *	to hold max_queue_size requests, so that we never
+	 *	have to allocate memory when queueing a request.
 	 */
 	for (i = 0; i < RAD_LISTEN_MAX; i++) {
-		thread_pool.fifo[i] = fr_fifo_create(thread_pool.max_queue_size, NULL);
-		if (!thread_pool.fifo[i]) {
-			radlog(L_ERR, "FATAL: Failed to set up request fifo");
+		thread_pool.queue[i] = fr_atomic_queue_create(thread_pool.max_queue_size);
+		if (!thread_pool.queue[i]) {
+			radlog(L_ERR, "FATAL: Failed to set up request queue");
 			return -1;
 		}
 	}
@@ -864,6 +1072,48 @@ int thread_pool_init(CONF_SECTION *cs, int *spawn_flag)
 		}
 	}
 
+	/*
+	 *	The crypto threads are all started now, and never
+	 *	exit.  There's no point in managing them, as the
+	 *	handshakes are limited by CPU, not by waiting.
+	 */
+	if (thread_pool.crypto_threads > 0) {
+		pthread_t pthread_id;
+		pthread_attr_t attr;
+
+		rcode = sem_init(&thread_pool.crypto_semaphore, 0,
+				 SEMAPHORE_LOCKED);
+		if (rcode != 0) {
+			radlog(L_ERR, "FATAL: Failed to initialize semaphore: %s",
+			       strerror(errno));
+			return -1;
+		}
+
+		thread_pool.crypto_queue = fr_atomic_queue_create(thread_pool.max_queue_size);
+		if (!thread_pool.crypto_queue) {
+			radlog(L_ERR, "FATAL: Failed to set up crypto queue");
+			return -1;
+		}
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		for (i = 0; i < thread_pool.crypto_threads; i++) {
+			rcode = pthread_create(&pthread_id, &attr,
+					       crypto_handler_thread, NULL);
+			if (rcode != 0) {
+				radlog(L_ERR, "Thread create failed: %s",
+				       strerror(rcode));
+				pthread_attr_destroy(&attr);
+				return -1;
+			}
+		}
+		pthread_attr_destroy(&attr);
+
+		thread_pool.crypto.threads = thread_pool.crypto_threads;
+		DEBUG2("Started %d crypto threads", thread_pool.crypto_threads);
+	}
+
 	DEBUG2("Thread pool initialized");
 	pool_initialized = TRUE;
 	return 0;
@@ -897,6 +1147,14 @@ int thread_pool_addrequest(REQUEST *request, RAD_REQUEST_FUNP fun)
 		return 1;
 	}
 
+	/*
+	 *	TLS handshakes go to the crypto threads.  They don't
+	 *	affect the management of the main pool.
+	 */
+	if (request_wants_crypto(request)) {
+		return crypto_enqueue(request, fun);
+	}
+
 	/*
 	 *	Add the new request to the queue.
 	 */
@@ -1175,23 +1433,13 @@ pid_t rad_waitpid(pid_t pid, int *status)
  */
 #endif
 
-void thread_pool_lock(void)
-{
-	pthread_mutex_lock(&thread_pool.queue_mutex);
-}
-
-void thread_pool_unlock(void)
-{
-	pthread_mutex_unlock(&thread_pool.queue_mutex);
-}
-
 void thread_pool_queue_stats(int *array)
 {
 	int i;
 
 	if (pool_initialized) {
 		for (i = 0; i < RAD_LISTEN_MAX; i++) {
-			array[i] = fr_fifo_num_elements(thread_pool.fifo[i]);
+			array[i] = fr_atomic_queue_num_elements(thread_pool.queue[i]);
 		}
 	} else {
 		for (i = 0; i < RAD_LISTEN_MAX; i++) {
@@ -1199,4 +1447,116 @@ void thread_pool_queue_stats(int *array)
 		}
 	}
 }
+
+void thread_pool_crypto_stats(fr_crypto_pool_stats_t *stats)
+{
+	memcpy(stats, &thread_pool.crypto, sizeof(*stats));
+}
+
+#ifdef TESTING
+/*
+ *  After building the server, in src/main:
+ *
+ *  cc -g -O2 -D_REENTRANT -DNDEBUG -DTESTING -I.. -I../.. -c threads.c -o threads_test.o && cc threads_test.o xlat.o util.o valuepair.o log.o exec.o conffile.o evaluate.o ../lib/.libs/libfreeradius-radius.a -lcrypto -lpthread -o threads
+ *
+ *  Leave out -DNDEBUG if the server was configured with
+ *  --enable-developer, as REQUEST is a different size.
+ *
+ *  ./threads
+ *
+ *  Checks which EAP packets request_wants_crypto() sends to the
+ *  crypto threads.
+ */
+int		debug_flag = 0;
+const char	*radacct_dir = NULL;
+const char	*radius_dir = RADDBDIR;
+const char	*radlog_dir = NULL;
+struct main_config_t mainconfig;
+char		*request_log_file = NULL;
+char		*debug_log_file = NULL;
+
+void radius_handle_request(UNUSED REQUEST *request,
+			   UNUSED RAD_REQUEST_FUNP fun)
+{
+}
+
+typedef struct crypto_test_t {
+	const char	*name;
+	int		eap_type;
+	int		flags;
+	int		len;		/* of the TLS data */
+	uint8_t		tls[8];
+	int		wants_crypto;
+} crypto_test_t;
+
+static const crypto_test_t crypto_tests[] = {
+	{ "EAP-TLS ClientHello", EAP_TYPE_TLS, 0x00, 8,
+	  { 22, 3, 1, 0, 0x40, 1, 0, 0 }, 1 },
+	{ "TTLS first fragment", EAP_TYPE_TTLS, 0xc0, 8,
+	  { 0, 0, 0x10, 0, 22, 3, 1, 0 }, 1 },
+	{ "EAP-TLS next fragment", EAP_TYPE_TLS, 0x40, 8,
+	  { 0x8a, 0x5b, 0x13, 0x02, 0xe4, 0x77, 0x00, 0x91 }, 1 },
+	{ "PEAP ChangeCipherSpec and Finished", EAP_TYPE_PEAP, 0x00, 8,
+	  { 20, 3, 1, 0, 1, 1, 22, 3 }, 1 },
+	{ "ACK", EAP_TYPE_TLS, 0x00, 0,
+	  { 0 }, 0 },
+	{ "TTLS tunnelled PAP", EAP_TYPE_TTLS, 0x00, 8,
+	  { 23, 3, 1, 0, 0x30, 0x8f, 0x1e, 0x02 }, 0 },
+	{ "PEAP tunnelled MS-CHAPv2", EAP_TYPE_PEAP, 0x00, 8,
+	  { 23, 3, 1, 0, 0x50, 0x11, 0x42, 0x7c }, 0 },
+	{ "TTLS tunnelled PAP, with the length", EAP_TYPE_TTLS, 0x80, 8,
+	  { 0, 0, 0, 0x35, 23, 3, 1, 0 }, 0 },
+	{ "Alert", EAP_TYPE_TLS, 0x00, 8,
+	  { 21, 3, 1, 0, 2, 1, 0, 0 }, 0 },
+	{ "EAP-MD5", 4, 0x00, 8,
+	  { 16, 1, 2, 3, 4, 5, 6, 7 }, 0 },
+	{ NULL, 0, 0, 0, { 0 }, 0 }
+};
+
+int main(void)
+{
+	int i, len, wants_crypto, failed = 0;
+	uint8_t data[64];
+	uint8_t *eap;
+	REQUEST request;
+	RADIUS_PACKET packet;
+	const crypto_test_t *t;
+
+	thread_pool.crypto_threads = 1;
+
+	for (i = 0; crypto_tests[i].name != NULL; i++) {
+		t = &crypto_tests[i];
+
+		len = 6 + t->len;
+		memset(data, 0, sizeof(data));
+		data[0] = PW_AUTHENTICATION_REQUEST;
+		data[20] = PW_EAP_MESSAGE;
+		data[21] = 2 + len;
+		eap = data + 22;
+		eap[0] = EAP_CODE_RESPONSE;
+		eap[1] = i;
+		eap[2] = len >> 8;
+		eap[3] = len & 0xff;
+		eap[4] = t->eap_type;
+		eap[5] = t->flags;
+		memcpy(eap + 6, t->tls, t->len);
+
+		memset(&packet, 0, sizeof(packet));
+		packet.code = PW_AUTHENTICATION_REQUEST;
+		packet.data = data;
+		packet.data_len = 22 + len;
+
+		memset(&request, 0, sizeof(request));
+		request.priority = RAD_LISTEN_AUTH;
+		request.packet = &packet;
+
+		wants_crypto = request_wants_crypto(&request);
+		printf("%-40s %s\n", t->name,
+		       (wants_crypto == t->wants_crypto) ? "ok" : "FAILED");
+		if (wants_crypto != t->wants_crypto) failed++;
+	}
+
+	return (failed != 0);
+}
+#endif
 #endif /* HAVE_PTHREAD_H */
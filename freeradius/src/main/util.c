@@ -185,6 +185,10 @@ void *request_data_reference(REQUEST *request,
 	return NULL;		/* wasn't found, too bad... */
 }
 
+/*
+ *	There's one of these for every packet, so re-use them.
+ */
+static fr_slab_t *request_slab = NULL;
 
 /*
  *	Free a REQUEST struct.
@@ -264,7 +268,7 @@ void request_free(REQUEST **request_ptr)
 #ifdef WITH_PROXY
 	request->home_server = NULL;
 #endif
-	free(request);
+	fr_slab_free(request_slab, request);
 
 	*request_ptr = NULL;
 }
@@ -374,7 +378,9 @@ REQUEST *request_alloc(void)
 {
 	REQUEST *request;
 
-	request = rad_malloc(sizeof(REQUEST));
+	request = fr_slab_alloc(fr_slab_get(&request_slab, "REQUEST",
+					    sizeof(REQUEST)));
+	if (!request) request = rad_malloc(sizeof(REQUEST));
 	memset(request, 0, sizeof(REQUEST));
 #ifndef NDEBUG
 	request->magic = REQUEST_MAGIC;
@@ -519,6 +525,7 @@ int rad_copy_string(char *to, const char *from)
 		if (*from == '\\') {
 			*(to++) = *(from++);
 			length++;
+			if (!*from) return -1;
 		}
 		*(to++) = *(from++);
 		length++;
@@ -563,6 +570,7 @@ int rad_copy_variable(char *to, const char *from)
 			return length; /* proper end of variable */
 
 		case '\\':
+			if (!from[1]) return -1; /* don't run off the end */
 			*(to++) = *(from++);
 			*(to++) = *(from++);
 			length += 2;
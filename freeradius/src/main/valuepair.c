@@ -69,7 +69,7 @@ int radius_compare_vps(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 #ifdef HAVE_REGEX_H
 	if (check->operator == T_OP_REG_EQ) {
 		int i, compare;
-		regex_t reg;
+		regex_t *preg;
 		char name[1024];
 		char value[1024];
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
@@ -80,18 +80,14 @@ int radius_compare_vps(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 		/*
 		 *	Include substring matches.
 		 */
-		compare = regcomp(&reg, check->vp_strvalue, REG_EXTENDED);
-		if (compare != 0) {
-			char buffer[256];
-			regerror(compare, &reg, buffer, sizeof(buffer));
-
-			RDEBUG("Invalid regular expression %s: %s",
-			       check->vp_strvalue, buffer);
+		preg = fr_regex_get(check->vp_strvalue, REG_EXTENDED);
+		if (!preg) {
+			RDEBUG("%s", fr_strerror());
 			return -1;
 		}
-		compare = regexec(&reg, value,  REQUEST_MAX_REGEX + 1,
+		compare = regexec(preg, value,  REQUEST_MAX_REGEX + 1,
 				  rxmatch, 0);
-		regfree(&reg);
+		fr_regex_release(preg);
 
 		/*
 		 *	Add %{0}, %{1}, etc.
@@ -146,7 +142,7 @@ int radius_compare_vps(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 
 	if (check->operator == T_OP_REG_NE) {
 		int compare;
-		regex_t reg;
+		regex_t *preg;
 		char name[1024];
 		char value[1024];
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
@@ -157,19 +153,14 @@ int radius_compare_vps(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 		/*
 		 *	Include substring matches.
 		 */
-		compare = regcomp(&reg, (char *)check->vp_strvalue,
-				  REG_EXTENDED);
-		if (compare != 0) {
-			char buffer[256];
-			regerror(compare, &reg, buffer, sizeof(buffer));
-
-			RDEBUG("Invalid regular expression %s: %s",
-			       check->vp_strvalue, buffer);
+		preg = fr_regex_get(check->vp_strvalue, REG_EXTENDED);
+		if (!preg) {
+			RDEBUG("%s", fr_strerror());
 			return -1;
 		}
-		compare = regexec(&reg, value,  REQUEST_MAX_REGEX + 1,
+		compare = regexec(preg, value,  REQUEST_MAX_REGEX + 1,
 				  rxmatch, 0);
-		regfree(&reg);
+		fr_regex_release(preg);
 
 		if (compare != 0) return 0;
 		return -1;
@@ -553,6 +544,8 @@ void pairxlatmove(REQUEST *req, VALUE_PAIR **to, VALUE_PAIR **from)
 	VALUE_PAIR **tailto, *i, *j, *next;
 	VALUE_PAIR *tailfrom = NULL;
 	VALUE_PAIR *found;
+	int num_from = 0;
+	fr_pair_index_t *pi;
 
 	/*
 	 *	Point "tailto" to the end of the "to" list.
@@ -562,6 +555,9 @@ void pairxlatmove(REQUEST *req, VALUE_PAIR **to, VALUE_PAIR **from)
 		tailto = &i->next;
 	}
 
+	for(i = *from; i; i = i->next) num_from++;
+	pi = pairindex_create(*to, num_from);
+
 	/*
 	 *	Loop over the "from" list.
 	 */
@@ -595,7 +591,7 @@ void pairxlatmove(REQUEST *req, VALUE_PAIR **to, VALUE_PAIR **from)
 			pairparsevalue(i, buffer);
 		}
 
-		found = pairfind(*to, i->attribute);
+		found = pairindex_find(pi, *to, i->attribute);
 		switch (i->operator) {
 
 			/*
@@ -607,6 +603,7 @@ void pairxlatmove(REQUEST *req, VALUE_PAIR **to, VALUE_PAIR **from)
 				if (!i->vp_strvalue[0] ||
 				    (strcmp((char *)found->vp_strvalue,
 					    (char *)i->vp_strvalue) == 0)){
+					pairindex_delete(pi, found->attribute);
 					pairdelete(to, found->attribute);
 
 					/*
@@ -683,8 +680,15 @@ void pairxlatmove(REQUEST *req, VALUE_PAIR **to, VALUE_PAIR **from)
 		if (i) {
 			i->next = NULL;
 			tailto = &i->next;
+
+			if (!pairindex_add(pi, i)) {
+				pairindex_free(pi);
+				pi = NULL;
+			}
 		}
 	} /* loop over the 'from' list */
+
+	pairindex_free(pi);
 }
 
 /*
@@ -114,18 +114,16 @@ redo:
 }
 
 /*
- *	Dynamically translate for check:, request:, reply:, etc.
+ *	Find the list (and packet) which check:, request:, reply:, etc.
+ *	refer to.
  */
-static size_t xlat_packet(void *instance, REQUEST *request,
-			  char *fmt, char *out, size_t outlen,
-			  RADIUS_ESCAPE_STRING func)
+static int xlat_packet_list(REQUEST *request, int list,
+			    VALUE_PAIR **pvps, RADIUS_PACKET **ppacket)
 {
-	DICT_ATTR	*da;
-	VALUE_PAIR	*vp;
 	VALUE_PAIR	*vps = NULL;
 	RADIUS_PACKET	*packet = NULL;
 
-	switch (*(int*) instance) {
+	switch (list) {
 	case 0:
 		vps = request->config_items;
 		break;
@@ -178,6 +176,179 @@ static size_t xlat_packet(void *instance, REQUEST *request,
 		return 0;
 	}
 
+	*pvps = vps;
+	*ppacket = packet;
+	return 1;
+}
+
+/*
+ *	Print a known attribute from a list.
+ */
+static size_t xlat_packet_attr(REQUEST *request, VALUE_PAIR *vps,
+			       RADIUS_PACKET *packet, const DICT_ATTR *da,
+			       char *out, size_t outlen,
+			       RADIUS_ESCAPE_STRING func)
+{
+	VALUE_PAIR	*vp;
+
+	vp = pairfind(vps, da->attr);
+	if (!vp) {
+		/*
+		 *	Some "magic" handlers, which are never in VP's, but
+		 *	which are in the packet.
+		 *
+		 *	FIXME: We should really do this in a more
+		 *	intelligent way...
+		 */
+		if (packet) {
+			VALUE_PAIR localvp;
+
+			memset(&localvp, 0, sizeof(localvp));
+
+			switch (da->attr) {
+			case PW_PACKET_TYPE:
+			{
+				DICT_VALUE *dval;
+
+				dval = dict_valbyattr(da->attr, packet->code);
+				if (dval) {
+					snprintf(out, outlen, "%s", dval->name);
+				} else {
+					snprintf(out, outlen, "%d", packet->code);
+				}
+				return strlen(out);
+			}
+			break;
+
+			case PW_CLIENT_SHORTNAME:
+				if (request->client && request->client->shortname) {
+					strlcpy(out, request->client->shortname, outlen);
+				} else {
+					strlcpy(out, "<UNKNOWN-CLIENT>", outlen);
+				}
+				return strlen(out);
+
+			case PW_CLIENT_IP_ADDRESS: /* the same as below */
+			case PW_PACKET_SRC_IP_ADDRESS:
+				if (packet->src_ipaddr.af != AF_INET) {
+					return 0;
+				}
+				localvp.attribute = da->attr;
+				localvp.vp_ipaddr = packet->src_ipaddr.ipaddr.ip4addr.s_addr;
+				break;
+
+			case PW_PACKET_DST_IP_ADDRESS:
+				if (packet->dst_ipaddr.af != AF_INET) {
+					return 0;
+				}
+				localvp.attribute = da->attr;
+				localvp.vp_ipaddr = packet->dst_ipaddr.ipaddr.ip4addr.s_addr;
+				break;
+
+			case PW_PACKET_SRC_PORT:
+				localvp.attribute = da->attr;
+				localvp.vp_integer = packet->src_port;
+				break;
+
+			case PW_PACKET_DST_PORT:
+				localvp.attribute = da->attr;
+				localvp.vp_integer = packet->dst_port;
+				break;
+
+			case PW_PACKET_AUTHENTICATION_VECTOR:
+				localvp.attribute = da->attr;
+				memcpy(localvp.vp_strvalue, packet->vector,
+				       sizeof(packet->vector));
+				localvp.length = sizeof(packet->vector);
+				break;
+
+				/*
+				 *	Authorization, accounting, etc.
+				 */
+			case PW_REQUEST_PROCESSING_STAGE:
+				if (request->component) {
+					strlcpy(out, request->component, outlen);
+				} else {
+					strlcpy(out, "server_core", outlen);
+				}
+				return strlen(out);
+
+			case PW_PACKET_SRC_IPV6_ADDRESS:
+				if (packet->src_ipaddr.af != AF_INET6) {
+					return 0;
+				}
+				localvp.attribute = da->attr;
+				memcpy(localvp.vp_strvalue,
+				       &packet->src_ipaddr.ipaddr.ip6addr,
+				       sizeof(packet->src_ipaddr.ipaddr.ip6addr));
+				break;
+
+			case PW_PACKET_DST_IPV6_ADDRESS:
+				if (packet->dst_ipaddr.af != AF_INET6) {
+					return 0;
+				}
+				localvp.attribute = da->attr;
+				memcpy(localvp.vp_strvalue,
+				       &packet->dst_ipaddr.ipaddr.ip6addr,
+				       sizeof(packet->dst_ipaddr.ipaddr.ip6addr));
+				break;
+
+			case PW_VIRTUAL_SERVER:
+				if (!request->server) return 0;
+
+				snprintf(out, outlen, "%s", request->server);
+				return strlen(out);
+				break;
+
+			case PW_MODULE_RETURN_CODE:
+				localvp.attribute = da->attr;
+
+				/*
+				 *	See modcall.c for a bit of a hack.
+				 */
+				localvp.vp_integer = request->simul_max;
+				break;
+
+			default:
+				return 0; /* not found */
+				break;
+			}
+
+			localvp.type = da->type;
+			return valuepair2str(out, outlen, &localvp,
+					     da->type, func);
+		}
+
+		/*
+		 *	Not found, die.
+		 */
+		return 0;
+	}
+
+	if (!vps) return 0;	/* silently fail */
+
+	/*
+	 *	Convert the VP to a string, and return it.
+	 */
+	return valuepair2str(out, outlen, vp, da->type, func);
+}
+
+/*
+ *	Dynamically translate for check:, request:, reply:, etc.
+ */
+static size_t xlat_packet(void *instance, REQUEST *request,
+			  char *fmt, char *out, size_t outlen,
+			  RADIUS_ESCAPE_STRING func)
+{
+	DICT_ATTR	*da;
+	VALUE_PAIR	*vp;
+	VALUE_PAIR	*vps = NULL;
+	RADIUS_PACKET	*packet = NULL;
+
+	if (!xlat_packet_list(request, *(int*) instance, &vps, &packet)) {
+		return 0;
+	}
+
 	/*
 	 *	The "format" string is the attribute name.
 	 */
@@ -335,187 +506,48 @@ static size_t xlat_packet(void *instance, REQUEST *request,
 		return valuepair2str(out, outlen, vp, da->type, func);
 	}
 
-	vp = pairfind(vps, da->attr);
-	if (!vp) {
-		/*
-		 *	Some "magic" handlers, which are never in VP's, but
-		 *	which are in the packet.
-		 *
-		 *	FIXME: We should really do this in a more
-		 *	intelligent way...
-		 */
-		if (packet) {
-			VALUE_PAIR localvp;
+	return xlat_packet_attr(request, vps, packet, da, out, outlen, func);
+}
 
-			memset(&localvp, 0, sizeof(localvp));
+/*
+ *	Print data as integer, not as VALUE.
+ */
+static size_t xlat_integer(UNUSED void *instance, REQUEST *request,
+			   char *fmt, char *out, size_t outlen,
+			   UNUSED RADIUS_ESCAPE_STRING func)
+{
+	VALUE_PAIR *vp;
 
-			switch (da->attr) {
-			case PW_PACKET_TYPE:
-			{
-				DICT_VALUE *dval;
+	while (isspace((int) *fmt)) fmt++;
 
-				dval = dict_valbyattr(da->attr, packet->code);
-				if (dval) {
-					snprintf(out, outlen, "%s", dval->name);
-				} else {
-					snprintf(out, outlen, "%d", packet->code);
-				}
-				return strlen(out);
-			}
-			break;
+	if (!radius_get_vp(request, fmt, &vp) || !vp) {
+		*out = '\0';
+		return 0;
+	}
 
-			case PW_CLIENT_SHORTNAME:
-				if (request->client && request->client->shortname) {
-					strlcpy(out, request->client->shortname, outlen);
-				} else {
-					strlcpy(out, "<UNKNOWN-CLIENT>", outlen);
-				}
-				return strlen(out);
+	if ((vp->type != PW_TYPE_IPADDR) &&
+	    (vp->type != PW_TYPE_INTEGER) &&
+	    (vp->type != PW_TYPE_SHORT) &&
+	    (vp->type != PW_TYPE_BYTE) &&
+	    (vp->type != PW_TYPE_DATE)) {
+		*out = '\0';
+		return 0;
+	}
 
-			case PW_CLIENT_IP_ADDRESS: /* the same as below */
-			case PW_PACKET_SRC_IP_ADDRESS:
-				if (packet->src_ipaddr.af != AF_INET) {
-					return 0;
-				}
-				localvp.attribute = da->attr;
-				localvp.vp_ipaddr = packet->src_ipaddr.ipaddr.ip4addr.s_addr;
-				break;
+	return snprintf(out, outlen, "%u", vp->vp_integer);
+}
 
-			case PW_PACKET_DST_IP_ADDRESS:
-				if (packet->dst_ipaddr.af != AF_INET) {
-					return 0;
-				}
-				localvp.attribute = da->attr;
-				localvp.vp_ipaddr = packet->dst_ipaddr.ipaddr.ip4addr.s_addr;
-				break;
+/*
+ *	Print data as string, if possible.
+ */
+static size_t xlat_string(UNUSED void *instance, REQUEST *request,
+			  char *fmt, char *out, size_t outlen,
+			  UNUSED RADIUS_ESCAPE_STRING func)
+{
+	int len;
+	VALUE_PAIR *vp;
 
-			case PW_PACKET_SRC_PORT:
-				localvp.attribute = da->attr;
-				localvp.vp_integer = packet->src_port;
-				break;
-
-			case PW_PACKET_DST_PORT:
-				localvp.attribute = da->attr;
-				localvp.vp_integer = packet->dst_port;
-				break;
-
-			case PW_PACKET_AUTHENTICATION_VECTOR:
-				localvp.attribute = da->attr;
-				memcpy(localvp.vp_strvalue, packet->vector,
-				       sizeof(packet->vector));
-				localvp.length = sizeof(packet->vector);
-				break;
-
-				/*
-				 *	Authorization, accounting, etc.
-				 */
-			case PW_REQUEST_PROCESSING_STAGE:
-				if (request->component) {
-					strlcpy(out, request->component, outlen);
-				} else {
-					strlcpy(out, "server_core", outlen);
-				}
-				return strlen(out);
-
-			case PW_PACKET_SRC_IPV6_ADDRESS:
-				if (packet->src_ipaddr.af != AF_INET6) {
-					return 0;
-				}
-				localvp.attribute = da->attr;
-				memcpy(localvp.vp_strvalue,
-				       &packet->src_ipaddr.ipaddr.ip6addr,
-				       sizeof(packet->src_ipaddr.ipaddr.ip6addr));
-				break;
-
-			case PW_PACKET_DST_IPV6_ADDRESS:
-				if (packet->dst_ipaddr.af != AF_INET6) {
-					return 0;
-				}
-				localvp.attribute = da->attr;
-				memcpy(localvp.vp_strvalue,
-				       &packet->dst_ipaddr.ipaddr.ip6addr,
-				       sizeof(packet->dst_ipaddr.ipaddr.ip6addr));
-				break;
-
-			case PW_VIRTUAL_SERVER:
-				if (!request->server) return 0;
-
-				snprintf(out, outlen, "%s", request->server);
-				return strlen(out);
-				break;
-
-			case PW_MODULE_RETURN_CODE:
-				localvp.attribute = da->attr;
-
-				/*
-				 *	See modcall.c for a bit of a hack.
-				 */
-				localvp.vp_integer = request->simul_max;
-				break;
-
-			default:
-				return 0; /* not found */
-				break;
-			}
-
-			localvp.type = da->type;
-			return valuepair2str(out, outlen, &localvp,
-					     da->type, func);
-		}
-
-		/*
-		 *	Not found, die.
-		 */
-		return 0;
-	}
-
-	if (!vps) return 0;	/* silently fail */
-
-	/*
-	 *	Convert the VP to a string, and return it.
-	 */
-	return valuepair2str(out, outlen, vp, da->type, func);
-}
-
-/*
- *	Print data as integer, not as VALUE.
- */
-static size_t xlat_integer(UNUSED void *instance, REQUEST *request,
-			   char *fmt, char *out, size_t outlen,
-			   UNUSED RADIUS_ESCAPE_STRING func)
-{
-	VALUE_PAIR *vp;
-
-	while (isspace((int) *fmt)) fmt++;
-
-	if (!radius_get_vp(request, fmt, &vp) || !vp) {
-		*out = '\0';
-		return 0;
-	}
-
-	if ((vp->type != PW_TYPE_IPADDR) &&
-	    (vp->type != PW_TYPE_INTEGER) &&
-	    (vp->type != PW_TYPE_SHORT) &&
-	    (vp->type != PW_TYPE_BYTE) &&
-	    (vp->type != PW_TYPE_DATE)) {
-		*out = '\0';
-		return 0;
-	}
-
-	return snprintf(out, outlen, "%u", vp->vp_integer);
-}
-
-/*
- *	Print data as string, if possible.
- */
-static size_t xlat_string(UNUSED void *instance, REQUEST *request,
-			  char *fmt, char *out, size_t outlen,
-			  UNUSED RADIUS_ESCAPE_STRING func)
-{
-	int len;
-	VALUE_PAIR *vp;
-
-	while (isspace((int) *fmt)) fmt++;
+	while (isspace((int) *fmt)) fmt++;
 
 	if (outlen < 3) {
 	nothing:
@@ -704,12 +736,16 @@ static int xlat_cmp(const void *a, const void *b)
  */
 static xlat_t *xlat_find(const char *module)
 {
+	xlat_t *c;
 	xlat_t my_xlat;
 
 	strlcpy(my_xlat.module, module, sizeof(my_xlat.module));
 	my_xlat.length = strlen(my_xlat.module);
 
-	return rbtree_finddata(xlat_root, &my_xlat);
+	c = rbtree_finddata(xlat_root, &my_xlat);
+	if (c && !c->do_xlat) return NULL; /* unregistered */
+
+	return c;
 }
 
 
@@ -864,7 +900,13 @@ void xlat_unregister(const char *module, RAD_XLAT_FUNC func, void *instance)
 
 	if (c->instance != instance) return;
 
-	rbtree_deletebydata(xlat_root, c);
+	/*
+	 *	Compiled templates may point to this entry, so it
+	 *	isn't deleted.  It's re-used if the module registers
+	 *	again, and freed with the rest of the tree.
+	 */
+	c->do_xlat = NULL;
+	c->instance = NULL;
 }
 
 /*
@@ -1132,55 +1174,337 @@ static size_t xlat_copy(char *out, size_t outlen, const char *in)
 }
 
 /*
- *	Replace %<whatever> in a string.
+ *	Expand a single-letter %<whatever>.
  *
  *	See 'doc/variables.txt' for more information.
  */
-int radius_xlat(char *out, int outlen, const char *fmt,
-		REQUEST *request, RADIUS_ESCAPE_STRING func)
+static int xlat_percent(REQUEST *request, int letter, char *q, int freespace,
+			RADIUS_ESCAPE_STRING func)
 {
-	int c, len, freespace;
-	const char *p;
-	char *q;
+	int len;
+	char *start = q;
 	char *nl;
 	VALUE_PAIR *tmp;
 	struct tm *TM, s_TM;
 	char tmpdt[40]; /* For temporary storing of dates */
-	int openbraces=0;
+	const char *datefmt;
+
+	switch (letter) {
+	case 'a': /* Protocol: */
+		return valuepair2str(q,freespace,pairfind(request->reply->vps,PW_FRAMED_PROTOCOL),PW_TYPE_INTEGER, func);
+	case 'c': /* Callback-Number */
+		return valuepair2str(q,freespace,pairfind(request->reply->vps,PW_CALLBACK_NUMBER),PW_TYPE_STRING, func);
+	case 'd': /* request day */
+		datefmt = "%d";
+		goto do_date;
+	case 'f': /* Framed IP address */
+		return valuepair2str(q,freespace,pairfind(request->reply->vps,PW_FRAMED_IP_ADDRESS),PW_TYPE_IPADDR, func);
+	case 'i': /* Calling station ID */
+		return valuepair2str(q,freespace,pairfind(request->packet->vps,PW_CALLING_STATION_ID),PW_TYPE_STRING, func);
+	case 'l': /* request timestamp */
+		snprintf(tmpdt, sizeof(tmpdt), "%lu",
+			 (unsigned long) request->timestamp);
+		strlcpy(q,tmpdt,freespace);
+		return strlen(q);
+	case 'm': /* request month */
+		datefmt = "%m";
+		goto do_date;
+	case 'n': /* NAS IP address */
+		return valuepair2str(q,freespace,pairfind(request->packet->vps,PW_NAS_IP_ADDRESS),PW_TYPE_IPADDR, func);
+	case 'p': /* Port number */
+		return valuepair2str(q,freespace,pairfind(request->packet->vps,PW_NAS_PORT),PW_TYPE_INTEGER, func);
+	case 's': /* Speed */
+		return valuepair2str(q,freespace,pairfind(request->packet->vps,PW_CONNECT_INFO),PW_TYPE_STRING, func);
+	case 't': /* request timestamp */
+		CTIME_R(&request->timestamp, tmpdt, sizeof(tmpdt));
+		nl = strchr(tmpdt, '\n');
+		if (nl) *nl = '\0';
+		strlcpy(q, tmpdt, freespace);
+		return strlen(q);
+	case 'u': /* User name */
+		return valuepair2str(q,freespace,pairfind(request->packet->vps,PW_USER_NAME),PW_TYPE_STRING, func);
+	case 'A': /* radacct_dir */
+		strlcpy(q,radacct_dir,freespace);
+		return strlen(q);
+	case 'C': /* ClientName */
+		strlcpy(q,request->client->shortname,freespace);
+		return strlen(q);
+	case 'D': /* request date */
+		datefmt = "%Y%m%d";
+		goto do_date;
+	case 'H': /* request hour */
+		datefmt = "%H";
+		goto do_date;
+	case 'I': /* Request ID */
+		snprintf(tmpdt, sizeof(tmpdt), "%i", request->packet->id);
+		strlcpy(q, tmpdt, freespace);
+		return strlen(q);
+	case 'L': /* radlog_dir */
+		strlcpy(q,radlog_dir,freespace);
+		return strlen(q);
+	case 'G': /* request minute */
+		datefmt = "%M";
+		goto do_date;
+	case 'M': /* MTU */
+		return valuepair2str(q,freespace,pairfind(request->reply->vps,PW_FRAMED_MTU),PW_TYPE_INTEGER, func);
+	case 'R': /* radius_dir */
+		strlcpy(q,radius_dir,freespace);
+		return strlen(q);
+	case 'S': /* request timestamp in SQL format*/
+		datefmt = "%Y-%m-%d %H:%M:%S";
+		goto do_date;
+	case 'T': /* request timestamp */
+		datefmt = "%Y-%m-%d-%H.%M.%S.000000";
+		goto do_date;
+	case 'U': /* Stripped User name */
+		return valuepair2str(q,freespace,pairfind(request->packet->vps,PW_STRIPPED_USER_NAME),PW_TYPE_STRING, func);
+	case 'V': /* Request-Authenticator */
+		strlcpy(q,"Verified",freespace);
+		return strlen(q);
+	case 'Y': /* request year */
+		datefmt = "%Y";
+		goto do_date;
+	case 'Z': /* Full request pairs except password */
+		tmp = request->packet->vps;
+		while (tmp && (freespace > 3)) {
+			if (tmp->attribute != PW_USER_PASSWORD) {
+				*q++ = '\t';
+				len = vp_prints(q, freespace - 2, tmp);
+				q += len;
+				freespace -= (len + 2);
+				*q++ = '\n';
+			}
+			tmp = tmp->next;
+		}
+		return q - start;
+	default:
+		RDEBUG2("WARNING: Unknown variable '%%%c': See 'doc/variables.txt'", letter);
+		if (freespace > 2) {
+			*q++ = '%';
+			*q++ = letter;
+		} else {
+			*q++ = letter;
+		}
+		return q - start;
+	}
+
+do_date:
+	TM = localtime_r(&request->timestamp, &s_TM);
+	len = strftime(tmpdt, sizeof(tmpdt), datefmt, TM);
+	if (len > 0) {
+		strlcpy(q, tmpdt, freespace);
+		return strlen(q);
+	}
+	return 0;
+}
+/*
+ *	A format string is parsed into a list of nodes.  Literal text
+ *	is stored with the escapes already processed.  Simple
+ *	attribute references and module calls are looked up when the
+ *	node is parsed.  Anything more complicated (%{%{foo}:-bar},
+ *	%{Attr:-bar}, and references to modules which aren't loaded
+ *	yet) is kept as text, and decoded when it is expanded.
+ *
+ *	radius_xlat() parses and expands one node at a time.  A
+ *	template keeps the nodes, so that the parsing is done once.
+ */
+typedef enum xlat_node_type_t {
+	XLAT_LITERAL = 0,
+	XLAT_PERCENT,		/* %u, %t, ... */
+	XLAT_ATTRIBUTE,		/* %{User-Name}, %{reply:Reply-Message} */
+	XLAT_FUNCTION,		/* %{module:string}, %{0} */
+	XLAT_VARIABLE		/* everything else */
+} xlat_node_type_t;
+
+typedef struct xlat_node_t {
+	struct xlat_node_t *next;
+	xlat_node_type_t type;
+	int		letter;
+	int		do_length;
+	int		list;
+	const DICT_ATTR	*da;
+	const xlat_t	*xlat;
+	int		len;
+	char		text[1];
+} xlat_node_t;
+
+struct xlat_template_t {
+	xlat_node_t	*head;
+	int		max_call;	/* longest function argument */
+	char		fmt[1];
+};
+
+#define XLAT_MAX_TEXT (8192)
+
+/*
+ *	A node never holds more text than the format it was parsed
+ *	from, so short formats are parsed on the stack.  Longer ones
+ *	get one node from the heap for the whole expansion, which
+ *	keeps nested expansions from eating the thread's stack.
+ */
+#define XLAT_SMALL_TEXT (256)
+
+typedef union xlat_scratch_t {
+	xlat_node_t	node;
+	char		buffer[sizeof(xlat_node_t) + XLAT_SMALL_TEXT];
+} xlat_scratch_t;
+
+static xlat_node_t *xlat_scratch_alloc(xlat_scratch_t *scratch,
+				       size_t fmtlen)
+{
+	if (fmtlen < XLAT_SMALL_TEXT) return &scratch->node;
+
+	if (fmtlen > XLAT_MAX_TEXT) fmtlen = XLAT_MAX_TEXT;
+	return rad_malloc(sizeof(xlat_node_t) + fmtlen);
+}
+
+static void xlat_scratch_free(xlat_scratch_t *scratch, xlat_node_t *node)
+{
+	if (node != &scratch->node) free(node);
+}
+
+/*
+ *	Parse a %{...} reference, using the same rules as
+ *	decode_attribute().
+ */
+static int xlat_parse_variable(const char **from, const char *end,
+			       xlat_node_t *node)
+{
+	int		varlen;
+	const char	*module_name;
+	char		*p, *l;
+	const xlat_t	*c;
+	const DICT_ATTR	*da;
 
 	/*
-	 *	Catch bad modules.
+	 *	Use the node text as a scratch buffer.
+	 *	rad_copy_variable() doesn't know how big the output
+	 *	is, so if the rest of the format may not fit, copy
+	 *	the variable somewhere larger first, and then check
+	 *	that the variable itself fits.
 	 */
-	if (!fmt || !out || !request) return 0;
+	if ((end - *from) < XLAT_MAX_TEXT) {
+		varlen = rad_copy_variable(node->text, *from);
+	} else {
+		char *buffer;
+
+		buffer = rad_malloc((end - *from) + 1);
+		varlen = rad_copy_variable(buffer, *from);
+		if (varlen >= XLAT_MAX_TEXT) {
+			free(buffer);
+			fr_strerror_printf("Variable is too long: %s", *from);
+			return -1;
+		}
+		if (varlen >= 0) memcpy(node->text, buffer, varlen + 1);
+		free(buffer);
+	}
+	if (varlen < 0) {
+		fr_strerror_printf("Badly formatted variable: %s", *from);
+		return -1;
+	}
+
+	p = node->text;
+	p[varlen - 1] = '\0';
+	p += 2;
+	if (*p == '#') {
+		p++;
+		node->do_length = 1;
+	}
 
 	/*
-	 *  Ensure that we always have an escaping function.
+	 *	%{%{foo}:-%{bar}}
 	 */
-	if (func == NULL) {
-		func = xlat_copy;
-	}
+	if ((p[0] == '%') && (p[1] == '{')) goto variable;
 
-       	q = out;
-	p = fmt;
-	while (*p) {
-		/* Calculate freespace in output */
-		freespace = outlen - (q - out);
-		if (freespace <= 1)
+	module_name = NULL;
+	for (l = p; *l != '\0'; l++) {
+		if (*l == '\\') {
+			l++;
+			continue;
+		}
+
+		if (*l == ':') {
+			if (l[1] == '-') break;
+			if (isdigit(l[1])) break;
+
+			module_name = p;
+			*l = '\0';
+			p = l + 1;
 			break;
+		}
+
+		if ((*l == ' ') || (*l == '\t')) break;
+	}
+
+	if (!module_name) {
+		if (isdigit(*p)) {
+			module_name = p;
+		} else {
+			module_name = internal_xlat[1];
+		}
+
+	} else if (*p == '-') {
+		goto variable;	/* old-style %{foo:-bar} */
+	}
+
+	/*
+	 *	The module may not have been loaded yet.  Leave it
+	 *	until the node is expanded.
+	 */
+	c = xlat_find(module_name);
+	if (!c) goto variable;
+
+	node->type = XLAT_FUNCTION;
+	node->xlat = c;
+
+	if (c->do_xlat == xlat_packet) {
+		da = dict_attrbyname(p);
+		if (da) {
+			node->type = XLAT_ATTRIBUTE;
+			node->list = *(const int *) c->instance;
+			node->da = da;
+		}
+	}
+
+	node->len = strlen(p);
+	memmove(node->text, p, node->len + 1);
+	*from += varlen;
+	return 0;
+
+variable:
+	node->type = XLAT_VARIABLE;
+	node->do_length = 0;
+	node->len = varlen;
+	memcpy(node->text, *from, varlen);
+	node->text[varlen] = '\0';
+	*from += varlen;
+	return 0;
+}
+
+/*
+ *	Parse the next node from a format string, which ends at
+ *	"end".  The node has room for the rest of the format, or for
+ *	XLAT_MAX_TEXT bytes of text, whichever is smaller.
+ *
+ *	Returns 1 if a node was parsed, 0 at the end of the string,
+ *	and -1 (with fr_strerror() set) on error.
+ */
+static int xlat_parse_node(const char **from, const char *end,
+			   xlat_node_t *node)
+{
+	int c, len;
+	const char *p;
+
+	memset(node, 0, sizeof(*node));
+	node->type = XLAT_LITERAL;
+	len = 0;
+
+	p = *from;
+	while (*p && (len < (XLAT_MAX_TEXT - 2))) {
 		c = *p;
 
 		if ((c != '%') && (c != '$') && (c != '\\')) {
-			/*
-			 * We check if we're inside an open brace.  If we are
-			 * then we assume this brace is NOT literal, but is
-			 * a closing brace and apply it
-			 */
-			if ((c == '}') && openbraces) {
-				openbraces--;
-				p++; /* skip it */
-				continue;
-			}
-			*q++ = *p++;
+			node->text[len++] = *p++;
 			continue;
 		}
 
@@ -1189,222 +1513,351 @@ int radius_xlat(char *out, int outlen, const char *fmt,
 		 *	the last '%' or "$' or '\\' over to the output
 		 *	buffer, and exit.
 		 */
-		if (*++p == '\0') {
-			*q++ = c;
+		if (p[1] == '\0') {
+			node->text[len++] = c;
+			p++;
 			break;
 		}
 
 		if (c == '\\') {
-			switch(*p) {
+			switch (p[1]) {
 			case '\\':
-				*q++ = *p;
+				node->text[len++] = '\\';
 				break;
 			case 't':
-				*q++ = '\t';
+				node->text[len++] = '\t';
 				break;
 			case 'n':
-				*q++ = '\n';
+				node->text[len++] = '\n';
 				break;
 			default:
-				*q++ = c;
-				*q++ = *p;
+				node->text[len++] = c;
+				node->text[len++] = p[1];
 				break;
 			}
+			p += 2;
+			continue;
+		}
+
+		/*
+		 *	'$' followed by anything is silently dropped.
+		 */
+		if (c == '$') {
 			p++;
+			continue;
+		}
 
-		} else if (c == '%') switch(*p) {
-			case '{':
-				p--;
-				if (decode_attribute(&p, &q, freespace, request, func) < 0) return 0;
-				break;
+		if (p[1] == '%') {
+			node->text[len++] = '%';
+			p += 2;
+			continue;
+		}
 
-			case '%':
-				*q++ = *p++;
-				break;
-			case 'a': /* Protocol: */
-				q += valuepair2str(q,freespace,pairfind(request->reply->vps,PW_FRAMED_PROTOCOL),PW_TYPE_INTEGER, func);
-				p++;
-				break;
-			case 'c': /* Callback-Number */
-				q += valuepair2str(q,freespace,pairfind(request->reply->vps,PW_CALLBACK_NUMBER),PW_TYPE_STRING, func);
-				p++;
-				break;
-			case 'd': /* request day */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%d", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'f': /* Framed IP address */
-				q += valuepair2str(q,freespace,pairfind(request->reply->vps,PW_FRAMED_IP_ADDRESS),PW_TYPE_IPADDR, func);
-				p++;
-				break;
-			case 'i': /* Calling station ID */
-				q += valuepair2str(q,freespace,pairfind(request->packet->vps,PW_CALLING_STATION_ID),PW_TYPE_STRING, func);
-				p++;
-				break;
-			case 'l': /* request timestamp */
-				snprintf(tmpdt, sizeof(tmpdt), "%lu",
-					 (unsigned long) request->timestamp);
-				strlcpy(q,tmpdt,freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'm': /* request month */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%m", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'n': /* NAS IP address */
-				q += valuepair2str(q,freespace,pairfind(request->packet->vps,PW_NAS_IP_ADDRESS),PW_TYPE_IPADDR, func);
-				p++;
-				break;
-			case 'p': /* Port number */
-				q += valuepair2str(q,freespace,pairfind(request->packet->vps,PW_NAS_PORT),PW_TYPE_INTEGER, func);
-				p++;
-				break;
-			case 's': /* Speed */
-				q += valuepair2str(q,freespace,pairfind(request->packet->vps,PW_CONNECT_INFO),PW_TYPE_STRING, func);
-				p++;
-				break;
-			case 't': /* request timestamp */
-				CTIME_R(&request->timestamp, tmpdt, sizeof(tmpdt));
-				nl = strchr(tmpdt, '\n');
-				if (nl) *nl = '\0';
-				strlcpy(q, tmpdt, freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'u': /* User name */
-				q += valuepair2str(q,freespace,pairfind(request->packet->vps,PW_USER_NAME),PW_TYPE_STRING, func);
-				p++;
-				break;
-			case 'A': /* radacct_dir */
-				strlcpy(q,radacct_dir,freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'C': /* ClientName */
-				strlcpy(q,request->client->shortname,freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'D': /* request date */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%Y%m%d", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'H': /* request hour */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%H", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'I': /* Request ID */
-				snprintf(tmpdt, sizeof(tmpdt), "%i", request->packet->id);
-				strlcpy(q, tmpdt, freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'L': /* radlog_dir */
-				strlcpy(q,radlog_dir,freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'G': /* request minute */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%M", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'M': /* MTU */
-				q += valuepair2str(q,freespace,pairfind(request->reply->vps,PW_FRAMED_MTU),PW_TYPE_INTEGER, func);
-				p++;
-				break;
-			case 'R': /* radius_dir */
-				strlcpy(q,radius_dir,freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'S': /* request timestamp in SQL format*/
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%Y-%m-%d %H:%M:%S", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'T': /* request timestamp */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%Y-%m-%d-%H.%M.%S.000000", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'U': /* Stripped User name */
-				q += valuepair2str(q,freespace,pairfind(request->packet->vps,PW_STRIPPED_USER_NAME),PW_TYPE_STRING, func);
-				p++;
-				break;
-			case 'V': /* Request-Authenticator */
-				strlcpy(q,"Verified",freespace);
-				q += strlen(q);
-				p++;
-				break;
-			case 'Y': /* request year */
-				TM = localtime_r(&request->timestamp, &s_TM);
-				len = strftime(tmpdt, sizeof(tmpdt), "%Y", TM);
-				if (len > 0) {
-					strlcpy(q, tmpdt, freespace);
-					q += strlen(q);
-				}
-				p++;
-				break;
-			case 'Z': /* Full request pairs except password */
-				tmp = request->packet->vps;
-				while (tmp && (freespace > 3)) {
-					if (tmp->attribute != PW_USER_PASSWORD) {
-						*q++ = '\t';
-						len = vp_prints(q, freespace - 2, tmp);
-						q += len;
-						freespace -= (len + 2);
-						*q++ = '\n';
-					}
-					tmp = tmp->next;
-				}
-				p++;
-				break;
-			default:
-				RDEBUG2("WARNING: Unknown variable '%%%c': See 'doc/variables.txt'", *p);
-				if (freespace > 2) {
-					*q++ = '%';
-					*q++ = *p++;
-				}
-				break;
+		/*
+		 *	Return the literal text before the expansion.
+		 */
+		if (len > 0) break;
+
+		if (p[1] != '{') {
+			node->type = XLAT_PERCENT;
+			node->letter = p[1];
+			node->text[len++] = p[1];
+			p += 2;
+			break;
+		}
+
+		if (xlat_parse_variable(&p, end, node) < 0) return -1;
+
+		*from = p;
+		return 1;
+	}
+
+	node->len = len;
+	node->text[len] = '\0';
+	*from = p;
+
+	return (len > 0);
+}
+
+/*
+ *	Call a registered xlat function.  The function may mangle the
+ *	string, and templates are shared, so "buffer" is where the
+ *	caller wants the node text copied.  It can be the node text
+ *	itself, for nodes which aren't shared.
+ */
+static int xlat_node_call(REQUEST *request, const xlat_node_t *node,
+			  char *buffer, char *q, int freespace,
+			  RADIUS_ESCAPE_STRING func)
+{
+	const xlat_t *c = node->xlat;
+
+	if (!c->do_xlat) {
+		RDEBUG2("WARNING: Unknown module \"%s\" in string expansion", c->module);
+		return -1;
+	}
+
+	if (buffer != node->text) memcpy(buffer, node->text, node->len + 1);
+
+	if (!c->internal) RDEBUG3("radius_xlat: Running registered xlat function of module %s for string \'%s\'",
+				  c->module, buffer);
+
+	return c->do_xlat(c->instance, request, buffer, q, freespace, func);
+}
+
+/*
+ *	Expand one node.  Returns the number of bytes written, or -1
+ *	if the whole expansion should fail.
+ */
+static int xlat_node_expand(REQUEST *request, const xlat_node_t *node,
+			    char *buffer, char *q, int freespace,
+			    RADIUS_ESCAPE_STRING func)
+{
+	int len;
+	const char *p;
+	char *start;
+	VALUE_PAIR *vps;
+	RADIUS_PACKET *packet;
+
+	switch (node->type) {
+	case XLAT_LITERAL:
+		len = node->len;
+		if (len >= freespace) len = freespace - 1;
+		memcpy(q, node->text, len);
+		return len;
+
+	case XLAT_PERCENT:
+		return xlat_percent(request, node->letter, q, freespace, func);
+
+	case XLAT_ATTRIBUTE:
+		*q = '\0';
+		if (!xlat_packet_list(request, node->list, &vps, &packet)) {
+			return 0;
+		}
+
+		len = xlat_packet_attr(request, vps, packet, node->da,
+				       q, freespace, func);
+		break;
+
+	case XLAT_FUNCTION:
+		*q = '\0';
+		len = xlat_node_call(request, node, buffer, q, freespace,
+				     func);
+		if (len < 0) return -1;
+		break;
+
+	case XLAT_VARIABLE:
+		p = node->text;
+		start = q;
+		if (decode_attribute(&p, &q, freespace, request, func) < 0) {
+			return -1;
+		}
+		return q - start;
+
+	default:
+		return -1;
+	}
+
+	if ((len > 0) && node->do_length) {
+		snprintf(q, freespace, "%d", len);
+		len = strlen(q);
+	}
+
+	return len;
+}
+
+/*
+ *	Compile a format string into a template, which can be
+ *	expanded many times with radius_xlat_template().
+ *
+ *	Returns NULL, with fr_strerror() set, on error.
+ */
+xlat_template_t *radius_compile_xlat(const char *fmt)
+{
+	int rcode;
+	size_t fmtlen;
+	const char *p;
+	xlat_node_t *node, *parsed, **last;
+	xlat_template_t *xt;
+	xlat_scratch_t scratch;
+
+	if (!fmt) return NULL;
+
+	fmtlen = strlen(fmt);
+	xt = rad_malloc(sizeof(*xt) + fmtlen);
+	xt->head = NULL;
+	xt->max_call = 0;
+	memcpy(xt->fmt, fmt, fmtlen + 1);
+	last = &xt->head;
+
+	parsed = xlat_scratch_alloc(&scratch, fmtlen);
+
+	p = fmt;
+	while ((rcode = xlat_parse_node(&p, fmt + fmtlen, parsed)) > 0) {
+		node = rad_malloc(sizeof(*node) + parsed->len);
+		memcpy(node, parsed, sizeof(*node) + parsed->len);
+
+		if ((node->type == XLAT_FUNCTION) &&
+		    (node->len > xt->max_call)) {
+			xt->max_call = node->len;
+		}
+
+		*last = node;
+		last = &node->next;
+	}
+
+	xlat_scratch_free(&scratch, parsed);
+
+	if (rcode < 0) {
+		radius_free_xlat(&xt);
+		return NULL;
+	}
+
+	return xt;
+}
+
+/*
+ *	Expand a compiled template.  The return value and output
+ *	are the same as for radius_xlat().
+ */
+int radius_xlat_template(char *out, int outlen, const xlat_template_t *xt,
+			 REQUEST *request, RADIUS_ESCAPE_STRING func)
+{
+	int rcode, len, freespace;
+	char *q, *buffer;
+	const xlat_node_t *node;
+	char small[XLAT_SMALL_TEXT];
+
+	if (!xt || !out || !request) return 0;
+
+	/*
+	 *  Ensure that we always have an escaping function.
+	 */
+	if (func == NULL) {
+		func = xlat_copy;
+	}
+
+	/*
+	 *	Where the function arguments are copied to.
+	 */
+	if (xt->max_call < (int) sizeof(small)) {
+		buffer = small;
+	} else {
+		buffer = rad_malloc(xt->max_call + 1);
+	}
+
+	rcode = 0;
+	q = out;
+	for (node = xt->head; node != NULL; node = node->next) {
+		/* Calculate freespace in output */
+		freespace = outlen - (q - out);
+		if (freespace <= 1)
+			break;
+
+		len = xlat_node_expand(request, node, buffer, q, freespace,
+				       func);
+		if (len < 0) goto done;
+
+		q += len;
+	}
+	*q = '\0';
+
+	RDEBUG2("\texpand: %s -> %s", xt->fmt, out);
+
+	rcode = strlen(out);
+
+done:
+	if (buffer != small) free(buffer);
+	return rcode;
+}
+
+void radius_free_xlat(xlat_template_t **pxt)
+{
+	xlat_node_t *node, *next;
+
+	if (!pxt || !*pxt) return;
+
+	for (node = (*pxt)->head; node != NULL; node = next) {
+		next = node->next;
+		free(node);
+	}
+
+	free(*pxt);
+	*pxt = NULL;
+}
+
+/*
+ *	Replace %<whatever> in a string.
+ *
+ *	See 'doc/variables.txt' for more information.
+ */
+int radius_xlat(char *out, int outlen, const char *fmt,
+		REQUEST *request, RADIUS_ESCAPE_STRING func)
+{
+	int rcode, len, freespace;
+	const char *p, *end;
+	char *q;
+	xlat_node_t *node;
+	xlat_scratch_t scratch;
+
+	/*
+	 *	Catch bad modules.
+	 */
+	if (!fmt || !out || !request) return 0;
+
+	/*
+	 *  Ensure that we always have an escaping function.
+	 */
+	if (func == NULL) {
+		func = xlat_copy;
+	}
+
+	q = out;
+	p = fmt;
+	end = fmt + strlen(fmt);
+	node = xlat_scratch_alloc(&scratch, end - fmt);
+	while (*p) {
+		/* Calculate freespace in output */
+		freespace = outlen - (q - out);
+		if (freespace <= 1)
+			break;
+
+		/*
+		 *	Plain text is copied directly.
+		 */
+		if ((*p != '%') && (*p != '$') && (*p != '\\')) {
+			*q++ = *p++;
+			continue;
+		}
+
+		rcode = xlat_parse_node(&p, end, node);
+		if (rcode < 0) {
+			*q = '\0';
+			RDEBUG2("ERROR: %s", fr_strerror());
+			rcode = 0;
+			goto done;
 		}
+		if (rcode == 0) break;
+
+		/*
+		 *	The node is ours, so the function can have its
+		 *	text.
+		 */
+		len = xlat_node_expand(request, node, node->text, q,
+				       freespace, func);
+		if (len < 0) {
+			rcode = 0;
+			goto done;
+		}
+
+		q += len;
 	}
 	*q = '\0';
 
 	RDEBUG2("\texpand: %s -> %s", fmt, out);
 
-	return strlen(out);
+	rcode = strlen(out);
+
+done:
+	xlat_scratch_free(&scratch, node);
+	return rcode;
 }
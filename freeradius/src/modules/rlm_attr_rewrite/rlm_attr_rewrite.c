@@ -51,6 +51,8 @@ typedef struct rlm_attr_rewrite_t {
 	int  new_attr;		/* Boolean. Do we create a new attribute or not? */
 	int  num_matches;	/* Maximum number of matches */
 	const char *name;	/* The module name */
+	regex_t preg;		/* The search pattern, if it's static */
+	int  have_preg;
 } rlm_attr_rewrite_t;
 
 static const CONF_PARSER module_config[] = {
@@ -107,6 +109,28 @@ static int attr_rewrite_instantiate(CONF_SECTION *conf, void **instance)
 		return -1;
 	}
 
+	/*
+	 *	If the search pattern doesn't need expanding, compile
+	 *	it now, instead of for every packet.
+	 */
+	if (!data->new_attr && !strchr(data->search, '%')) {
+		int err;
+		int cflags = REG_EXTENDED;
+
+		if (data->nocase) cflags |= REG_ICASE;
+
+		err = regcomp(&data->preg, data->search, cflags);
+		if (err != 0) {
+			char err_msg[MAX_STRING_LEN];
+
+			regerror(err, &data->preg, err_msg, sizeof(err_msg));
+			radlog(L_ERR, "rlm_attr_rewrite: Invalid regular expression %s: %s",
+			       data->search, err_msg);
+			return -1;
+		}
+		data->have_preg = 1;
+	}
+
 	if (data->num_matches < 1 || data->num_matches > MAX_STRING_LEN) {
 		radlog(L_ERR, "rlm_attr_rewrite: Illegal range for match number.");
 		return -1;
@@ -148,19 +172,23 @@ static int attr_rewrite_instantiate(CONF_SECTION *conf, void **instance)
 	return 0;
 }
 
+static void release_regex(rlm_attr_rewrite_t *data, regex_t *preg)
+{
+	if (preg != &data->preg) fr_regex_release(preg);
+}
+
 static int do_attr_rewrite(void *instance, REQUEST *request)
 {
 	rlm_attr_rewrite_t *data = (rlm_attr_rewrite_t *) instance;
 	int ret = RLM_MODULE_NOOP;
 	VALUE_PAIR *attr_vp = NULL;
 	VALUE_PAIR *tmp = NULL;
-	regex_t preg;
+	regex_t *preg;
 	regmatch_t pmatch[9];
 	int cflags = 0;
 	int err = 0;
 	char done_xlat = 0;
 	unsigned int len = 0;
-	char err_msg[MAX_STRING_LEN];
 	unsigned int i = 0;
 	unsigned int j = 0;
 	unsigned int counter = 0;
@@ -268,15 +296,19 @@ do_again:
 		if (data->nocase)
 			cflags |= REG_ICASE;
 
-		if (!radius_xlat(search_STR, sizeof(search_STR), data->search, request, NULL) && data->search_len != 0) {
-			DEBUG2("%s: xlat on search string failed.", data->name);
-			return ret;
-		}
+		if (data->have_preg) {
+			preg = &data->preg;
+		} else {
+			if (!radius_xlat(search_STR, sizeof(search_STR), data->search, request, NULL) && data->search_len != 0) {
+				DEBUG2("%s: xlat on search string failed.", data->name);
+				return ret;
+			}
 
-		if ((err = regcomp(&preg,search_STR,cflags))) {
-			regerror(err, &preg, err_msg, MAX_STRING_LEN);
-			DEBUG2("%s: regcomp() returned error: %s", data->name,err_msg);
-			return ret;
+			preg = fr_regex_get(search_STR, cflags);
+			if (!preg) {
+				DEBUG2("%s: %s", data->name, fr_strerror());
+				return ret;
+			}
 		}
 
 		if ((attr_vp->type == PW_TYPE_IPADDR) &&
@@ -291,18 +323,18 @@ do_again:
 		counter = 0;
 
 		for ( i = 0 ;i < (unsigned)data->num_matches; i++) {
-			err = regexec(&preg, ptr2, REQUEST_MAX_REGEX, pmatch, 0);
+			err = regexec(preg, ptr2, REQUEST_MAX_REGEX, pmatch, 0);
 			if (err == REG_NOMATCH) {
 				if (i == 0) {
 					DEBUG2("%s: Does not match: %s = %s", data->name,
 							data->attribute, attr_vp->vp_strvalue);
-					regfree(&preg);
+					release_regex(data, preg);
 					goto to_do_again;
 				} else
 					break;
 			}
 			if (err != 0) {
-				regfree(&preg);
+				release_regex(data, preg);
 				radlog(L_ERR, "%s: match failure for attribute %s with value '%s'", data->name,
 						data->attribute, attr_vp->vp_strvalue);
 				return ret;
@@ -315,7 +347,7 @@ do_again:
 			}
 			counter += len;
 			if (counter >= MAX_STRING_LEN) {
-				regfree(&preg);
+				release_regex(data, preg);
 				DEBUG2("%s: Replacement out of limits for attribute %s with value '%s'", data->name,
 						data->attribute, attr_vp->vp_strvalue);
 				return ret;
@@ -362,6 +394,7 @@ do_again:
 			if (!done_xlat){
 				if (data->replace_len != 0 &&
 				radius_xlat(replace_STR, sizeof(replace_STR), data->replace, request, NULL) == 0) {
+					release_regex(data, preg);
 					DEBUG2("%s: xlat on replace string failed.", data->name);
 					return ret;
 				}
@@ -371,7 +404,7 @@ do_again:
 
 			counter += replace_len;
 			if (counter >= MAX_STRING_LEN) {
-				regfree(&preg);
+				release_regex(data, preg);
 				DEBUG2("%s: Replacement out of limits for attribute %s with value '%s'", data->name,
 						data->attribute, attr_vp->vp_strvalue);
 				return ret;
@@ -382,7 +415,7 @@ do_again:
 				*ptr = '\0';
 			}
 		}
-		regfree(&preg);
+		release_regex(data, preg);
 		len = strlen(ptr2) + 1;		/* We add the ending NULL */
 		counter += len;
 		if (counter >= MAX_STRING_LEN){
@@ -455,6 +488,9 @@ static int attr_rewrite_postauth(void *instance, REQUEST *request)
 
 static int attr_rewrite_detach(void *instance)
 {
+	rlm_attr_rewrite_t *data = (rlm_attr_rewrite_t *) instance;
+
+	if (data->have_preg) regfree(&data->preg);
 	free(instance);
 	return 0;
 }
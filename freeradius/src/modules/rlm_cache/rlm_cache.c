@@ -28,6 +28,80 @@ RCSID("$Id$")
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifndef HAVE_PTHREAD_H
+/*
+ *	This is easier than ifdef's throughout the code.
+ */
+#define pthread_mutex_init(_x, _y)
+#define pthread_mutex_destroy(_x)
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_trylock(_x) (0)
+#define pthread_mutex_unlock(_x)
+#endif
+
+/*
+ *	The cache is split into shards, each with its own lock, so
+ *	that worker threads looking up different keys don't contend.
+ *	Must be a power of two, and no more than 256.
+ */
+#define CACHE_NUM_SHARDS (16)
+
+typedef struct rlm_cache_entry_t rlm_cache_entry_t;
+
+/*
+ *	A key which some thread is busy creating an entry for.
+ */
+typedef struct rlm_cache_inflight_t {
+	char		*key;
+	int		done;
+	int		waiters;
+	struct rlm_cache_inflight_t *next;
+} rlm_cache_inflight_t;
+
+typedef struct rlm_cache_shard_t {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;		/* an in-flight key is done */
+#endif
+	rlm_cache_inflight_t *inflight;
+	fr_hash_table_t	*cache;
+	fr_heap_t	*heap;
+
+	/*
+	 *	Most recently used at the head.  We evict from the
+	 *	tail when the shard is full.
+	 */
+	rlm_cache_entry_t *lru_head;
+	rlm_cache_entry_t *lru_tail;
+
+	int		max_entries;
+	size_t		max_memory;
+	size_t		memory;
+
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	evictions;
+	uint64_t	expired;
+	uint64_t	coalesced;
+} rlm_cache_shard_t;
+
+typedef struct rlm_cache_stats_t {
+	int		entries;
+	size_t		memory;
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	evictions;
+	uint64_t	expired;
+	uint64_t	coalesced;
+} rlm_cache_stats_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -41,22 +115,50 @@ typedef struct rlm_cache_t {
 	int		ttl;
 	int		epoch;
 	int		stats;
+	int		max_entries;
+	int		max_memory;
+	char		*snapshot;
+	char		*snapshot_file;	/* outlives the configuration */
+	int		snapshot_interval;
+	int		snapshot_ready;
+	int		single_flight;
+	int		single_flight_timeout;
+	time_t		next_snapshot;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	snapshot_mutex;
+	pthread_cond_t	snapshot_cond;	/* wakes the thread to exit */
+	pthread_t	snapshot_thread;
+	int		snapshot_thread_running;
+	int		snapshot_stop;
+#endif
 	CONF_SECTION	*cs;
-	rbtree_t	*cache;
-	fr_heap_t	*heap;
+	rlm_cache_shard_t shard[CACHE_NUM_SHARDS];
 } rlm_cache_t;
 
-typedef struct rlm_cache_entry_t {
+struct rlm_cache_entry_t {
 	const char	*key;
 	int		offset;
 	long long int	hits;
 	time_t		created;
 	time_t		expires;
-	VALUE_PAIR	*control;
-	VALUE_PAIR	*request;
-	VALUE_PAIR	*reply;
-} rlm_cache_entry_t;
+	size_t		size;		/* for max_memory */
 
+	rlm_cache_entry_t *lru_prev;
+	rlm_cache_entry_t *lru_next;
+
+	/*
+	 *	Packed, as there may be millions of entries.
+	 */
+	VALUE_PAIR_PACKED *control;
+	VALUE_PAIR_PACKED *request;
+	VALUE_PAIR_PACKED *reply;
+};
+
+
+static uint32_t cache_entry_hash(const void *data)
+{
+	return fr_hash_string(((const rlm_cache_entry_t *) data)->key);
+}
 
 /*
  *	Compare two entries by key.  There may only be one entry with
@@ -75,9 +177,9 @@ static void cache_entry_free(void *data)
 	rlm_cache_entry_t *c = data;
 
 	free(c->key);
-	pairfree(&c->control);
-	pairfree(&c->request);
-	pairfree(&c->reply);
+	free(c->control);
+	free(c->request);
+	free(c->reply);
 	free(c);
 }
 
@@ -97,8 +199,160 @@ static int cache_heap_cmp(const void *one, const void *two)
 	return 0;
 }
 
+static size_t cache_entry_size(const rlm_cache_entry_t *c)
+{
+	return sizeof(*c) + strlen(c->key) + 1 +
+		pairpacked_size(c->control) +
+		pairpacked_size(c->request) +
+		pairpacked_size(c->reply);
+}
+
+/*
+ *	The hash tables use the low bits of the hash, so we pick
+ *	the shard from the high bits.
+ */
+static rlm_cache_shard_t *cache_shard(rlm_cache_t *inst, const char *key)
+{
+	uint32_t hash = fr_hash_string(key);
+
+	return &inst->shard[(hash >> 24) & (CACHE_NUM_SHARDS - 1)];
+}
+
+static void cache_lru_unlink(rlm_cache_shard_t *shard, rlm_cache_entry_t *c)
+{
+	if (c->lru_prev) {
+		c->lru_prev->lru_next = c->lru_next;
+	} else {
+		shard->lru_head = c->lru_next;
+	}
+
+	if (c->lru_next) {
+		c->lru_next->lru_prev = c->lru_prev;
+	} else {
+		shard->lru_tail = c->lru_prev;
+	}
+
+	c->lru_prev = c->lru_next = NULL;
+}
+
+static void cache_lru_push(rlm_cache_shard_t *shard, rlm_cache_entry_t *c)
+{
+	c->lru_prev = NULL;
+	c->lru_next = shard->lru_head;
+	if (shard->lru_head) shard->lru_head->lru_prev = c;
+	shard->lru_head = c;
+	if (!shard->lru_tail) shard->lru_tail = c;
+}
+
+/*
+ *	Remove an entry from the shard, and free it.  The caller
+ *	must hold the shard lock.
+ */
+static void cache_entry_remove(rlm_cache_shard_t *shard, rlm_cache_entry_t *c)
+{
+	fr_heap_extract(shard->heap, c);
+	cache_lru_unlink(shard, c);
+	shard->memory -= c->size;
+	fr_hash_table_delete(shard->cache, c);
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Single-flight: when a key misses, the first thread marks it
+ *	as in-flight while it creates the entry.  Other threads which
+ *	miss on the same key wait for it, instead of all going to the
+ *	backend at once.  The caller must hold the shard lock.
+ */
+static rlm_cache_inflight_t *cache_inflight_find(rlm_cache_shard_t *shard,
+						 const char *key)
+{
+	rlm_cache_inflight_t *f;
+
+	for (f = shard->inflight; f != NULL; f = f->next) {
+		if (strcmp(f->key, key) == 0) return f;
+	}
+
+	return NULL;
+}
+
+static rlm_cache_inflight_t *cache_inflight_add(rlm_cache_shard_t *shard,
+						const char *key)
+{
+	rlm_cache_inflight_t *f;
+
+	f = rad_malloc(sizeof(*f));
+	memset(f, 0, sizeof(*f));
+	f->key = strdup(key);
+	f->next = shard->inflight;
+	shard->inflight = f;
+
+	return f;
+}
+
+static void cache_inflight_free(rlm_cache_inflight_t *f)
+{
+	free(f->key);
+	free(f);
+}
+
+/*
+ *	The entry has been created (or not).  Wake up the waiters.
+ *	The last one out frees the in-flight marker.
+ */
+static void cache_inflight_done(rlm_cache_shard_t *shard,
+				rlm_cache_inflight_t *f)
+{
+	rlm_cache_inflight_t **last;
+
+	for (last = &shard->inflight; *last != NULL; last = &(*last)->next) {
+		if (*last == f) {
+			*last = f->next;
+			break;
+		}
+	}
+
+	f->done = 1;
+	pthread_cond_broadcast(&shard->cond);
+
+	if (!f->waiters) cache_inflight_free(f);
+}
+
+/*
+ *	Wait for another thread to create the entry.  Returns 1 if it
+ *	finished, or 0 if we timed out.
+ */
+static int cache_inflight_wait(rlm_cache_t *inst, rlm_cache_shard_t *shard,
+			       rlm_cache_inflight_t *f)
+{
+	int done;
+	struct timeval now;
+	struct timespec when;
+
+	gettimeofday(&now, NULL);
+	when.tv_sec = now.tv_sec + (inst->single_flight_timeout / 1000);
+	when.tv_nsec = (now.tv_usec + (inst->single_flight_timeout % 1000) * 1000) * 1000;
+	if (when.tv_nsec >= 1000000000) {
+		when.tv_sec++;
+		when.tv_nsec -= 1000000000;
+	}
+
+	f->waiters++;
+	while (!f->done) {
+		if (pthread_cond_timedwait(&shard->cond, &shard->mutex,
+					   &when) == ETIMEDOUT) break;
+	}
+	f->waiters--;
+
+	done = f->done;
+	if (done && !f->waiters) cache_inflight_free(f);
+
+	return done;
+}
+#endif
+
 /*
- *	Merge a cached entry into a REQUEST.
+ *	Merge a cached entry into a REQUEST.  The caller must hold
+ *	the shard lock, so that the entry isn't freed underneath us.
  */
 static void cache_merge(rlm_cache_t *inst, REQUEST *request,
 			rlm_cache_entry_t *c)
@@ -109,19 +363,19 @@ static void cache_merge(rlm_cache_t *inst, REQUEST *request,
 	rad_assert(c != NULL);
 
 	if (c->control) {
-		vp = paircopy(c->control);
+		vp = pairunpack(c->control);
 		pairmove(&request->config_items, &vp);
 		pairfree(&vp);
 	}
 
 	if (c->request && request->packet) {
-		vp = paircopy(c->request);
+		vp = pairunpack(c->request);
 		pairmove(&request->packet->vps, &vp);
 		pairfree(&vp);
 	}
 
 	if (c->reply && request->reply) {
-		vp = paircopy(c->reply);
+		vp = pairunpack(c->reply);
 		pairmove(&request->reply->vps, &vp);
 		pairfree(&vp);
 	}
@@ -138,38 +392,33 @@ static void cache_merge(rlm_cache_t *inst, REQUEST *request,
 
 
 /*
- *	Find a cached entry.
+ *	Find a cached entry.  The caller must hold the shard lock.
  */
 static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request,
-				     const char *key)
+				     rlm_cache_shard_t *shard, const char *key)
 {
 	int ttl;
 	rlm_cache_entry_t *c, my_c;
 	VALUE_PAIR *vp;
 
 	/*
-	 *	Look at the expiry heap.
+	 *	Expire old entries from the heap.
 	 */
-	c = fr_heap_peek(inst->heap);
-	if (!c) {
-		rad_assert(rbtree_num_elements(inst->cache) == 0);
-		return NULL;
-	}
-
-	/*
-	 *	If it's time to expire an old entry, do so now.
-	 */
-	if (c->expires < request->timestamp) {
-		fr_heap_extract(inst->heap, c);
-		rbtree_deletebydata(inst->cache, c);
+	while (((c = fr_heap_peek(shard->heap)) != NULL) &&
+	       (c->expires < request->timestamp)) {
+		cache_entry_remove(shard, c);
+		shard->expired++;
 	}
 
 	/*
 	 *	Is there an entry for this key?
 	 */
 	my_c.key = key;
-	c = rbtree_finddata(inst->cache, &my_c);
-	if (!c) return NULL;
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (!c) {
+		shard->misses++;
+		return NULL;
+	}
 
 	/*
 	 *	Yes, but it expired, OR the "forget all" epoch has
@@ -180,9 +429,10 @@ static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request,
 	delete:
 		DEBUG("rlm_cache: Entry has expired, removing");
 
-		fr_heap_extract(inst->heap, c);
-		rbtree_deletebydata(inst->cache, c);
-		
+		cache_entry_remove(shard, c);
+		shard->expired++;
+		shard->misses++;
+
 		return NULL;
 	}
 
@@ -197,24 +447,33 @@ static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request,
 		if (vp->vp_integer == 0) goto delete;
 		
 		ttl = vp->vp_integer;
+
+		fr_heap_extract(shard->heap, c);
 		c->expires = request->timestamp + ttl;
+		fr_heap_insert(shard->heap, c);
 		DEBUG("rlm_cache: Adding %d to the TTL", ttl);
 	}
 	c->hits++;
+	shard->hits++;
+
+	cache_lru_unlink(shard, c);
+	cache_lru_push(shard, c);
 
 	return c;
 }
 
 
 /*
- *	Add an entry to the cache.
+ *	Create an entry for the cache.  This expands the attributes,
+ *	which may take a while, so we don't hold the shard lock.
  */
-static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
-				    const char *key)
+static rlm_cache_entry_t *cache_create(rlm_cache_t *inst, REQUEST *request,
+				       const char *key)
 {
 	int ttl;
 	const char *attr, *p;
 	VALUE_PAIR *vp, **vps;
+	VALUE_PAIR *control = NULL, *request_vps = NULL, *reply = NULL;
 	CONF_ITEM *ci;
 	CONF_PAIR *cp;
 	rlm_cache_entry_t *c;
@@ -256,19 +515,19 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
 
 		if (strncmp(attr, "control:", 8) == 0) {
 			p = attr + 8;
-			vps = &c->control;
+			vps = &control;
 
 		} else if (strncmp(attr, "request:", 8) == 0) {
 			p = attr + 8;
-			vps = &c->request;
+			vps = &request_vps;
 
 		} else if (strncmp(attr, "reply:", 6) == 0) {
 			p = attr + 6;
-			vps = &c->reply;
+			vps = &reply;
 
 		} else {
 			p = attr;
-			vps = &c->request;
+			vps = &request_vps;
 		}
 
 		/*
@@ -283,25 +542,471 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request,
 		pairadd(vps, vp);
 	}
 
-	if (!rbtree_insert(inst->cache, c)) {
-		DEBUG("rlm_cache: FAILED adding entry for key %s", key);
+	if (control) c->control = pairpack(control);
+	if (request_vps) c->request = pairpack(request_vps);
+	if (reply) c->reply = pairpack(reply);
+	pairfree(&control);
+	pairfree(&request_vps);
+	pairfree(&reply);
+
+	c->size = cache_entry_size(c);
+
+	DEBUG("rlm_cache: Adding entry for \"%s\", with TTL of %d",
+	      key, ttl);
+
+	return c;
+}
+
+
+/*
+ *	Add an entry to the shard, evicting the least recently used
+ *	entries if the shard is full.  The caller must hold the shard
+ *	lock.
+ *
+ *	If another thread added an entry for the same key while we
+ *	were creating ours, we use theirs.
+ */
+static rlm_cache_entry_t *cache_insert(rlm_cache_shard_t *shard,
+				       rlm_cache_entry_t *c)
+{
+	rlm_cache_entry_t *old;
+
+	old = fr_hash_table_finddata(shard->cache, c);
+	if (old) {
+		cache_entry_free(c);
+		return old;
+	}
+
+	while (shard->lru_tail &&
+	       ((shard->max_entries &&
+		 (fr_hash_table_num_elements(shard->cache) >= shard->max_entries)) ||
+		(shard->max_memory &&
+		 ((shard->memory + c->size) > shard->max_memory)))) {
+		DEBUG2("rlm_cache: Evicting entry for \"%s\"",
+		       shard->lru_tail->key);
+		cache_entry_remove(shard, shard->lru_tail);
+		shard->evictions++;
+	}
+
+	if (!fr_hash_table_insert(shard->cache, c)) {
+		DEBUG("rlm_cache: FAILED adding entry for key %s", c->key);
 		cache_entry_free(c);
 		return NULL;
 	}
 
-	if (!fr_heap_insert(inst->heap, c)) {
-		DEBUG("rlm_cache: FAILED adding entry for key %s", key);
-		rbtree_deletebydata(inst->cache, c);
+	if (!fr_heap_insert(shard->heap, c)) {
+		DEBUG("rlm_cache: FAILED adding entry for key %s", c->key);
+		fr_hash_table_delete(shard->cache, c);
 		return NULL;
 	}
 
-	DEBUG("rlm_cache: Adding entry for \"%s\", with TTL of %d",
-	      key, ttl);
+	cache_lru_push(shard, c);
+	shard->memory += c->size;
 
 	return c;
 }
 
 
+/*
+ *	The snapshot file is a header, followed by one record per
+ *	entry.  Each record is followed by the key, and then by the
+ *	packed control, request, and reply lists.
+ *
+ *	It's written in host byte order, and is only meant to be read
+ *	back by the same server.
+ */
+#define CACHE_SNAPSHOT_MAGIC "FRcache1"
+
+typedef struct cache_snapshot_header_t {
+	char		magic[8];
+	uint32_t	byte_order;	/* 0x01020304 */
+	uint32_t	data_size;	/* sizeof(VALUE_PAIR_DATA) */
+	uint32_t	num_entries;
+	uint32_t	reserved;
+} cache_snapshot_header_t;
+
+typedef struct cache_snapshot_record_t {
+	int64_t		created;
+	int64_t		expires;
+	int64_t		hits;
+	uint32_t	key_len;	/* including the trailing zero */
+	uint32_t	list_len[3];	/* 0 for no list */
+} cache_snapshot_record_t;
+
+typedef struct cache_snapshot_buffer_t {
+	uint8_t		*data;
+	size_t		size;
+	size_t		used;
+} cache_snapshot_buffer_t;
+
+static int cache_snapshot_append(cache_snapshot_buffer_t *buf,
+				 const void *data, size_t len)
+{
+	if ((buf->used + len) > buf->size) {
+		size_t size = buf->size ? buf->size : 65536;
+		uint8_t *p;
+
+		while (size < (buf->used + len)) size *= 2;
+
+		p = realloc(buf->data, size);
+		if (!p) return 0;
+
+		buf->data = p;
+		buf->size = size;
+	}
+
+	memcpy(buf->data + buf->used, data, len);
+	buf->used += len;
+
+	return 1;
+}
+
+/*
+ *	Copy the entries in a shard to a buffer.  We hold the shard
+ *	lock only while copying, and write the buffer to disk later.
+ *
+ *	The least recently used entries go first, so that loading the
+ *	snapshot gets the LRU order right.
+ */
+static int cache_snapshot_shard(rlm_cache_shard_t *shard,
+				cache_snapshot_buffer_t *buf)
+{
+	int num = 0;
+	rlm_cache_entry_t *c;
+	cache_snapshot_record_t rec;
+
+	pthread_mutex_lock(&shard->mutex);
+	for (c = shard->lru_tail; c != NULL; c = c->lru_prev) {
+		memset(&rec, 0, sizeof(rec));
+		rec.created = c->created;
+		rec.expires = c->expires;
+		rec.hits = c->hits;
+		rec.key_len = strlen(c->key) + 1;
+		rec.list_len[0] = pairpacked_size(c->control);
+		rec.list_len[1] = pairpacked_size(c->request);
+		rec.list_len[2] = pairpacked_size(c->reply);
+
+		if (!cache_snapshot_append(buf, &rec, sizeof(rec)) ||
+		    !cache_snapshot_append(buf, c->key, rec.key_len) ||
+		    !cache_snapshot_append(buf, c->control, rec.list_len[0]) ||
+		    !cache_snapshot_append(buf, c->request, rec.list_len[1]) ||
+		    !cache_snapshot_append(buf, c->reply, rec.list_len[2])) {
+			num = -1;
+			break;
+		}
+		num++;
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return num;
+}
+
+/*
+ *	Write the snapshot to a temporary file, and then rename it,
+ *	so that a crash half-way through doesn't leave a broken file.
+ */
+static int cache_snapshot_write(rlm_cache_t *inst)
+{
+	int i, num;
+	FILE *fp;
+	cache_snapshot_header_t hdr;
+	cache_snapshot_buffer_t buf;
+	char filename[1024];
+
+	snprintf(filename, sizeof(filename), "%s.%u", inst->snapshot_file,
+		 (unsigned int) getpid());
+
+	fp = fopen(filename, "w");
+	if (!fp) {
+		radlog(L_ERR, "rlm_cache: Failed creating %s: %s",
+		       filename, strerror(errno));
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.byte_order = 0x01020304;
+	hdr.data_size = sizeof(VALUE_PAIR_DATA);
+
+	/*
+	 *	Leave room for the header, which we write at the end.
+	 */
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) goto error;
+
+	memset(&buf, 0, sizeof(buf));
+	for (i = 0; i < CACHE_NUM_SHARDS; i++) {
+		buf.used = 0;
+		num = cache_snapshot_shard(&inst->shard[i], &buf);
+		if (num < 0) {
+			free(buf.data);
+			goto error;
+		}
+
+		if (buf.used && (fwrite(buf.data, buf.used, 1, fp) != 1)) {
+			free(buf.data);
+			goto error;
+		}
+		hdr.num_entries += num;
+	}
+	free(buf.data);
+
+	if ((fseek(fp, 0, SEEK_SET) < 0) ||
+	    (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)) goto error;
+
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		goto error;
+	}
+
+	if (rename(filename, inst->snapshot_file) < 0) {
+		radlog(L_ERR, "rlm_cache: Failed renaming %s to %s: %s",
+		       filename, inst->snapshot_file, strerror(errno));
+		unlink(filename);
+		return -1;
+	}
+
+	DEBUG2("rlm_cache: Wrote %u entries to %s",
+	       hdr.num_entries, inst->snapshot_file);
+
+	return 0;
+
+error:
+	radlog(L_ERR, "rlm_cache: Failed writing %s: %s",
+	       filename, strerror(errno));
+	if (fp) fclose(fp);
+	unlink(filename);
+	return -1;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Write a snapshot every snapshot_interval, so that the worker
+ *	threads never wait for the disk.
+ */
+static void *cache_snapshot_thread(void *arg)
+{
+	time_t now;
+	struct timespec when;
+	rlm_cache_t *inst = arg;
+
+	pthread_mutex_lock(&inst->snapshot_mutex);
+	while (!inst->snapshot_stop) {
+		when.tv_sec = inst->next_snapshot;
+		when.tv_nsec = 0;
+		pthread_cond_timedwait(&inst->snapshot_cond,
+				       &inst->snapshot_mutex, &when);
+		if (inst->snapshot_stop) break;
+
+		now = time(NULL);
+		if (now < inst->next_snapshot) continue;
+
+		inst->next_snapshot = now + inst->snapshot_interval;
+		pthread_mutex_unlock(&inst->snapshot_mutex);
+
+		cache_snapshot_write(inst);
+
+		pthread_mutex_lock(&inst->snapshot_mutex);
+	}
+	pthread_mutex_unlock(&inst->snapshot_mutex);
+
+	return NULL;
+}
+
+/*
+ *	The thread is started by the first request, and not in
+ *	instantiate(), as the server forks into the background after
+ *	the modules have been instantiated.  Only one thread does the
+ *	work, the others carry on.
+ */
+static void cache_snapshot_periodic(rlm_cache_t *inst,
+				    UNUSED time_t now)
+{
+	int rcode;
+
+	if (inst->snapshot_thread_running) return;
+
+	if (pthread_mutex_trylock(&inst->snapshot_mutex) != 0) return;
+
+	if (!inst->snapshot_thread_running) {
+		rcode = pthread_create(&inst->snapshot_thread, NULL,
+				       cache_snapshot_thread, inst);
+		if (rcode != 0) {
+			radlog(L_ERR, "rlm_cache: Failed creating snapshot thread: %s",
+			       strerror(rcode));
+			inst->snapshot_interval = 0;
+		} else {
+			inst->snapshot_thread_running = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&inst->snapshot_mutex);
+}
+
+/*
+ *	Stop the thread before the final snapshot is written.
+ */
+static void cache_snapshot_stop(rlm_cache_t *inst)
+{
+	if (!inst->snapshot_thread_running) return;
+
+	pthread_mutex_lock(&inst->snapshot_mutex);
+	inst->snapshot_stop = 1;
+	pthread_cond_signal(&inst->snapshot_cond);
+	pthread_mutex_unlock(&inst->snapshot_mutex);
+
+	pthread_join(inst->snapshot_thread, NULL);
+	inst->snapshot_thread_running = 0;
+}
+#else
+/*
+ *	No threads, so the server is handling one request at a time
+ *	anyway.  Write a snapshot if it's time.
+ */
+static void cache_snapshot_periodic(rlm_cache_t *inst, time_t now)
+{
+	if (now >= inst->next_snapshot) {
+		inst->next_snapshot = now + inst->snapshot_interval;
+		cache_snapshot_write(inst);
+	}
+}
+
+#define cache_snapshot_stop(_x)
+#endif
+
+/*
+ *	Load the entries from a snapshot, skipping any which have
+ *	expired.  Problems with the file are logged, but are not
+ *	fatal.  We just start with an empty cache.
+ */
+static void cache_snapshot_load(rlm_cache_t *inst)
+{
+	int fd, i;
+	int loaded = 0, skipped = 0;
+	uint32_t entry;
+	size_t len, offset;
+	time_t now = time(NULL);
+	struct stat st;
+	uint8_t *data;
+	cache_snapshot_header_t hdr;
+	cache_snapshot_record_t rec;
+	rlm_cache_entry_t *c;
+	const char *p;
+
+	fd = open(inst->snapshot_file, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			radlog(L_ERR, "rlm_cache: Failed opening %s: %s",
+			       inst->snapshot_file, strerror(errno));
+		}
+		return;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		radlog(L_ERR, "rlm_cache: Failed reading %s: %s",
+		       inst->snapshot_file, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	len = st.st_size;
+	if (len < sizeof(hdr)) {
+		radlog(L_ERR, "rlm_cache: Ignoring truncated snapshot %s",
+		       inst->snapshot_file);
+		close(fd);
+		return;
+	}
+
+#ifdef HAVE_SYS_MMAN_H
+	data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+#else
+	data = malloc(len);
+	if (!data || (read(fd, data, len) != (ssize_t) len)) {
+		free(data);
+#endif
+		radlog(L_ERR, "rlm_cache: Failed reading %s: %s",
+		       inst->snapshot_file, strerror(errno));
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	memcpy(&hdr, data, sizeof(hdr));
+	if ((memcmp(hdr.magic, CACHE_SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0) ||
+	    (hdr.byte_order != 0x01020304) ||
+	    (hdr.data_size != sizeof(VALUE_PAIR_DATA))) {
+		radlog(L_ERR, "rlm_cache: Ignoring snapshot %s from a different server",
+		       inst->snapshot_file);
+		goto done;
+	}
+
+	offset = sizeof(hdr);
+	for (entry = 0; entry < hdr.num_entries; entry++) {
+		size_t rec_len;
+		VALUE_PAIR_PACKED **lists[3];
+
+		if ((offset + sizeof(rec)) > len) goto corrupt;
+		memcpy(&rec, data + offset, sizeof(rec));
+		offset += sizeof(rec);
+
+		rec_len = (size_t) rec.key_len + rec.list_len[0] +
+			rec.list_len[1] + rec.list_len[2];
+		if ((rec.key_len == 0) || (rec_len > (len - offset))) {
+			goto corrupt;
+		}
+
+		p = (const char *) (data + offset);
+		if (p[rec.key_len - 1] != '\0') goto corrupt;
+
+		if ((rec.expires < now) || (rec.created < inst->epoch)) {
+			offset += rec_len;
+			skipped++;
+			continue;
+		}
+
+		c = rad_malloc(sizeof(*c));
+		memset(c, 0, sizeof(*c));
+		c->key = strdup(p);
+		c->created = rec.created;
+		c->expires = rec.expires;
+		c->hits = rec.hits;
+		offset += rec.key_len;
+
+		lists[0] = &c->control;
+		lists[1] = &c->request;
+		lists[2] = &c->reply;
+		for (i = 0; i < 3; i++) {
+			if (!rec.list_len[i]) continue;
+
+			*lists[i] = pairpacked_copy(data + offset,
+						    rec.list_len[i]);
+			if (!*lists[i]) {
+				cache_entry_free(c);
+				goto corrupt;
+			}
+			offset += rec.list_len[i];
+		}
+		c->size = cache_entry_size(c);
+
+		if (cache_insert(cache_shard(inst, c->key), c)) loaded++;
+	}
+
+	radlog(L_INFO, "rlm_cache: Loaded %d entries from %s, skipped %d expired entries",
+	       loaded, inst->snapshot_file, skipped);
+	goto done;
+
+corrupt:
+	radlog(L_ERR, "rlm_cache: Snapshot %s is corrupt after %d entries",
+	       inst->snapshot_file, loaded + skipped);
+
+done:
+#ifdef HAVE_SYS_MMAN_H
+	munmap(data, len);
+#else
+	free(data);
+#endif
+}
+
 /*
  *	Verify that the cache section makes sense.
  */
@@ -352,6 +1057,106 @@ static int cache_verify(rlm_cache_t *inst)
 	return 1;
 }
 
+/*
+ *	Add up the statistics for all of the shards.
+ */
+static void cache_stats_get(rlm_cache_t *inst, rlm_cache_stats_t *stats)
+{
+	int i;
+	rlm_cache_shard_t *shard;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < CACHE_NUM_SHARDS; i++) {
+		shard = &inst->shard[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		stats->entries += fr_hash_table_num_elements(shard->cache);
+		stats->memory += shard->memory;
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->expired += shard->expired;
+		stats->coalesced += shard->coalesced;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/*
+ *	For "radmin -e 'stats module cache'"
+ */
+static size_t cache_stats(void *instance, char *out, size_t outlen)
+{
+	rlm_cache_stats_t stats;
+
+	cache_stats_get(instance, &stats);
+
+	return snprintf(out, outlen,
+			"entries\t\t%d\n"
+			"memory\t\t%lu\n"
+			"hits\t\t%llu\n"
+			"misses\t\t%llu\n"
+			"evictions\t%llu\n"
+			"expired\t\t%llu\n"
+			"coalesced\t%llu\n",
+			stats.entries,
+			(unsigned long) stats.memory,
+			(unsigned long long) stats.hits,
+			(unsigned long long) stats.misses,
+			(unsigned long long) stats.evictions,
+			(unsigned long long) stats.expired,
+			(unsigned long long) stats.coalesced);
+}
+
+/*
+ *	"%{cache:stats:hits}", etc.
+ */
+static int cache_xlat_stats(rlm_cache_t *inst, const char *name,
+			    char *out, size_t freespace)
+{
+	rlm_cache_stats_t stats;
+
+	cache_stats_get(inst, &stats);
+
+	if (strcmp(name, "entries") == 0) {
+		return snprintf(out, freespace, "%d", stats.entries);
+	}
+
+	if (strcmp(name, "memory") == 0) {
+		return snprintf(out, freespace, "%lu",
+				(unsigned long) stats.memory);
+	}
+
+	if (strcmp(name, "hits") == 0) {
+		return snprintf(out, freespace, "%llu",
+				(unsigned long long) stats.hits);
+	}
+
+	if (strcmp(name, "misses") == 0) {
+		return snprintf(out, freespace, "%llu",
+				(unsigned long long) stats.misses);
+	}
+
+	if (strcmp(name, "evictions") == 0) {
+		return snprintf(out, freespace, "%llu",
+				(unsigned long long) stats.evictions);
+	}
+
+	if (strcmp(name, "expired") == 0) {
+		return snprintf(out, freespace, "%llu",
+				(unsigned long long) stats.expired);
+	}
+
+	if (strcmp(name, "coalesced") == 0) {
+		return snprintf(out, freespace, "%llu",
+				(unsigned long long) stats.coalesced);
+	}
+
+	radlog(L_ERR, "rlm_cache: Unknown statistic \"%s\"", name);
+
+	return 0;
+}
+
 /*
  *	Allow single attribute values to be retrieved from the cache.
  */
@@ -359,18 +1164,29 @@ static int cache_xlat(void *instance, REQUEST *request,
 		      char *fmt, char *out, size_t freespace,
 		      UNUSED RADIUS_ESCAPE_STRING func)
 {
+	int rcode;
 	rlm_cache_entry_t *c;
 	rlm_cache_t *inst = instance;
+	rlm_cache_shard_t *shard;
 	VALUE_PAIR *vp, *vps;
+	VALUE_PAIR_PACKED *packed;
 	DICT_ATTR *target;
 	const char *p = fmt;
 	char buffer[1024];
 
+	if (strncmp(fmt, "stats:", 6) == 0) {
+		return cache_xlat_stats(inst, fmt + 6, out, freespace);
+	}
+
 	radius_xlat(buffer, sizeof(buffer), inst->key, request, NULL);
 
-	c = cache_find(inst, request, buffer);
+	shard = cache_shard(inst, buffer);
+	pthread_mutex_lock(&shard->mutex);
+
+	c = cache_find(inst, request, shard, buffer);
 	
 	if (!c) {
+		pthread_mutex_unlock(&shard->mutex);
 		RDEBUG("No cache entry for key \"%s\"", buffer);
 		
 		return 0;
@@ -378,36 +1194,44 @@ static int cache_xlat(void *instance, REQUEST *request,
 	
 	if (strncmp(fmt, "control:", 8) == 0) {
 		p = fmt + 8;
-		vps = c->control;
+		packed = c->control;
 
 	} else if (strncmp(fmt, "request:", 8) == 0) {
 		p = fmt + 8;
-		vps = c->request;
+		packed = c->request;
 
 	} else if (strncmp(fmt, "reply:", 6) == 0) {
 		p = fmt + 6;
-		vps = c->reply;
+		packed = c->reply;
 
 	} else {
 		p = fmt;
-		vps = c->request;
+		packed = c->request;
 	}
 
 	target = dict_attrbyname(p);
 	if (!target) {
+		pthread_mutex_unlock(&shard->mutex);
 		radlog(L_ERR, "rlm_cache: Unknown attribute \"%s\"", p);
 		
 		return 0;
 	}
 	
+	vps = pairunpack(packed);
+	pthread_mutex_unlock(&shard->mutex);
+
 	vp = pairfind(vps, target->attr);
 	if (!vp) {
 		RDEBUG("No instance of this attribute has been cached");
+		pairfree(&vps);
 		
 		return 0;
 	}
 	
-	return vp_prints_value(out, freespace, vp, 0);
+	rcode = vp_prints_value(out, freespace, vp, 0);
+	pairfree(&vps);
+
+	return rcode;
 }
 
 
@@ -429,6 +1253,18 @@ static const CONF_PARSER module_config[] = {
 	  offsetof(rlm_cache_t, epoch), NULL,   "0" },
 	{ "add-stats", PW_TYPE_BOOLEAN,
 	  offsetof(rlm_cache_t, stats), NULL,   "no" },
+	{ "max_entries", PW_TYPE_INTEGER,
+	  offsetof(rlm_cache_t, max_entries), NULL,   "0" },
+	{ "max_memory", PW_TYPE_INTEGER,
+	  offsetof(rlm_cache_t, max_memory), NULL,   "0" },
+	{ "single_flight", PW_TYPE_BOOLEAN,
+	  offsetof(rlm_cache_t, single_flight), NULL,   "no" },
+	{ "single_flight_timeout", PW_TYPE_INTEGER,
+	  offsetof(rlm_cache_t, single_flight_timeout), NULL,   "1000" },
+	{ "snapshot", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_cache_t, snapshot), NULL,   NULL },
+	{ "snapshot_interval", PW_TYPE_INTEGER,
+	  offsetof(rlm_cache_t, snapshot_interval), NULL,   "0" },
 
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
@@ -440,13 +1276,43 @@ static const CONF_PARSER module_config[] = {
  */
 static int cache_detach(void *instance)
 {
+	int i;
 	rlm_cache_t *inst = instance;
 
+	module_stats_unregister(inst);
+
+	if (inst->snapshot_ready) {
+		cache_snapshot_stop(inst);
+		cache_snapshot_write(inst);
+	}
+
 	free(inst->key);
+	free(inst->snapshot_file);
 	free(inst->xlat_name);
 
-	fr_heap_delete(inst->heap);
-	rbtree_free(inst->cache);
+	for (i = 0; i < CACHE_NUM_SHARDS; i++) {
+		rlm_cache_shard_t *shard = &inst->shard[i];
+
+		/*
+		 *	Not initialized.
+		 */
+		if (!shard->heap) continue;
+
+		fr_heap_delete(shard->heap);
+		fr_hash_table_free(shard->cache);
+		pthread_mutex_destroy(&shard->mutex);
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_destroy(&shard->cond);
+#endif
+	}
+
+	if (inst->snapshot_ready) {
+		pthread_mutex_destroy(&inst->snapshot_mutex);
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_destroy(&inst->snapshot_cond);
+#endif
+	}
+
 	free(instance);
 	return 0;
 }
@@ -457,6 +1323,7 @@ static int cache_detach(void *instance)
  */
 static int cache_instantiate(CONF_SECTION *conf, void **instance)
 {
+	int i;
 	const char *xlat_name;
 	rlm_cache_t *inst;
 
@@ -506,27 +1373,57 @@ static int cache_instantiate(CONF_SECTION *conf, void **instance)
 		return -1;
 	}
 
-	/*
-	 *	The cache.
-	 */
-	inst->cache = rbtree_create(cache_entry_cmp, cache_entry_free, 0);
-	if (!inst->cache) {
-		radlog(L_ERR, "rlm_cache: Failed to create cache");
+	if (inst->single_flight && (inst->single_flight_timeout <= 0)) {
+		radlog(L_ERR, "rlm_cache: single_flight_timeout must be greater than zero");
 		cache_detach(inst);
 		return -1;
 	}
 
-	/*
-	 *	The heap of entries to expire.
-	 */
-	inst->heap = fr_heap_create(cache_heap_cmp,
-				    offsetof(rlm_cache_entry_t, offset));
-	if (!inst->heap) {
-		radlog(L_ERR, "rlm_cache: Failed to create cache");
+	if ((inst->max_entries < 0) || (inst->max_memory < 0)) {
+		radlog(L_ERR, "rlm_cache: max_entries and max_memory cannot be negative");
 		cache_detach(inst);
 		return -1;
 	}
-	
+
+	for (i = 0; i < CACHE_NUM_SHARDS; i++) {
+		rlm_cache_shard_t *shard = &inst->shard[i];
+
+		/*
+		 *	The cache.
+		 */
+		shard->cache = fr_hash_table_create(cache_entry_hash,
+						    cache_entry_cmp,
+						    cache_entry_free);
+		if (!shard->cache) {
+			radlog(L_ERR, "rlm_cache: Failed to create cache");
+			cache_detach(inst);
+			return -1;
+		}
+
+		/*
+		 *	The heap of entries to expire.
+		 */
+		shard->heap = fr_heap_create(cache_heap_cmp,
+					     offsetof(rlm_cache_entry_t, offset));
+		if (!shard->heap) {
+			fr_hash_table_free(shard->cache);
+			radlog(L_ERR, "rlm_cache: Failed to create cache");
+			cache_detach(inst);
+			return -1;
+		}
+
+		pthread_mutex_init(&shard->mutex, NULL);
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_init(&shard->cond, NULL);
+#endif
+
+		/*
+		 *	The limits are split evenly across the shards.
+		 */
+		shard->max_entries = (inst->max_entries + CACHE_NUM_SHARDS - 1) / CACHE_NUM_SHARDS;
+		shard->max_memory = ((size_t) inst->max_memory * 1024 * 1024) / CACHE_NUM_SHARDS;
+	}
+
 
 	inst->cs = cf_section_sub_find(conf, "update");
 	if (!inst->cs) {
@@ -543,6 +1440,28 @@ static int cache_instantiate(CONF_SECTION *conf, void **instance)
 		return -1;
 	}
 
+	if (!inst->snapshot) inst->snapshot_interval = 0;
+
+	if (inst->snapshot) {
+		if (inst->snapshot_interval < 0) {
+			radlog(L_ERR, "rlm_cache: snapshot_interval cannot be negative");
+			cache_detach(inst);
+			return -1;
+		}
+
+		inst->snapshot_file = strdup(inst->snapshot);
+		pthread_mutex_init(&inst->snapshot_mutex, NULL);
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_init(&inst->snapshot_cond, NULL);
+#endif
+		cache_snapshot_load(inst);
+
+		inst->next_snapshot = time(NULL) + inst->snapshot_interval;
+		inst->snapshot_ready = 1;
+	}
+
+	module_stats_register(inst, cache_stats);
+
 	*instance = inst;
 
 	return 0;
@@ -559,18 +1478,30 @@ static int cache_it(void *instance, REQUEST *request)
 {
 	rlm_cache_entry_t *c;
 	rlm_cache_t *inst = instance;
+	rlm_cache_shard_t *shard;
+#ifdef HAVE_PTHREAD_H
+	rlm_cache_inflight_t *f = NULL;
+#endif
 	VALUE_PAIR *vp;
 	char buffer[1024];
 
+	if (inst->snapshot_interval) {
+		cache_snapshot_periodic(inst, request->timestamp);
+	}
+
 	radius_xlat(buffer, sizeof(buffer), inst->key, request, NULL);
 
-	c = cache_find(inst, request, buffer);
+	shard = cache_shard(inst, buffer);
+	pthread_mutex_lock(&shard->mutex);
+
+	c = cache_find(inst, request, shard, buffer);
 	
 	/*
 	 *	If yes, only return whether we found a valid cache entry
 	 */
 	vp = pairfind(request->config_items, PW_CACHE_STATUS_ONLY);
 	if (vp && vp->vp_integer) {
+		pthread_mutex_unlock(&shard->mutex);
 		return c ?
 			RLM_MODULE_OK:
 			RLM_MODULE_NOTFOUND;
@@ -578,13 +1509,57 @@ static int cache_it(void *instance, REQUEST *request)
 	
 	if (c) {
 		cache_merge(inst, request, c);
+		pthread_mutex_unlock(&shard->mutex);
 		return RLM_MODULE_OK;
 	}
 
-	c = cache_add(inst, request, buffer);
-	if (!c) return RLM_MODULE_NOOP;
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Someone else is already creating this entry.  Wait
+	 *	for them, and use theirs.  If they take too long, we
+	 *	create it ourselves.
+	 */
+	if (inst->single_flight) {
+		f = cache_inflight_find(shard, buffer);
+		if (!f) {
+			f = cache_inflight_add(shard, buffer);
+
+		} else {
+			RDEBUG2("Waiting for another request to create the entry for \"%s\"",
+				buffer);
+			if (cache_inflight_wait(inst, shard, f)) {
+				c = cache_find(inst, request, shard, buffer);
+				if (c) {
+					shard->coalesced++;
+					cache_merge(inst, request, c);
+					pthread_mutex_unlock(&shard->mutex);
+					return RLM_MODULE_OK;
+				}
+			} else {
+				RDEBUG2("Timed out waiting for the entry for \"%s\"",
+					buffer);
+			}
+			f = NULL;
+		}
+	}
+#endif
+	pthread_mutex_unlock(&shard->mutex);
+
+	c = cache_create(inst, request, buffer);
+
+	pthread_mutex_lock(&shard->mutex);
+#ifdef HAVE_PTHREAD_H
+	if (f) cache_inflight_done(shard, f);
+#endif
+
+	if (c) c = cache_insert(shard, c);
+	if (!c) {
+		pthread_mutex_unlock(&shard->mutex);
+		return RLM_MODULE_NOOP;
+	}
 
 	cache_merge(inst, request, c);
+	pthread_mutex_unlock(&shard->mutex);
 
 	return RLM_MODULE_UPDATED;
 }
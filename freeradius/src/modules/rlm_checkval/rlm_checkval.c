@@ -260,22 +260,19 @@ static int do_checkval(void *instance, REQUEST *request)
 #ifdef HAVE_REGEX_H
 		if (ret == RLM_MODULE_REJECT &&
 		    chk_vp->operator == T_OP_REG_EQ) {
-			regex_t reg;
-			int err;
-			char err_msg[MAX_STRING_LEN];
+			regex_t *preg;
 
 			DEBUG("rlm_checkval: Doing regex");
-			err = regcomp(&reg, (char *)chk_vp->vp_strvalue, REG_EXTENDED|REG_NOSUB);
-			if (err){
-				regerror(err, &reg,err_msg, MAX_STRING_LEN);
-				DEBUG("rlm_checkval: regcomp() returned error: %s", err_msg);
+			preg = fr_regex_get(chk_vp->vp_strvalue, REG_EXTENDED|REG_NOSUB);
+			if (!preg){
+				DEBUG("rlm_checkval: %s", fr_strerror());
 				return RLM_MODULE_FAIL;
 			}
-			if (regexec(&reg, (char *)item_vp->vp_strvalue,0, NULL, 0) == 0)
+			if (regexec(preg, (char *)item_vp->vp_strvalue,0, NULL, 0) == 0)
 				ret = RLM_MODULE_OK;
 			else
 				ret = RLM_MODULE_REJECT;
-			regfree(&reg);
+			fr_regex_release(preg);
 		}
 #endif
 		tmp = chk_vp->next;
@@ -30,6 +30,7 @@ RCSID("$Id$")
 
 #include	<ctype.h>
 #include	<fcntl.h>
+#include	<stdarg.h>
 #include	<sys/stat.h>
 
 #ifdef HAVE_FNMATCH_H
@@ -46,9 +47,63 @@ RCSID("$Id$")
 
 #define 	DIRLEN	8192
 
+#ifndef HAVE_PTHREAD_H
+/*
+ *	This is easier than ifdef's throughout the code.  Without
+ *	threads, the thread which adds a record always writes it.
+ */
+#define pthread_mutex_init(_x, _y)
+#define pthread_mutex_destroy(_x)
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_unlock(_x)
+#define pthread_cond_init(_x, _y)
+#define pthread_cond_destroy(_x)
+#define pthread_cond_broadcast(_x)
+#define pthread_cond_wait(_x, _y)
+#endif
+
+/*
+ *	In buffered mode, files which haven't been written to for
+ *	this many seconds are closed.
+ */
+#define DETAIL_IDLE_TIMEOUT (60)
+
+/*
+ *	A buffer which grows as needed.
+ */
+typedef struct detail_buf_t {
+	char		*data;
+	size_t		used;
+	size_t		size;
+} detail_buf_t;
+
+/*
+ *	Records waiting to be written to a file, as one write().
+ */
+typedef struct detail_batch_t {
+	detail_buf_t	buf;
+	int		waiters;
+	int		done;
+	int		rcode;
+} detail_batch_t;
+
+/*
+ *	A detail file which is kept open, in buffered mode.
+ */
+typedef struct detail_file_t {
+	struct detail_file_t *next;
+	char		*filename;
+	int		fd;
+	int		users;
+	int		flushing;
+	time_t		last_used;
+	detail_batch_t	*batch;
+} detail_file_t;
+
 struct detail_instance {
 	/* detail file */
 	char *detailfile;
+	xlat_template_t *detailfile_xt;
 
 	/* detail file permissions */
 	int detailperm;
@@ -61,6 +116,7 @@ struct detail_instance {
 
 	/* timestamp & stuff */
 	char *header;
+	xlat_template_t *header_xt;
 
 	/* if we want file locking */
 	int locking;
@@ -69,6 +125,29 @@ struct detail_instance {
 	int log_srcdst;
 
 	fr_hash_table_t *ht;
+
+	/* buffered writes */
+	int buffered;
+	int flush_interval;
+	int buffer_size;
+	int sync;
+
+	/* the rest is protected by the mutex */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	pthread_t	thread;
+#endif
+	int		thread_running;
+	int		stop;
+
+	fr_hash_table_t	*files_ht;
+	detail_file_t	*files;
+
+	uint64_t	records;
+	uint64_t	batches;
+	uint64_t	bytes;
+	uint64_t	failed;
 };
 
 static const CONF_PARSER module_config[] = {
@@ -86,17 +165,105 @@ static const CONF_PARSER module_config[] = {
 	  offsetof(struct detail_instance,locking),    NULL, "no" },
 	{ "log_packet_header",       PW_TYPE_BOOLEAN,
 	  offsetof(struct detail_instance,log_srcdst),    NULL, "no" },
+	{ "buffered",      PW_TYPE_BOOLEAN,
+	  offsetof(struct detail_instance,buffered),    NULL, "no" },
+	{ "flush_interval", PW_TYPE_INTEGER,
+	  offsetof(struct detail_instance,flush_interval), NULL, "0" },
+	{ "buffer_size",   PW_TYPE_INTEGER,
+	  offsetof(struct detail_instance,buffer_size), NULL, "65536" },
+	{ "fdatasync",     PW_TYPE_BOOLEAN,
+	  offsetof(struct detail_instance,sync),    NULL, "no" },
 	{ NULL, -1, 0, NULL, NULL }
 };
 
 
+static void detail_batch_free(detail_batch_t *batch);
+static void detail_flush(struct detail_instance *inst, detail_file_t *f);
+
+static uint32_t detail_file_hash(const void *data);
+static int detail_file_cmp(const void *a, const void *b);
+
+static void detail_file_free(void *data)
+{
+	detail_file_t *f = data;
+
+	if (f->fd >= 0) close(f->fd);
+	free(f->filename);
+	free(f);
+}
+
+
+static size_t detail_stats(void *instance, char *out, size_t outlen)
+{
+	struct detail_instance *inst = instance;
+	int num_files = 0;
+	uint64_t records, batches, bytes, failed;
+	detail_file_t *f;
+
+	pthread_mutex_lock(&inst->mutex);
+	for (f = inst->files; f != NULL; f = f->next) {
+		if (f->fd >= 0) num_files++;
+	}
+	records = inst->records;
+	batches = inst->batches;
+	bytes = inst->bytes;
+	failed = inst->failed;
+	pthread_mutex_unlock(&inst->mutex);
+
+	return snprintf(out, outlen,
+			"records\t\t%llu\n"
+			"batches\t\t%llu\n"
+			"bytes\t\t%llu\n"
+			"failed\t\t%llu\n"
+			"files_open\t%d\n",
+			(unsigned long long) records,
+			(unsigned long long) batches,
+			(unsigned long long) bytes,
+			(unsigned long long) failed,
+			num_files);
+}
+
+
 /*
  *	Clean up.
  */
 static int detail_detach(void *instance)
 {
         struct detail_instance *inst = instance;
+	detail_file_t *f;
+
+	if (inst->buffered) {
+		module_stats_unregister(inst);
+
+#ifdef HAVE_PTHREAD_H
+		if (inst->thread_running) {
+			pthread_mutex_lock(&inst->mutex);
+			inst->stop = 1;
+			pthread_cond_broadcast(&inst->cond);
+			pthread_mutex_unlock(&inst->mutex);
+
+			pthread_join(inst->thread, NULL);
+		}
+#endif
+
+		/*
+		 *	Write anything which is left.
+		 */
+		pthread_mutex_lock(&inst->mutex);
+		for (f = inst->files; f != NULL; f = f->next) {
+			if (f->batch) detail_flush(inst, f);
+		}
+		pthread_mutex_unlock(&inst->mutex);
+
+		if (inst->files_ht) fr_hash_table_free(inst->files_ht);
+	}
+
+	pthread_mutex_destroy(&inst->mutex);
+	pthread_cond_destroy(&inst->cond);
+
 	if (inst->ht) fr_hash_table_free(inst->ht);
+	radius_free_xlat(&inst->detailfile_xt);
+	radius_free_xlat(&inst->header_xt);
 
         free(inst);
 	return 0;
@@ -129,11 +296,30 @@ static int detail_instantiate(CONF_SECTION *conf, void **instance)
 	}
 	memset(inst, 0, sizeof(*inst));
 
+	pthread_mutex_init(&inst->mutex, NULL);
+	pthread_cond_init(&inst->cond, NULL);
+
 	if (cf_section_parse(conf, inst, module_config) < 0) {
 		detail_detach(inst);
 		return -1;
 	}
 
+	inst->detailfile_xt = radius_compile_xlat(inst->detailfile);
+	if (!inst->detailfile_xt) {
+		radlog(L_ERR, "rlm_detail: Invalid detailfile \"%s\": %s",
+		       inst->detailfile, fr_strerror());
+		detail_detach(inst);
+		return -1;
+	}
+
+	inst->header_xt = radius_compile_xlat(inst->header);
+	if (!inst->header_xt) {
+		radlog(L_ERR, "rlm_detail: Invalid header \"%s\": %s",
+		       inst->header, fr_strerror());
+		detail_detach(inst);
+		return -1;
+	}
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -176,216 +362,95 @@ static int detail_instantiate(CONF_SECTION *conf, void **instance)
 	}
 
 
-	*instance = inst;
-	return 0;
-}
-
-/*
- *	Do detail, compatible with old accounting
- */
-static int do_detail(void *instance, REQUEST *request, RADIUS_PACKET *packet,
-		     int compat)
-{
-	int		outfd;
-	char		timestamp[256];
-	char		buffer[DIRLEN];
-	char		*p;
-	struct stat	st;
-	int		locked;
-	int		lock_count;
-	struct timeval	tv;
-	VALUE_PAIR	*pair;
-	off_t		fsize;
-	FILE		*fp;
+	if (inst->buffered) {
+		if ((inst->flush_interval < 0) || (inst->buffer_size <= 0)) {
+			radlog(L_ERR, "rlm_detail: Invalid flush_interval or buffer_size");
+			detail_detach(inst);
+			return -1;
+		}
 
-#ifdef HAVE_GRP_H
-	gid_t		gid;
-	struct group	*grp;
-	char		*endptr;
+#ifndef HAVE_PTHREAD_H
+		inst->flush_interval = 0;
 #endif
 
-	struct detail_instance *inst = instance;
-
-	rad_assert(request != NULL);
+		inst->files_ht = fr_hash_table_create(detail_file_hash,
+						      detail_file_cmp,
+						      detail_file_free);
+		if (!inst->files_ht) {
+			detail_detach(inst);
+			return -1;
+		}
 
-	/*
-	 *	Nothing to log: don't do anything.
-	 */
-	if (!packet) {
-		return RLM_MODULE_NOOP;
+		module_stats_register(inst, detail_stats);
 	}
 
-	/*
-	 *	Create a directory for this nas.
-	 *
-	 *	Generate the path for the detail file.  Use the
-	 *	same format, but truncate at the last /.  Then
-	 *	feed it through radius_xlat() to expand the
-	 *	variables.
-	 */
-	if (radius_xlat(buffer, sizeof(buffer), inst->detailfile, request, NULL) == 0) {
-		radlog_request(L_ERR, 0, request, "rlm_detail: Failed to expand detail file %s",
-		    inst->detailfile);
-	    return RLM_MODULE_FAIL;
-	}
-	RDEBUG2("%s expands to %s", inst->detailfile, buffer);
+	*instance = inst;
+	return 0;
+}
 
-#ifdef HAVE_FNMATCH_H
-#ifdef FNM_FILE_NAME
-	/*
-	 *	If we read it from a detail file, and we're about to
-	 *	write it back to the SAME detail file directory, then
-	 *	suppress the write.  This check prevents an infinite
-	 *	loop.
-	 */
-	if ((request->listener->type == RAD_LISTEN_DETAIL) &&
-	    (fnmatch(((listen_detail_t *)request->listener->data)->filename,
-		     buffer, FNM_FILE_NAME | FNM_PERIOD ) == 0)) {
-		RDEBUG2("WARNING: Suppressing infinite loop.");
-		return RLM_MODULE_NOOP;
-	}
-#endif
-#endif
+static void detail_buf_grow(detail_buf_t *b, size_t need)
+{
+	size_t size;
+	char *data;
 
-	/*
-	 *	Grab the last directory delimiter.
-	 */
-	p = strrchr(buffer,'/');
+	size = b->size ? b->size : 1024;
+	while ((size - b->used) < need) size <<= 1;
+	if (size == b->size) return;
 
-	/*
-	 *	There WAS a directory delimiter there, and the file
-	 *	doesn't exist, so we must create it the directories..
-	 */
-	if (p) {
-		*p = '\0';
+	data = rad_malloc(size);
+	if (b->used) memcpy(data, b->data, b->used);
+	free(b->data);
 
-		/*
-		 *	Always try to create the directory.  If it
-		 *	exists, rad_mkdir() will check via stat(), and
-		 *	return immediately.
-		 *
-		 *	This catches the case where some idiot deleted
-		 *	a directory that the server was using.
-		 */
-		if (rad_mkdir(buffer, inst->dirperm) < 0) {
-			radlog_request(L_ERR, 0, request, "rlm_detail: Failed to create directory %s: %s", buffer, strerror(errno));
-			return RLM_MODULE_FAIL;
-		}
-		
-		*p = '/';
-	} /* else there was no directory delimiter. */
+	b->data = data;
+	b->size = size;
+}
 
-	locked = 0;
-	lock_count = 0;
-	do {
-		/*
-		 *	Open & create the file, with the given
-		 *	permissions.
-		 */
-		if ((outfd = open(buffer, O_WRONLY | O_APPEND | O_CREAT,
-				  inst->detailperm)) < 0) {
-			radlog_request(L_ERR, 0, request, "rlm_detail: Couldn't open file %s: %s",
-			       buffer, strerror(errno));
-			return RLM_MODULE_FAIL;
-		}
+static void detail_buf_add(detail_buf_t *b, const char *data, size_t len)
+{
+	detail_buf_grow(b, len);
+	memcpy(b->data + b->used, data, len);
+	b->used += len;
+}
 
-		/*
-		 *	If we fail to aquire the filelock in 80 tries
-		 *	(approximately two seconds) we bail out.
-		 */
-		if (inst->locking) {
-			lseek(outfd, 0L, SEEK_SET);
-			if (rad_lockfd_nonblock(outfd, 0) < 0) {
-				close(outfd);
-				tv.tv_sec = 0;
-				tv.tv_usec = 25000;
-				select(0, NULL, NULL, NULL, &tv);
-				lock_count++;
-				continue;
-			}
+static void detail_buf_printf(detail_buf_t *b, const char *fmt, ...)
+{
+	int len;
+	va_list ap;
 
-			/*
-			 *	The file might have been deleted by
-			 *	radrelay while we tried to acquire
-			 *	the lock (race condition)
-			 */
-			if (fstat(outfd, &st) != 0) {
-				radlog_request(L_ERR, 0, request, "rlm_detail: Couldn't stat file %s: %s",
-				       buffer, strerror(errno));
-				close(outfd);
-				return RLM_MODULE_FAIL;
-			}
-			if (st.st_nlink == 0) {
-				RDEBUG2("File %s removed by another program, retrying",
-				      buffer);
-				close(outfd);
-				lock_count = 0;
-				continue;
-			}
+	while (1) {
+		va_start(ap, fmt);
+		len = vsnprintf(b->data + b->used, b->size - b->used, fmt, ap);
+		va_end(ap);
+		if (len < 0) return;
 
-			RDEBUG2("Acquired filelock, tried %d time(s)",
-			      lock_count + 1);
-			locked = 1;
-		}
-	} while (inst->locking && !locked && lock_count < 80);
+		if ((size_t) len < (b->size - b->used)) break;
 
-	if (inst->locking && !locked) {
-		close(outfd);
-		radlog_request(L_ERR, 0, request, "rlm_detail: Failed to acquire filelock for %s, giving up",
-		       buffer);
-		return RLM_MODULE_FAIL;
+		detail_buf_grow(b, len + 1);
 	}
 
+	b->used += len;
+}
 
-#ifdef HAVE_GRP_H
-	if (inst->group != NULL) {
-		gid = strtol(inst->group, &endptr, 10);
-		if (*endptr != '\0') {
-			grp = getgrnam(inst->group);
-			if (grp == NULL) {
-				RDEBUG2("rlm_detail: Unable to find system group \"%s\"", inst->group);
-				goto skip_group;
-			}
-			gid = grp->gr_gid;
-		}
-
-		if (chown(buffer, -1, gid) == -1) {
-			RDEBUG2("rlm_detail: Unable to change system group of \"%s\"", buffer);
-		}
-	}
-
- skip_group:
-#endif
+static void detail_buf_vp(detail_buf_t *b, VALUE_PAIR *vp)
+{
+	char buffer[1024];
 
-	/*
-	 *	Post a timestamp
-	 */
-	fsize = lseek(outfd, 0L, SEEK_END);
-	if (fsize < 0) {
-		radlog_request(L_ERR, 0, request, "rlm_detail: Failed to seek to the end of detail file %s",
-			buffer);
-		close(outfd);
-		return RLM_MODULE_FAIL;
-	}
+	vp_prints(buffer, sizeof(buffer), vp);
+	detail_buf_printf(b, "\t%s\n", buffer);
+}
 
-	if (radius_xlat(timestamp, sizeof(timestamp), inst->header, request, NULL) == 0) {
-		radlog_request(L_ERR, 0, request, "rlm_detail: Unable to expand detail header format %s",
-			inst->header);
-		close(outfd);
-		return RLM_MODULE_FAIL;
-	}
 
-	/*
-	 *	Open the FP for buffering.
-	 */
-	if ((fp = fdopen(outfd, "a")) == NULL) {
-		radlog_request(L_ERR, 0, request, "rlm_detail: Couldn't open file %s: %s",
-			       buffer, strerror(errno));
-		close(outfd);
-		return RLM_MODULE_FAIL;
-	}
+/*
+ *	Format one record, in the same way as it will be written to
+ *	the file.
+ */
+static void detail_format(struct detail_instance *inst, REQUEST *request,
+			  RADIUS_PACKET *packet, int compat,
+			  const char *timestamp, detail_buf_t *b)
+{
+	VALUE_PAIR	*pair;
 
-	fprintf(fp, "%s\n", timestamp);
+	detail_buf_printf(b, "%s\n", timestamp);
 
 	/*
 	 *	Write the information to the file.
@@ -397,10 +462,11 @@ static int do_detail(void *instance, REQUEST *request, RADIUS_PACKET *packet,
 		 */
 		if ((packet->code > 0) &&
 		    (packet->code < FR_MAX_PACKET_CODE)) {
-			fprintf(fp, "\tPacket-Type = %s\n",
-				fr_packet_codes[packet->code]);
+			detail_buf_printf(b, "\tPacket-Type = %s\n",
+					  fr_packet_codes[packet->code]);
 		} else {
-			fprintf(fp, "\tPacket-Type = %d\n", packet->code);
+			detail_buf_printf(b, "\tPacket-Type = %d\n",
+					  packet->code);
 		}
 	}
 
@@ -440,8 +506,8 @@ static int do_detail(void *instance, REQUEST *request, RADIUS_PACKET *packet,
 			break;
 		}
 
-		vp_print(fp, &src_vp);
-		vp_print(fp, &dst_vp);
+		detail_buf_vp(b, &src_vp);
+		detail_buf_vp(b, &dst_vp);
 
 		src_vp.name = "Packet-Src-IP-Port";
 		src_vp.attribute = PW_PACKET_SRC_PORT;
@@ -452,8 +518,8 @@ static int do_detail(void *instance, REQUEST *request, RADIUS_PACKET *packet,
 		dst_vp.type = PW_TYPE_INTEGER;
 		dst_vp.vp_integer = packet->dst_port;
 
-		vp_print(fp, &src_vp);
-		vp_print(fp, &dst_vp);
+		detail_buf_vp(b, &src_vp);
+		detail_buf_vp(b, &dst_vp);
 	}
 
 	/* Write each attribute/value to the log file */
@@ -472,7 +538,7 @@ static int do_detail(void *instance, REQUEST *request, RADIUS_PACKET *packet,
 		/*
 		 *	Print all of the attributes.
 		 */
-		vp_print(fp, pair);
+		detail_buf_vp(b, pair);
 	}
 
 	/*
@@ -485,34 +551,649 @@ static int do_detail(void *instance, REQUEST *request, RADIUS_PACKET *packet,
 			inet_ntop(request->proxy->dst_ipaddr.af,
 				  &request->proxy->dst_ipaddr.ipaddr,
 				  proxy_buffer, sizeof(proxy_buffer));
-			fprintf(fp, "\tFreeradius-Proxied-To = %s\n",
-				proxy_buffer);
+			detail_buf_printf(b, "\tFreeradius-Proxied-To = %s\n",
+					  proxy_buffer);
 			RDEBUG("Freeradius-Proxied-To = %s",
 				proxy_buffer);
 		}
 
-		fprintf(fp, "\tTimestamp = %ld\n",
-			(unsigned long) request->timestamp);
+		detail_buf_printf(b, "\tTimestamp = %ld\n",
+				  (unsigned long) request->timestamp);
 	}
 
-	fprintf(fp, "\n");
+	detail_buf_add(b, "\n", 1);
+}
+
+
+/*
+ *	Create the directory for a detail file.
+ */
+static int detail_mkdir(struct detail_instance *inst, REQUEST *request,
+			char *filename)
+{
+	char *p;
 
 	/*
-	 *	If we can't flush it to disk, truncate the file and
-	 *	return an error.
+	 *	Grab the last directory delimiter.
 	 */
-	if (fflush(fp) != 0) {
-		ftruncate(outfd, fsize); /* ignore errors! */
-		fclose(fp);
-		return RLM_MODULE_FAIL;
-	}
-
-	fclose(fp);
+	p = strrchr(filename,'/');
 
 	/*
-	 *	And everything is fine.
+	 *	There WAS a directory delimiter there, and the file
+	 *	doesn't exist, so we must create it the directories..
 	 */
-	return RLM_MODULE_OK;
+	if (p) {
+		*p = '\0';
+
+		/*
+		 *	Always try to create the directory.  If it
+		 *	exists, rad_mkdir() will check via stat(), and
+		 *	return immediately.
+		 *
+		 *	This catches the case where some idiot deleted
+		 *	a directory that the server was using.
+		 */
+		if (rad_mkdir(filename, inst->dirperm) < 0) {
+			radlog_request(L_ERR, 0, request, "rlm_detail: Failed to create directory %s: %s", filename, strerror(errno));
+			*p = '/';
+			return -1;
+		}
+
+		*p = '/';
+	} /* else there was no directory delimiter. */
+
+	return 0;
+}
+
+
+static void detail_chgrp(struct detail_instance *inst, REQUEST *request,
+			 const char *filename)
+{
+#ifdef HAVE_GRP_H
+	gid_t		gid;
+	struct group	*grp;
+	char		*endptr;
+
+	if (inst->group == NULL) return;
+
+	gid = strtol(inst->group, &endptr, 10);
+	if (*endptr != '\0') {
+		grp = getgrnam(inst->group);
+		if (grp == NULL) {
+			RDEBUG2("rlm_detail: Unable to find system group \"%s\"", inst->group);
+			return;
+		}
+		gid = grp->gr_gid;
+	}
+
+	if (chown(filename, -1, gid) == -1) {
+		RDEBUG2("rlm_detail: Unable to change system group of \"%s\"", filename);
+	}
+#else
+	inst = inst;		/* -Wunused */
+	request = request;
+	filename = filename;
+#endif
+}
+
+
+static int detail_write_all(int fd, const char *data, size_t len)
+{
+	ssize_t rcode;
+
+	while (len > 0) {
+		rcode = write(fd, data, len);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		data += rcode;
+		len -= rcode;
+	}
+
+	return 0;
+}
+
+
+/*
+ *	Write one record: open the file, lock it, append the record,
+ *	and close it.
+ */
+static int detail_write(struct detail_instance *inst, REQUEST *request,
+			char *buffer, const detail_buf_t *b)
+{
+	int		outfd;
+	struct stat	st;
+	int		locked;
+	int		lock_count;
+	struct timeval	tv;
+	off_t		fsize;
+
+	/*
+	 *	Create a directory for this nas.
+	 */
+	if (detail_mkdir(inst, request, buffer) < 0) {
+		return RLM_MODULE_FAIL;
+	}
+
+	locked = 0;
+	lock_count = 0;
+	do {
+		/*
+		 *	Open & create the file, with the given
+		 *	permissions.
+		 */
+		if ((outfd = open(buffer, O_WRONLY | O_APPEND | O_CREAT,
+				  inst->detailperm)) < 0) {
+			radlog_request(L_ERR, 0, request, "rlm_detail: Couldn't open file %s: %s",
+			       buffer, strerror(errno));
+			return RLM_MODULE_FAIL;
+		}
+
+		/*
+		 *	If we fail to aquire the filelock in 80 tries
+		 *	(approximately two seconds) we bail out.
+		 */
+		if (inst->locking) {
+			lseek(outfd, 0L, SEEK_SET);
+			if (rad_lockfd_nonblock(outfd, 0) < 0) {
+				close(outfd);
+				tv.tv_sec = 0;
+				tv.tv_usec = 25000;
+				select(0, NULL, NULL, NULL, &tv);
+				lock_count++;
+				continue;
+			}
+
+			/*
+			 *	The file might have been deleted by
+			 *	radrelay while we tried to acquire
+			 *	the lock (race condition)
+			 */
+			if (fstat(outfd, &st) != 0) {
+				radlog_request(L_ERR, 0, request, "rlm_detail: Couldn't stat file %s: %s",
+				       buffer, strerror(errno));
+				close(outfd);
+				return RLM_MODULE_FAIL;
+			}
+			if (st.st_nlink == 0) {
+				RDEBUG2("File %s removed by another program, retrying",
+				      buffer);
+				close(outfd);
+				lock_count = 0;
+				continue;
+			}
+
+			RDEBUG2("Acquired filelock, tried %d time(s)",
+			      lock_count + 1);
+			locked = 1;
+		}
+	} while (inst->locking && !locked && lock_count < 80);
+
+	if (inst->locking && !locked) {
+		close(outfd);
+		radlog_request(L_ERR, 0, request, "rlm_detail: Failed to acquire filelock for %s, giving up",
+		       buffer);
+		return RLM_MODULE_FAIL;
+	}
+
+	detail_chgrp(inst, request, buffer);
+
+	fsize = lseek(outfd, 0L, SEEK_END);
+	if (fsize < 0) {
+		radlog_request(L_ERR, 0, request, "rlm_detail: Failed to seek to the end of detail file %s",
+			buffer);
+		close(outfd);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	If we can't write it to disk, truncate the file and
+	 *	return an error.
+	 */
+	if (detail_write_all(outfd, b->data, b->used) < 0) {
+		radlog_request(L_ERR, 0, request, "rlm_detail: Failed writing to %s: %s",
+			       buffer, strerror(errno));
+		ftruncate(outfd, fsize); /* ignore errors! */
+		close(outfd);
+		return RLM_MODULE_FAIL;
+	}
+
+	close(outfd);
+
+	/*
+	 *	And everything is fine.
+	 */
+	return RLM_MODULE_OK;
+}
+
+
+/*
+ *	Buffered mode.
+ *
+ *	Each detail file is kept open.  Records for it are appended
+ *	to a batch in memory, and each batch is written with one
+ *	write() while holding the file lock.
+ *
+ *	With flush_interval = 0, the thread which adds a record waits
+ *	until the batch has been written.  The first thread to arrive
+ *	writes the batch, and any records added while it is writing
+ *	go into the next batch, which is written as one.  So the
+ *	server still does not reply until the record is in the file.
+ *
+ *	Otherwise, the thread returns as soon as the record is in the
+ *	batch.  A separate thread writes each batch once it is
+ *	flush_interval milliseconds old.  The batch is also written
+ *	when it reaches buffer_size bytes.  Records in the batch are
+ *	lost if the server stops unexpectedly.
+ */
+static uint32_t detail_file_hash(const void *data)
+{
+	return fr_hash_string(((const detail_file_t *) data)->filename);
+}
+
+static int detail_file_cmp(const void *a, const void *b)
+{
+	return strcmp(((const detail_file_t *) a)->filename,
+		      ((const detail_file_t *) b)->filename);
+}
+
+static void detail_batch_free(detail_batch_t *batch)
+{
+	free(batch->buf.data);
+	free(batch);
+}
+
+static void detail_file_close(detail_file_t *f)
+{
+	if (f->fd >= 0) close(f->fd);
+	f->fd = -1;
+}
+
+
+/*
+ *	Open the file, if it isn't already open, and lock it.  If the
+ *	file has been renamed or deleted since we opened it (e.g. by
+ *	the detail file reader, or by log rotation), open it again.
+ *
+ *	Called without the mutex held.
+ */
+static int detail_file_lock(struct detail_instance *inst, detail_file_t *f)
+{
+	int lock_count;
+	struct stat st, fst;
+	struct timeval tv;
+
+	for (lock_count = 0; lock_count < 80; lock_count++) {
+		if (f->fd < 0) {
+			if (detail_mkdir(inst, NULL, f->filename) < 0) return -1;
+
+			f->fd = open(f->filename, O_WRONLY | O_APPEND | O_CREAT,
+				     inst->detailperm);
+			if (f->fd < 0) {
+				radlog(L_ERR, "rlm_detail: Couldn't open file %s: %s",
+				       f->filename, strerror(errno));
+				return -1;
+			}
+			fcntl(f->fd, F_SETFD, FD_CLOEXEC);
+
+			detail_chgrp(inst, NULL, f->filename);
+		}
+
+		if (inst->locking) {
+			lseek(f->fd, 0L, SEEK_SET);
+			if (rad_lockfd_nonblock(f->fd, 0) < 0) {
+				tv.tv_sec = 0;
+				tv.tv_usec = 25000;
+				select(0, NULL, NULL, NULL, &tv);
+				continue;
+			}
+		}
+
+		if ((fstat(f->fd, &fst) == 0) &&
+		    (stat(f->filename, &st) == 0) &&
+		    (st.st_dev == fst.st_dev) &&
+		    (st.st_ino == fst.st_ino)) {
+			return 0;
+		}
+
+		DEBUG2("rlm_detail: File %s was moved by another program, re-opening it",
+		       f->filename);
+		detail_file_close(f);
+	}
+
+	radlog(L_ERR, "rlm_detail: Failed to acquire filelock for %s, giving up",
+	       f->filename);
+	return -1;
+}
+
+
+/*
+ *	Write one batch.  Called without the mutex held.
+ */
+static int detail_file_write(struct detail_instance *inst, detail_file_t *f,
+			     detail_batch_t *batch)
+{
+	int rcode = 0;
+	off_t fsize;
+
+	if (detail_file_lock(inst, f) < 0) return -1;
+
+	fsize = lseek(f->fd, 0L, SEEK_END);
+	if ((fsize < 0) ||
+	    (detail_write_all(f->fd, batch->buf.data, batch->buf.used) < 0)) {
+		radlog(L_ERR, "rlm_detail: Failed writing to %s: %s",
+		       f->filename, strerror(errno));
+		if (fsize >= 0) ftruncate(f->fd, fsize); /* ignore errors! */
+		rcode = -1;
+	}
+
+	if ((rcode == 0) && inst->sync) {
+#ifdef HAVE_FDATASYNC
+		if (fdatasync(f->fd) < 0) {
+#else
+		if (fsync(f->fd) < 0) {
+#endif
+			radlog(L_ERR, "rlm_detail: Failed syncing %s: %s",
+			       f->filename, strerror(errno));
+			rcode = -1;
+		}
+	}
+
+	if (inst->locking) {
+		lseek(f->fd, 0L, SEEK_SET);
+		rad_unlockfd(f->fd, 0);
+	}
+
+	/*
+	 *	Don't keep writing to a file which is broken.
+	 */
+	if (rcode < 0) detail_file_close(f);
+
+	return rcode;
+}
+
+
+/*
+ *	Write the current batch for a file.  Called with the mutex
+ *	held, and returns with it held.
+ */
+static void detail_flush(struct detail_instance *inst, detail_file_t *f)
+{
+	int rcode;
+	detail_batch_t *batch;
+
+	rad_assert(!f->flushing);
+	rad_assert(f->batch != NULL);
+
+	batch = f->batch;
+	f->batch = NULL;
+	f->flushing = 1;
+
+	pthread_mutex_unlock(&inst->mutex);
+	rcode = detail_file_write(inst, f, batch);
+	pthread_mutex_lock(&inst->mutex);
+
+	f->flushing = 0;
+	inst->batches++;
+	if (rcode == 0) {
+		inst->bytes += batch->buf.used;
+	} else {
+		inst->failed++;
+	}
+
+	batch->rcode = rcode;
+	batch->done = 1;
+	if (!batch->waiters) detail_batch_free(batch);
+
+	pthread_cond_broadcast(&inst->cond);
+}
+
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Write batches which are old enough, and close files which
+ *	haven't been used in a while.
+ */
+static void *detail_thread(void *arg)
+{
+	struct detail_instance *inst = arg;
+	int interval;
+	struct timeval now;
+	struct timespec when;
+	detail_file_t *f, **last;
+
+	interval = inst->flush_interval;
+	if ((interval <= 0) || (interval > 1000)) interval = 1000;
+
+	pthread_mutex_lock(&inst->mutex);
+	while (!inst->stop) {
+		gettimeofday(&now, NULL);
+		when.tv_sec = now.tv_sec + (interval / 1000);
+		when.tv_nsec = (now.tv_usec + (interval % 1000) * 1000) * 1000;
+		if (when.tv_nsec >= 1000000000) {
+			when.tv_sec++;
+			when.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&inst->cond, &inst->mutex, &when);
+		if (inst->stop) break;
+
+		gettimeofday(&now, NULL);
+
+		/*
+		 *	Files are only removed from the list here, so
+		 *	the list doesn't change under us while
+		 *	detail_flush() has the mutex unlocked.
+		 */
+		last = &inst->files;
+		while ((f = *last) != NULL) {
+			if (f->batch && !f->flushing &&
+			    (inst->flush_interval > 0)) {
+				detail_flush(inst, f);
+			}
+
+			if (!f->batch && !f->flushing && !f->users &&
+			    ((f->last_used + DETAIL_IDLE_TIMEOUT) < now.tv_sec)) {
+				*last = f->next;
+				fr_hash_table_delete(inst->files_ht, f);
+				continue; /* and it's freed */
+			}
+
+			last = &f->next;
+		}
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	return NULL;
+}
+
+/*
+ *	The thread is started when the first record is written, and
+ *	not in instantiate(), as the server forks into the background
+ *	after the modules have been instantiated.  Called with the
+ *	mutex held.
+ */
+static void detail_thread_start(struct detail_instance *inst)
+{
+	int rcode;
+
+	rcode = pthread_create(&inst->thread, NULL, detail_thread, inst);
+	if (rcode != 0) {
+		radlog(L_ERR, "rlm_detail: Failed creating thread: %s",
+		       strerror(rcode));
+		return;
+	}
+
+	inst->thread_running = 1;
+}
+#endif
+
+
+/*
+ *	Add a record to the batch for a file.
+ */
+static int detail_append(struct detail_instance *inst, char *filename,
+			 const detail_buf_t *b)
+{
+	int rcode;
+	detail_file_t *f, my_f;
+	detail_batch_t *batch;
+
+	pthread_mutex_lock(&inst->mutex);
+
+#ifdef HAVE_PTHREAD_H
+	if (!inst->thread_running) detail_thread_start(inst);
+#endif
+
+	my_f.filename = filename;
+	f = fr_hash_table_finddata(inst->files_ht, &my_f);
+	if (!f) {
+		f = rad_malloc(sizeof(*f));
+		memset(f, 0, sizeof(*f));
+		f->filename = strdup(filename);
+		f->fd = -1;
+
+		if (!fr_hash_table_insert(inst->files_ht, f)) {
+			pthread_mutex_unlock(&inst->mutex);
+			free(f->filename);
+			free(f);
+			return RLM_MODULE_FAIL;
+		}
+		f->next = inst->files;
+		inst->files = f;
+	}
+
+	f->users++;
+	f->last_used = time(NULL);
+
+	/*
+	 *	Don't let the batch grow without bound while the
+	 *	file is being written.
+	 */
+	if (inst->flush_interval > 0) {
+		while (f->batch && f->flushing &&
+		       (f->batch->buf.used >= (size_t) inst->buffer_size)) {
+			pthread_cond_wait(&inst->cond, &inst->mutex);
+		}
+	}
+
+	if (!f->batch) {
+		f->batch = rad_malloc(sizeof(*f->batch));
+		memset(f->batch, 0, sizeof(*f->batch));
+	}
+	batch = f->batch;
+
+	detail_buf_add(&batch->buf, b->data, b->used);
+	inst->records++;
+
+	if (inst->flush_interval > 0) {
+		if (!f->flushing &&
+		    (batch->buf.used >= (size_t) inst->buffer_size)) {
+			detail_flush(inst, f);
+		}
+		rcode = RLM_MODULE_OK;
+
+	} else {
+		batch->waiters++;
+		while (!batch->done) {
+			/*
+			 *	Nothing is being written, so our
+			 *	batch is the current one.  Write it.
+			 */
+			if (!f->flushing) {
+				detail_flush(inst, f);
+				continue;
+			}
+
+			pthread_cond_wait(&inst->cond, &inst->mutex);
+		}
+		batch->waiters--;
+
+		rcode = (batch->rcode == 0) ? RLM_MODULE_OK : RLM_MODULE_FAIL;
+		if (!batch->waiters) detail_batch_free(batch);
+	}
+
+	f->users--;
+	pthread_mutex_unlock(&inst->mutex);
+
+	return rcode;
+}
+
+
+/*
+ *	Do detail, compatible with old accounting
+ */
+static int do_detail(void *instance, REQUEST *request, RADIUS_PACKET *packet,
+		     int compat)
+{
+	int		rcode;
+	char		timestamp[256];
+	char		buffer[DIRLEN];
+	detail_buf_t	b;
+
+	struct detail_instance *inst = instance;
+
+	rad_assert(request != NULL);
+
+	/*
+	 *	Nothing to log: don't do anything.
+	 */
+	if (!packet) {
+		return RLM_MODULE_NOOP;
+	}
+
+	/*
+	 *	Generate the path for the detail file.
+	 */
+	if (radius_xlat_template(buffer, sizeof(buffer), inst->detailfile_xt, request, NULL) == 0) {
+		radlog_request(L_ERR, 0, request, "rlm_detail: Failed to expand detail file %s",
+		    inst->detailfile);
+	    return RLM_MODULE_FAIL;
+	}
+	RDEBUG2("%s expands to %s", inst->detailfile, buffer);
+
+#ifdef HAVE_FNMATCH_H
+#ifdef FNM_FILE_NAME
+	/*
+	 *	If we read it from a detail file, and we're about to
+	 *	write it back to the SAME detail file directory, then
+	 *	suppress the write.  This check prevents an infinite
+	 *	loop.
+	 */
+	if ((request->listener->type == RAD_LISTEN_DETAIL) &&
+	    (fnmatch(((listen_detail_t *)request->listener->data)->filename,
+		     buffer, FNM_FILE_NAME | FNM_PERIOD ) == 0)) {
+		RDEBUG2("WARNING: Suppressing infinite loop.");
+		return RLM_MODULE_NOOP;
+	}
+#endif
+#endif
+
+	/*
+	 *	Post a timestamp
+	 */
+	if (radius_xlat_template(timestamp, sizeof(timestamp), inst->header_xt, request, NULL) == 0) {
+		radlog_request(L_ERR, 0, request, "rlm_detail: Unable to expand detail header format %s",
+			inst->header);
+		return RLM_MODULE_FAIL;
+	}
+
+	memset(&b, 0, sizeof(b));
+	detail_format(inst, request, packet, compat, timestamp, &b);
+
+	if (inst->buffered) {
+		rcode = detail_append(inst, buffer, &b);
+	} else {
+		pthread_mutex_lock(&inst->mutex);
+		rcode = detail_write(inst, request, buffer, &b);
+		pthread_mutex_unlock(&inst->mutex);
+	}
+
+	free(b.data);
+
+	return rcode;
 }
 
 /*
@@ -613,7 +1294,7 @@ static int detail_post_proxy(void *instance, REQUEST *request)
 module_t rlm_detail = {
 	RLM_MODULE_INIT,
 	"detail",
-	RLM_TYPE_THREAD_UNSAFE | RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE,
+	RLM_TYPE_CHECK_CONFIG_SAFE | RLM_TYPE_HUP_SAFE,
 	detail_instantiate,		/* instantiation */
 	detail_detach,			/* detach */
 	{
@@ -130,6 +130,7 @@ typedef struct eap_type_t {
 	int	(*authorize)(void *type_data, EAP_HANDLER *handler);
 	int	(*authenticate)(void *type_data, EAP_HANDLER *handler);
 	int	(*detach)(void *type_data);
+	size_t	(*stats)(void *type_data, char *out, size_t outlen);
 } EAP_TYPE;
 
 #define REQUEST_DATA_EAP_HANDLER	 (1)
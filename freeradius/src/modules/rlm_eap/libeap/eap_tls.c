@@ -130,6 +130,9 @@ int eaptls_success(EAP_HANDLER *handler, int peap_flag)
 	     (vp->vp_integer == 0))) {
 		SSL_CTX_remove_session(tls_session->ctx,
 				       tls_session->ssl->session);
+		tls_cache_delete(tls_session->cache,
+				 tls_session->ssl->session->session_id,
+				 tls_session->ssl->session->session_id_length);
 		tls_session->allow_session_resumption = 0;
 
 		/*
@@ -164,6 +167,15 @@ int eaptls_success(EAP_HANDLER *handler, int peap_flag)
 		if (vps) {
 			SSL_SESSION_set_ex_data(tls_session->ssl->session,
 						eaptls_session_idx, vps);
+
+			/*
+			 *	Also save it outside of this server,
+			 *	if we've been told to.
+			 */
+			tls_cache_store(tls_session->cache,
+					tls_session->ssl->session->session_id,
+					tls_session->ssl->session->session_id_length,
+					tls_session->ssl->session, vps);
 		} else {
 			RDEBUG2("WARNING: No information to cache: session caching will be disabled for this session.");
 			SSL_CTX_remove_session(tls_session->ctx,
@@ -264,8 +276,10 @@ int eaptls_request(EAP_DS *eap_ds, tls_session_t *ssn)
 {
 	EAPTLS_PACKET	reply;
 	unsigned int	size;
+	unsigned int	pending;
 	unsigned int 	nlen;
 	unsigned int 	lbit = 0;
+	uint8_t		*ptr;
 
 	/* This value determines whether we set (L)ength flag for
 		EVERY packet we send and add corresponding
@@ -286,15 +300,16 @@ int eaptls_request(EAP_DS *eap_ds, tls_session_t *ssn)
 	if (ssn->length_flag) {
 		lbit = 4;
 	}
+	pending = BIO_ctrl_pending(ssn->from_ssl);
 	if (ssn->fragment == 0) {
-		ssn->tls_msg_len = ssn->dirty_out.used;
+		ssn->tls_msg_len = pending;
 	}
 
 	reply.code = EAPTLS_REQUEST;
 	reply.flags = ssn->peap_flag;
 
 	/* Send data, NOT more than the FRAGMENT size */
-	if (ssn->dirty_out.used > ssn->offset) {
+	if (pending > ssn->offset) {
 		size = ssn->offset;
 		reply.flags = SET_MORE_FRAGMENTS(reply.flags);
 		/* Length MUST be included if it is the First Fragment */
@@ -303,24 +318,31 @@ int eaptls_request(EAP_DS *eap_ds, tls_session_t *ssn)
 		}
 		ssn->fragment = 1;
 	} else {
-		size = ssn->dirty_out.used;
+		size = pending;
 		ssn->fragment = 0;
 	}
 
 	reply.dlen = lbit + size;
 	reply.length = TLS_HEADER_LEN + 1/*flags*/ + reply.dlen;
+	reply.data = NULL;
+	if (lbit) reply.flags = SET_LENGTH_INCLUDED(reply.flags);
 
-	reply.data = malloc(reply.dlen);
+	/*
+	 *	Compose the header, and then read the fragment
+	 *	straight from the BIO into the EAP packet.
+	 */
+	if (!eaptls_compose(eap_ds, &reply)) return 0;
+
+	ptr = eap_ds->request->type.data + 1/*flags*/;
 	if (lbit) {
 		nlen = htonl(ssn->tls_msg_len);
-		memcpy(reply.data, &nlen, lbit);
-		reply.flags = SET_LENGTH_INCLUDED(reply.flags);
+		memcpy(ptr, &nlen, lbit);
+		ptr += lbit;
+	}
+	if (size && (BIO_read(ssn->from_ssl, ptr, size) != (int) size)) {
+		radlog(L_ERR, "rlm_eap_tls: Failed reading TLS data");
+		return 0;
 	}
-	(ssn->record_minus)(&ssn->dirty_out, reply.data + lbit, size);
-
-	eaptls_compose(eap_ds, &reply);
-	free(reply.data);
-	reply.data = NULL;
 
 	return 1;
 }
@@ -359,7 +381,7 @@ static eaptls_status_t eaptls_ack_handler(EAP_HANDLER *handler)
 
 	case handshake:
 		if ((tls_session->info.handshake_type == finished) &&
-		    (tls_session->dirty_out.used == 0)) {
+		    (BIO_ctrl_pending(tls_session->from_ssl) == 0)) {
 			RDEBUG2("ACK handshake is finished");
 
 			/* 
@@ -582,16 +604,22 @@ static eaptls_status_t eaptls_verify(EAP_HANDLER *handler)
  *  The Length field is two octets and indicates the length of the EAP
  *  packet including the Code, Identifir, Length, Type, and TLS data
  *  fields.
+ *
+ *  The TLS data is written straight from the EAP packet to the
+ *  into_ssl BIO, where the fragments are reassembled.  SSL doesn't
+ *  read it until the last fragment has arrived.
  */
-static EAPTLS_PACKET *eaptls_extract(REQUEST *request, EAP_DS *eap_ds, eaptls_status_t status)
+static int eaptls_extract(REQUEST *request, EAP_DS *eap_ds,
+			  eaptls_status_t status, tls_session_t *tls_session)
 {
-	EAPTLS_PACKET	*tlspacket;
+	unsigned int	length;
+	uint8_t		flags;
 	uint32_t	data_len = 0;
 	uint32_t	len = 0;
 	uint8_t		*data = NULL;
 
 	if (status  == EAPTLS_INVALID)
-		return NULL;
+		return 0;
 
 	/*
 	 *	The main EAP code & eaptls_verify() take care of
@@ -608,9 +636,6 @@ static EAPTLS_PACKET *eaptls_extract(REQUEST *request, EAP_DS *eap_ds, eaptls_st
 	 */
 	assert(eap_ds->response->length > 2);
 
-	tlspacket = eaptls_alloc();
-	if (tlspacket == NULL) return NULL;
-
 	/*
 	 *	Code & id for EAPTLS & EAP are same
 	 *	but eaptls_length = eap_length - 1(EAP-Type = 1 octet)
@@ -618,20 +643,17 @@ static EAPTLS_PACKET *eaptls_extract(REQUEST *request, EAP_DS *eap_ds, eaptls_st
 	 *	length = code + id + length + type + tlsdata
 	 *	       =  1   +  1 +   2    +  1    +  X
 	 */
-	tlspacket->code = eap_ds->response->code;
-	tlspacket->id = eap_ds->response->id;
-	tlspacket->length = eap_ds->response->length - 1; /* EAP type */
-	tlspacket->flags = eap_ds->response->type.data[0];
+	length = eap_ds->response->length - 1; /* EAP type */
+	flags = eap_ds->response->type.data[0];
 
 	/*
 	 *	A quick sanity check of the flags.  If we've been told
 	 *	that there's a length, and there isn't one, then stop.
 	 */
-	if (TLS_LENGTH_INCLUDED(tlspacket->flags) &&
-	    (tlspacket->length < 5)) { /* flags + TLS message length */
+	if (TLS_LENGTH_INCLUDED(flags) &&
+	    (length < 5)) { /* flags + TLS message length */
 		RDEBUG("Invalid EAP-TLS packet received.  (Length bit is set, but no length was found.)");
-		eaptls_free(&tlspacket);
-		return NULL;
+		return 0;
 	}
 
 	/*
@@ -644,22 +666,20 @@ static EAPTLS_PACKET *eaptls_extract(REQUEST *request, EAP_DS *eap_ds, eaptls_st
 	 *	FIXME: Try to ensure that the claimed length is
 	 *	consistent across multiple TLS fragments.
 	 */
-	if (TLS_LENGTH_INCLUDED(tlspacket->flags)) {
+	if (TLS_LENGTH_INCLUDED(flags)) {
 		memcpy(&data_len, &eap_ds->response->type.data[1], 4);
 		data_len = ntohl(data_len);
-		if (data_len > MAX_RECORD_SIZE) {
+		if (data_len > TLS_BIO_SIZE) {
 			RDEBUG("The EAP-TLS packet will contain more data than we can process.");
-			eaptls_free(&tlspacket);
-			return NULL;
+			return 0;
 		}
 
 #if 0
-		DEBUG2(" TLS: %d %d\n", data_len, tlspacket->length);
+		DEBUG2(" TLS: %d %d\n", data_len, length);
 
-		if (data_len < tlspacket->length) {
+		if (data_len < length) {
 			RDEBUG("EAP-TLS packet claims to be smaller than the encapsulating EAP packet.");
-			eaptls_free(&tlspacket);
-			return NULL;
+			return 0;
 		}
 #endif
 	}
@@ -677,10 +697,9 @@ static EAPTLS_PACKET *eaptls_extract(REQUEST *request, EAP_DS *eap_ds, eaptls_st
 	case EAPTLS_FIRST_FRAGMENT:
 	case EAPTLS_LENGTH_INCLUDED:
 	case EAPTLS_MORE_FRAGMENTS_WITH_LENGTH:
-		if (tlspacket->length < 5) { /* flags + TLS message length */
+		if (length < 5) { /* flags + TLS message length */
 			RDEBUG("Invalid EAP-TLS packet received.  (Expected length, got none.)");
-			eaptls_free(&tlspacket);
-			return NULL;
+			return 0;
 		}
 
 		/*
@@ -712,22 +731,21 @@ static EAPTLS_PACKET *eaptls_extract(REQUEST *request, EAP_DS *eap_ds, eaptls_st
 
 	default:
 		RDEBUG("Invalid EAP-TLS packet received");
-		eaptls_free(&tlspacket);
-		return NULL;
+		return 0;
 	}
 
-	tlspacket->dlen = data_len;
-	if (data_len) {
-		tlspacket->data = (unsigned char *)malloc(data_len);
-		if (tlspacket->data == NULL) {
-			RDEBUG("out of memory");
-			eaptls_free(&tlspacket);
-			return NULL;
-		}
-		memcpy(tlspacket->data, data, data_len);
+	/*
+	 *	NOTE: The BIO will contain partial data when M bit is set.
+	 */
+	if (data_len == 0) return 1;
+
+	if ((BIO_ctrl_get_write_guarantee(tls_session->into_ssl) < data_len) ||
+	    (BIO_write(tls_session->into_ssl, data, data_len) != (int) data_len)) {
+		RDEBUG("Exceeded maximum record size");
+		return 0;
 	}
 
-	return tlspacket;
+	return 1;
 }
 
 
@@ -794,14 +812,14 @@ static eaptls_status_t eaptls_operation(eaptls_status_t status,
 	 *
 	 *	TLS proper can decide what to do, then.
 	 */
-	if (tls_session->dirty_out.used > 0) {
+	if (BIO_ctrl_pending(tls_session->from_ssl) > 0) {
 		eaptls_request(handler->eap_ds, tls_session);
 		return EAPTLS_HANDLED;
 	}
 		
 	/* 
 	 *	If there is no data to send i.e
-	 *	dirty_out.used <=0 and if the SSL
+	 *	from_ssl is empty and if the SSL
 	 *	handshake is finished, then return a
 	 *	EPTLS_SUCCESS
 	 */
@@ -853,7 +871,6 @@ static eaptls_status_t eaptls_operation(eaptls_status_t status,
 eaptls_status_t eaptls_process(EAP_HANDLER *handler)
 {
 	tls_session_t *tls_session = (tls_session_t *) handler->opaque;
-	EAPTLS_PACKET	*tlspacket;
 	eaptls_status_t	status;
 	REQUEST *request = handler->request;
 
@@ -909,33 +926,12 @@ eaptls_status_t eaptls_process(EAP_HANDLER *handler)
 	}
 
 	/*
-	 *	Extract the TLS packet from the buffer.
+	 *	Extract the TLS data from the packet, into the
+	 *	session's into_ssl BIO.
 	 */
-	if ((tlspacket = eaptls_extract(request, handler->eap_ds, status)) == NULL)
+	if (!eaptls_extract(request, handler->eap_ds, status, tls_session))
 		return EAPTLS_FAIL;
 
-	/*
-	 *	Get the session struct from the handler
-	 *
-	 *	update the dirty_in buffer
-	 *
-	 *	NOTE: This buffer will contain partial data when M bit is set.
-	 *
-	 * 	CAUTION while reinitializing this buffer, it should be
-	 * 	reinitialized only when this M bit is NOT set.
-	 */
-	if (tlspacket->dlen !=
-	    (tls_session->record_plus)(&tls_session->dirty_in, tlspacket->data, tlspacket->dlen)) {
-		eaptls_free(&tlspacket);
-		RDEBUG("Exceeded maximum record size");
-		return EAPTLS_FAIL;
-	}
-
-	/*
-	 *	No longer needed.
-	 */
-	eaptls_free(&tlspacket);
-
 	/*
 	 *	SSL initalization is done.  Return.
 	 *
@@ -962,17 +958,10 @@ eaptls_status_t eaptls_process(EAP_HANDLER *handler)
 			return EAPTLS_HANDLED;
 		}
 
-		/*	
-		 *	Decrypt the complete record.
-		 */
-		BIO_write(tls_session->into_ssl, tls_session->dirty_in.data,
-			  tls_session->dirty_in.used);
-
 		/*
-		 *      Clear the dirty buffer now that we are done with it
-		 *      and init the clean_out buffer to store decrypted data
+		 *      The complete record is in into_ssl.  Init the
+		 *      clean_out buffer to store decrypted data
 		 */
-		(tls_session->record_init)(&tls_session->dirty_in);
 		(tls_session->record_init)(&tls_session->clean_out);
 
 		/*
@@ -1058,7 +1047,10 @@ int eaptls_compose(EAP_DS *eap_ds, EAPTLS_PACKET *reply)
 	ptr = eap_ds->request->type.data;
 	*ptr++ = (uint8_t)(reply->flags & 0xFF);
 
-	if (reply->dlen) memcpy(ptr, reply->data, reply->dlen);
+	/*
+	 *	If there's no data, the caller fills it in.
+	 */
+	if (reply->dlen && reply->data) memcpy(ptr, reply->data, reply->dlen);
 
 	switch (reply->code) {
 	case EAPTLS_ACK:
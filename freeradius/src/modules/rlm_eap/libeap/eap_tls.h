@@ -67,6 +67,8 @@ RCSIDH(eap_tls_h, "$Id$")
 
 #include "eap.h"
 
+typedef struct tls_cache_t tls_cache_t;
+
 typedef enum {
         EAPTLS_INVALID = 0,	  	/* invalid, don't reply */
         EAPTLS_REQUEST,       		/* request, ok to send, invalid to receive */
@@ -102,6 +104,18 @@ typedef enum {
  *	being fragmented; this simplifies buffer allocation.
  */
 
+/*
+ *	The dirty (encrypted) data is not copied into a record_t.  It
+ *	is kept in the ring buffers of an OpenSSL BIO pair, which
+ *	SSL reads from and writes to directly.  Each EAP fragment is
+ *	copied once into the ring as it arrives, and each fragment we
+ *	send is read once from the ring into the EAP packet.
+ *
+ *	Each ring must hold a complete set of TLS messages, e.g. the
+ *	server's certificate chain, or the client's.
+ */
+#define TLS_BIO_SIZE (2 * MAX_RECORD_SIZE)
+
 /*
  * FIXME: Dynamic allocation of buffer to overcome MAX_RECORD_SIZE overflows.
  * 	or configure TLS not to exceed MAX_RECORD_SIZE.
@@ -129,9 +143,11 @@ typedef struct _tls_info_t {
  * (ie EAPTLS_DATA(fragment), EAPTLS-ALERT, EAPTLS-REQUEST ...)
  *
  * clean_in  - data that needs to be sent but only after it is soiled.
- * dirty_in  - data EAP server receives.
  * clean_out - data that is cleaned after receiving.
- * dirty_out - data EAP server sends.
+ * into_ssl  - data EAP server receives.
+ * from_ssl  - data EAP server sends.
+ *	       Both are the network end of the same BIO pair, see
+ *	       TLS_BIO_SIZE.
  * offset    - current fragment size transmitted
  * fragment  - Flag, In fragment mode or not.
  * tls_msg_len - Actual/Total TLS message length.
@@ -147,8 +163,6 @@ typedef struct _tls_session_t {
 	BIO 		*from_ssl;
 	record_t 	clean_in;
 	record_t 	clean_out;
-	record_t 	dirty_in;
-	record_t 	dirty_out;
 
 	void 		(*record_init)(record_t *buf);
 	void 		(*record_close)(record_t *buf);
@@ -177,6 +191,7 @@ typedef struct _tls_session_t {
 
 	const char	*prf_label;
 	int		allow_session_resumption;
+	tls_cache_t	*cache;
 } tls_session_t;
 
 
@@ -368,6 +383,36 @@ void 		session_free(void *ssn);
 void 		session_close(tls_session_t *ssn);
 void 		session_init(tls_session_t *ssn);
 
+/*
+ *	External session cache.  The backend stores opaque data
+ *	under the session ID.  fetch() returns the length of the
+ *	data, 0 if there's no such session, or -1 on error.
+ */
+typedef struct tls_cache_ops_t {
+	const char	*name;
+	int		(*store)(void *ctx, const uint8_t *id, size_t idlen,
+				 const uint8_t *data, size_t len,
+				 time_t expires);
+	int		(*fetch)(void *ctx, const uint8_t *id, size_t idlen,
+				 uint8_t *data, size_t size);
+	int		(*delete)(void *ctx, const uint8_t *id, size_t idlen);
+	void		(*free)(void *ctx);
+} tls_cache_ops_t;
+
+tls_cache_t	*tls_cache_create(const tls_cache_ops_t *ops, void *ctx,
+				  size_t max_size);
+tls_cache_t	*tls_cache_file_create(const char *filename, int entries,
+				       int entry_size);
+void		tls_cache_free(tls_cache_t *cache);
+int		tls_cache_store(tls_cache_t *cache, const uint8_t *id,
+				size_t idlen, SSL_SESSION *sess,
+				VALUE_PAIR *vps);
+SSL_SESSION	*tls_cache_fetch(tls_cache_t *cache, const uint8_t *id,
+				 size_t idlen, VALUE_PAIR **vps);
+void		tls_cache_delete(tls_cache_t *cache, const uint8_t *id,
+				 size_t idlen);
+size_t		tls_cache_stats(tls_cache_t *cache, char *out, size_t outlen);
+
 /* SSL Indicies for ex data */
 extern int	eaptls_handle_idx;
 extern int	eaptls_conf_idx;
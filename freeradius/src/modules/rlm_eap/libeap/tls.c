@@ -39,6 +39,7 @@ tls_session_t *eaptls_new_session(SSL_CTX *ssl_ctx, int client_cert)
 {
 	tls_session_t *state = NULL;
 	SSL *new_tls = NULL;
+	BIO *ssl_bio = NULL;
 
 	client_cert = client_cert; /* -Wunused.  See bug #350 */
 
@@ -75,10 +76,22 @@ tls_session_t *eaptls_new_session(SSL_CTX *ssl_ctx, int client_cert)
 	 *	This means that all SSL IO is done to/from memory,
 	 *	and we can update those BIOs from the EAP packets we've
 	 *	received.
+	 *
+	 *	SSL gets one end of a BIO pair, and we keep the other.
+	 *	Unlike a memory BIO, reading from a pair doesn't
+	 *	move the remaining data, so we can take it out one
+	 *	fragment at a time.
 	 */
-	state->into_ssl = BIO_new(BIO_s_mem());
-	state->from_ssl = BIO_new(BIO_s_mem());
-	SSL_set_bio(state->ssl, state->into_ssl, state->from_ssl);
+	if (!BIO_new_bio_pair(&ssl_bio, TLS_BIO_SIZE,
+			      &state->into_ssl, TLS_BIO_SIZE)) {
+		radlog(L_ERR, "SSL: Error creating BIO pair: %s",
+		       ERR_error_string(ERR_get_error(), NULL));
+		SSL_free(new_tls);
+		free(state);
+		return NULL;
+	}
+	state->from_ssl = state->into_ssl;
+	SSL_set_bio(state->ssl, ssl_bio, ssl_bio);
 
 	/*
 	 *	Add the message callback to identify what type of
@@ -170,26 +183,24 @@ static int int_ssl_check(REQUEST *request, SSL *s, int ret, const char *text)
  * We are the server, we always get the dirty data
  * (Handshake data is also considered as dirty data)
  * During handshake, since SSL API handles itself,
- * After clean-up, dirty_out will be filled with
+ * After clean-up, from_ssl will be filled with
  * the data required for handshaking. So we check
- * if dirty_out is empty then we simply send it back.
+ * if from_ssl is empty then we simply send it back.
  * As of now, if handshake is successful, then it is EAP-Success
  * or else EAP-failure should be sent
  *
- * Fill the Bio with the dirty data to clean it
- * Get the cleaned data from SSL, if it is not Handshake data
+ * The dirty data has already been written to into_ssl, as the
+ * fragments arrived.  Get the cleaned data from SSL, if it is not
+ * Handshake data
  */
 int tls_handshake_recv(REQUEST *request, tls_session_t *ssn)
 {
 	int err;
 
-	BIO_write(ssn->into_ssl, ssn->dirty_in.data, ssn->dirty_in.used);
-
 	err = SSL_read(ssn->ssl, ssn->clean_out.data + ssn->clean_out.used,
 		       sizeof(ssn->clean_out.data) - ssn->clean_out.used);
 	if (err > 0) {
 		ssn->clean_out.used += err;
-		record_init(&ssn->dirty_in);
 		return 1;
 	}
 
@@ -214,31 +225,16 @@ int tls_handshake_recv(REQUEST *request, tls_session_t *ssn)
 		DEBUG2("In SSL Connect mode \n");
 	}
 
-	err = BIO_ctrl_pending(ssn->from_ssl);
-	if (err > 0) {
-		err = BIO_read(ssn->from_ssl, ssn->dirty_out.data,
-			       sizeof(ssn->dirty_out.data));
-		if (err > 0) {
-			ssn->dirty_out.used = err;
-
-		} else if (BIO_should_retry(ssn->from_ssl)) {
-			record_init(&ssn->dirty_in);
-			DEBUG2("  tls: Asking for more data in tunnel");
-			return 1;
-
-		} else {
-			int_ssl_check(request, ssn->ssl, err, "BIO_read");
-			record_init(&ssn->dirty_in);
-			return 0;
-		}
-	} else {
+	/*
+	 *	The data to send stays in from_ssl, and is read from
+	 *	there one fragment at a time by eaptls_request().
+	 */
+	if (BIO_ctrl_pending(ssn->from_ssl) == 0) {
 		DEBUG2("SSL Application Data");
 		/* Its clean application data, do whatever we want */
 		record_init(&ssn->clean_out);
 	}
 
-	/* We are done with dirty_in, reinitialize it */
-	record_init(&ssn->dirty_in);
 	return 1;
 }
 
@@ -248,8 +244,6 @@ int tls_handshake_recv(REQUEST *request, tls_session_t *ssn)
  */
 int tls_handshake_send(REQUEST *request, tls_session_t *ssn)
 {
-	int err;
-
 	/*
 	 *	If there's un-encrypted data in 'clean_in', then write
 	 *	that data to the SSL session, and then call the BIO function
@@ -263,16 +257,16 @@ int tls_handshake_send(REQUEST *request, tls_session_t *ssn)
 		int written;
 
 		written = SSL_write(ssn->ssl, ssn->clean_in.data, ssn->clean_in.used);
-		record_minus(&ssn->clean_in, NULL, written);
-
-		/* Get the dirty data from Bio to send it */
-		err = BIO_read(ssn->from_ssl, ssn->dirty_out.data,
-			       sizeof(ssn->dirty_out.data));
-		if (err > 0) {
-			ssn->dirty_out.used = err;
+		if (written > 0) {
+			record_minus(&ssn->clean_in, NULL, written);
 		} else {
-			int_ssl_check(request, ssn->ssl, err, "handshake_send");
+			int_ssl_check(request, ssn->ssl, written, "handshake_send");
 		}
+
+		/*
+		 *	The dirty data is now in from_ssl, waiting to
+		 *	be sent.
+		 */
 	}
 
 	return 1;
@@ -284,8 +278,6 @@ void session_init(tls_session_t *ssn)
 	ssn->into_ssl = ssn->from_ssl = NULL;
 	record_init(&ssn->clean_in);
 	record_init(&ssn->clean_out);
-	record_init(&ssn->dirty_in);
-	record_init(&ssn->dirty_out);
 
 	memset(&ssn->info, 0, sizeof(ssn->info));
 
@@ -304,20 +296,16 @@ void session_close(tls_session_t *ssn)
 
 	if(ssn->ssl)
 		SSL_free(ssn->ssl);
-#if 0
-/*
- * WARNING: SSL_free seems to decrement the reference counts already,
- * 	so doing this might crash the application.
- */
+
+	/*
+	 *	SSL_free frees the SSL end of the BIO pair.  The
+	 *	other end is ours.  into_ssl and from_ssl are the same.
+	 */
 	if(ssn->into_ssl)
 		BIO_free(ssn->into_ssl);
-	if(ssn->from_ssl)
-		BIO_free(ssn->from_ssl);
-#endif
+
 	record_close(&ssn->clean_in);
 	record_close(&ssn->clean_out);
-	record_close(&ssn->dirty_in);
-	record_close(&ssn->dirty_out);
 	session_init(ssn);
 }
 
@@ -0,0 +1,712 @@
+/*
+ * tls_cache.c	External storage for TLS sessions, so that sessions
+ *		can be resumed after a restart, or on another server.
+ *
+ * Version:     $Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2012  The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include "eap_tls.h"
+
+#ifndef NO_OPENSSL
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#else
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_unlock(_x)
+#define pthread_mutex_init(_x, _y) (0)
+#define pthread_mutex_destroy(_x)
+#endif
+
+/*
+ *	The cache doesn't care where the sessions are stored.  The
+ *	backend is given an opaque blob, and it's expiry time.
+ *
+ *	The blob is the DER encoded SSL_SESSION, prefixed by it's
+ *	length (4 octets, network order), followed by the cached
+ *	attributes, one "Name = value" per line.
+ */
+struct tls_cache_t {
+	const tls_cache_ops_t	*ops;
+	void			*ctx;
+	size_t			max_size;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		stores;
+	uint64_t		deletes;
+	uint64_t		too_big;
+	uint64_t		errors;
+};
+
+#define TLS_CACHE_LINE_LEN (4096)
+
+tls_cache_t *tls_cache_create(const tls_cache_ops_t *ops, void *ctx,
+			      size_t max_size)
+{
+	tls_cache_t *cache;
+
+	if (!ops || (max_size < 64)) return NULL;
+
+	cache = rad_malloc(sizeof(*cache));
+	memset(cache, 0, sizeof(*cache));
+
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		free(cache);
+		return NULL;
+	}
+
+	cache->ops = ops;
+	cache->ctx = ctx;
+	cache->max_size = max_size;
+
+	return cache;
+}
+
+void tls_cache_free(tls_cache_t *cache)
+{
+	if (!cache) return;
+
+	if (cache->ops->free) cache->ops->free(cache->ctx);
+
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+}
+
+#define TLS_CACHE_COUNT(_cache, _x) do { \
+		pthread_mutex_lock(&(_cache)->mutex); \
+		(_cache)->_x++; \
+		pthread_mutex_unlock(&(_cache)->mutex); \
+	} while (0)
+
+/*
+ *	Returns the length of the encoded session, or 0 if it doesn't
+ *	fit.
+ */
+static size_t tls_cache_encode(SSL_SESSION *sess, VALUE_PAIR *vps,
+			       uint8_t *data, size_t size)
+{
+	int der_len;
+	size_t len, used;
+	unsigned char *p;
+	VALUE_PAIR *vp;
+	char line[TLS_CACHE_LINE_LEN];
+
+	der_len = i2d_SSL_SESSION(sess, NULL);
+	if ((der_len <= 0) || (((size_t) der_len + 4) > size)) return 0;
+
+	data[0] = (der_len >> 24) & 0xff;
+	data[1] = (der_len >> 16) & 0xff;
+	data[2] = (der_len >> 8) & 0xff;
+	data[3] = der_len & 0xff;
+
+	p = data + 4;
+	if (i2d_SSL_SESSION(sess, &p) != der_len) return 0;
+	used = der_len + 4;
+
+	for (vp = vps; vp != NULL; vp = vp->next) {
+		len = vp_prints(line, sizeof(line), vp);
+		if ((len == 0) || (len >= (sizeof(line) - 1))) return 0;
+
+		if ((used + len + 1) > size) return 0;
+
+		memcpy(data + used, line, len);
+		used += len;
+		data[used++] = '\n';
+	}
+
+	return used;
+}
+
+static SSL_SESSION *tls_cache_decode(const uint8_t *data, size_t size,
+				     VALUE_PAIR **vps)
+{
+	size_t der_len, len;
+	const uint8_t *p, *end, *eol;
+	const unsigned char *der;
+	SSL_SESSION *sess;
+	char line[TLS_CACHE_LINE_LEN];
+
+	*vps = NULL;
+
+	if (size < 4) return NULL;
+
+	der_len = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+	if ((der_len == 0) || (der_len > (size - 4))) return NULL;
+
+	der = data + 4;
+	sess = d2i_SSL_SESSION(NULL, &der, der_len);
+	if (!sess) return NULL;
+
+	p = data + 4 + der_len;
+	end = data + size;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+
+		len = eol - p;
+		if (len >= sizeof(line)) goto error;
+
+		memcpy(line, p, len);
+		line[len] = '\0';
+
+		if ((len > 0) && (userparse(line, vps) == T_OP_INVALID)) {
+			goto error;
+		}
+
+		p = eol + 1;
+	}
+
+	return sess;
+
+ error:
+	pairfree(vps);
+	SSL_SESSION_free(sess);
+	return NULL;
+}
+
+/*
+ *	Save a session, along with the attributes which are cached
+ *	for it.
+ */
+int tls_cache_store(tls_cache_t *cache, const uint8_t *id, size_t idlen,
+		    SSL_SESSION *sess, VALUE_PAIR *vps)
+{
+	int rcode;
+	size_t len;
+	time_t expires;
+	uint8_t *data;
+
+	if (!cache || !sess || (idlen == 0)) return 0;
+
+	expires = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+	if (expires <= time(NULL)) return 0;
+
+	data = rad_malloc(cache->max_size);
+
+	len = tls_cache_encode(sess, vps, data, cache->max_size);
+	if (len == 0) {
+		free(data);
+		DEBUG2("  SSL: Session is too large for the %s session cache",
+		       cache->ops->name);
+		TLS_CACHE_COUNT(cache, too_big);
+		return 0;
+	}
+
+	rcode = cache->ops->store(cache->ctx, id, idlen, data, len, expires);
+	free(data);
+
+	if (rcode < 0) {
+		radlog(L_ERR, "rlm_eap_tls: Failed writing session to the %s session cache",
+		       cache->ops->name);
+		TLS_CACHE_COUNT(cache, errors);
+		return -1;
+	}
+
+	TLS_CACHE_COUNT(cache, stores);
+	return 1;
+}
+
+/*
+ *	Returns a new session, which the caller owns, and the
+ *	cached attributes.
+ */
+SSL_SESSION *tls_cache_fetch(tls_cache_t *cache, const uint8_t *id,
+			     size_t idlen, VALUE_PAIR **vps)
+{
+	int len;
+	uint8_t *data;
+	SSL_SESSION *sess;
+
+	*vps = NULL;
+	if (!cache || (idlen == 0)) return NULL;
+
+	data = rad_malloc(cache->max_size);
+
+	len = cache->ops->fetch(cache->ctx, id, idlen, data, cache->max_size);
+	if (len <= 0) {
+		free(data);
+
+		if (len < 0) {
+			radlog(L_ERR, "rlm_eap_tls: Failed reading session from the %s session cache",
+			       cache->ops->name);
+			TLS_CACHE_COUNT(cache, errors);
+		} else {
+			TLS_CACHE_COUNT(cache, misses);
+		}
+		return NULL;
+	}
+
+	sess = tls_cache_decode(data, len, vps);
+	free(data);
+
+	if (!sess) {
+		radlog(L_ERR, "rlm_eap_tls: Ignoring invalid session in the %s session cache",
+		       cache->ops->name);
+		cache->ops->delete(cache->ctx, id, idlen);
+		TLS_CACHE_COUNT(cache, errors);
+		return NULL;
+	}
+
+	TLS_CACHE_COUNT(cache, hits);
+	return sess;
+}
+
+void tls_cache_delete(tls_cache_t *cache, const uint8_t *id, size_t idlen)
+{
+	if (!cache || (idlen == 0)) return;
+
+	if (cache->ops->delete(cache->ctx, id, idlen) < 0) {
+		TLS_CACHE_COUNT(cache, errors);
+		return;
+	}
+
+	TLS_CACHE_COUNT(cache, deletes);
+}
+
+size_t tls_cache_stats(tls_cache_t *cache, char *out, size_t outlen)
+{
+	uint64_t hits, misses, stores, deletes, too_big, errors;
+
+	if (!cache) return 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	hits = cache->hits;
+	misses = cache->misses;
+	stores = cache->stores;
+	deletes = cache->deletes;
+	too_big = cache->too_big;
+	errors = cache->errors;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return snprintf(out, outlen,
+			"store\t\t%s\n"
+			"store hits\t%llu\n"
+			"store misses\t%llu\n"
+			"store writes\t%llu\n"
+			"store deletes\t%llu\n"
+			"store too big\t%llu\n"
+			"store errors\t%llu\n",
+			cache->ops->name,
+			(unsigned long long) hits,
+			(unsigned long long) misses,
+			(unsigned long long) stores,
+			(unsigned long long) deletes,
+			(unsigned long long) too_big,
+			(unsigned long long) errors);
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ *	The file store is a fixed-size hash table, mapped into
+ *	memory.  Each session lives in one of a few slots after the
+ *	one it hashes to.  When they're all full, the session which
+ *	expires first is thrown away.
+ *
+ *	The file is re-created if the configured sizes change.
+ *	Only one server should use a particular file.  Within a
+ *	server, module instances which use the same file share one
+ *	mapping, and one mutex, so that the old and new instances
+ *	don't trample each other after a HUP.
+ *
+ *	The map is shared, so the kernel writes the pages back in
+ *	whatever order it likes, and the order in which a slot is
+ *	changed says nothing about what's in the file after a crash.
+ *	Instead, each slot has a checksum, which is checked when the
+ *	session is found.  A slot which doesn't match is empty.
+ */
+#define TLS_CACHE_FILE_MAGIC (0x46527464)
+#define TLS_CACHE_FILE_PROBE (8)
+
+typedef struct tls_cache_file_header_t {
+	uint32_t	magic;
+	uint32_t	entries;
+	uint32_t	entry_size;
+	uint32_t	unused;
+} tls_cache_file_header_t;
+
+typedef struct tls_cache_file_entry_t {
+	int64_t		expires;
+	uint32_t	idlen;
+	uint32_t	len;
+	uint32_t	checksum;
+	uint32_t	unused;
+	uint8_t		id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	uint8_t		data[8];
+} tls_cache_file_entry_t;
+
+typedef struct tls_cache_file_t {
+	char		*filename;
+	uint8_t		*map;
+	size_t		map_size;
+	uint32_t	entries;
+	uint32_t	entry_size;
+	int		refcount;	/* module instances using it */
+	struct tls_cache_file_t *next;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+} tls_cache_file_t;
+
+/*
+ *	Only used from the main thread, when modules are
+ *	instantiated and detached.
+ */
+static tls_cache_file_t *tls_cache_files = NULL;
+
+#define TLS_CACHE_FILE_DATA_LEN(_f) ((_f)->entry_size - offsetof(tls_cache_file_entry_t, data))
+
+static tls_cache_file_entry_t *file_entry(tls_cache_file_t *file, uint32_t i)
+{
+	return (tls_cache_file_entry_t *) (file->map + sizeof(tls_cache_file_header_t) +
+					   ((size_t) (i % file->entries) * file->entry_size));
+}
+
+/*
+ *	The caller checks that the lengths fit in the slot.
+ */
+static uint32_t file_checksum(const tls_cache_file_entry_t *entry)
+{
+	uint32_t hash;
+
+	hash = fr_hash(&entry->expires, sizeof(entry->expires));
+	hash = fr_hash_update(&entry->idlen, sizeof(entry->idlen), hash);
+	hash = fr_hash_update(&entry->len, sizeof(entry->len), hash);
+	hash = fr_hash_update(entry->id, entry->idlen, hash);
+	return fr_hash_update(entry->data, entry->len, hash);
+}
+
+/*
+ *	Returns the slot holding the session, or NULL.  Expired
+ *	and damaged sessions are removed as we go.
+ */
+static tls_cache_file_entry_t *file_find(tls_cache_file_t *file,
+					 const uint8_t *id, size_t idlen,
+					 time_t now)
+{
+	uint32_t i, hash;
+	tls_cache_file_entry_t *entry;
+
+	hash = fr_hash(id, idlen);
+
+	for (i = 0; i < TLS_CACHE_FILE_PROBE; i++) {
+		entry = file_entry(file, hash + i);
+		if (entry->idlen == 0) continue;
+
+		if ((entry->expires <= now) ||
+		    (entry->idlen > sizeof(entry->id)) ||
+		    (entry->len > TLS_CACHE_FILE_DATA_LEN(file))) {
+			entry->idlen = 0;
+			continue;
+		}
+
+		if ((entry->idlen == idlen) &&
+		    (memcmp(entry->id, id, idlen) == 0)) {
+			if (entry->checksum != file_checksum(entry)) {
+				entry->idlen = 0;
+				continue;
+			}
+
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static int file_store(void *ctx, const uint8_t *id, size_t idlen,
+		      const uint8_t *data, size_t len, time_t expires)
+{
+	uint32_t i, hash;
+	time_t now = time(NULL);
+	tls_cache_file_t *file = ctx;
+	tls_cache_file_entry_t *entry, *victim;
+
+	if ((idlen > sizeof(entry->id)) ||
+	    (len > TLS_CACHE_FILE_DATA_LEN(file))) return -1;
+
+	pthread_mutex_lock(&file->mutex);
+
+	victim = file_find(file, id, idlen, now);
+	if (!victim) {
+		hash = fr_hash(id, idlen);
+
+		for (i = 0; i < TLS_CACHE_FILE_PROBE; i++) {
+			entry = file_entry(file, hash + i);
+			if (entry->idlen == 0) {
+				victim = entry;
+				break;
+			}
+
+			if (!victim || (entry->expires < victim->expires)) {
+				victim = entry;
+			}
+		}
+	}
+
+	victim->expires = expires;
+	victim->idlen = idlen;
+	victim->len = len;
+	memcpy(victim->id, id, idlen);
+	memcpy(victim->data, data, len);
+	victim->checksum = file_checksum(victim);
+
+	pthread_mutex_unlock(&file->mutex);
+
+	return 0;
+}
+
+static int file_fetch(void *ctx, const uint8_t *id, size_t idlen,
+		      uint8_t *data, size_t size)
+{
+	int len;
+	tls_cache_file_t *file = ctx;
+	tls_cache_file_entry_t *entry;
+
+	pthread_mutex_lock(&file->mutex);
+
+	entry = file_find(file, id, idlen, time(NULL));
+	if (!entry || (entry->len > size)) {
+		len = 0;
+	} else {
+		memcpy(data, entry->data, entry->len);
+		len = entry->len;
+	}
+
+	pthread_mutex_unlock(&file->mutex);
+
+	return len;
+}
+
+static int file_delete(void *ctx, const uint8_t *id, size_t idlen)
+{
+	tls_cache_file_t *file = ctx;
+	tls_cache_file_entry_t *entry;
+
+	pthread_mutex_lock(&file->mutex);
+
+	entry = file_find(file, id, idlen, time(NULL));
+	if (entry) entry->idlen = 0;
+
+	pthread_mutex_unlock(&file->mutex);
+
+	return 0;
+}
+
+static void file_close(tls_cache_file_t *file)
+{
+	if (file->map) {
+		msync(file->map, file->map_size, MS_ASYNC);
+		munmap(file->map, file->map_size);
+	}
+	pthread_mutex_destroy(&file->mutex);
+	free(file->filename);
+	free(file);
+}
+
+static void file_free(void *ctx)
+{
+	tls_cache_file_t *this, **last;
+	tls_cache_file_t *file = ctx;
+
+	if (--file->refcount > 0) return;
+
+	for (last = &tls_cache_files; *last != NULL; last = &this->next) {
+		this = *last;
+		if (this == file) {
+			*last = file->next;
+			break;
+		}
+	}
+
+	file_close(file);
+}
+
+static const tls_cache_ops_t tls_cache_file_ops = {
+	"file",
+	file_store,
+	file_fetch,
+	file_delete,
+	file_free
+};
+
+static tls_cache_file_t *file_open(const char *filename, int entries,
+				   int entry_size)
+{
+	int fd;
+	struct stat buf;
+	tls_cache_file_t *file;
+	tls_cache_file_header_t *hdr;
+
+	file = rad_malloc(sizeof(*file));
+	memset(file, 0, sizeof(*file));
+
+	file->entries = entries;
+	file->entry_size = entry_size;
+	file->map_size = sizeof(*hdr) + ((size_t) file->entries * file->entry_size);
+
+	if (pthread_mutex_init(&file->mutex, NULL) != 0) {
+		free(file);
+		return NULL;
+	}
+	file->filename = strdup(filename);
+
+	fd = open(filename, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		radlog(L_ERR, "rlm_eap_tls: Failed opening session cache file %s: %s",
+		       filename, strerror(errno));
+		file_close(file);
+		return NULL;
+	}
+
+	if (fstat(fd, &buf) < 0) {
+		radlog(L_ERR, "rlm_eap_tls: Failed reading session cache file %s: %s",
+		       filename, strerror(errno));
+		close(fd);
+		file_close(file);
+		return NULL;
+	}
+
+	/*
+	 *	Check that the file was created with the same sizes
+	 *	before trusting it.  If not, start again.
+	 */
+	if ((size_t) buf.st_size == file->map_size) {
+		tls_cache_file_header_t old;
+
+		if ((read(fd, &old, sizeof(old)) != sizeof(old)) ||
+		    (old.magic != TLS_CACHE_FILE_MAGIC) ||
+		    (old.entries != file->entries) ||
+		    (old.entry_size != file->entry_size)) {
+			buf.st_size = 0;
+		}
+	} else {
+		buf.st_size = 0;
+	}
+
+	if (buf.st_size == 0) {
+		DEBUG("rlm_eap_tls: Creating session cache file %s", filename);
+
+		if ((ftruncate(fd, 0) < 0) ||
+		    (ftruncate(fd, file->map_size) < 0)) {
+			radlog(L_ERR, "rlm_eap_tls: Failed sizing session cache file %s: %s",
+			       filename, strerror(errno));
+			close(fd);
+			file_close(file);
+			return NULL;
+		}
+	}
+
+	file->map = mmap(NULL, file->map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	close(fd);
+	if (file->map == MAP_FAILED) {
+		radlog(L_ERR, "rlm_eap_tls: Failed mapping session cache file %s: %s",
+		       filename, strerror(errno));
+		file->map = NULL;
+		file_close(file);
+		return NULL;
+	}
+
+	hdr = (tls_cache_file_header_t *) file->map;
+	hdr->magic = TLS_CACHE_FILE_MAGIC;
+	hdr->entries = file->entries;
+	hdr->entry_size = file->entry_size;
+
+	return file;
+}
+
+tls_cache_t *tls_cache_file_create(const char *filename, int entries,
+				   int entry_size)
+{
+	tls_cache_t *cache;
+	tls_cache_file_t *file;
+
+	if ((entries <= 0) || (entry_size < 512)) {
+		radlog(L_ERR, "rlm_eap_tls: Invalid size for session cache file %s",
+		       filename);
+		return NULL;
+	}
+
+	/*
+	 *	Keep the slots aligned.
+	 */
+	entry_size = (entry_size + 7) & ~7;
+
+	for (file = tls_cache_files; file != NULL; file = file->next) {
+		if (strcmp(file->filename, filename) != 0) continue;
+
+		/*
+		 *	The old instance is still using the map, so
+		 *	the file can't be re-created.
+		 */
+		if ((file->entries != (uint32_t) entries) ||
+		    (file->entry_size != (uint32_t) entry_size)) {
+			radlog(L_ERR, "rlm_eap_tls: Session cache file %s is already in use with different sizes.  Restart the server to change them",
+			       filename);
+			return NULL;
+		}
+		break;
+	}
+
+	if (!file) {
+		file = file_open(filename, entries, entry_size);
+		if (!file) return NULL;
+
+		file->next = tls_cache_files;
+		tls_cache_files = file;
+	}
+
+	cache = tls_cache_create(&tls_cache_file_ops, file,
+				 TLS_CACHE_FILE_DATA_LEN(file));
+	if (!cache) {
+		file->refcount++;
+		file_free(file);
+		return NULL;
+	}
+
+	file->refcount++;
+	return cache;
+}
+#else
+tls_cache_t *tls_cache_file_create(const char *filename, UNUSED int entries,
+				   UNUSED int entry_size)
+{
+	radlog(L_ERR, "rlm_eap_tls: Session cache file %s cannot be used on this system",
+	       filename);
+	return NULL;
+}
+#endif	/* HAVE_SYS_MMAN_H */
+
+#endif /* !defined(NO_OPENSSL) */
@@ -257,16 +257,130 @@ void eaptype_free(EAP_TYPES *i)
 }
 
 
+/*
+ *	Compare two handlers.
+ */
+static int eap_handler_cmp(const void *a, const void *b)
+{
+	int rcode;
+	const EAP_HANDLER *one = a;
+	const EAP_HANDLER *two = b;
+
+	if (one->eap_id < two->eap_id) return -1;
+	if (one->eap_id > two->eap_id) return +1;
+
+	rcode = memcmp(one->state, two->state, sizeof(one->state));
+	if (rcode != 0) return rcode;
+
+	/*
+	 *	As of 2.1.8, we don't key off of source IP.  This
+	 *	a NAS to send packets load-balanced (or fail-over)
+	 *	across multiple intermediate proxies, and still have
+	 *	EAP work.
+	 */
+	if (fr_ipaddr_cmp(&one->src_ipaddr, &two->src_ipaddr) != 0) {
+		DEBUG("WARNING: EAP packets are arriving from two different upstream servers.  Has there been a proxy fail-over?");
+	}
+
+	return 0;
+}
+
+
+/*
+ *	The wheel has one slot per second, and enough of them that
+ *	slots aren't re-used until their sessions have expired.
+ */
+int eaplist_init(rlm_eap_t *inst)
+{
+	int i;
+	eap_session_shard_t *shard;
+
+	if (inst->timer_limit < 0) inst->timer_limit = 0;
+	inst->wheel_size = inst->timer_limit + 2;
+
+	for (i = 0; i < EAP_SESSION_SHARDS; i++) {
+		shard = &inst->shards[i];
+
+		shard->tree = rbtree_create(eap_handler_cmp, NULL, 0);
+		if (!shard->tree) {
+			radlog(L_ERR|L_CONS, "rlm_eap: Cannot initialize tree");
+			return -1;
+		}
+
+		shard->wheel = rad_malloc(inst->wheel_size * sizeof(shard->wheel[0]));
+		memset(shard->wheel, 0, inst->wheel_size * sizeof(shard->wheel[0]));
+
+		shard->expired = time(NULL) - inst->timer_limit;
+		shard->max_sessions = (inst->max_sessions + EAP_SESSION_SHARDS - 1) / EAP_SESSION_SHARDS;
+		if (shard->max_sessions < 1) shard->max_sessions = 1;
+
+		pthread_mutex_init(&shard->mutex, NULL);
+	}
+
+	pthread_mutex_init(&inst->rand_mutex, NULL);
+
+	return 0;
+}
+
 void eaplist_free(rlm_eap_t *inst)
 {
+	int i, j;
+	eap_session_shard_t *shard;
 	EAP_HANDLER *node, *next;
 
-       	for (node = inst->session_head; node != NULL; node = next) {
-		next = node->next;
-		eap_handler_free(inst, node);
+	for (i = 0; i < EAP_SESSION_SHARDS; i++) {
+		shard = &inst->shards[i];
+
+		if (shard->tree) rbtree_free(shard->tree);
+		shard->tree = NULL;
+
+		if (!shard->wheel) continue;
+
+		for (j = 0; j < inst->wheel_size; j++) {
+			for (node = shard->wheel[j]; node != NULL; node = next) {
+				next = node->next;
+				eap_handler_free(inst, node);
+			}
+		}
+
+		free(shard->wheel);
+		shard->wheel = NULL;
+
+		pthread_mutex_destroy(&shard->mutex);
 	}
 
-	inst->session_head = inst->session_tail = NULL;
+	pthread_mutex_destroy(&inst->rand_mutex);
+}
+
+size_t eaplist_stats(rlm_eap_t *inst, char *out, size_t outlen)
+{
+	int i;
+	size_t len;
+	uint64_t active, expired, evicted;
+	eap_session_shard_t *shard;
+
+	active = expired = evicted = 0;
+
+	for (i = 0; i < EAP_SESSION_SHARDS; i++) {
+		shard = &inst->shards[i];
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		active += rbtree_num_elements(shard->tree);
+		expired += shard->num_expired;
+		evicted += shard->num_evicted;
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	len = snprintf(out, outlen,
+		       "sessions\t%llu\n"
+		       "expired\t\t%llu\n"
+		       "evicted\t\t%llu\n",
+		       (unsigned long long) active,
+		       (unsigned long long) expired,
+		       (unsigned long long) evicted);
+	if (len >= outlen) return outlen - 1;
+
+	return len;
 }
 
 /*
@@ -286,77 +400,154 @@ static uint32_t eap_rand(fr_randctx *ctx)
 }
 
 
-static EAP_HANDLER *eaplist_delete(rlm_eap_t *inst, EAP_HANDLER *handler)
+static eap_session_shard_t *eaplist_shard(rlm_eap_t *inst, const uint8_t *state)
 {
-	rbnode_t *node;
+	return &inst->shards[fr_hash(state, EAP_STATE_LEN) % EAP_SESSION_SHARDS];
+}
 
-	node = rbtree_find(inst->session_tree, handler);
-	if (!node) return NULL;
+/*
+ *	The wheel lists are linked through handler->prev, and
+ *	handler->next.  The shard must be locked.
+ */
+static void wheel_insert(rlm_eap_t *inst, eap_session_shard_t *shard,
+			 EAP_HANDLER *handler)
+{
+	EAP_HANDLER **head;
 
-	handler = rbtree_node2data(inst->session_tree, node);
+	head = &shard->wheel[handler->timestamp % inst->wheel_size];
 
-	/*
-	 *	Delete old handler from the tree.
-	 */
-	rbtree_delete(inst->session_tree, node);
-	
-	/*
-	 *	And unsplice it from the linked list.
-	 */
+	handler->prev = NULL;
+	handler->next = *head;
+	if (*head) (*head)->prev = handler;
+	*head = handler;
+}
+
+static void wheel_remove(rlm_eap_t *inst, eap_session_shard_t *shard,
+			 EAP_HANDLER *handler)
+{
 	if (handler->prev) {
 		handler->prev->next = handler->next;
 	} else {
-		inst->session_head = handler->next;
+		shard->wheel[handler->timestamp % inst->wheel_size] = handler->next;
 	}
 	if (handler->next) {
 		handler->next->prev = handler->prev;
-	} else {
-		inst->session_tail = handler->prev;
 	}
 	handler->prev = handler->next = NULL;
+}
+
+
+static EAP_HANDLER *eaplist_delete(rlm_eap_t *inst, eap_session_shard_t *shard,
+				   EAP_HANDLER *handler)
+{
+	rbnode_t *node;
+
+	node = rbtree_find(shard->tree, handler);
+	if (!node) return NULL;
+
+	handler = rbtree_node2data(shard->tree, node);
+
+	/*
+	 *	Delete old handler from the tree.
+	 */
+	rbtree_delete(shard->tree, node);
+	
+	/*
+	 *	And unsplice it from the wheel.
+	 */
+	wheel_remove(inst, shard, handler);
 
 	return handler;
 }
 
 
-static void eaplist_expire(rlm_eap_t *inst, time_t timestamp)
+/*
+ *	Remove the handlers which are too old, moving the wheel up
+ *	to the current time.  The handlers are returned in a list,
+ *	so that they can be freed after the shard is unlocked.
+ */
+static EAP_HANDLER *eaplist_expire(rlm_eap_t *inst, eap_session_shard_t *shard,
+				   time_t timestamp, EAP_HANDLER *list)
 {
 	int i;
-	EAP_HANDLER *handler;
+	time_t limit;
+	EAP_HANDLER *handler, *next;
+
+	limit = timestamp - inst->timer_limit;
 
 	/*
-	 *	Check the first few handlers in the list, and delete
-	 *	them if they're too old.  We don't need to check them
-	 *	all, as incoming requests will quickly cause older
-	 *	handlers to be deleted.
-	 *
+	 *	If nothing has happened for a while, we may be more
+	 *	than a full turn of the wheel behind.  Then we look
+	 *	at each slot once.
 	 */
-	for (i = 0; i < 3; i++) {
-		handler = inst->session_head;
-		if (!handler) break;
+	for (i = 0; (i < inst->wheel_size) && (shard->expired < limit); i++) {
+		handler = shard->wheel[shard->expired % inst->wheel_size];
 
-		/*
-		 *	Expire entries from the start of the list.
-		 *	They should be the oldest ones.
-		 */
-		if ((timestamp - handler->timestamp) > inst->timer_limit) {
-			rbnode_t *node;
-			node = rbtree_find(inst->session_tree, handler);
-			rad_assert(node != NULL);
-			rbtree_delete(inst->session_tree, node);
-
-			/*
-			 *	handler == inst->session_head
-			 */
-			inst->session_head = handler->next;
-			if (handler->next) {
-				handler->next->prev = NULL;
-			} else {
-				inst->session_head = NULL;
-				inst->session_tail = NULL;
+		for (; handler != NULL; handler = next) {
+			next = handler->next;
+
+			if (handler->timestamp >= limit) continue;
+
+			rbtree_deletebydata(shard->tree, handler);
+			wheel_remove(inst, shard, handler);
+
+			handler->next = list;
+			list = handler;
+			shard->num_expired++;
+		}
+
+		shard->expired++;
+	}
+
+	if (shard->expired < limit) shard->expired = limit;
+
+	return list;
+}
+
+/*
+ *	When the shard is full, we throw away the oldest session, on
+ *	the assumption that it is less likely to finish than the new
+ *	one.  e.g. when a controller fails, and all of its clients
+ *	start again elsewhere.
+ */
+static EAP_HANDLER *eaplist_evict(rlm_eap_t *inst, eap_session_shard_t *shard,
+				  EAP_HANDLER *list)
+{
+	int i;
+	EAP_HANDLER *handler, *oldest;
+
+	oldest = NULL;
+	for (i = 0; i < inst->wheel_size; i++) {
+		handler = shard->wheel[(shard->expired + i) % inst->wheel_size];
+
+		for (; handler != NULL; handler = handler->next) {
+			if (!oldest || (handler->timestamp < oldest->timestamp)) {
+				oldest = handler;
 			}
-			eap_handler_free(inst, handler);
 		}
+
+		if (oldest) break;
+	}
+
+	if (!oldest) return list;
+
+	rbtree_deletebydata(shard->tree, oldest);
+	wheel_remove(inst, shard, oldest);
+
+	oldest->next = list;
+	shard->num_evicted++;
+
+	return oldest;
+}
+
+static void eaplist_free_expired(rlm_eap_t *inst, EAP_HANDLER *list)
+{
+	EAP_HANDLER *next;
+
+	for (; list != NULL; list = next) {
+		next = list->next;
+		list->next = NULL;
+		eap_handler_free(inst, list);
 	}
 }
 
@@ -369,8 +560,11 @@ static void eaplist_expire(rlm_eap_t *inst, time_t timestamp)
 int eaplist_add(rlm_eap_t *inst, EAP_HANDLER *handler)
 {
 	int		status = 0;
+	int		evicted = FALSE;
 	VALUE_PAIR	*state;
 	REQUEST		*request = handler->request;
+	eap_session_shard_t *shard;
+	EAP_HANDLER	*old;
 
 	rad_assert(handler != NULL);
 	rad_assert(request != NULL);
@@ -392,21 +586,6 @@ int eaplist_add(rlm_eap_t *inst, EAP_HANDLER *handler)
 	handler->src_ipaddr = request->packet->src_ipaddr;
 	handler->eap_id = handler->eap_ds->request->id;
 
-	/*
-	 *	Playing with a data structure shared among threads
-	 *	means that we need a lock, to avoid conflict.
-	 */
-	PTHREAD_MUTEX_LOCK(&(inst->session_mutex));
-
-	/*
-	 *	If we have a DoS attack, discard new sessions.
-	 */
-	if (rbtree_num_elements(inst->session_tree) >= inst->max_sessions) {
-		status = -1;
-		eaplist_expire(inst, handler->timestamp);
-		goto done;
-	}
-
 	/*
 	 *	Create a unique content for the State variable.
 	 *	It will be modified slightly per round trip, but less so
@@ -415,6 +594,7 @@ int eaplist_add(rlm_eap_t *inst, EAP_HANDLER *handler)
 	if (handler->trips == 0) {
 		int i;
 
+		PTHREAD_MUTEX_LOCK(&(inst->rand_mutex));
 		for (i = 0; i < 4; i++) {
 			uint32_t lvalue;
 
@@ -423,6 +603,7 @@ int eaplist_add(rlm_eap_t *inst, EAP_HANDLER *handler)
 			memcpy(handler->state + i * 4, &lvalue,
 			       sizeof(lvalue));
 		}		
+		PTHREAD_MUTEX_UNLOCK(&(inst->rand_mutex));
 	}
 
 	memcpy(state->vp_octets, handler->state, sizeof(handler->state));
@@ -440,10 +621,36 @@ int eaplist_add(rlm_eap_t *inst, EAP_HANDLER *handler)
 	 */
 	memcpy(handler->state, state->vp_octets, sizeof(handler->state));
 
+	/*
+	 *	Playing with a data structure shared among threads
+	 *	means that we need a lock, to avoid conflict.  Only
+	 *	the shard for this State is locked.
+	 */
+	shard = eaplist_shard(inst, handler->state);
+	PTHREAD_MUTEX_LOCK(&(shard->mutex));
+
+	old = eaplist_expire(inst, shard, handler->timestamp, NULL);
+
+	/*
+	 *	If we have a DoS attack, discard old sessions.
+	 */
+	if (rbtree_num_elements(shard->tree) >= shard->max_sessions) {
+		old = eaplist_evict(inst, shard, old);
+		evicted = TRUE;
+	}
+
+	/*
+	 *	The wheel has already moved past this time, so put it
+	 *	in the oldest slot which is left.
+	 */
+	if (handler->timestamp < shard->expired) {
+		handler->timestamp = shard->expired;
+	}
+
 	/*
 	 *	Big-time failure.
 	 */
-	status = rbtree_insert(inst->session_tree, handler);
+	status = rbtree_insert(shard->tree, handler);
 
 	/*
 	 *	Catch Access-Challenge without response.
@@ -457,47 +664,37 @@ int eaplist_add(rlm_eap_t *inst, EAP_HANDLER *handler)
 		request_data_add(request, inst, 0, check, check_handler);
 	}
 
-	if (status) {
-		EAP_HANDLER *prev;
+	if (status) wheel_insert(inst, shard, handler);
 
-		prev = inst->session_tail;
-		if (prev) {
-			prev->next = handler;
-			handler->prev = prev;
-			handler->next = NULL;
-			inst->session_tail = handler;
-		} else {
-			inst->session_head = inst->session_tail = handler;
-			handler->next = handler->prev = NULL;
-		}
-	}
+	/*
+	 *	We don't need this any more.
+	 */
+	if (status > 0) handler->request = NULL;
 
 	/*
 	 *	Now that we've finished mucking with the list,
 	 *	unlock it.
 	 */
- done:
+	PTHREAD_MUTEX_UNLOCK(&(shard->mutex));
 
 	/*
-	 *	We don't need this any more.
+	 *	Freeing TLS sessions is expensive, so it's done
+	 *	without the lock.
 	 */
-	if (status > 0) handler->request = NULL;
+	eaplist_free_expired(inst, old);
 
-	PTHREAD_MUTEX_UNLOCK(&(inst->session_mutex));
+	if (evicted) {
+		static time_t last_logged = 0;
+
+		if (last_logged < request->timestamp) {
+			last_logged = request->timestamp;
+			radlog(L_ERR, "rlm_eap: Too many open sessions.  Discarding the oldest ones.  Try increasing \"max_sessions\" in the EAP module configuration");
+		}				       
+	}
 
 	if (status <= 0) {
 		pairfree(&state);
-
-		if (status < 0) {
-			static time_t last_logged = 0;
-
-			if (last_logged < handler->timestamp) {
-				last_logged = handler->timestamp;
-				radlog(L_ERR, "rlm_eap: Too many open sessions.  Try increasing \"max_sessions\" in the EAP module configuration");
-			}				       
-		} else {
-			radlog(L_ERR, "rlm_eap: Internal error: failed to store handler");
-		}
+		radlog(L_ERR, "rlm_eap: Internal error: failed to store handler");
 		return 0;
 	}
 
@@ -520,7 +717,8 @@ EAP_HANDLER *eaplist_find(rlm_eap_t *inst, REQUEST *request,
 			  eap_packet_t *eap_packet)
 {
 	VALUE_PAIR	*state;
-	EAP_HANDLER	*handler, myHandler;
+	EAP_HANDLER	*handler, myHandler, *old;
+	eap_session_shard_t *shard;
 
 	/*
 	 *	We key the sessions off of the 'state' attribute, so it
@@ -540,12 +738,15 @@ EAP_HANDLER *eaplist_find(rlm_eap_t *inst, REQUEST *request,
 	 *	Playing with a data structure shared among threads
 	 *	means that we need a lock, to avoid conflict.
 	 */
-	PTHREAD_MUTEX_LOCK(&(inst->session_mutex));
+	shard = eaplist_shard(inst, myHandler.state);
+	PTHREAD_MUTEX_LOCK(&(shard->mutex));
+
+	old = eaplist_expire(inst, shard, request->timestamp, NULL);
 
-	eaplist_expire(inst, request->timestamp);
+	handler = eaplist_delete(inst, shard, &myHandler);
+	PTHREAD_MUTEX_UNLOCK(&(shard->mutex));
 
-	handler = eaplist_delete(inst, &myHandler);
-	PTHREAD_MUTEX_UNLOCK(&(inst->session_mutex));
+	eaplist_free_expired(inst, old);
 
 	/*
 	 *	Might not have been there.
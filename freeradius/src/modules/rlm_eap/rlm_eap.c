@@ -55,15 +55,15 @@ static int eap_detach(void *instance)
 
 	inst = (rlm_eap_t *)instance;
 
+	module_stats_unregister(inst);
+
+	eaplist_free(inst);
+
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_destroy(&(inst->session_mutex));
 	if (inst->handler_tree) pthread_mutex_destroy(&(inst->handler_mutex));
 #endif
-
-	rbtree_free(inst->session_tree);
 	if (inst->handler_tree) rbtree_free(inst->handler_tree);
-	inst->session_tree = NULL;
-	eaplist_free(inst);
+	inst->handler_tree = NULL;
 
 	for (i = 0; i < PW_EAP_MAX_TYPES; i++) {
 		if (inst->types[i]) eaptype_free(inst->types[i]);
@@ -77,42 +77,37 @@ static int eap_detach(void *instance)
 
 
 /*
- *	Compare two handlers.
+ *	Compare two handler pointers
  */
-static int eap_handler_cmp(const void *a, const void *b)
+static int eap_handler_ptr_cmp(const void *a, const void *b)
 {
-	int rcode;
-	const EAP_HANDLER *one = a;
-	const EAP_HANDLER *two = b;
-
-	if (one->eap_id < two->eap_id) return -1;
-	if (one->eap_id > two->eap_id) return +1;
-
-	rcode = memcmp(one->state, two->state, sizeof(one->state));
-	if (rcode != 0) return rcode;
-
-	/*
-	 *	As of 2.1.8, we don't key off of source IP.  This
-	 *	a NAS to send packets load-balanced (or fail-over)
-	 *	across multiple intermediate proxies, and still have
-	 *	EAP work.
-	 */
-	if (fr_ipaddr_cmp(&one->src_ipaddr, &two->src_ipaddr) != 0) {
-		DEBUG("WARNING: EAP packets are arriving from two different upstream servers.  Has there been a proxy fail-over?");
-	}
-
+	if (a < b) return -1;
+	if (a > b) return +1;
 	return 0;
 }
 
 
 /*
- *	Compare two handler pointers
+ *	Print the session statistics, and those of the EAP types
+ *	which keep them.
  */
-static int eap_handler_ptr_cmp(const void *a, const void *b)
+static size_t eap_stats(void *instance, char *out, size_t outlen)
 {
-	if (a < b) return -1;
-	if (a > b) return +1;
-	return 0;
+	int i;
+	size_t len;
+	rlm_eap_t *inst = instance;
+
+	len = eaplist_stats(inst, out, outlen);
+
+	for (i = 0; i < PW_EAP_MAX_TYPES; i++) {
+		if (!inst->types[i] || !inst->types[i]->type->stats) continue;
+		if (len >= (outlen - 1)) break;
+
+		len += inst->types[i]->type->stats(inst->types[i]->type_data,
+						   out + len, outlen - len);
+	}
+
+	return len;
 }
 
 
@@ -238,17 +233,10 @@ static int eap_instantiate(CONF_SECTION *cs, void **instance)
 	inst->default_eap_type = eap_type; /* save the numerical type */
 
 	/*
-	 *	List of sessions are set to NULL by the memset
-	 *	of 'inst', above.
+	 *	Lookup sessions in the trees.  We don't free them in
+	 *	the trees, as that's taken care of elsewhere...
 	 */
-
-	/*
-	 *	Lookup sessions in the tree.  We don't free them in
-	 *	the tree, as that's taken care of elsewhere...
-	 */
-	inst->session_tree = rbtree_create(eap_handler_cmp, NULL, 0);
-	if (!inst->session_tree) {
-		radlog(L_ERR|L_CONS, "rlm_eap: Cannot initialize tree");
+	if (eaplist_init(inst) < 0) {
 		eap_detach(inst);
 		return -1;
 	}
@@ -270,13 +258,7 @@ static int eap_instantiate(CONF_SECTION *cs, void **instance)
 #endif
 	}
 
-#ifdef HAVE_PTHREAD_H
-	if (pthread_mutex_init(&(inst->session_mutex), NULL) < 0) {
-		radlog(L_ERR|L_CONS, "rlm_eap: Failed initializing mutex: %s", strerror(errno));
-		eap_detach(inst);
-		return -1;
-	}
-#endif
+	module_stats_register(inst, eap_stats);
 
 	*instance = inst;
 	return 0;
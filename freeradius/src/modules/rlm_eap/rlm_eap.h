@@ -42,15 +42,35 @@ typedef struct eap_types_t {
 	void		*type_data;
 } EAP_TYPES;
 
+/*
+ *	In-progress sessions are split into shards by their State,
+ *	each with its own lock, so that threads don't all wait for
+ *	one.  Each shard also keeps its sessions in a timer wheel,
+ *	with one list per second, so that old sessions are found
+ *	without searching for them.
+ */
+#define EAP_SESSION_SHARDS (16)
+
+typedef struct eap_session_shard_t {
+	rbtree_t	*tree;
+	EAP_HANDLER	**wheel;
+	time_t		expired; /* sessions before this time are gone */
+	int		max_sessions;
+	uint64_t	num_expired;
+	uint64_t	num_evicted;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+} eap_session_shard_t;
+
 /*
  * This structure contains eap's persistent data.
- * sessions = remembered sessions, in a tree for speed.
+ * shards = remembered sessions, in trees for speed.
  * types = All supported EAP-Types
- * mutex = ensure only one thread is updating the sessions[] struct
  */
 typedef struct rlm_eap_t {
-	rbtree_t	*session_tree;
-	EAP_HANDLER	*session_head, *session_tail;
+	eap_session_shard_t shards[EAP_SESSION_SHARDS];
+	int		wheel_size;
 	rbtree_t	*handler_tree; /* for debugging only */
 	EAP_TYPES 	*types[PW_EAP_MAX_TYPES + 1];
 
@@ -65,7 +85,7 @@ typedef struct rlm_eap_t {
 	int		max_sessions;
 
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_t	session_mutex;
+	pthread_mutex_t	rand_mutex;
 	pthread_mutex_t	handler_mutex;
 #endif
 
@@ -108,10 +128,12 @@ void	    	eap_ds_free(EAP_DS **eap_ds);
 void	    	eap_opaque_free(EAP_HANDLER *handler);
 void	    	eap_handler_free(rlm_eap_t *inst, EAP_HANDLER *handler);
 
+int		eaplist_init(rlm_eap_t *inst);
 int 	    	eaplist_add(rlm_eap_t *inst, EAP_HANDLER *handler);
 EAP_HANDLER 	*eaplist_find(rlm_eap_t *inst, REQUEST *request,
 			      eap_packet_t *eap_packet);
 void		eaplist_free(rlm_eap_t *inst);
+size_t		eaplist_stats(rlm_eap_t *inst, char *out, size_t outlen);
 
 /* State */
 void	    	generate_key(void);
@@ -39,6 +39,7 @@ RCSID("$Id$")
 #include <openssl/x509.h>
 
 #include "rlm_eap_tls.h"
+#include <freeradius-devel/modpriv.h>
 #include "config.h"
 
 #ifdef HAVE_SYS_STAT_H
@@ -63,6 +64,14 @@ static CONF_PARSER cache_config[] = {
 	  offsetof(EAP_TLS_CONF, session_cache_size), NULL, "255" },
 	{ "name", PW_TYPE_STRING_PTR,
 	  offsetof(EAP_TLS_CONF, session_id_name), NULL, NULL},
+	{ "store", PW_TYPE_STRING_PTR,
+	  offsetof(EAP_TLS_CONF, session_cache_store), NULL, NULL},
+	{ "file", PW_TYPE_FILENAME,
+	  offsetof(EAP_TLS_CONF, session_cache_file), NULL, NULL},
+	{ "store_entries", PW_TYPE_INTEGER,
+	  offsetof(EAP_TLS_CONF, session_cache_store_entries), NULL, "4096" },
+	{ "store_entry_size", PW_TYPE_INTEGER,
+	  offsetof(EAP_TLS_CONF, session_cache_store_size), NULL, "4096" },
  	{ NULL, -1, 0, NULL, NULL }           /* end the list */
 };
 
@@ -121,6 +130,8 @@ static CONF_PARSER module_config[] = {
 	  offsetof(EAP_TLS_CONF, random_file), NULL, NULL },
 	{ "fragment_size", PW_TYPE_INTEGER,
 	  offsetof(EAP_TLS_CONF, fragment_size), NULL, "1024" },
+	{ "max_fragment_size", PW_TYPE_INTEGER,
+	  offsetof(EAP_TLS_CONF, max_fragment_size), NULL, "0" },
 	{ "include_length", PW_TYPE_BOOLEAN,
 	  offsetof(EAP_TLS_CONF, include_length), NULL, "yes" },
 	{ "check_crl", PW_TYPE_BOOLEAN,
@@ -375,9 +386,10 @@ static int generate_eph_rsa_key(SSL_CTX *ctx)
 
 
 /*
- *	FIXME: Write sessions to some long-term storage, so that
- *	       session resumption can still occur after the server
- *	       restarts.
+ *	Sessions are written to the external store (if any) in
+ *	eaptls_success(), once we know which attributes are cached
+ *	with them.  Sessions which fall out of the internal cache
+ *	stay in the store, and are read back here.
  */
 #define MAX_SESSION_SIZE (256)
 
@@ -413,11 +425,14 @@ static int cbtls_new_session(UNUSED SSL *s, SSL_SESSION *sess)
 	return 1;
 }
 
-static SSL_SESSION *cbtls_get_session(UNUSED SSL *s,
+static SSL_SESSION *cbtls_get_session(SSL *s,
 				      unsigned char *data, int len,
-				      UNUSED int *copy)
+				      int *copy)
 {
 	size_t size;
+	EAP_TLS_CONF *conf;
+	SSL_SESSION *sess;
+	VALUE_PAIR *vps;
 	char buffer[2 * MAX_SESSION_SIZE + 1];
 
 	size = len;
@@ -425,10 +440,181 @@ static SSL_SESSION *cbtls_get_session(UNUSED SSL *s,
 
 	fr_bin2hex(data, buffer, size);
 
-        DEBUG2("  SSL: Client requested nonexistent cached session %s",
-	       buffer);
+	conf = (EAP_TLS_CONF *) SSL_get_ex_data(s, 1);
+	if (!conf || !conf->session_cache) {
+		DEBUG2("  SSL: Client requested nonexistent cached session %s",
+		       buffer);
+		return NULL;
+	}
+
+	sess = tls_cache_fetch(conf->session_cache, data, len, &vps);
+	if (!sess) {
+		DEBUG2("  SSL: Client requested nonexistent cached session %s",
+		       buffer);
+		return NULL;
+	}
+
+	DEBUG2("  SSL: Read session %s from the %s session store",
+	       buffer, conf->session_cache_store);
+
+	/*
+	 *	The attributes are freed along with the session.
+	 *	OpenSSL gets our reference to the session, so it
+	 *	doesn't need to take another one.
+	 */
+	SSL_SESSION_set_ex_data(sess, eaptls_session_idx, vps);
+	*copy = 0;
+
+	return sess;
+}
+
+/*
+ *	Sessions can be stored in redis, via an instance of
+ *	rlm_redis.  We look up its functions by name, so that this
+ *	module doesn't need hiredis to build.
+ */
+typedef struct eaptls_redis_t {
+	void	*instance;
+	int	(*set)(void *instance, const uint8_t *key, size_t keylen,
+		       const uint8_t *data, size_t len, int ttl);
+	int	(*get)(void *instance, const uint8_t *key, size_t keylen,
+		       uint8_t *data, size_t size);
+	int	(*del)(void *instance, const uint8_t *key, size_t keylen);
+} eaptls_redis_t;
+
+#define REDIS_KEY_PREFIX "eap_tls:"
+#define REDIS_KEY_LEN (sizeof(REDIS_KEY_PREFIX) + (2 * MAX_SESSION_SIZE))
+
+static size_t redis_key(uint8_t *key, const uint8_t *id, size_t idlen)
+{
+	if (idlen > MAX_SESSION_SIZE) idlen = MAX_SESSION_SIZE;
+
+	memcpy(key, REDIS_KEY_PREFIX, sizeof(REDIS_KEY_PREFIX) - 1);
+	fr_bin2hex(id, (char *) key + sizeof(REDIS_KEY_PREFIX) - 1, idlen);
+
+	return (sizeof(REDIS_KEY_PREFIX) - 1) + (2 * idlen);
+}
+
+static int redis_store(void *ctx, const uint8_t *id, size_t idlen,
+		       const uint8_t *data, size_t len, time_t expires)
+{
+	int ttl;
+	size_t keylen;
+	uint8_t key[REDIS_KEY_LEN];
+	eaptls_redis_t *redis = ctx;
+
+	ttl = expires - time(NULL);
+	if (ttl <= 0) return 0;
+
+	keylen = redis_key(key, id, idlen);
+
+	return redis->set(redis->instance, key, keylen, data, len, ttl);
+}
+
+static int redis_fetch(void *ctx, const uint8_t *id, size_t idlen,
+		       uint8_t *data, size_t size)
+{
+	size_t keylen;
+	uint8_t key[REDIS_KEY_LEN];
+	eaptls_redis_t *redis = ctx;
+
+	keylen = redis_key(key, id, idlen);
+
+	return redis->get(redis->instance, key, keylen, data, size);
+}
 
-	return NULL;
+static int redis_delete(void *ctx, const uint8_t *id, size_t idlen)
+{
+	size_t keylen;
+	uint8_t key[REDIS_KEY_LEN];
+	eaptls_redis_t *redis = ctx;
+
+	keylen = redis_key(key, id, idlen);
+
+	return redis->del(redis->instance, key, keylen);
+}
+
+static void redis_free(void *ctx)
+{
+	free(ctx);
+}
+
+static const tls_cache_ops_t redis_cache_ops = {
+	"redis",
+	redis_store,
+	redis_fetch,
+	redis_delete,
+	redis_free
+};
+
+/*
+ *	"store = file" uses a local file.  Anything else is the name
+ *	of a redis module.
+ */
+static tls_cache_t *init_session_store(EAP_TLS_CONF *conf)
+{
+	tls_cache_t *cache;
+	eaptls_redis_t *redis;
+	module_instance_t *modinst;
+
+	/*
+	 *	Otherwise the session context changes when the server
+	 *	restarts, and OpenSSL won't resume the stored sessions.
+	 */
+	if (!conf->session_id_name) {
+		radlog(L_ERR, "rlm_eap_tls: You MUST set \"name\" in the \"cache\" section when \"store\" is set");
+		return NULL;
+	}
+
+	if (strcmp(conf->session_cache_store, "file") == 0) {
+		if (!conf->session_cache_file) {
+			radlog(L_ERR, "rlm_eap_tls: You MUST set \"file\" in the \"cache\" section when \"store = file\"");
+			return NULL;
+		}
+
+		return tls_cache_file_create(conf->session_cache_file,
+					     conf->session_cache_store_entries,
+					     conf->session_cache_store_size);
+	}
+
+	modinst = find_module_instance(cf_section_find("modules"),
+				       conf->session_cache_store, 1);
+	if (!modinst) {
+		radlog(L_ERR, "rlm_eap_tls: Failed to find module instance \"%s\" for the session store",
+		       conf->session_cache_store);
+		return NULL;
+	}
+
+	if (strcmp(modinst->entry->module->name, "redis") != 0) {
+		radlog(L_ERR, "rlm_eap_tls: Module instance \"%s\" is not a redis module",
+		       conf->session_cache_store);
+		return NULL;
+	}
+
+	redis = rad_malloc(sizeof(*redis));
+	memset(redis, 0, sizeof(*redis));
+
+	redis->instance = modinst->insthandle;
+	redis->set = (void *) lt_dlsym(modinst->entry->handle, "rlm_redis_kv_set");
+	redis->get = (void *) lt_dlsym(modinst->entry->handle, "rlm_redis_kv_get");
+	redis->del = (void *) lt_dlsym(modinst->entry->handle, "rlm_redis_kv_del");
+
+	if (!redis->set || !redis->get || !redis->del) {
+		radlog(L_ERR, "rlm_eap_tls: Module \"%s\" cannot be used to store sessions",
+		       conf->session_cache_store);
+		free(redis);
+		return NULL;
+	}
+
+	cache = tls_cache_create(&redis_cache_ops, redis,
+				 conf->session_cache_store_size);
+	if (!cache) {
+		radlog(L_ERR, "rlm_eap_tls: Invalid \"store_entry_size\"");
+		free(redis);
+		return NULL;
+	}
+
+	return cache;
 }
 
 #ifdef HAVE_OPENSSL_OCSP_H
@@ -1409,6 +1595,7 @@ static int eaptls_detach(void *arg)
 	conf = inst->conf;
 
 	if (conf) {
+		tls_cache_free(conf->session_cache);
 		memset(conf, 0, sizeof(*conf));
 		free(inst->conf);
 		inst->conf = NULL;
@@ -1482,12 +1669,28 @@ static int eaptls_attach(CONF_SECTION *cs, void **instance)
 		return -1;
 	}
 
+	/*
+	 *	The NAS may tell us it can take larger fragments,
+	 *	but never more than fits into a RADIUS packet.
+	 */
+	if (conf->max_fragment_size == 0) {
+		conf->max_fragment_size = conf->fragment_size;
+	}
+
+	if ((conf->max_fragment_size < conf->fragment_size) ||
+	    (conf->max_fragment_size > 4000)) {
+		radlog(L_ERR, "rlm_eap_tls: max_fragment_size must be between fragment_size and 4000.");
+		eaptls_detach(inst);
+		return -1;
+	}
+
 	/*
 	 *	Account for the EAP header (4), and the EAP-TLS header
 	 *	(6), as per Section 4.2 of RFC 2716.  What's left is
 	 *	the maximum amount of data we read from a TLS buffer.
 	 */
 	conf->fragment_size -= 10;
+	conf->max_fragment_size -= 10;
 
 	/*
 	 *	This magic makes the administrators life HUGELY easier
@@ -1520,6 +1723,17 @@ static int eaptls_attach(CONF_SECTION *cs, void **instance)
 		return -1;
 	}
 
+	/*
+	 *	Keep sessions outside of the server, too.
+	 */
+	if (conf->session_cache_enable && conf->session_cache_store) {
+		conf->session_cache = init_session_store(conf);
+		if (!conf->session_cache) {
+			eaptls_detach(inst);
+			return -1;
+		}
+	}
+
 #ifdef HAVE_OPENSSL_OCSP_H
 	/*
 	 * 	Initialize OCSP Revocation Store
@@ -1679,10 +1893,14 @@ static int eaptls_initiate(void *type_arg, EAP_HANDLER *handler)
 	 *	asking the administrator to know the internal details
 	 *	of EAP-TLS in order to calculate fragment sizes is
 	 *	just too much.
+	 *
+	 *	If max_fragment_size is set, a NAS which sends a
+	 *	larger Framed-MTU gets larger fragments, and the
+	 *	handshake takes fewer round trips.
 	 */
 	ssn->offset = inst->conf->fragment_size;
 	vp = pairfind(handler->request->packet->vps, PW_FRAMED_MTU);
-	if (vp && ((vp->vp_integer - 14) < ssn->offset)) {
+	if (vp && (vp->vp_integer > 14)) {
 		/*
 		 *	Discount the Framed-MTU by:
 		 *	 4 : EAPOL header
@@ -1696,6 +1914,9 @@ static int eaptls_initiate(void *type_arg, EAP_HANDLER *handler)
 		 *	14
 		 */
 		ssn->offset = vp->vp_integer - 14;
+		if (ssn->offset > (unsigned int) inst->conf->max_fragment_size) {
+			ssn->offset = inst->conf->max_fragment_size;
+		}
 	}
 
 	handler->opaque = ((void *)ssn);
@@ -1744,6 +1965,7 @@ static int eaptls_initiate(void *type_arg, EAP_HANDLER *handler)
 
 	if (inst->conf->session_cache_enable) {
 		ssn->allow_session_resumption = 1; /* otherwise it's zero */
+		ssn->cache = inst->conf->session_cache;
 	}
 
 	/*
@@ -1805,7 +2027,7 @@ static int eaptls_authenticate(void *arg, EAP_HANDLER *handler)
 			unsigned int data_len;
 			unsigned char buffer[1024];
 
-			data_len = (tls_session->record_minus)(&tls_session->dirty_in,
+			data_len = (tls_session->record_minus)(&tls_session->clean_out,
 						buffer, sizeof(buffer));
 			log_debug("  Tunneled data (%u bytes)\n", data_len);
 			for (i = 0; i < data_len; i++) {
@@ -1832,6 +2054,9 @@ static int eaptls_authenticate(void *arg, EAP_HANDLER *handler)
 		if (inst->conf->session_cache_enable) {	
 			SSL_CTX_remove_session(inst->ctx,
 					       tls_session->ssl->session);
+			tls_cache_delete(inst->conf->session_cache,
+					 tls_session->ssl->session->session_id,
+					 tls_session->ssl->session->session_id_length);
 		}
 
 		return 0;
@@ -1876,6 +2101,34 @@ static int eaptls_authenticate(void *arg, EAP_HANDLER *handler)
 	return eaptls_success(handler, 0);
 }
 
+/*
+ *	For "radmin -e 'stats module eap'".
+ */
+static size_t eaptls_stats(void *arg, char *out, size_t outlen)
+{
+	size_t len;
+	eap_tls_t *inst = (eap_tls_t *) arg;
+
+	if (!inst->conf->session_cache_enable) return 0;
+
+	len = snprintf(out, outlen,
+		       "tls sessions\t%ld\n"
+		       "tls hits\t%ld\n"
+		       "tls misses\t%ld\n"
+		       "tls timeouts\t%ld\n",
+		       SSL_CTX_sess_number(inst->ctx),
+		       SSL_CTX_sess_hits(inst->ctx),
+		       SSL_CTX_sess_misses(inst->ctx),
+		       SSL_CTX_sess_timeouts(inst->ctx));
+	if (len >= outlen) return outlen - 1;
+
+	len += tls_cache_stats(inst->conf->session_cache,
+			       out + len, outlen - len);
+	if (len >= outlen) return outlen - 1;
+
+	return len;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -1886,5 +2139,6 @@ EAP_TYPE rlm_eap_tls = {
 	eaptls_initiate,		/* Start the initial request */
 	NULL,				/* authorization */
 	eaptls_authenticate,		/* authentication */
-	eaptls_detach			/* detach */
+	eaptls_detach,			/* detach */
+	eaptls_stats			/* statistics */
 };
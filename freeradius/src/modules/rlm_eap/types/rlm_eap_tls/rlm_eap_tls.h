@@ -55,6 +55,7 @@ typedef struct eap_tls_conf {
 	 *	Always < 4096 (due to radius limit), 0 by default = 2048
 	 */
 	int		fragment_size;
+	int		max_fragment_size;
 	int		check_crl;
 	int		allow_expired_crl;
 	char		*check_cert_cn;
@@ -67,6 +68,11 @@ typedef struct eap_tls_conf {
 	char		*session_id_name;
 	char		session_context_id[SSL_MAX_SSL_SESSION_ID_LENGTH];
 	time_t		session_last_flushed;
+	char		*session_cache_store;
+	char		*session_cache_file;
+	int		session_cache_store_entries;
+	int		session_cache_store_size;
+	tls_cache_t	*session_cache;
 
 	char		*verify_tmp_dir;
 	char		*verify_client_cert_cmd;
@@ -40,6 +40,9 @@ typedef struct rlm_exec_t {
 	char	*packet_type;
 	unsigned int	packet_code;
 	int	shell_escape;
+	int	helpers;
+	int	timeout;
+	exec_pool_t	*pool;
 } rlm_exec_t;
 
 /*
@@ -62,6 +65,8 @@ static const CONF_PARSER module_config[] = {
 	{ "packet_type", PW_TYPE_STRING_PTR,
 	  offsetof(rlm_exec_t,packet_type), NULL, NULL },
 	{ "shell_escape", PW_TYPE_BOOLEAN,  offsetof(rlm_exec_t,shell_escape), NULL, "yes" },
+	{ "helpers", PW_TYPE_INTEGER,  offsetof(rlm_exec_t,helpers), NULL, "0" },
+	{ "timeout", PW_TYPE_INTEGER,  offsetof(rlm_exec_t,timeout), NULL, "10" },
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
@@ -152,6 +157,14 @@ static size_t exec_xlat(void *instance, REQUEST *request,
 }
 
 
+static size_t exec_stats(void *instance, char *out, size_t outlen)
+{
+	rlm_exec_t	*inst = instance;
+
+	return exec_pool_stats(inst->pool, out, outlen);
+}
+
+
 /*
  *	Detach an instance and free it's data.
  */
@@ -159,6 +172,11 @@ static int exec_detach(void *instance)
 {
 	rlm_exec_t	*inst = instance;
 
+	if (inst->pool) {
+		module_stats_unregister(inst);
+		exec_pool_free(inst->pool);
+	}
+
 	if (inst->xlat_name) {
 		xlat_unregister(inst->xlat_name, exec_xlat, instance);
 		free(inst->xlat_name);
@@ -240,6 +258,36 @@ static int exec_instantiate(CONF_SECTION *conf, void **instance)
 		inst->packet_code = dval->value;
 	}
 
+	/*
+	 *	Run the program as a pool of helpers, instead of
+	 *	once per request.
+	 */
+	if (inst->helpers > 0) {
+		if (!inst->program || !inst->wait) {
+			radlog(L_ERR, "rlm_exec: \"helpers\" requires \"program\", and \"wait = yes\"");
+			exec_detach(inst);
+			return -1;
+		}
+
+		if (strchr(inst->program, '%') != NULL) {
+			radlog(L_ERR, "rlm_exec: \"program\" cannot contain expansions when \"helpers\" is set");
+			exec_detach(inst);
+			return -1;
+		}
+
+		inst->pool = exec_pool_create(cf_section_name2(conf) ?
+					      cf_section_name2(conf) :
+					      cf_section_name1(conf),
+					      inst->program, inst->helpers,
+					      inst->timeout);
+		if (!inst->pool) {
+			exec_detach(inst);
+			return -1;
+		}
+
+		module_stats_register(inst, exec_stats);
+	}
+
 	xlat_name = cf_section_name2(conf);
 	if (xlat_name == NULL) {
 		xlat_name = cf_section_name1(conf);
@@ -321,9 +369,15 @@ static int exec_dispatch(void *instance, REQUEST *request)
 	 *	exec program function xlat's it's string value
 	 *	into something else.
 	 */
-	result = radius_exec_program(inst->program, request,
-				     inst->wait, NULL, 0,
-				     *input_pairs, &answer, inst->shell_escape);
+	if (inst->pool) {
+		result = radius_exec_pool(inst->pool, request, NULL, 0,
+					  *input_pairs, &answer);
+	} else {
+		result = radius_exec_program(inst->program, request,
+					     inst->wait, NULL, 0,
+					     *input_pairs, &answer,
+					     inst->shell_escape);
+	}
 	if (result < 0) {
 		radlog(L_ERR, "rlm_exec (%s): External script failed",
 		       inst->xlat_name);
@@ -145,6 +145,8 @@ typedef struct {
 	char           *filter;
 	char           *base_filter;
 	char           *basedn;
+	xlat_template_t	*filter_xt;
+	xlat_template_t	*basedn_xt;
 	char           *default_profile;
 	char           *profile_attr;
 	char           *access_attr;
@@ -154,6 +156,7 @@ typedef struct {
 	char           *dictionary_mapping;
 	char	       *groupname_attr;
 	char	       *groupmemb_filt;
+	xlat_template_t	*groupmemb_filt_xt;
 	char           *groupmemb_attr;
 	char		**atts;
 	TLDAP_RADIUS   *check_item_map;
@@ -370,6 +373,7 @@ static int ldap_groupcmp(void *, REQUEST *, VALUE_PAIR *, VALUE_PAIR *, VALUE_PA
 static size_t ldap_xlat(void *, REQUEST *, char *, char *, size_t, RADIUS_ESCAPE_STRING);
 static LDAP    *ldap_connect(void *instance, const char *, const char *, int, int *, char **);
 static int     read_mappings(ldap_instance* inst);
+static int     ldap_detach(void *instance);
 
 static inline int ldap_get_conn(LDAP_CONN *conns,LDAP_CONN **ret,
 				ldap_instance *inst)
@@ -710,6 +714,34 @@ ldap_instantiate(CONF_SECTION * conf, void **instance)
 
 	DEBUG("conns: %p",inst->conns);
 
+	/*
+	 *	The filters and base DN are expanded for every
+	 *	request, so parse them once, here.
+	 */
+	if (inst->filter &&
+	    ((inst->filter_xt = radius_compile_xlat(inst->filter)) == NULL)) {
+		radlog(L_ERR, "rlm_ldap: Invalid filter \"%s\": %s",
+		       inst->filter, fr_strerror());
+		ldap_detach(inst);
+		return -1;
+	}
+
+	if (inst->basedn &&
+	    ((inst->basedn_xt = radius_compile_xlat(inst->basedn)) == NULL)) {
+		radlog(L_ERR, "rlm_ldap: Invalid basedn \"%s\": %s",
+		       inst->basedn, fr_strerror());
+		ldap_detach(inst);
+		return -1;
+	}
+
+	if (inst->groupmemb_filt &&
+	    ((inst->groupmemb_filt_xt = radius_compile_xlat(inst->groupmemb_filt)) == NULL)) {
+		radlog(L_ERR, "rlm_ldap: Invalid groupmembership_filter \"%s\": %s",
+		       inst->groupmemb_filt, fr_strerror());
+		ldap_detach(inst);
+		return -1;
+	}
+
 	*instance = inst;
 
 
@@ -1039,7 +1071,7 @@ static int ldap_groupcmp(void *instance, REQUEST *req,
                 return 1;
         }
 
-        if (!radius_xlat(basedn, sizeof(basedn), inst->basedn, req, ldap_escape_func)) {
+        if (!radius_xlat_template(basedn, sizeof(basedn), inst->basedn_xt, req, ldap_escape_func)) {
                 DEBUG("rlm_ldap::ldap_groupcmp: unable to create basedn.");
                 return 1;
         }
@@ -1047,7 +1079,7 @@ static int ldap_groupcmp(void *instance, REQUEST *req,
         while((vp_user_dn = pairfind(*request_pairs, PW_LDAP_USERDN)) == NULL){
                 char            *user_dn = NULL;
 
-                if (!radius_xlat(filter, sizeof(filter), inst->filter,
+                if (!radius_xlat_template(filter, sizeof(filter), inst->filter_xt,
 					req, ldap_escape_func)){
                         DEBUG("rlm_ldap::ldap_groupcmp: unable to create filter");
                         return 1;
@@ -1086,8 +1118,8 @@ static int ldap_groupcmp(void *instance, REQUEST *req,
                 ldap_msgfree(result);
         }
 
-        if(!radius_xlat(gr_filter, sizeof(gr_filter),
-			inst->groupmemb_filt, req, ldap_escape_func)) {
+        if(!radius_xlat_template(gr_filter, sizeof(gr_filter),
+			inst->groupmemb_filt_xt, req, ldap_escape_func)) {
                 DEBUG("rlm_ldap::ldap_groupcmp: unable to create filter.");
                 return 1;
         }
@@ -1372,13 +1404,13 @@ static int ldap_authorize(void *instance, REQUEST * request)
 	RDEBUG("performing user authorization for %s",
 	       request->username->vp_strvalue);
 
-	if (!radius_xlat(filter, sizeof(filter), inst->filter,
+	if (!radius_xlat_template(filter, sizeof(filter), inst->filter_xt,
 			 request, ldap_escape_func)) {
 		radlog(L_ERR, "  [%s] unable to create filter.\n", inst->xlat_name);
 		return RLM_MODULE_INVALID;
 	}
 
-	if (!radius_xlat(basedn, sizeof(basedn), inst->basedn,
+	if (!radius_xlat_template(basedn, sizeof(basedn), inst->basedn_xt,
 			 request, ldap_escape_func)) {
 		radlog(L_ERR, "  [%s] unable to create basedn.\n", inst->xlat_name);
 		return RLM_MODULE_INVALID;
@@ -1888,13 +1920,13 @@ static int ldap_authenticate(void *instance, REQUEST * request)
 
 	while ((vp_user_dn = pairfind(request->config_items,
 				      PW_LDAP_USERDN)) == NULL) {
-		if (!radius_xlat(filter, sizeof(filter), inst->filter,
+		if (!radius_xlat_template(filter, sizeof(filter), inst->filter_xt,
 				request, ldap_escape_func)) {
 			radlog(L_ERR, "  [%s] unable to create filter.\n", inst->xlat_name);
 			return RLM_MODULE_INVALID;
 		}
 
-		if (!radius_xlat(basedn, sizeof(basedn), inst->basedn,
+		if (!radius_xlat_template(basedn, sizeof(basedn), inst->basedn_xt,
 		 		request, ldap_escape_func)) {
 			radlog(L_ERR, "  [%s] unable to create basedn.\n", inst->xlat_name);
 			return RLM_MODULE_INVALID;
@@ -2651,6 +2683,10 @@ ldap_detach(void *instance)
 	if (inst->atts)
 		free(inst->atts);
 
+	radius_free_xlat(&inst->filter_xt);
+	radius_free_xlat(&inst->basedn_xt);
+	radius_free_xlat(&inst->groupmemb_filt_xt);
+
 	paircompare_unregister(PW_LDAP_GROUP, ldap_groupcmp);
 	xlat_unregister(inst->xlat_name,ldap_xlat, instance);
 	free(inst->xlat_name);
@@ -64,6 +64,9 @@ typedef struct rlm_linelog_t {
 	char		*group;
 	char		*line;
 	char		*reference;
+	xlat_template_t	*filename_xt;
+	xlat_template_t	*line_xt;
+	xlat_template_t	*reference_xt;
 } rlm_linelog_t;
 
 /*
@@ -96,10 +99,62 @@ static int linelog_detach(void *instance)
 {
 	rlm_linelog_t *inst = instance;
 
+	radius_free_xlat(&inst->filename_xt);
+	radius_free_xlat(&inst->line_xt);
+	radius_free_xlat(&inst->reference_xt);
+
 	free(inst);
 	return 0;
 }
 
+static void linelog_free_xlat(void *data)
+{
+	xlat_template_t *xt = data;
+
+	radius_free_xlat(&xt);
+}
+
+/*
+ *	Compile every value which "reference" might point to, and
+ *	remember the templates in the section holding the value.
+ *
+ *	Values which don't compile are left alone, and are expanded
+ *	the slow way at run time.
+ */
+static void linelog_compile_section(CONF_SECTION *cs)
+{
+	CONF_ITEM *ci;
+	CONF_PAIR *cp;
+	const char *value;
+	xlat_template_t *xt;
+	char name[256];
+
+	for (ci = cf_item_find_next(cs, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(cs, ci)) {
+		if (cf_item_is_section(ci)) {
+			linelog_compile_section(cf_itemtosection(ci));
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		cp = cf_itemtopair(ci);
+		value = cf_pair_value(cp);
+		if (!value || !*value) continue;
+
+		snprintf(name, sizeof(name), "linelog:%s", cf_pair_attr(cp));
+		if (cf_data_find(cs, name)) continue;
+
+		xt = radius_compile_xlat(value);
+		if (!xt) continue;
+
+		if (cf_data_add(cs, name, xt, linelog_free_xlat) < 0) {
+			radius_free_xlat(&xt);
+		}
+	}
+}
+
 /*
  *	Instantiate the module.
  */
@@ -155,6 +210,36 @@ static int linelog_instantiate(CONF_SECTION *conf, void **instance)
 		return -1;
 	}
 
+	if (strcmp(inst->filename, "syslog") != 0) {
+		inst->filename_xt = radius_compile_xlat(inst->filename);
+		if (!inst->filename_xt) {
+			radlog(L_ERR, "rlm_linelog: Invalid filename \"%s\": %s",
+			       inst->filename, fr_strerror());
+			linelog_detach(inst);
+			return -1;
+		}
+	}
+
+	inst->line_xt = radius_compile_xlat(inst->line);
+	if (!inst->line_xt) {
+		radlog(L_ERR, "rlm_linelog: Invalid format \"%s\": %s",
+		       inst->line, fr_strerror());
+		linelog_detach(inst);
+		return -1;
+	}
+
+	if (inst->reference) {
+		inst->reference_xt = radius_compile_xlat(inst->reference);
+		if (!inst->reference_xt) {
+			radlog(L_ERR, "rlm_linelog: Invalid reference \"%s\": %s",
+			       inst->reference, fr_strerror());
+			linelog_detach(inst);
+			return -1;
+		}
+
+		linelog_compile_section(conf);
+	}
+
 	inst->cs = conf;
 	*instance = inst;
 
@@ -231,6 +316,7 @@ static int do_linelog(void *instance, REQUEST *request)
 	char line[1024];
 	rlm_linelog_t *inst = (rlm_linelog_t*) instance;
 	const char *value = inst->line;
+	const xlat_template_t *xt = inst->line_xt;
 
 #ifdef HAVE_GRP_H
 	gid_t gid;
@@ -242,8 +328,9 @@ static int do_linelog(void *instance, REQUEST *request)
 		CONF_ITEM *ci;
 		CONF_PAIR *cp;
 
-		radius_xlat(line + 1, sizeof(line) - 2, inst->reference,
-			    request, linelog_escape_func);
+		radius_xlat_template(line + 1, sizeof(line) - 2,
+				     inst->reference_xt, request,
+				     linelog_escape_func);
 		line[0] = '.';	/* force to be in current section */
 
 		/*
@@ -273,6 +360,10 @@ static int do_linelog(void *instance, REQUEST *request)
 		 *	Value exists, but is empty.  Don't log anything.
 		 */
 		if (!*value) return RLM_MODULE_OK;
+
+		snprintf(buffer, sizeof(buffer), "linelog:%s",
+			 cf_pair_attr(cp));
+		xt = cf_data_find(cf_item_parent(ci), buffer);
 	}
 
  do_log:
@@ -280,8 +371,8 @@ static int do_linelog(void *instance, REQUEST *request)
 	 *	FIXME: Check length.
 	 */
 	if (strcmp(inst->filename, "syslog") != 0) {
-		radius_xlat(buffer, sizeof(buffer), inst->filename, request,
-			    NULL);
+		radius_xlat_template(buffer, sizeof(buffer), inst->filename_xt,
+				     request, NULL);
 		
 		/* check path and eventually create subdirs */
 		p = strrchr(buffer,'/');
@@ -325,8 +416,13 @@ static int do_linelog(void *instance, REQUEST *request)
 	/*
 	 *	FIXME: Check length.
 	 */
-	radius_xlat(line, sizeof(line) - 1, value, request,
-		    linelog_escape_func);
+	if (xt) {
+		radius_xlat_template(line, sizeof(line) - 1, xt, request,
+				     linelog_escape_func);
+	} else {
+		radius_xlat(line, sizeof(line) - 1, value, request,
+			    linelog_escape_func);
+	}
 
 	if (fd >= 0) {
 		strcat(line, "\n");
@@ -128,6 +128,12 @@ static int pdb_decode_acct_ctrl(const char *p)
 }
 
 
+/*
+ *	How long an ntlm_auth helper can be idle before we check that
+ *	it's still working.
+ */
+#define NTLM_AUTH_CHECK_INTERVAL (30)
+
 typedef struct rlm_mschap_t {
 	int use_mppe;
 	int require_encryption;
@@ -136,6 +142,10 @@ typedef struct rlm_mschap_t {
 	char *passwd_file;
 	const char *xlat_name;
 	char *ntlm_auth;
+	char *ntlm_auth_helper;
+	int ntlm_auth_helpers;
+	int ntlm_auth_timeout;
+	exec_pool_t *ntlm_pool;
 	const char *auth_type;
 	int allow_retry;
 	char *retry_msg;
@@ -535,6 +545,12 @@ static const CONF_PARSER module_config[] = {
 	  offsetof(rlm_mschap_t, passwd_file), NULL,  NULL },
 	{ "ntlm_auth",   PW_TYPE_STRING_PTR,
 	  offsetof(rlm_mschap_t, ntlm_auth), NULL,  NULL },
+	{ "ntlm_auth_helper",   PW_TYPE_STRING_PTR,
+	  offsetof(rlm_mschap_t, ntlm_auth_helper), NULL,  NULL },
+	{ "ntlm_auth_helpers",   PW_TYPE_INTEGER,
+	  offsetof(rlm_mschap_t, ntlm_auth_helpers), NULL,  "5" },
+	{ "ntlm_auth_timeout",   PW_TYPE_INTEGER,
+	  offsetof(rlm_mschap_t, ntlm_auth_timeout), NULL,  "10" },
 	{ "allow_retry",   PW_TYPE_BOOLEAN,
 	  offsetof(rlm_mschap_t, allow_retry), NULL,  "yes" },
 	{ "retry_msg",   PW_TYPE_STRING_PTR,
@@ -547,12 +563,23 @@ static const CONF_PARSER module_config[] = {
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
+static size_t mschap_stats(void *instance, char *out, size_t outlen)
+{
+	rlm_mschap_t *inst = instance;
+
+	return exec_pool_stats(inst->ntlm_pool, out, outlen);
+}
+
 /*
  *	deinstantiate module, free all memory allocated during
  *	mschap_instantiate()
  */
 static int mschap_detach(void *instance){
 #define inst ((rlm_mschap_t *)instance)
+	if (inst->ntlm_pool) {
+		module_stats_unregister(inst);
+		exec_pool_free(inst->ntlm_pool);
+	}
 	if (inst->xlat_name) {
 		xlat_unregister(inst->xlat_name, mschap_xlat, instance);
 		free(inst->xlat_name);
@@ -610,6 +637,36 @@ static int mschap_instantiate(CONF_SECTION *conf, void **instance)
 		inst->auth_type = inst->xlat_name;
 	}
 
+	/*
+	 *	Keep a pool of ntlm_auth processes running, instead
+	 *	of running ntlm_auth for every request.
+	 */
+	if (inst->ntlm_auth_helper) {
+		if (strchr(inst->ntlm_auth_helper, '%') != NULL) {
+			radlog(L_ERR, "rlm_mschap: \"ntlm_auth_helper\" cannot contain expansions");
+			mschap_detach(inst);
+			return -1;
+		}
+
+		inst->ntlm_pool = exec_pool_create(inst->xlat_name,
+						   inst->ntlm_auth_helper,
+						   inst->ntlm_auth_helpers,
+						   inst->ntlm_auth_timeout);
+		if (!inst->ntlm_pool) {
+			mschap_detach(inst);
+			return -1;
+		}
+
+		/*
+		 *	An empty request gets an "Error:" answer, which
+		 *	is enough to show that the helper is working.
+		 */
+		exec_pool_check(inst->ntlm_pool, ".\n",
+				NTLM_AUTH_CHECK_INTERVAL);
+
+		module_stats_register(inst, mschap_stats);
+	}
+
 	return 0;
 }
 
@@ -651,6 +708,180 @@ static void mppe_add_reply(REQUEST *request,
 }
 
 
+/*
+ *	Add "key: value" to an ntlm_auth helper request.  Values
+ *	which aren't plain text are sent as "key:: base64".
+ */
+static size_t ntlm_helper_add(char *out, size_t outlen,
+			      const char *key, const char *value)
+{
+	static const char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i, len, vlen;
+	const uint8_t *p;
+
+	vlen = strlen(value);
+	for (i = 0; i < vlen; i++) {
+		if ((value[i] < 0x20) || (value[i] > 0x7e)) break;
+	}
+
+	if ((i == vlen) && (value[0] != ' ')) {
+		len = snprintf(out, outlen, "%s: %s\n", key, value);
+		return (len < outlen) ? len : 0;
+	}
+
+	len = snprintf(out, outlen, "%s:: ", key);
+	if ((len + (((vlen + 2) / 3) * 4) + 2) > outlen) return 0;
+
+	p = (const uint8_t *) value;
+	for (i = 0; i < vlen; i += 3, p += 3) {
+		out[len++] = b64[p[0] >> 2];
+		out[len++] = b64[((p[0] & 0x03) << 4) |
+				 ((i + 1 < vlen) ? (p[1] >> 4) : 0)];
+		out[len++] = (i + 1 < vlen) ?
+			b64[((p[1] & 0x0f) << 2) |
+			    ((i + 2 < vlen) ? (p[2] >> 6) : 0)] : '=';
+		out[len++] = (i + 2 < vlen) ? b64[p[2] & 0x3f] : '=';
+	}
+	out[len++] = '\n';
+	out[len] = '\0';
+
+	return len;
+}
+
+/*
+ *	Ask a running ntlm_auth, using "--helper-protocol=ntlm-server-1".
+ *
+ *	The request is:
+ *
+ *		Username: bob
+ *		NT-Domain: EXAMPLE
+ *		LANMAN-Challenge: 0001020304050607
+ *		NT-Response: 0001...
+ *		Request-User-Session-Key: Yes
+ *		.
+ *
+ *	and the answer is:
+ *
+ *		Authenticated: Yes
+ *		User-Session-Key: 000102030405060708090a0b0c0d0e0f
+ *		.
+ *
+ *	or "Authenticated: No", with an "Authentication-Error" line.
+ */
+static int do_ntlm_helper(rlm_mschap_t *inst, REQUEST *request,
+			  uint8_t *challenge, uint8_t *response,
+			  uint8_t *nthashhash)
+{
+	int		code, authenticated;
+	size_t		len, rcode;
+	char		*p, *q, *error, *key;
+	VALUE_PAIR	*vp;
+	char		name[256], domain[256], hex[64];
+	char		msg[1024], answer[1024];
+
+	memset(nthashhash, 0, 16);
+
+	if (!mschap_xlat(inst, request, "User-Name", name, sizeof(name), NULL)) {
+		return -1;
+	}
+
+	domain[0] = '\0';
+	mschap_xlat(inst, request, "NT-Domain", domain, sizeof(domain), NULL);
+
+	len = ntlm_helper_add(msg, sizeof(msg), "Username", name);
+	if (!len) return -1;
+
+	if (domain[0]) {
+		rcode = ntlm_helper_add(msg + len, sizeof(msg) - len,
+					"NT-Domain", domain);
+		if (!rcode) return -1;
+		len += rcode;
+	}
+
+	fr_bin2hex(challenge, hex, 8);
+	rcode = ntlm_helper_add(msg + len, sizeof(msg) - len,
+				"LANMAN-Challenge", hex);
+	if (!rcode) return -1;
+	len += rcode;
+
+	fr_bin2hex(response, hex, 24);
+	rcode = ntlm_helper_add(msg + len, sizeof(msg) - len,
+				"NT-Response", hex);
+	if (!rcode) return -1;
+	len += rcode;
+
+	rcode = ntlm_helper_add(msg + len, sizeof(msg) - len,
+				"Request-User-Session-Key", "Yes");
+	if (!rcode) return -1;
+	len += rcode;
+
+	if ((len + 3) > sizeof(msg)) return -1;
+	msg[len++] = '.';
+	msg[len++] = '\n';
+
+	code = exec_pool_send(inst->ntlm_pool, msg, len,
+			      answer, sizeof(answer));
+	if (code < 0) {
+		error = "no answer from ntlm_auth";
+		goto fail;
+	}
+
+	RDEBUG2("ntlm_auth says %s", answer);
+
+	authenticated = FALSE;
+	error = key = NULL;
+	for (p = answer; *p; p = q) {
+		q = strchr(p, '\n');
+		if (q) {
+			*(q++) = '\0';
+		} else {
+			q = p + strlen(p);
+		}
+
+		if (strcmp(p, "Authenticated: Yes") == 0) {
+			authenticated = TRUE;
+
+		} else if (strncmp(p, "User-Session-Key: ", 18) == 0) {
+			key = p + 18;
+
+		} else if (!error &&
+			   ((strncmp(p, "Authentication-Error: ", 22) == 0) ||
+			    (strncmp(p, "Error: ", 7) == 0))) {
+			error = strchr(p, ' ') + 1;
+		}
+	}
+
+	if (!authenticated) {
+		if (!error) error = "Authenticated: No";
+		goto fail;
+	}
+
+	if (!key || (strlen(key) < 32) ||
+	    (fr_hex2bin(key, nthashhash, 16) != 16)) {
+		RDEBUG2("Invalid output from ntlm_auth: User-Session-Key is missing or malformed");
+		return -1;
+	}
+
+	return 0;
+
+ fail:
+	RDEBUG2("External script failed.");
+
+	vp = pairmake("Module-Failure-Message", "", T_OP_EQ);
+	if (!vp) {
+		radlog_request(L_ERR, 0, request, "No memory to allocate Module-Failure-Message");
+		return -1;
+	}
+
+	snprintf(vp->vp_strvalue, sizeof(vp->vp_strvalue),
+		 "%s: External script says %s",
+		 inst->xlat_name, error);
+	vp->length = strlen(vp->vp_strvalue);
+	pairadd(&request->packet->vps, vp);
+	return -1;
+}
+
 /*
  *	Do the MS-CHAP stuff.
  *
@@ -692,6 +923,10 @@ static int do_mschap(rlm_mschap_t *inst,
 		} else {
 			memset(nthashhash, 0, 16);
 		}
+	} else if (inst->ntlm_pool) {
+		return do_ntlm_helper(inst, request, challenge, response,
+				      nthashhash);
+
 	} else {		/* run ntlm_auth */
 		int	result;
 		char	buffer[256];
@@ -961,7 +1196,8 @@ static int mschap_authenticate(void * instance, REQUEST *request)
 	 *	If we have ntlm_auth configured, use it unless told
 	 *	otherwise
 	 */
-	do_ntlm_auth = (inst->ntlm_auth != NULL);
+	do_ntlm_auth = ((inst->ntlm_auth != NULL) ||
+			(inst->ntlm_pool != NULL));
 
 	/*
 	 *	If we have an ntlm_auth configuration, then we may
@@ -610,6 +610,155 @@ int redis_release_socket(REDIS_INST *inst, REDISSOCK *dissocket)
 	return 0;
 }
 
+/*
+ *	Run a command whose arguments may contain binary data.  The
+ *	caller frees the reply.
+ */
+static redisReply *redis_command_argv(REDIS_INST *inst, REDISSOCK *dissocket,
+				      int argc, const char **argv,
+				      const size_t *argvlen)
+{
+	redisReply *reply;
+
+	DEBUG2("rlm_redis (%s): executing %s", inst->xlat_name, argv[0]);
+	reply = redisCommandArgv(dissocket->conn, argc, argv, argvlen);
+	if (!reply) {
+		radlog(L_ERR, "rlm_redis: (%s) REDIS error: %s",
+		       inst->xlat_name, dissocket->conn->errstr);
+
+		if (dissocket->state == sockconnected) {
+			redisFree(dissocket->conn);
+			dissocket->state = sockunconnected;
+		}
+
+		if (connect_single_socket(inst, dissocket) < 0) {
+			radlog(L_ERR, "rlm_redis (%s): reconnect failed, database down?",
+			       inst->xlat_name);
+			return NULL;
+		}
+
+		reply = redisCommandArgv(dissocket->conn, argc, argv, argvlen);
+		if (!reply) {
+			radlog(L_ERR, "rlm_redis (%s): failed after re-connect",
+			       inst->xlat_name);
+			return NULL;
+		}
+	}
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		radlog(L_ERR, "rlm_redis (%s): %s failed: %s",
+		       inst->xlat_name, argv[0], reply->str);
+		freeReplyObject(reply);
+		return NULL;
+	}
+
+	return reply;
+}
+
+/*
+ *	Binary-safe key/value access, for other modules which don't
+ *	build queries from strings.  They find this module with
+ *	find_module_instance(), and these functions with lt_dlsym().
+ */
+int rlm_redis_kv_set(void *instance, const uint8_t *key, size_t keylen,
+		     const uint8_t *data, size_t len, int ttl)
+{
+	REDIS_INST *inst = instance;
+	REDISSOCK *dissocket;
+	redisReply *reply;
+	char buffer[32];
+	const char *argv[4];
+	size_t argvlen[4];
+
+	if (ttl <= 0) return -1;
+
+	dissocket = redis_get_socket(inst);
+	if (!dissocket) return -1;
+
+	snprintf(buffer, sizeof(buffer), "%d", ttl);
+
+	argv[0] = "SETEX";
+	argvlen[0] = 5;
+	argv[1] = (const char *) key;
+	argvlen[1] = keylen;
+	argv[2] = buffer;
+	argvlen[2] = strlen(buffer);
+	argv[3] = (const char *) data;
+	argvlen[3] = len;
+
+	reply = redis_command_argv(inst, dissocket, 4, argv, argvlen);
+	redis_release_socket(inst, dissocket);
+
+	if (!reply) return -1;
+
+	freeReplyObject(reply);
+	return 0;
+}
+
+/*
+ *	Returns the length of the value, 0 if there's no such key
+ *	(or it's too large), or -1 on error.
+ */
+int rlm_redis_kv_get(void *instance, const uint8_t *key, size_t keylen,
+		     uint8_t *data, size_t size)
+{
+	int len;
+	REDIS_INST *inst = instance;
+	REDISSOCK *dissocket;
+	redisReply *reply;
+	const char *argv[2];
+	size_t argvlen[2];
+
+	dissocket = redis_get_socket(inst);
+	if (!dissocket) return -1;
+
+	argv[0] = "GET";
+	argvlen[0] = 3;
+	argv[1] = (const char *) key;
+	argvlen[1] = keylen;
+
+	reply = redis_command_argv(inst, dissocket, 2, argv, argvlen);
+	redis_release_socket(inst, dissocket);
+
+	if (!reply) return -1;
+
+	if ((reply->type != REDIS_REPLY_STRING) ||
+	    ((size_t) reply->len > size)) {
+		len = 0;
+	} else {
+		memcpy(data, reply->str, reply->len);
+		len = reply->len;
+	}
+
+	freeReplyObject(reply);
+	return len;
+}
+
+int rlm_redis_kv_del(void *instance, const uint8_t *key, size_t keylen)
+{
+	REDIS_INST *inst = instance;
+	REDISSOCK *dissocket;
+	redisReply *reply;
+	const char *argv[2];
+	size_t argvlen[2];
+
+	dissocket = redis_get_socket(inst);
+	if (!dissocket) return -1;
+
+	argv[0] = "DEL";
+	argvlen[0] = 3;
+	argv[1] = (const char *) key;
+	argvlen[1] = keylen;
+
+	reply = redis_command_argv(inst, dissocket, 2, argv, argvlen);
+	redis_release_socket(inst, dissocket);
+
+	if (!reply) return -1;
+
+	freeReplyObject(reply);
+	return 0;
+}
+
 static int redis_instantiate(CONF_SECTION *conf, void **instance)
 {
 	REDIS_INST *inst;
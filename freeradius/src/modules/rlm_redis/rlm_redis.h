@@ -85,5 +85,11 @@ int rlm_redis_finish_query(REDISSOCK *dissocket);
 REDISSOCK * redis_get_socket(REDIS_INST * inst);
 int redis_release_socket(REDIS_INST * inst, REDISSOCK *dissocket);
 
+int rlm_redis_kv_set(void *instance, const uint8_t *key, size_t keylen,
+		     const uint8_t *data, size_t len, int ttl);
+int rlm_redis_kv_get(void *instance, const uint8_t *key, size_t keylen,
+		     uint8_t *data, size_t size);
+int rlm_redis_kv_del(void *instance, const uint8_t *key, size_t keylen);
+
 #endif	/* RLM_REDIS_H */
 
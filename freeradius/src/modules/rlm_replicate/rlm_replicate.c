@@ -27,32 +27,898 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
+#ifndef HAVE_PTHREAD_H
+/*
+ *	This is easier than ifdef's throughout the code.
+ */
+#define pthread_mutex_init(_x, _y)
+#define pthread_mutex_destroy(_x)
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_unlock(_x)
+#endif
+
+/*
+ *	A bound UDP socket which isn't being used by any thread.
+ */
+typedef struct rlm_replicate_socket_t {
+	int		sockfd;
+	fr_ipaddr_t	src_ipaddr;
+	struct rlm_replicate_socket_t *next;
+} rlm_replicate_socket_t;
+
+struct replicate_dest_t;
+
+typedef struct rlm_replicate_t {
+	int		max_sockets;
+	int		batch;
+
+	int		async;
+	int		queue_size;
+	char		*spool_dir;
+	int		retry_delay;
+	int		retry_count;
+	int		drain_rate;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+	rlm_replicate_socket_t *idle;
+	int		num_idle;
+
+	/*
+	 *	Protected by the mutex.
+	 */
+	uint64_t	sent;
+	uint64_t	failed;
+	uint64_t	batches;
+	uint64_t	opened;
+
+	/*
+	 *	For async mode, also protected by the mutex.
+	 */
+	struct replicate_dest_t *dests;
+#ifdef HAVE_PTHREAD_H
+	pthread_t	thread;
+#endif
+	int		thread_running;
+	int		stop;
+} rlm_replicate_t;
+
+static const CONF_PARSER module_config[] = {
+	{ "max_sockets", PW_TYPE_INTEGER,
+	  offsetof(rlm_replicate_t, max_sockets), NULL, "32" },
+	{ "batch", PW_TYPE_BOOLEAN,
+	  offsetof(rlm_replicate_t, batch), NULL, "yes" },
+
+	{ "async", PW_TYPE_BOOLEAN,
+	  offsetof(rlm_replicate_t, async), NULL, "no" },
+	{ "queue_size", PW_TYPE_INTEGER,
+	  offsetof(rlm_replicate_t, queue_size), NULL, "1024" },
+	{ "spool_dir", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_replicate_t, spool_dir), NULL, NULL },
+	{ "retry_delay", PW_TYPE_INTEGER,
+	  offsetof(rlm_replicate_t, retry_delay), NULL, "5" },
+	{ "retry_count", PW_TYPE_INTEGER,
+	  offsetof(rlm_replicate_t, retry_count), NULL, "3" },
+	{ "drain_rate", PW_TYPE_INTEGER,
+	  offsetof(rlm_replicate_t, drain_rate), NULL, "100" },
+
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+/*
+ *	Get a socket bound to the given source address, re-using an
+ *	idle one if we can.
+ */
+static int socket_get(rlm_replicate_t *inst, const fr_ipaddr_t *src_ipaddr)
+{
+	int sockfd;
+	fr_ipaddr_t ipaddr;
+	rlm_replicate_socket_t *this, **last;
+
+	pthread_mutex_lock(&inst->mutex);
+	for (last = &inst->idle; *last != NULL; last = &(*last)->next) {
+		this = *last;
+		if (fr_ipaddr_cmp(&this->src_ipaddr, src_ipaddr) != 0) continue;
+
+		*last = this->next;
+		inst->num_idle--;
+		pthread_mutex_unlock(&inst->mutex);
+
+		sockfd = this->sockfd;
+		free(this);
+		return sockfd;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	ipaddr = *src_ipaddr;
+	sockfd = fr_socket(&ipaddr, 0);
+	if (sockfd < 0) return -1;
+
+	pthread_mutex_lock(&inst->mutex);
+	inst->opened++;
+	pthread_mutex_unlock(&inst->mutex);
+
+	return sockfd;
+}
+
+/*
+ *	Put a socket back in the pool, or close it if the pool is
+ *	full.
+ */
+static void socket_put(rlm_replicate_t *inst, int sockfd,
+		       const fr_ipaddr_t *src_ipaddr)
+{
+	rlm_replicate_socket_t *this;
+
+	if (sockfd < 0) return;
+
+#ifdef MSG_DONTWAIT
+	/*
+	 *	We never read the replies, so they would otherwise
+	 *	sit in the socket buffer until it filled up.
+	 */
+	if (inst->max_sockets > 0) {
+		uint8_t buffer[64];
+
+		while (recv(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0) {
+			/* nothing */
+		}
+	}
+#endif
+
+	pthread_mutex_lock(&inst->mutex);
+	if (inst->num_idle >= inst->max_sockets) {
+		pthread_mutex_unlock(&inst->mutex);
+		close(sockfd);
+		return;
+	}
+
+	this = rad_malloc(sizeof(*this));
+	this->sockfd = sockfd;
+	this->src_ipaddr = *src_ipaddr;
+	this->next = inst->idle;
+	inst->idle = this;
+	inst->num_idle++;
+	pthread_mutex_unlock(&inst->mutex);
+}
 
 static void cleanup(RADIUS_PACKET *packet)
 {
 	if (!packet) return;
-	if (packet->sockfd >= 0) close(packet->sockfd);
+	packet->vps = NULL;	/* shared by all of the packets */
 	rad_free(&packet);
 }
 
+/*
+ *	Send the packets we've built up, which all use the same
+ *	socket.
+ */
+static int replicate_flush(rlm_replicate_t *inst, REQUEST *request,
+			   RADIUS_PACKET **packets, int *num)
+{
+	int i, sent;
+
+	if (*num == 0) return 0;
+
+	sent = rad_send_batch(packets, *num);
+	if (sent < 0) {
+		RDEBUG("ERROR: Failed replicating packet: %s", fr_strerror());
+		sent = 0;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	inst->sent += sent;
+	inst->failed += *num - sent;
+	inst->batches++;
+	pthread_mutex_unlock(&inst->mutex);
+
+	for (i = 0; i < *num; i++) {
+		cleanup(packets[i]);
+	}
+	*num = 0;
+
+	return sent;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	In "async" mode, the worker threads don't send anything.
+ *	They encode the packet, put it on a queue for the home server,
+ *	and carry on.  A separate thread sends the packets, retransmits
+ *	them until the home server replies, and takes them off the
+ *	queue when it does.
+ *
+ *	When a home server stops responding, or its queue is full, new
+ *	packets are appended to a spool file instead.  When the home
+ *	server responds again, the spool file is read back into the
+ *	queue at "drain_rate" packets per second, and truncated once
+ *	it's empty.
+ *
+ *	Each home server has its own socket, so the IDs of the packets
+ *	in flight only have to be unique for that home server.  A
+ *	packet keeps its ID and authenticator when it's retransmitted,
+ *	so the home server can see that it's a duplicate.
+ */
+#define REPLICATE_WINDOW	(64)	/* packets in flight, per home server */
+#define REPLICATE_MIN_PACKET	(20)
+#define REPLICATE_MAX_PACKET	(4096)
+#define REPLICATE_SPOOL_MAGIC	(0x52455031)	/* "REP1" */
+
+typedef struct replicate_entry_t {
+	struct replicate_entry_t *prev;
+	struct replicate_entry_t *next;
+	time_t		sent;		/* when it was last sent */
+	int		tries;
+	int		id;		/* -1 until it's sent */
+	int		offset;		/* of the Message-Authenticator */
+	uint8_t		vector[AUTH_VECTOR_LEN];
+	size_t		data_len;
+	uint8_t		data[1];
+} replicate_entry_t;
+
+typedef struct replicate_spool_record_t {
+	uint32_t	magic;
+	uint32_t	data_len;
+	int32_t		offset;
+	uint8_t		vector[AUTH_VECTOR_LEN];
+} replicate_spool_record_t;
+
+typedef struct replicate_dest_t {
+	/*
+	 *	The home servers are freed before the modules are
+	 *	detached, so we keep copies of what we need.
+	 */
+	home_server	*home;		/* only for finding this entry */
+	char		name[256];
+	fr_ipaddr_t	ipaddr;
+	int		port;
+	char		secret[256];
+
+	int		sockfd;
+	int		alive;
+
+	replicate_entry_t *head;	/* oldest first */
+	replicate_entry_t *tail;
+	replicate_entry_t *unsent;	/* everything before this is in flight */
+	int		num_queued;
+	int		num_in_flight;
+	int		next_id;
+	replicate_entry_t *in_flight[256];
+
+	int		spool_fd;
+	off_t		spool_read;
+	off_t		spool_end;
+	double		tokens;		/* for draining the spool */
+
+	uint64_t	sent;
+	uint64_t	acked;
+	uint64_t	retransmits;
+	uint64_t	spooled;
+	uint64_t	drained;
+	uint64_t	dropped;
+
+	struct replicate_dest_t *next;
+} replicate_dest_t;
+
+static replicate_entry_t *entry_alloc(const uint8_t *data, size_t data_len,
+				      int offset, const uint8_t *vector)
+{
+	replicate_entry_t *entry;
+
+	entry = rad_malloc(sizeof(*entry) + data_len);
+	memset(entry, 0, sizeof(*entry));
+	entry->id = -1;
+	entry->offset = offset;
+	memcpy(entry->vector, vector, sizeof(entry->vector));
+	entry->data_len = data_len;
+	memcpy(entry->data, data, data_len);
+
+	return entry;
+}
+
+static void queue_append(replicate_dest_t *dest, replicate_entry_t *entry)
+{
+	entry->next = NULL;
+	entry->prev = dest->tail;
+	if (dest->tail) {
+		dest->tail->next = entry;
+	} else {
+		dest->head = entry;
+	}
+	dest->tail = entry;
+
+	if (!dest->unsent) dest->unsent = entry;
+	dest->num_queued++;
+}
+
+static void queue_remove(replicate_dest_t *dest, replicate_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		dest->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		dest->tail = entry->prev;
+	}
+	if (dest->unsent == entry) dest->unsent = entry->next;
+	dest->num_queued--;
+
+	if (entry->id >= 0) {
+		dest->in_flight[entry->id] = NULL;
+		dest->num_in_flight--;
+	}
+}
+
+/*
+ *	After a HUP, the old instance saves its queue to the spool
+ *	file which the new instance is draining.  flock() locks belong
+ *	to the open file, and not to the process, so they keep the two
+ *	instances apart.  rad_lockfd() prefers lockf(), which doesn't.
+ */
+#ifdef LOCK_EX
+#define spool_lock(_dest) flock((_dest)->spool_fd, LOCK_EX)
+#define spool_unlock(_dest) flock((_dest)->spool_fd, LOCK_UN)
+#else
+#define spool_lock(_dest)
+#define spool_unlock(_dest)
+#endif
+
+/*
+ *	Called with the spool locked.  Another instance may have
+ *	appended to the file.
+ */
+static void spool_refresh(replicate_dest_t *dest)
+{
+	struct stat buf;
+
+	if (fstat(dest->spool_fd, &buf) == 0) dest->spool_end = buf.st_size;
+}
+
+static int spool_append(replicate_dest_t *dest, const replicate_entry_t *entry)
+{
+	replicate_spool_record_t rec;
+	uint8_t buffer[sizeof(rec) + REPLICATE_MAX_PACKET];
+
+	if (dest->spool_fd < 0) return 0;
+
+	rec.magic = REPLICATE_SPOOL_MAGIC;
+	rec.data_len = entry->data_len;
+	rec.offset = entry->offset;
+	memcpy(rec.vector, entry->vector, sizeof(rec.vector));
+	memcpy(buffer, &rec, sizeof(rec));
+	memcpy(buffer + sizeof(rec), entry->data, entry->data_len);
+
+	/*
+	 *	The file is opened with O_APPEND, so a short write
+	 *	leaves a partial record at the end, which is thrown
+	 *	away when it's read.
+	 */
+	spool_lock(dest);
+	if (write(dest->spool_fd, buffer, sizeof(rec) + entry->data_len) !=
+	    (ssize_t) (sizeof(rec) + entry->data_len)) {
+		spool_unlock(dest);
+		radlog(L_ERR, "rlm_replicate: Failed writing to spool file for home server %s: %s",
+		       dest->name, strerror(errno));
+		return 0;
+	}
+	spool_refresh(dest);
+	spool_unlock(dest);
+
+	dest->spooled++;
+	return 1;
+}
+
+static replicate_entry_t *spool_read(replicate_dest_t *dest)
+{
+	replicate_spool_record_t rec;
+	uint8_t buffer[REPLICATE_MAX_PACKET];
+
+	if ((pread(dest->spool_fd, &rec, sizeof(rec), dest->spool_read) != sizeof(rec)) ||
+	    (rec.magic != REPLICATE_SPOOL_MAGIC) ||
+	    (rec.data_len < REPLICATE_MIN_PACKET) ||
+	    (rec.data_len > sizeof(buffer)) ||
+	    (pread(dest->spool_fd, buffer, rec.data_len,
+		   dest->spool_read + sizeof(rec)) != (ssize_t) rec.data_len)) {
+		radlog(L_ERR, "rlm_replicate: Discarding invalid data at offset %lu of spool file for home server %s",
+		       (unsigned long) dest->spool_read, dest->name);
+		dest->spool_read = dest->spool_end;
+		return NULL;
+	}
+
+	dest->spool_read += sizeof(rec) + rec.data_len;
+	dest->drained++;
+
+	return entry_alloc(buffer, rec.data_len, rec.offset, rec.vector);
+}
+
+static replicate_dest_t *dest_find(rlm_replicate_t *inst, home_server *home)
+{
+	replicate_dest_t *dest;
+	char buffer[128];
+	char filename[1024];
+
+	for (dest = inst->dests; dest != NULL; dest = dest->next) {
+		if (dest->home == home) return dest;
+	}
+
+	dest = rad_malloc(sizeof(*dest));
+	memset(dest, 0, sizeof(*dest));
+	dest->home = home;
+	strlcpy(dest->name, home->name, sizeof(dest->name));
+	dest->ipaddr = home->ipaddr;
+	dest->port = home->port;
+	strlcpy(dest->secret, home->secret, sizeof(dest->secret));
+	dest->alive = 1;
+	dest->next_id = fr_rand() & 0xff;
+	dest->spool_fd = -1;
+
+	dest->sockfd = fr_socket(&home->src_ipaddr, 0);
+	if (dest->sockfd < 0) {
+		radlog(L_ERR, "rlm_replicate: Failed opening socket for home server %s: %s",
+		       home->name, fr_strerror());
+		free(dest);
+		return NULL;
+	}
+
+	/*
+	 *	The thread uses select().
+	 */
+	if (dest->sockfd >= FD_SETSIZE) {
+		radlog(L_ERR, "rlm_replicate: Socket %d for home server %s is too large for select()",
+		       dest->sockfd, home->name);
+		close(dest->sockfd);
+		free(dest);
+		return NULL;
+	}
+
+	if (inst->spool_dir) {
+		snprintf(filename, sizeof(filename), "%s/%s-%d.spool",
+			 inst->spool_dir,
+			 ip_ntoh(&home->ipaddr, buffer, sizeof(buffer)),
+			 home->port);
+
+		dest->spool_fd = open(filename, O_RDWR | O_CREAT | O_APPEND,
+				      0600);
+		if (dest->spool_fd < 0) {
+			radlog(L_ERR, "rlm_replicate: Failed opening %s: %s",
+			       filename, strerror(errno));
+		} else {
+			dest->spool_end = lseek(dest->spool_fd, 0, SEEK_END);
+			if (dest->spool_end < 0) dest->spool_end = 0;
+
+			if (dest->spool_end > 0) {
+				radlog(L_INFO, "rlm_replicate: Sending %lu bytes of packets from %s",
+				       (unsigned long) dest->spool_end,
+				       filename);
+			}
+		}
+	}
+
+	dest->next = inst->dests;
+	inst->dests = dest;
+
+	return dest;
+}
+
+static void *replicate_thread(void *arg);
+
+/*
+ *	The thread is started when the first packet is queued, and
+ *	not in instantiate(), as the server forks into the background
+ *	after the modules have been instantiated.  Called with the
+ *	mutex held.
+ */
+static void replicate_thread_start(rlm_replicate_t *inst)
+{
+	int rcode;
+
+	rcode = pthread_create(&inst->thread, NULL, replicate_thread, inst);
+	if (rcode != 0) {
+		radlog(L_ERR, "rlm_replicate: Failed creating thread: %s",
+		       strerror(rcode));
+		return;
+	}
+
+	inst->thread_running = 1;
+}
+
+/*
+ *	Called from the event loop once the server has forked, so
+ *	that spool files found at startup are sent without waiting
+ *	for the first packet.
+ */
+static void replicate_spool_start(void *ctx)
+{
+	rlm_replicate_t *inst = ctx;
+
+	pthread_mutex_lock(&inst->mutex);
+	if (!inst->thread_running) replicate_thread_start(inst);
+	pthread_mutex_unlock(&inst->mutex);
+}
+
+/*
+ *	Called by the worker threads.
+ */
+static int replicate_enqueue(rlm_replicate_t *inst, home_server *home,
+			     RADIUS_PACKET *packet)
+{
+	int rcode = 1;
+	replicate_dest_t *dest;
+	replicate_entry_t *entry;
+
+	entry = entry_alloc(packet->data, packet->data_len, packet->offset,
+			    packet->vector);
+
+	pthread_mutex_lock(&inst->mutex);
+	if (!inst->thread_running) replicate_thread_start(inst);
+
+	dest = dest_find(inst, home);
+	if (!dest) {
+		pthread_mutex_unlock(&inst->mutex);
+		free(entry);
+		return 0;
+	}
+
+	/*
+	 *	Once we've started spooling, keep spooling until the
+	 *	spool is empty, so that the packets stay in order.
+	 */
+	if (dest->alive && (dest->spool_read == dest->spool_end) &&
+	    (dest->num_queued < inst->queue_size)) {
+		queue_append(dest, entry);
+		entry = NULL;
+
+	} else if (!spool_append(dest, entry)) {
+		dest->dropped++;
+		rcode = 0;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	free(entry);
+	return rcode;
+}
+
+static void replicate_send(replicate_dest_t *dest, replicate_entry_t *entry,
+			   time_t now)
+{
+	RADIUS_PACKET packet;
+
+	memset(&packet, 0, sizeof(packet));
+	packet.sockfd = dest->sockfd;
+	packet.code = entry->data[0];
+	packet.data = entry->data;
+	packet.data_len = entry->data_len;
+	packet.offset = entry->offset;
+	memcpy(packet.vector, entry->vector, sizeof(packet.vector));
+	packet.dst_ipaddr = dest->ipaddr;
+	packet.dst_port = dest->port;
+
+	/*
+	 *	First time: give it an ID, and sign it.
+	 */
+	if (entry->id < 0) {
+		while (dest->in_flight[dest->next_id]) {
+			dest->next_id = (dest->next_id + 1) & 0xff;
+		}
+		entry->id = dest->next_id;
+		dest->next_id = (dest->next_id + 1) & 0xff;
+		dest->in_flight[entry->id] = entry;
+		dest->num_in_flight++;
+
+		entry->data[1] = entry->id;
+		packet.id = entry->id;
+
+		/*
+		 *	Packets read back from the spool may have
+		 *	been signed already.
+		 */
+		if ((packet.code != PW_AUTHENTICATION_REQUEST) &&
+		    (packet.code != PW_STATUS_SERVER)) {
+			memset(entry->data + 4, 0, AUTH_VECTOR_LEN);
+		}
+		rad_sign(&packet, NULL, dest->secret);
+		memcpy(entry->vector, packet.vector, sizeof(entry->vector));
+		dest->sent++;
+	} else {
+		dest->retransmits++;
+	}
+
+	entry->sent = now;
+	entry->tries++;
+
+	if (rad_send(&packet, NULL, dest->secret) < 0) {
+		DEBUG("rlm_replicate: Failed sending packet to home server %s: %s",
+		      dest->name, fr_strerror());
+	}
+}
+
+static void replicate_recv(replicate_dest_t *dest)
+{
+	RADIUS_PACKET *reply;
+	RADIUS_PACKET original;
+	replicate_entry_t *entry;
+	replicate_entry_t *this;
+
+	reply = rad_recv(dest->sockfd, 0);
+	if (!reply) return;
+
+	if ((fr_ipaddr_cmp(&reply->src_ipaddr, &dest->ipaddr) != 0) ||
+	    (reply->src_port != dest->port)) {
+		rad_free(&reply);
+		return;
+	}
+
+	entry = dest->in_flight[reply->id];
+	if (!entry) {
+		rad_free(&reply);
+		return;
+	}
+
+	memset(&original, 0, sizeof(original));
+	original.code = entry->data[0];
+	original.id = entry->id;
+	memcpy(original.vector, entry->vector, sizeof(original.vector));
+
+	if (rad_verify(reply, &original, dest->secret) < 0) {
+		DEBUG("rlm_replicate: Ignoring invalid reply from home server %s: %s",
+		      dest->name, fr_strerror());
+		rad_free(&reply);
+		return;
+	}
+	rad_free(&reply);
+
+	queue_remove(dest, entry);
+	free(entry);
+	dest->acked++;
+
+	if (!dest->alive) {
+		radlog(L_INFO, "rlm_replicate: Home server %s is responding again",
+		       dest->name);
+		dest->alive = 1;
+
+		/*
+		 *	Send the rest of the packets in flight now.
+		 */
+		for (this = dest->head; this != dest->unsent; this = this->next) {
+			this->sent = 0;
+			this->tries = 0;
+		}
+	}
+}
+
+static void replicate_service(rlm_replicate_t *inst, replicate_dest_t *dest,
+			      time_t now, double elapsed)
+{
+	replicate_entry_t *entry;
+
+	if (!dest->alive) {
+		/*
+		 *	Keep sending the oldest packet, to see if
+		 *	the home server has come back.  Only a reply
+		 *	marks it alive, so if the queue is empty, the
+		 *	probe comes from the spool.
+		 */
+		entry = dest->head;
+		if (!entry && (dest->spool_fd >= 0)) {
+			spool_lock(dest);
+			spool_refresh(dest);
+			if (dest->spool_read < dest->spool_end) {
+				entry = spool_read(dest);
+				if (entry) queue_append(dest, entry);
+			}
+			spool_unlock(dest);
+		}
+
+		if (!entry) return;
+
+		if ((entry->id < 0) ||
+		    ((now - entry->sent) >= inst->retry_delay)) {
+			if (dest->unsent == entry) dest->unsent = entry->next;
+			replicate_send(dest, entry, now);
+		}
+		return;
+	}
+
+	for (entry = dest->head; entry != dest->unsent; entry = entry->next) {
+		if ((now - entry->sent) < inst->retry_delay) continue;
+
+		if (entry->tries > inst->retry_count) {
+			radlog(L_ERR, "rlm_replicate: Home server %s is not responding.  Spooling packets",
+			       dest->name);
+			dest->alive = 0;
+			return;
+		}
+
+		replicate_send(dest, entry, now);
+	}
+
+	/*
+	 *	Refill the queue from the spool.
+	 */
+	if (dest->spool_fd >= 0) {
+		spool_lock(dest);
+		spool_refresh(dest);
+	}
+
+	if (dest->spool_read < dest->spool_end) {
+		if (inst->drain_rate > 0) {
+			dest->tokens += elapsed * inst->drain_rate;
+			if (dest->tokens > inst->drain_rate) {
+				dest->tokens = inst->drain_rate;
+			}
+		} else {
+			dest->tokens = inst->queue_size;
+		}
+
+		while ((dest->tokens >= 1) &&
+		       (dest->num_queued < inst->queue_size) &&
+		       (dest->spool_read < dest->spool_end)) {
+			entry = spool_read(dest);
+			if (!entry) break;
+
+			queue_append(dest, entry);
+			dest->tokens -= 1;
+		}
+
+		if (dest->spool_read >= dest->spool_end) {
+			if (ftruncate(dest->spool_fd, 0) < 0) {
+				radlog(L_ERR, "rlm_replicate: Failed truncating spool file for home server %s: %s",
+				       dest->name, strerror(errno));
+			}
+			dest->spool_read = dest->spool_end = 0;
+			dest->tokens = 0;
+		}
+	}
+
+	if (dest->spool_fd >= 0) spool_unlock(dest);
+
+	while (dest->unsent && (dest->num_in_flight < REPLICATE_WINDOW)) {
+		entry = dest->unsent;
+		dest->unsent = entry->next;
+		replicate_send(dest, entry, now);
+	}
+}
+
+static void *replicate_thread(void *arg)
+{
+	int maxfd;
+	fd_set fds;
+	time_t now;
+	double elapsed;
+	struct timeval tv, when, last;
+	rlm_replicate_t *inst = arg;
+	replicate_dest_t *dest;
+
+	gettimeofday(&last, NULL);
+
+	while (1) {
+		FD_ZERO(&fds);
+		maxfd = -1;
+
+		pthread_mutex_lock(&inst->mutex);
+		if (inst->stop) {
+			pthread_mutex_unlock(&inst->mutex);
+			break;
+		}
+
+		for (dest = inst->dests; dest != NULL; dest = dest->next) {
+			FD_SET(dest->sockfd, &fds);
+			if (dest->sockfd > maxfd) maxfd = dest->sockfd;
+		}
+		pthread_mutex_unlock(&inst->mutex);
+
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		if (select(maxfd + 1, &fds, NULL, NULL, &tv) < 0) {
+			FD_ZERO(&fds);
+		}
+
+		gettimeofday(&when, NULL);
+		elapsed = (when.tv_sec - last.tv_sec) +
+			((when.tv_usec - last.tv_usec) / 1000000.0);
+		last = when;
+		now = when.tv_sec;
+
+		pthread_mutex_lock(&inst->mutex);
+		for (dest = inst->dests; dest != NULL; dest = dest->next) {
+			if ((dest->sockfd <= maxfd) &&
+			    FD_ISSET(dest->sockfd, &fds)) {
+				replicate_recv(dest);
+			}
+
+			replicate_service(inst, dest, now, elapsed);
+		}
+		pthread_mutex_unlock(&inst->mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ *	Pick up spool files left over from before a restart.
+ */
+static void replicate_spool_scan(rlm_replicate_t *inst)
+{
+#ifdef HAVE_DIRENT_H
+	DIR *dir;
+	struct dirent *dp;
+	char *p, *q;
+	int port;
+	fr_ipaddr_t ipaddr;
+	home_server *home;
+	char buffer[256];
+
+	dir = opendir(inst->spool_dir);
+	if (!dir) return;
+
+	while ((dp = readdir(dir)) != NULL) {
+		strlcpy(buffer, dp->d_name, sizeof(buffer));
+
+		p = strrchr(buffer, '.');
+		if (!p || (strcmp(p, ".spool") != 0)) continue;
+		*p = '\0';
+
+		p = strrchr(buffer, '-');
+		if (!p) continue;
+		*(p++) = '\0';
+
+		port = strtol(p, &q, 10);
+		if (*q || (port <= 0) ||
+		    (ip_hton(buffer, AF_UNSPEC, &ipaddr) < 0)) continue;
+
+		home = home_server_find(&ipaddr, port);
+		if (!home) {
+			radlog(L_ERR, "rlm_replicate: Ignoring spool file %s/%s, as there is no home server %s port %d",
+			       inst->spool_dir, dp->d_name, buffer, port);
+			continue;
+		}
+
+		dest_find(inst, home);
+	}
+	closedir(dir);
+#else
+	inst = inst;		/* -Wunused */
+#endif
+}
+#endif	/* HAVE_PTHREAD_H */
+
 /*
  *	Write accounting information to this modules database.
  */
 static int replicate_packet(void *instance, REQUEST *request)
 {
 	int rcode = RLM_MODULE_NOOP;
-	VALUE_PAIR *vp, *last;
+	int i, num = 0;
+	int sockfd = -1;
+	int id = fr_rand() & 0xff;
+	rlm_replicate_t *inst = instance;
+	VALUE_PAIR *vp, *last, *vps = NULL;
 	home_server *home;
 	REALM *realm;
 	home_pool_t *pool;
-	RADIUS_PACKET *packet = NULL;
+	fr_ipaddr_t src_ipaddr;
+	RADIUS_PACKET *packet;
+	RADIUS_PACKET *packets[RAD_BATCH_MAX];
 
-	instance = instance;	/* -Wunused */
+	memset(&src_ipaddr, 0, sizeof(src_ipaddr));
 	last = request->config_items;
 
 	/*
 	 *	Send as many packets as necessary to different
-	 *	destinations.
+	 *	destinations.  Packets which go out of the same socket
+	 *	are sent together, in one system call.
 	 */
 	while (1) {
 		vp = pairfind(last, PW_REPLICATE_TO_REALM);
@@ -62,7 +928,7 @@ static int replicate_packet(void *instance, REQUEST *request)
 
 		realm = realm_find2(vp->vp_strvalue);
 		if (!realm) {
-			RDEBUG2("ERROR: Cannot Replicate to unknown realm %s", realm);
+			RDEBUG2("ERROR: Cannot Replicate to unknown realm %s", vp->vp_strvalue);
 			continue;
 		}
 		
@@ -73,8 +939,8 @@ static int replicate_packet(void *instance, REQUEST *request)
 		default:
 			RDEBUG2("ERROR: Cannot replicate unknown packet code %d",
 				request->packet->code);
-			cleanup(packet);
-			return RLM_MODULE_FAIL;
+			rcode = RLM_MODULE_FAIL;
+			goto done;
 		
 		case PW_AUTHENTICATION_REQUEST:
 			pool = realm->auth_pool;
@@ -101,31 +967,26 @@ static int replicate_packet(void *instance, REQUEST *request)
 		}
 		
 		home = home_server_ldb(realm->name, pool, request);
+
+		/*
+		 *	In async mode, we do our own checks to see
+		 *	if the home server is alive.  If it's not,
+		 *	the packets are spooled, not lost.
+		 */
+		if (!home && inst->async) home = pool->servers[0];
+
 		if (!home) {
 			RDEBUG2("ERROR: Failed to find live home server for realm %s",
 				realm->name);
 			continue;
 		}
 		
-		if (!packet) {
-			packet = rad_alloc(1);
-			if (!packet) return RLM_MODULE_FAIL;
-			packet->sockfd = -1;
-			packet->code = request->packet->code;
-			packet->id = fr_rand() & 0xff;
-
-			packet->sockfd = fr_socket(&home->src_ipaddr, 0);
-			if (packet->sockfd < 0) {
-				RDEBUG("ERROR: Failed opening socket: %s", fr_strerror());
-				cleanup(packet);
-				return RLM_MODULE_FAIL;
-			}
-
-			packet->vps = paircopy(request->packet->vps);
-			if (!packet->vps) {
+		if (!vps) {
+			vps = paircopy(request->packet->vps);
+			if (!vps) {
 				RDEBUG("ERROR: Out of memory!");
-				cleanup(packet);
-				return RLM_MODULE_FAIL;
+				rcode = RLM_MODULE_FAIL;
+				goto done;
 			}
 
 			/*
@@ -135,55 +996,301 @@ static int replicate_packet(void *instance, REQUEST *request)
 			if ((request->packet->code == PW_AUTHENTICATION_REQUEST) &&
 			    (pairfind(request->packet->vps, PW_CHAP_PASSWORD) != NULL) &&
 			    (pairfind(request->packet->vps, PW_CHAP_CHALLENGE) == NULL)) {
-				vp = radius_paircreate(request, &packet->vps,
+				vp = radius_paircreate(request, &vps,
 						       PW_CHAP_CHALLENGE,
 						       PW_TYPE_OCTETS);
 				vp->length = AUTH_VECTOR_LEN;
 				memcpy(vp->vp_strvalue, request->packet->vector,
 				       AUTH_VECTOR_LEN);
 			}
-		} else {
-			size_t i;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		if (inst->async) {
+			packet = rad_alloc(1);
+			if (!packet) {
+				rcode = RLM_MODULE_FAIL;
+				goto done;
+			}
+			packet->code = request->packet->code;
+			packet->id = 0;	/* set when it's sent */
+			packet->vps = vps;
 
-			for (i = 0; i < sizeof(packet->vector); i++) {
-				packet->vector[i] = fr_rand() & 0xff;
+			if (rad_encode(packet, NULL, home->secret) < 0) {
+				RDEBUG("ERROR: Failed replicating packet: %s",
+				       fr_strerror());
+				cleanup(packet);
+				rcode = RLM_MODULE_FAIL;
+				goto done;
 			}
 
-			packet->id++;
-			free(packet->data);
-			packet->data = NULL;
-			packet->data_len = 0;
+			RDEBUG("Queueing packet for Realm %s", realm->name);
+			if (replicate_enqueue(inst, home, packet)) {
+				rcode = RLM_MODULE_OK;
+			} else {
+				RDEBUG("ERROR: Queue for home server %s is full",
+				       home->name);
+			}
+			cleanup(packet);
+			continue;
 		}
+#endif
 
 		/*
-		 *	(Re)-Write these.
+		 *	We need a socket bound to a different source
+		 *	address, or the batch is full.  Send what we
+		 *	have so far.
 		 */
+		if ((sockfd >= 0) &&
+		    ((fr_ipaddr_cmp(&src_ipaddr, &home->src_ipaddr) != 0) ||
+		     (num == RAD_BATCH_MAX))) {
+			if (replicate_flush(inst, request, packets, &num) > 0) {
+				rcode = RLM_MODULE_OK;
+			}
+
+			if (fr_ipaddr_cmp(&src_ipaddr, &home->src_ipaddr) != 0) {
+				socket_put(inst, sockfd, &src_ipaddr);
+				sockfd = -1;
+			}
+		}
+
+		if (sockfd < 0) {
+			src_ipaddr = home->src_ipaddr;
+			sockfd = socket_get(inst, &src_ipaddr);
+			if (sockfd < 0) {
+				RDEBUG("ERROR: Failed opening socket: %s", fr_strerror());
+				rcode = RLM_MODULE_FAIL;
+				goto done;
+			}
+		}
+
+		packet = rad_alloc(1);
+		if (!packet) {
+			rcode = RLM_MODULE_FAIL;
+			goto done;
+		}
+		packet->sockfd = sockfd;
+		packet->code = request->packet->code;
+		packet->id = id++ & 0xff;
+		packet->vps = vps;
 		packet->dst_ipaddr = home->ipaddr;
 		packet->dst_port = home->port;
 		memset(&packet->src_ipaddr, 0, sizeof(packet->src_ipaddr));
 		packet->src_port = 0;
 		
 		/*
-		 *	Encode, sign and then send the packet.
+		 *	Encode and sign the packet now.  It's sent
+		 *	later, with the others in the batch.
 		 */
 		RDEBUG("Replicating packet to Realm %s", realm->name);
-		if (rad_send(packet, NULL, home->secret) < 0) {
+		if ((rad_encode(packet, NULL, home->secret) < 0) ||
+		    (rad_sign(packet, NULL, home->secret) < 0)) {
 			RDEBUG("ERROR: Failed replicating packet: %s",
 			       fr_strerror());
 			cleanup(packet);
-			return RLM_MODULE_FAIL;
+			rcode = RLM_MODULE_FAIL;
+			goto done;
 		}
+		packets[num++] = packet;
 
-		/*
-		 *	We've sent it to at least one destination.
-		 */
+		if (!inst->batch &&
+		    (replicate_flush(inst, request, packets, &num) > 0)) {
+			rcode = RLM_MODULE_OK;
+		}
+	}
+
+	/*
+	 *	We've sent it to at least one destination.
+	 */
+	if (replicate_flush(inst, request, packets, &num) > 0) {
 		rcode = RLM_MODULE_OK;
 	}
 
-	cleanup(packet);
+done:
+	for (i = 0; i < num; i++) {
+		cleanup(packets[i]);
+	}
+	socket_put(inst, sockfd, &src_ipaddr);
+	pairfree(&vps);
+
 	return rcode;
 }
 
+/*
+ *	For "radmin -e 'stats module replicate'"
+ */
+static size_t replicate_stats(void *instance, char *out, size_t outlen)
+{
+	rlm_replicate_t *inst = instance;
+	uint64_t sent, failed, batches, opened;
+	int num_idle;
+	size_t len;
+#ifdef HAVE_PTHREAD_H
+	replicate_dest_t *dest;
+#endif
+
+	pthread_mutex_lock(&inst->mutex);
+	sent = inst->sent;
+	failed = inst->failed;
+	batches = inst->batches;
+	opened = inst->opened;
+	num_idle = inst->num_idle;
+	pthread_mutex_unlock(&inst->mutex);
+
+	len = snprintf(out, outlen,
+		       "sent\t\t%llu\n"
+		       "failed\t\t%llu\n"
+		       "batches\t\t%llu\n"
+		       "sockets_opened\t%llu\n"
+		       "sockets_idle\t%d\n",
+		       (unsigned long long) sent,
+		       (unsigned long long) failed,
+		       (unsigned long long) batches,
+		       (unsigned long long) opened,
+		       num_idle);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&inst->mutex);
+	for (dest = inst->dests;
+	     (dest != NULL) && (len < outlen);
+	     dest = dest->next) {
+		len += snprintf(out + len, outlen - len,
+				"home_server %s\n"
+				"\talive\t\t%s\n"
+				"\tqueued\t\t%d\n"
+				"\tin_flight\t%d\n"
+				"\tspool_bytes\t%lu\n"
+				"\tsent\t\t%llu\n"
+				"\tacked\t\t%llu\n"
+				"\tretransmits\t%llu\n"
+				"\tspooled\t\t%llu\n"
+				"\tdrained\t\t%llu\n"
+				"\tdropped\t\t%llu\n",
+				dest->name,
+				dest->alive ? "yes" : "no",
+				dest->num_queued,
+				dest->num_in_flight,
+				(unsigned long) (dest->spool_end - dest->spool_read),
+				(unsigned long long) dest->sent,
+				(unsigned long long) dest->acked,
+				(unsigned long long) dest->retransmits,
+				(unsigned long long) dest->spooled,
+				(unsigned long long) dest->drained,
+				(unsigned long long) dest->dropped);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+#endif
+
+	if (len >= outlen) len = outlen - 1;
+	return len;
+}
+
+static int replicate_detach(void *instance)
+{
+	rlm_replicate_t *inst = instance;
+	rlm_replicate_socket_t *this, *next;
+
+	module_stats_unregister(inst);
+
+#ifdef HAVE_PTHREAD_H
+	radius_event_undefer(inst);
+
+	if (inst->thread_running) {
+		pthread_mutex_lock(&inst->mutex);
+		inst->stop = 1;
+		pthread_mutex_unlock(&inst->mutex);
+
+		pthread_join(inst->thread, NULL);
+	}
+
+	while (inst->dests) {
+		replicate_dest_t *dest = inst->dests;
+		replicate_entry_t *entry;
+
+		/*
+		 *	Save the packets which haven't been
+		 *	acknowledged.  They end up after the ones
+		 *	which are already in the spool.
+		 */
+		while ((entry = dest->head) != NULL) {
+			queue_remove(dest, entry);
+			if (!spool_append(dest, entry)) dest->dropped++;
+			free(entry);
+		}
+
+		if (dest->dropped) {
+			radlog(L_ERR, "rlm_replicate: Lost %llu packets for home server %s",
+			       (unsigned long long) dest->dropped,
+			       dest->name);
+		}
+
+		close(dest->sockfd);
+		if (dest->spool_fd >= 0) close(dest->spool_fd);
+
+		inst->dests = dest->next;
+		free(dest);
+	}
+#endif
+
+	for (this = inst->idle; this != NULL; this = next) {
+		next = this->next;
+		close(this->sockfd);
+		free(this);
+	}
+
+	pthread_mutex_destroy(&inst->mutex);
+	free(inst);
+	return 0;
+}
+
+static int replicate_instantiate(CONF_SECTION *conf, void **instance)
+{
+	rlm_replicate_t *inst;
+
+	inst = rad_malloc(sizeof(*inst));
+	memset(inst, 0, sizeof(*inst));
+
+	if (cf_section_parse(conf, inst, module_config) < 0) {
+		free(inst);
+		return -1;
+	}
+
+	if (inst->max_sockets < 0) {
+		radlog(L_ERR, "rlm_replicate: max_sockets cannot be negative");
+		free(inst);
+		return -1;
+	}
+
+	pthread_mutex_init(&inst->mutex, NULL);
+
+	if (inst->async) {
+#ifdef HAVE_PTHREAD_H
+		if ((inst->queue_size <= 0) || (inst->retry_delay <= 0) ||
+		    (inst->retry_count < 0) || (inst->drain_rate < 0)) {
+			radlog(L_ERR, "rlm_replicate: Invalid configuration for async mode");
+			replicate_detach(inst);
+			return -1;
+		}
+
+		if (inst->spool_dir) {
+			replicate_spool_scan(inst);
+			if (inst->dests) {
+				radius_event_defer(replicate_spool_start, inst);
+			}
+		}
+#else
+		radlog(L_ERR, "rlm_replicate: async mode needs threads");
+		replicate_detach(inst);
+		return -1;
+#endif
+	}
+
+	module_stats_register(inst, replicate_stats);
+
+	*instance = inst;
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -197,8 +1304,8 @@ module_t rlm_replicate = {
 	RLM_MODULE_INIT,
 	"replicate",
 	RLM_TYPE_THREAD_SAFE,		/* type */
-	NULL,				/* instantiation */
-	NULL,				/* detach */
+	replicate_instantiate,		/* instantiation */
+	replicate_detach,		/* detach */
 	{
 		NULL,			/* authentication */
 		replicate_packet,	/* authorization */
@@ -53,6 +53,27 @@ typedef struct sql_config {
 	/* individual driver config */
 	void	*localcfg;
 
+	/*
+	 *	The queries above, compiled when the module is
+	 *	instantiated.
+	 */
+	xlat_template_t *query_user_xt;
+	xlat_template_t *authorize_check_query_xt;
+	xlat_template_t *authorize_reply_query_xt;
+	xlat_template_t *authorize_group_check_query_xt;
+	xlat_template_t *authorize_group_reply_query_xt;
+	xlat_template_t *accounting_onoff_query_xt;
+	xlat_template_t *accounting_update_query_xt;
+	xlat_template_t *accounting_update_query_alt_xt;
+	xlat_template_t *accounting_start_query_xt;
+	xlat_template_t *accounting_start_query_alt_xt;
+	xlat_template_t *accounting_stop_query_xt;
+	xlat_template_t *accounting_stop_query_alt_xt;
+	xlat_template_t *simul_count_query_xt;
+	xlat_template_t *simul_verify_query_xt;
+	xlat_template_t *groupmemb_query_xt;
+	xlat_template_t *postauth_query_xt;
+
 } SQL_CONFIG;
 
 
@@ -492,7 +492,7 @@ int sql_set_user(SQL_INST *inst, REQUEST *request, char *sqlusername, const char
 	if (username != NULL) {
 		strlcpy(tmpuser, username, sizeof(tmpuser));
 	} else if (strlen(inst->config->query_user)) {
-		radius_xlat(tmpuser, sizeof(tmpuser), inst->config->query_user, request, NULL);
+		radius_xlat_template(tmpuser, sizeof(tmpuser), inst->config->query_user_xt, request, NULL);
 	} else {
 		return 0;
 	}
@@ -541,7 +541,7 @@ static int sql_get_grouplist (SQL_INST *inst, SQLSOCK *sqlsocket, REQUEST *reque
 	    (inst->config->groupmemb_query[0] == 0))
 		return 0;
 
-	if (!radius_xlat(querystr, sizeof(querystr), inst->config->groupmemb_query, request, sql_escape_func)) {
+	if (!radius_xlat_template(querystr, sizeof(querystr), inst->config->groupmemb_query_xt, request, sql_escape_func)) {
 		radlog_request(L_ERR, 0, request, "xlat \"%s\" failed.",
 			       inst->config->groupmemb_query);
 		return -1;
@@ -696,7 +696,7 @@ static int rlm_sql_process_groups(SQL_INST *inst, REQUEST *request, SQLSOCK *sql
 			return -1;
 		}
 		pairadd(&request->packet->vps, sql_group);
-		if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_group_check_query, request, sql_escape_func)) {
+		if (!radius_xlat_template(querystr, sizeof(querystr), inst->config->authorize_group_check_query_xt, request, sql_escape_func)) {
 			radlog_request(L_ERR, 0, request,
 				       "Error generating query; rejecting user");
 			/* Remove the grouup we added above */
@@ -724,7 +724,7 @@ static int rlm_sql_process_groups(SQL_INST *inst, REQUEST *request, SQLSOCK *sql
 				/*
 				 *	Now get the reply pairs since the paircompare matched
 				 */
-				if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_group_reply_query, request, sql_escape_func)) {
+				if (!radius_xlat_template(querystr, sizeof(querystr), inst->config->authorize_group_reply_query_xt, request, sql_escape_func)) {
 					radlog_request(L_ERR, 0, request, "Error generating query; rejecting user");
 					/* Remove the grouup we added above */
 					pairdelete(&request->packet->vps, PW_SQL_GROUP);
@@ -759,7 +759,7 @@ static int rlm_sql_process_groups(SQL_INST *inst, REQUEST *request, SQLSOCK *sql
 			/*
 			 *	Now get the reply pairs since the paircompare matched
 			 */
-			if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_group_reply_query, request, sql_escape_func)) {
+			if (!radius_xlat_template(querystr, sizeof(querystr), inst->config->authorize_group_reply_query_xt, request, sql_escape_func)) {
 				radlog_request(L_ERR, 0, request, "Error generating query; rejecting user");
 				/* Remove the grouup we added above */
 				pairdelete(&request->packet->vps, PW_SQL_GROUP);
@@ -814,6 +814,23 @@ static int rlm_sql_detach(void *instance)
 			free(inst->config->xlat_name);
 		}
 
+		radius_free_xlat(&inst->config->query_user_xt);
+		radius_free_xlat(&inst->config->authorize_check_query_xt);
+		radius_free_xlat(&inst->config->authorize_reply_query_xt);
+		radius_free_xlat(&inst->config->authorize_group_check_query_xt);
+		radius_free_xlat(&inst->config->authorize_group_reply_query_xt);
+		radius_free_xlat(&inst->config->accounting_onoff_query_xt);
+		radius_free_xlat(&inst->config->accounting_update_query_xt);
+		radius_free_xlat(&inst->config->accounting_update_query_alt_xt);
+		radius_free_xlat(&inst->config->accounting_start_query_xt);
+		radius_free_xlat(&inst->config->accounting_start_query_alt_xt);
+		radius_free_xlat(&inst->config->accounting_stop_query_xt);
+		radius_free_xlat(&inst->config->accounting_stop_query_alt_xt);
+		radius_free_xlat(&inst->config->simul_count_query_xt);
+		radius_free_xlat(&inst->config->simul_verify_query_xt);
+		radius_free_xlat(&inst->config->groupmemb_query_xt);
+		radius_free_xlat(&inst->config->postauth_query_xt);
+
 		/*
 		 *	Free up dynamically allocated string pointers.
 		 */
@@ -858,6 +875,26 @@ static int rlm_sql_detach(void *instance)
 
 	return 0;
 }
+
+/*
+ *	Compile one of the configured queries.  Queries which aren't
+ *	set are left alone, and are never expanded.
+ */
+static int sql_compile_query(SQL_INST *inst, const char *name,
+			     const char *query, xlat_template_t **pxt)
+{
+	if (!query) return 1;
+
+	*pxt = radius_compile_xlat(query);
+	if (!*pxt) {
+		radlog(L_ERR, "rlm_sql (%s): Invalid %s \"%s\": %s",
+		       inst->config->xlat_name, name, query, fr_strerror());
+		return 0;
+	}
+
+	return 1;
+}
+
 static int rlm_sql_instantiate(CONF_SECTION * conf, void **instance)
 {
 	int i;
@@ -991,6 +1028,46 @@ static int rlm_sql_instantiate(CONF_SECTION * conf, void **instance)
 	}
 	allowed_chars = inst->config->allowed_chars;
 
+	/*
+	 *	Compile the queries, so that they don't have to be
+	 *	parsed for every request.
+	 */
+	if (!sql_compile_query(inst, "sql_user_name", inst->config->query_user,
+			       &inst->config->query_user_xt) ||
+	    !sql_compile_query(inst, "authorize_check_query", inst->config->authorize_check_query,
+			       &inst->config->authorize_check_query_xt) ||
+	    !sql_compile_query(inst, "authorize_reply_query", inst->config->authorize_reply_query,
+			       &inst->config->authorize_reply_query_xt) ||
+	    !sql_compile_query(inst, "authorize_group_check_query", inst->config->authorize_group_check_query,
+			       &inst->config->authorize_group_check_query_xt) ||
+	    !sql_compile_query(inst, "authorize_group_reply_query", inst->config->authorize_group_reply_query,
+			       &inst->config->authorize_group_reply_query_xt) ||
+	    !sql_compile_query(inst, "accounting_onoff_query", inst->config->accounting_onoff_query,
+			       &inst->config->accounting_onoff_query_xt) ||
+	    !sql_compile_query(inst, "accounting_update_query", inst->config->accounting_update_query,
+			       &inst->config->accounting_update_query_xt) ||
+	    !sql_compile_query(inst, "accounting_update_query_alt", inst->config->accounting_update_query_alt,
+			       &inst->config->accounting_update_query_alt_xt) ||
+	    !sql_compile_query(inst, "accounting_start_query", inst->config->accounting_start_query,
+			       &inst->config->accounting_start_query_xt) ||
+	    !sql_compile_query(inst, "accounting_start_query_alt", inst->config->accounting_start_query_alt,
+			       &inst->config->accounting_start_query_alt_xt) ||
+	    !sql_compile_query(inst, "accounting_stop_query", inst->config->accounting_stop_query,
+			       &inst->config->accounting_stop_query_xt) ||
+	    !sql_compile_query(inst, "accounting_stop_query_alt", inst->config->accounting_stop_query_alt,
+			       &inst->config->accounting_stop_query_alt_xt) ||
+	    !sql_compile_query(inst, "simul_count_query", inst->config->simul_count_query,
+			       &inst->config->simul_count_query_xt) ||
+	    !sql_compile_query(inst, "simul_verify_query", inst->config->simul_verify_query,
+			       &inst->config->simul_verify_query_xt) ||
+	    !sql_compile_query(inst, "groupmemb_query", inst->config->groupmemb_query,
+			       &inst->config->groupmemb_query_xt) ||
+	    !sql_compile_query(inst, "postauth_query", inst->config->postauth_query,
+			       &inst->config->postauth_query_xt)) {
+		rlm_sql_detach(inst);
+		return -1;
+	}
+
 	for (i = 0; module_config[i].name != NULL; i++) {
 		char **p;
 
@@ -1058,7 +1135,7 @@ static int rlm_sql_authorize(void *instance, REQUEST * request)
 	/*
 	 * Alright, start by getting the specific entry for the user
 	 */
-	if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_check_query, request, sql_escape_func)) {
+	if (!radius_xlat_template(querystr, sizeof(querystr), inst->config->authorize_check_query_xt, request, sql_escape_func)) {
 		radlog_request(L_ERR, 0, request, "Error generating query; rejecting user");
 		sql_release_socket(inst, sqlsocket);
 		/* Remove the username we (maybe) added above */
@@ -1087,7 +1164,7 @@ static int rlm_sql_authorize(void *instance, REQUEST * request)
 			/*
 			 *	Now get the reply pairs since the paircompare matched
 			 */
-			if (!radius_xlat(querystr, sizeof(querystr), inst->config->authorize_reply_query, request, sql_escape_func)) {
+			if (!radius_xlat_template(querystr, sizeof(querystr), inst->config->authorize_reply_query_xt, request, sql_escape_func)) {
 				radlog_request(L_ERR, 0, request, "Error generating query; rejecting user");
 				sql_release_socket(inst, sqlsocket);
 				/* Remove the username we (maybe) added above */
@@ -1232,7 +1309,7 @@ static int rlm_sql_accounting(void *instance, REQUEST * request) {
 		case PW_STATUS_ACCOUNTING_ON:
 		case PW_STATUS_ACCOUNTING_OFF:
 			RDEBUG("Received Acct On/Off packet");
-			radius_xlat(querystr, sizeof(querystr), inst->config->accounting_onoff_query, request, sql_escape_func);
+			radius_xlat_template(querystr, sizeof(querystr), inst->config->accounting_onoff_query_xt, request, sql_escape_func);
 			query_log(request, inst, querystr);
 
 			sqlsocket = sql_get_socket(inst);
@@ -1263,7 +1340,7 @@ static int rlm_sql_accounting(void *instance, REQUEST * request) {
 			 */
 			sql_set_user(inst, request, sqlusername, NULL);
 
-			radius_xlat(querystr, sizeof(querystr), inst->config->accounting_update_query, request, sql_escape_func);
+			radius_xlat_template(querystr, sizeof(querystr), inst->config->accounting_update_query_xt, request, sql_escape_func);
 			query_log(request, inst, querystr);
 
 			sqlsocket = sql_get_socket(inst);
@@ -1285,7 +1362,7 @@ static int rlm_sql_accounting(void *instance, REQUEST * request) {
 						 * matching Start record.  So we have to
 						 * insert this update rather than do an update
 						 */
-						radius_xlat(querystr, sizeof(querystr), inst->config->accounting_update_query_alt, request, sql_escape_func);
+						radius_xlat_template(querystr, sizeof(querystr), inst->config->accounting_update_query_alt_xt, request, sql_escape_func);
 						query_log(request, inst, querystr);
 						if (*querystr) { /* non-empty query */
 							if (rlm_sql_query(sqlsocket, inst, querystr)) {
@@ -1315,7 +1392,7 @@ static int rlm_sql_accounting(void *instance, REQUEST * request) {
 			 */
 			sql_set_user(inst, request, sqlusername, NULL);
 
-			radius_xlat(querystr, sizeof(querystr), inst->config->accounting_start_query, request, sql_escape_func);
+			radius_xlat_template(querystr, sizeof(querystr), inst->config->accounting_start_query_xt, request, sql_escape_func);
 			query_log(request, inst, querystr);
 
 			sqlsocket = sql_get_socket(inst);
@@ -1331,7 +1408,7 @@ static int rlm_sql_accounting(void *instance, REQUEST * request) {
 					 * the stop record came before the start.  We try
 					 * our alternate query now (typically an UPDATE)
 					 */
-					radius_xlat(querystr, sizeof(querystr), inst->config->accounting_start_query_alt, request, sql_escape_func);
+					radius_xlat_template(querystr, sizeof(querystr), inst->config->accounting_start_query_alt_xt, request, sql_escape_func);
 					query_log(request, inst, querystr);
 
 					if (*querystr) { /* non-empty query */
@@ -1361,7 +1438,7 @@ static int rlm_sql_accounting(void *instance, REQUEST * request) {
 			 */
 			sql_set_user(inst, request, sqlusername, NULL);
 
-			radius_xlat(querystr, sizeof(querystr), inst->config->accounting_stop_query, request, sql_escape_func);
+			radius_xlat_template(querystr, sizeof(querystr), inst->config->accounting_stop_query_xt, request, sql_escape_func);
 			query_log(request, inst, querystr);
 
 			sqlsocket = sql_get_socket(inst);
@@ -1400,7 +1477,7 @@ static int rlm_sql_accounting(void *instance, REQUEST * request) {
 						}
 #endif
 
-						radius_xlat(querystr, sizeof(querystr), inst->config->accounting_stop_query_alt, request, sql_escape_func);
+						radius_xlat_template(querystr, sizeof(querystr), inst->config->accounting_stop_query_alt_xt, request, sql_escape_func);
 						query_log(request, inst, querystr);
 
 						if (*querystr) { /* non-empty query */
@@ -1477,7 +1554,7 @@ static int rlm_sql_checksimul(void *instance, REQUEST * request) {
 	if(sql_set_user(inst, request, sqlusername, NULL) < 0)
 		return RLM_MODULE_FAIL;
 
-	radius_xlat(querystr, sizeof(querystr), inst->config->simul_count_query, request, sql_escape_func);
+	radius_xlat_template(querystr, sizeof(querystr), inst->config->simul_count_query_xt, request, sql_escape_func);
 
 	/* initialize the sql socket */
 	sqlsocket = sql_get_socket(inst);
@@ -1523,7 +1600,7 @@ static int rlm_sql_checksimul(void *instance, REQUEST * request) {
 		return RLM_MODULE_OK;
 	}
 
-	radius_xlat(querystr, sizeof(querystr), inst->config->simul_verify_query, request, sql_escape_func);
+	radius_xlat_template(querystr, sizeof(querystr), inst->config->simul_verify_query_xt, request, sql_escape_func);
 	if(rlm_sql_select_query(sqlsocket, inst, querystr)) {
 		radlog_request(L_ERR, 0, request, "Database query error");
 		sql_release_socket(inst, sqlsocket);
@@ -1645,7 +1722,7 @@ static int rlm_sql_postauth(void *instance, REQUEST *request) {
 
 	/* Expand variables in the query */
 	memset(querystr, 0, MAX_QUERY_LEN);
-	radius_xlat(querystr, sizeof(querystr), inst->config->postauth_query,
+	radius_xlat_template(querystr, sizeof(querystr), inst->config->postauth_query_xt,
 		    request, sql_escape_func);
 	query_log(request, inst, querystr);
 	DEBUG2("rlm_sql (%s) in sql_postauth: query is %s",
@@ -0,0 +1,143 @@
+/*
+ * ntlm_auth_stub.c	A stand-in for "ntlm_auth --helper-protocol=ntlm-server-1",
+ *			so that rlm_mschap can be tested without Samba.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2012  The FreeRADIUS server project
+ */
+
+#include <freeradius-devel/ident.h>
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/md4.h>
+
+#include "../modules/rlm_mschap/smbdes.h"
+
+/*
+ *	Every user has the same password.  The helper can also be
+ *	told to exit, or to stop answering, after a number of
+ *	requests, to test how the server handles broken helpers.
+ */
+static void usage(void)
+{
+	fprintf(stderr, "Usage: ntlm_auth_stub --helper-protocol=ntlm-server-1 --password=<password>\n");
+	fprintf(stderr, "         [--exit-after=<n>] [--hang-after=<n>]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int		i, requests, exit_after, hang_after;
+	int		have_user, have_challenge, have_response, want_key;
+	const char	*password;
+	char		*p;
+	char		buffer[1024];
+	uint8_t		nthash[16], nthashhash[16];
+	uint8_t		challenge[8], response[24], calculated[24];
+	uint8_t		unicode[512];
+
+	password = NULL;
+	exit_after = hang_after = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--helper-protocol=ntlm-server-1") == 0) {
+			continue;
+
+		} else if (strncmp(argv[i], "--password=", 11) == 0) {
+			password = argv[i] + 11;
+
+		} else if (strncmp(argv[i], "--exit-after=", 13) == 0) {
+			exit_after = atoi(argv[i] + 13);
+
+		} else if (strncmp(argv[i], "--hang-after=", 13) == 0) {
+			hang_after = atoi(argv[i] + 13);
+
+		} else {
+			usage();
+		}
+	}
+	if (!password || (strlen(password) > (sizeof(unicode) / 2))) usage();
+
+	/*
+	 *	NT-Password is MD4 of the password in UCS-2.
+	 */
+	for (i = 0; password[i] != '\0'; i++) {
+		unicode[i * 2] = password[i];
+		unicode[i * 2 + 1] = 0;
+	}
+	fr_md4_calc(nthash, unicode, i * 2);
+	fr_md4_calc(nthashhash, nthash, 16);
+
+	requests = 0;
+	have_user = have_challenge = have_response = want_key = 0;
+
+	while (fgets(buffer, sizeof(buffer), stdin)) {
+		p = strchr(buffer, '\n');
+		if (p) *p = '\0';
+
+		if (strcmp(buffer, ".") != 0) {
+			if (strncmp(buffer, "Username:", 9) == 0) {
+				have_user = 1;
+
+			} else if (strncmp(buffer, "LANMAN-Challenge: ", 18) == 0) {
+				have_challenge = (fr_hex2bin(buffer + 18, challenge, sizeof(challenge)) == sizeof(challenge));
+
+			} else if (strncmp(buffer, "NT-Response: ", 13) == 0) {
+				have_response = (fr_hex2bin(buffer + 13, response, sizeof(response)) == sizeof(response));
+
+			} else if (strcmp(buffer, "Request-User-Session-Key: Yes") == 0) {
+				want_key = 1;
+			}
+			continue;
+		}
+
+		requests++;
+		if (exit_after && (requests > exit_after)) exit(0);
+		if (hang_after && (requests > hang_after)) {
+			while (1) sleep(60);
+		}
+
+		if (!have_user) {
+			printf("Error: No username supplied!\n");
+
+		} else if (!have_challenge || !have_response) {
+			printf("Error: No password supplied!\n");
+
+		} else {
+			smbdes_mschap((const char *) nthash, challenge, calculated);
+			if (memcmp(calculated, response, sizeof(response)) == 0) {
+				printf("Authenticated: Yes\n");
+				if (want_key) {
+					fr_bin2hex(nthashhash, buffer, 16);
+					printf("User-Session-Key: %s\n", buffer);
+				}
+			} else {
+				printf("Authenticated: No\n");
+				printf("Authentication-Error: Wrong password\n");
+			}
+		}
+
+		printf(".\n");
+		fflush(stdout);
+
+		have_user = have_challenge = have_response = want_key = 0;
+	}
+
+	return 0;
+}